@@ -0,0 +1,448 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "async-io.h"
+
+#include "log.h"
+
+#define N_THREADS 8
+
+typedef struct AsyncIOBatch AsyncIOBatch;
+
+typedef struct AsyncIOOp {
+    /* NULL for the job which starts the syncs of the batch. */
+    AsyncIORequest  *req;
+    AsyncIOBatch    *batch;
+    /* Bytes transferred so far, short reads and writes are continued. */
+    guint32         done;
+    struct iovec    iov;
+} AsyncIOOp;
+
+struct AsyncIOBatch {
+    AsyncIO         *aio;
+    AsyncIORequest  *reqs;
+    AsyncIOOp       *ops;
+    int             n;
+    int             n_syncs;
+    /* Reads and writes are ops[n_syncs..n), syncs are ops[0..n_syncs). */
+    int             pending;
+    gboolean        syncing;
+    AsyncIOOp       start_syncs;
+    AsyncIODoneFunc done;
+    void            *user_data;
+};
+
+struct AsyncIO {
+    /* Runs blocking I/O when io_uring is not used, and starts syncs. */
+    GThreadPool     *pool;
+
+#ifdef HAVE_LIBURING
+    gboolean        use_uring;
+    struct io_uring ring;
+    pthread_t       reaper;
+    int             depth;
+    int             in_flight;
+    /* Ops submitted to the ring, failed if it stops working. */
+    GHashTable      *in_flight_ops;
+    pthread_mutex_t lock;
+    pthread_cond_t  slot_freed;
+#endif
+};
+
+static void start_ops (AsyncIOBatch *batch, AsyncIOOp *ops, int n);
+
+static void
+batch_op_done (AsyncIOBatch *batch)
+{
+    AsyncIO *aio = batch->aio;
+    GError *error = NULL;
+    int i;
+
+    if (!g_atomic_int_dec_and_test (&batch->pending))
+        return;
+
+    if (!batch->syncing && batch->n_syncs > 0) {
+        /* Start the syncs in the pool, this may be an I/O thread which
+         * can't wait for free slots.
+         */
+        batch->syncing = TRUE;
+        batch->pending = batch->n_syncs;
+        batch->start_syncs.batch = batch;
+        g_thread_pool_push (aio->pool, &batch->start_syncs, &error);
+        if (!error)
+            return;
+
+        seaf_warning ("Failed to start syncs: %s.\n", error->message);
+        g_clear_error (&error);
+        for (i = 0; i < batch->n_syncs; i++)
+            batch->ops[i].req->result = -EIO;
+    }
+
+    batch->done (batch->reqs, batch->n, batch->user_data);
+    g_free (batch->ops);
+    g_free (batch);
+}
+
+static void
+finish_op (AsyncIOOp *op, int res)
+{
+    AsyncIORequest *req = op->req;
+
+    if (res < 0)
+        req->result = res;
+    else if (req->type == ASYNC_IO_SYNC)
+        req->result = 0;
+    else
+        req->result = (int)op->done;
+
+    batch_op_done (op->batch);
+}
+
+static void
+run_op (AsyncIOOp *op)
+{
+    AsyncIORequest *req = op->req;
+    char *buf = req->buf;
+    ssize_t n;
+
+    if (req->type == ASYNC_IO_SYNC) {
+#ifdef __linux__
+        n = fdatasync (req->fd);
+#else
+        n = fsync (req->fd);
+#endif
+        finish_op (op, n < 0 ? -errno : 0);
+        return;
+    }
+
+    while (op->done < req->len) {
+        if (req->type == ASYNC_IO_READ)
+            n = pread (req->fd, buf + op->done, req->len - op->done,
+                       req->offset + op->done);
+        else
+            n = pwrite (req->fd, buf + op->done, req->len - op->done,
+                        req->offset + op->done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            finish_op (op, -errno);
+            return;
+        }
+        if (n == 0)
+            break;
+        op->done += n;
+    }
+
+    finish_op (op, 0);
+}
+
+#ifdef HAVE_LIBURING
+
+/* Called with aio->lock held. */
+static void
+prep_op (AsyncIO *aio, AsyncIOOp *op)
+{
+    AsyncIORequest *req = op->req;
+    struct io_uring_sqe *sqe;
+
+    while (!(sqe = io_uring_get_sqe (&aio->ring)))
+        io_uring_submit (&aio->ring);
+
+    if (req->type == ASYNC_IO_SYNC) {
+        io_uring_prep_fsync (sqe, req->fd, IORING_FSYNC_DATASYNC);
+    } else {
+        op->iov.iov_base = (char *)req->buf + op->done;
+        op->iov.iov_len = req->len - op->done;
+        if (req->type == ASYNC_IO_READ)
+            io_uring_prep_readv (sqe, req->fd, &op->iov, 1,
+                                 req->offset + op->done);
+        else
+            io_uring_prep_writev (sqe, req->fd, &op->iov, 1,
+                                  req->offset + op->done);
+    }
+    io_uring_sqe_set_data (sqe, op);
+}
+
+/* Returns the number of ops submitted. If the ring has failed, the rest
+ * have to be run in the pool.
+ */
+static int
+submit_uring_ops (AsyncIO *aio, AsyncIOOp *ops, int n)
+{
+    int i;
+
+    pthread_mutex_lock (&aio->lock);
+    for (i = 0; i < n; i++) {
+        while (aio->use_uring && aio->in_flight >= aio->depth) {
+            /* Make sure the prepared requests can complete. */
+            io_uring_submit (&aio->ring);
+            pthread_cond_wait (&aio->slot_freed, &aio->lock);
+        }
+        if (!aio->use_uring)
+            break;
+        ++aio->in_flight;
+        g_hash_table_add (aio->in_flight_ops, &ops[i]);
+        prep_op (aio, &ops[i]);
+    }
+    if (aio->use_uring)
+        io_uring_submit (&aio->ring);
+    pthread_mutex_unlock (&aio->lock);
+
+    return i;
+}
+
+/* Switch to the thread pool and fail the ops still in the ring. */
+static void
+fail_uring (AsyncIO *aio)
+{
+    GList *ops, *ptr;
+
+    pthread_mutex_lock (&aio->lock);
+    aio->use_uring = FALSE;
+    ops = g_hash_table_get_keys (aio->in_flight_ops);
+    g_hash_table_remove_all (aio->in_flight_ops);
+    aio->in_flight = 0;
+    /* Cancels the requests in the kernel, nothing uses the ring now. */
+    io_uring_queue_exit (&aio->ring);
+    pthread_cond_broadcast (&aio->slot_freed);
+    pthread_mutex_unlock (&aio->lock);
+
+    for (ptr = ops; ptr; ptr = ptr->next)
+        finish_op (ptr->data, -EIO);
+    g_list_free (ops);
+}
+
+static void *
+reap_completions (void *vaio)
+{
+    AsyncIO *aio = vaio;
+    struct io_uring_cqe *cqe;
+    AsyncIOOp *op;
+    int res, ret;
+
+    while (1) {
+        ret = io_uring_wait_cqe (&aio->ring, &cqe);
+        if (ret < 0) {
+            if (ret == -EINTR || ret == -EAGAIN)
+                continue;
+            seaf_warning ("Failed to wait for io_uring completion: %s, "
+                          "using threads for I/O.\n", strerror(-ret));
+            fail_uring (aio);
+            break;
+        }
+
+        op = io_uring_cqe_get_data (cqe);
+        res = cqe->res;
+        io_uring_cqe_seen (&aio->ring, cqe);
+
+        /* Continue short reads and writes in the same slot. */
+        if (res > 0 && op->req->type != ASYNC_IO_SYNC) {
+            op->done += res;
+            if (op->done < op->req->len) {
+                pthread_mutex_lock (&aio->lock);
+                prep_op (aio, op);
+                io_uring_submit (&aio->ring);
+                pthread_mutex_unlock (&aio->lock);
+                continue;
+            }
+        }
+
+        pthread_mutex_lock (&aio->lock);
+        --aio->in_flight;
+        g_hash_table_remove (aio->in_flight_ops, op);
+        pthread_cond_signal (&aio->slot_freed);
+        pthread_mutex_unlock (&aio->lock);
+
+        finish_op (op, res < 0 ? res : 0);
+    }
+
+    return NULL;
+}
+
+static void
+init_uring (AsyncIO *aio, int queue_depth)
+{
+    int ret;
+
+    ret = io_uring_queue_init (queue_depth, &aio->ring, 0);
+    if (ret < 0) {
+        seaf_message ("io_uring is not available (%s), using threads for I/O.\n",
+                      strerror(-ret));
+        return;
+    }
+
+    aio->depth = queue_depth;
+    aio->in_flight_ops = g_hash_table_new (g_direct_hash, g_direct_equal);
+    pthread_mutex_init (&aio->lock, NULL);
+    pthread_cond_init (&aio->slot_freed, NULL);
+
+    if (pthread_create (&aio->reaper, NULL, reap_completions, aio) != 0) {
+        seaf_warning ("Failed to start io_uring reaper thread.\n");
+        io_uring_queue_exit (&aio->ring);
+        return;
+    }
+    pthread_detach (aio->reaper);
+
+    aio->use_uring = TRUE;
+}
+
+#endif  /* HAVE_LIBURING */
+
+static void
+start_ops (AsyncIOBatch *batch, AsyncIOOp *ops, int n)
+{
+    AsyncIO *aio = batch->aio;
+    GError *error = NULL;
+    int i = 0;
+
+#ifdef HAVE_LIBURING
+    if (aio->use_uring)
+        i = submit_uring_ops (aio, ops, n);
+#endif
+
+    for (; i < n; i++) {
+        g_thread_pool_push (aio->pool, &ops[i], &error);
+        if (error) {
+            seaf_warning ("Failed to start I/O: %s.\n", error->message);
+            g_clear_error (&error);
+            finish_op (&ops[i], -EIO);
+        }
+    }
+}
+
+static void
+pool_job (gpointer data, gpointer user_data)
+{
+    AsyncIOOp *op = data;
+
+    if (!op->req) {
+        start_ops (op->batch, op->batch->ops, op->batch->n_syncs);
+        return;
+    }
+
+    run_op (op);
+}
+
+AsyncIO *
+async_io_new (int queue_depth)
+{
+    AsyncIO *aio = g_new0 (AsyncIO, 1);
+    GError *error = NULL;
+
+    aio->pool = g_thread_pool_new (pool_job, aio, N_THREADS, FALSE, &error);
+    if (!aio->pool) {
+        seaf_warning ("Failed to create I/O thread pool: %s.\n", error->message);
+        g_clear_error (&error);
+        g_free (aio);
+        return NULL;
+    }
+
+#ifdef HAVE_LIBURING
+    init_uring (aio, queue_depth);
+#endif
+
+    return aio;
+}
+
+int
+async_io_submit (AsyncIO *aio,
+                 AsyncIORequest *reqs,
+                 int n,
+                 AsyncIODoneFunc done,
+                 void *user_data)
+{
+    AsyncIOBatch *batch;
+    int i, j, k;
+
+    g_return_val_if_fail (n > 0, -1);
+
+    batch = g_new0 (AsyncIOBatch, 1);
+    batch->aio = aio;
+    batch->reqs = reqs;
+    batch->ops = g_new0 (AsyncIOOp, n);
+    batch->n = n;
+    batch->done = done;
+    batch->user_data = user_data;
+
+    for (i = 0; i < n; i++) {
+        reqs[i].result = 0;
+        if (reqs[i].type == ASYNC_IO_SYNC)
+            ++batch->n_syncs;
+    }
+
+    /* Syncs go first in ops, so they can be started together. */
+    for (i = 0, j = 0, k = batch->n_syncs; i < n; i++) {
+        AsyncIOOp *op = (reqs[i].type == ASYNC_IO_SYNC) ?
+            &batch->ops[j++] : &batch->ops[k++];
+        op->req = &reqs[i];
+        op->batch = batch;
+    }
+
+    if (batch->n_syncs == n) {
+        batch->syncing = TRUE;
+        batch->pending = n;
+        start_ops (batch, batch->ops, n);
+    } else {
+        batch->pending = n - batch->n_syncs;
+        start_ops (batch, batch->ops + batch->n_syncs, batch->pending);
+    }
+
+    return 0;
+}
+
+typedef struct RunData {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    gboolean        finished;
+} RunData;
+
+static void
+run_done (AsyncIORequest *reqs, int n, void *vdata)
+{
+    RunData *data = vdata;
+
+    pthread_mutex_lock (&data->lock);
+    data->finished = TRUE;
+    pthread_cond_signal (&data->cond);
+    pthread_mutex_unlock (&data->lock);
+}
+
+int
+async_io_run (AsyncIO *aio, AsyncIORequest *reqs, int n)
+{
+    RunData data;
+    int i, ret = 0;
+
+    if (n <= 0)
+        return 0;
+
+    memset (&data, 0, sizeof(data));
+    pthread_mutex_init (&data.lock, NULL);
+    pthread_cond_init (&data.cond, NULL);
+
+    async_io_submit (aio, reqs, n, run_done, &data);
+
+    pthread_mutex_lock (&data.lock);
+    while (!data.finished)
+        pthread_cond_wait (&data.cond, &data.lock);
+    pthread_mutex_unlock (&data.lock);
+
+    pthread_mutex_destroy (&data.lock);
+    pthread_cond_destroy (&data.cond);
+
+    for (i = 0; i < n; i++) {
+        if (reqs[i].result < 0 ||
+            (reqs[i].type != ASYNC_IO_SYNC && reqs[i].result != (int)reqs[i].len))
+            ret = -1;
+    }
+
+    return ret;
+}
@@ -0,0 +1,71 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <glib.h>
+
+/*
+ * Asynchronous file I/O for batches of requests.
+ *
+ * With liburing, requests are submitted to an io_uring and completed by a
+ * reaper thread. Otherwise, or if the kernel doesn't support io_uring, they
+ * are run by a pool of threads doing blocking I/O. If the ring fails later,
+ * the requests in it are failed with -EIO and new ones go to the pool.
+ *
+ * In a batch, all reads and writes are issued at once. Syncs are issued
+ * after all of them have completed, so a batch of writes followed by syncs
+ * of the same files makes them durable.
+ */
+
+enum {
+    ASYNC_IO_READ = 0,
+    ASYNC_IO_WRITE,
+    /* Flush the data of @fd to disk, other fields are ignored. */
+    ASYNC_IO_SYNC,
+};
+
+typedef struct AsyncIORequest {
+    int         type;
+    int         fd;
+    gint64      offset;
+    void        *buf;
+    guint32     len;
+
+    /* Bytes read or written, 0 for sync, or -errno on error. */
+    int         result;
+} AsyncIORequest;
+
+typedef struct AsyncIO AsyncIO;
+
+/* Called from an I/O thread when all requests of a batch are done. */
+typedef void (*AsyncIODoneFunc) (AsyncIORequest *reqs, int n, void *user_data);
+
+/*
+ * @queue_depth: max number of requests in flight.
+ */
+AsyncIO *
+async_io_new (int queue_depth);
+
+/*
+ * Start the requests in @reqs, which must stay valid until @done is called.
+ * With io_uring, this waits while @queue_depth requests are in flight, so
+ * it can block the caller for the duration of an I/O.
+ */
+int
+async_io_submit (AsyncIO *aio,
+                 AsyncIORequest *reqs,
+                 int n,
+                 AsyncIODoneFunc done,
+                 void *user_data);
+
+/*
+ * Run the requests and wait for them to complete.
+ * This blocks the calling thread, so don't call it from an event loop;
+ * use async_io_submit() there and continue in the callback.
+ * Returns -1 if any of them failed or was short.
+ */
+int
+async_io_run (AsyncIO *aio, AsyncIORequest *reqs, int n);
+
+#endif
@@ -0,0 +1,637 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "block-backend.h"
+
+#include "log.h"
+
+/*
+ * Block backend which keeps the contents of recently read blocks in memory,
+ * in front of another backend.
+ *
+ * The cache is split into shards, each with its own lock, LRU list and a
+ * share of the byte budget. Cached contents are never modified, readers
+ * take a reference to the entry and read from it directly.
+ */
+
+#define N_SHARDS 16
+/* Blocks are loaded in reads of at least this size. */
+#define LOAD_CHUNK_SIZE (64 * 1024)
+
+typedef struct CacheEntry {
+    /* "<store_id>/<block_id>" */
+    char        *key;
+    char        *data;
+    guint32     size;
+    int         ref;
+
+    struct CacheEntry *prev, *next;
+} CacheEntry;
+
+typedef struct CacheShard {
+    pthread_mutex_t lock;
+    GHashTable      *entries;
+    /* Most recently used at the head. */
+    CacheEntry      *head, *tail;
+    gint64          size;
+
+    guint64         hits;
+    guint64         misses;
+    guint64         evictions;
+} CacheShard;
+
+typedef struct {
+    BlockBackend    *inner;
+    gint64          shard_capacity;
+    /* Larger blocks are not cached. */
+    guint32         max_block_size;
+    CacheShard      shards[N_SHARDS];
+} CachePriv;
+
+struct _BHandle {
+    int         rw_type;
+    char        block_id[41];
+
+    /* Set when reading from the cache. */
+    CacheEntry  *entry;
+    guint32     pos;
+
+    /* Handle of the inner backend otherwise. */
+    BHandle     *inner;
+    /* Start of a block too large to be cached, which was already read
+     * from the inner handle.
+     */
+    GByteArray  *prefix;
+};
+
+static void
+cache_entry_unref (CacheEntry *entry)
+{
+    if (!g_atomic_int_dec_and_test (&entry->ref))
+        return;
+
+    g_free (entry->key);
+    g_free (entry->data);
+    g_free (entry);
+}
+
+static CacheShard *
+get_shard (CachePriv *priv, const char *block_id)
+{
+    return &priv->shards[g_str_hash (block_id) % N_SHARDS];
+}
+
+static char *
+make_key (const char *store_id, const char *block_id)
+{
+    return g_strconcat (store_id, "/", block_id, NULL);
+}
+
+/* Called with shard->lock held. */
+static void
+lru_unlink (CacheShard *shard, CacheEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        shard->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        shard->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+/* Called with shard->lock held. */
+static void
+lru_push_head (CacheShard *shard, CacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head)
+        shard->head->prev = entry;
+    shard->head = entry;
+    if (!shard->tail)
+        shard->tail = entry;
+}
+
+/* Called with shard->lock held. */
+static void
+remove_entry (CacheShard *shard, CacheEntry *entry)
+{
+    lru_unlink (shard, entry);
+    g_hash_table_remove (shard->entries, entry->key);
+    shard->size -= entry->size;
+    cache_entry_unref (entry);
+}
+
+static CacheEntry *
+cache_lookup (CachePriv *priv, const char *store_id, const char *block_id)
+{
+    CacheShard *shard = get_shard (priv, block_id);
+    char *key = make_key (store_id, block_id);
+    CacheEntry *entry;
+
+    pthread_mutex_lock (&shard->lock);
+
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry) {
+        lru_unlink (shard, entry);
+        lru_push_head (shard, entry);
+        g_atomic_int_inc (&entry->ref);
+        ++shard->hits;
+    } else {
+        ++shard->misses;
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    g_free (key);
+    return entry;
+}
+
+/* Takes over @entry, and returns it with a reference for the caller. */
+static CacheEntry *
+cache_insert (CachePriv *priv, const char *block_id, CacheEntry *entry)
+{
+    CacheShard *shard = get_shard (priv, block_id);
+    CacheEntry *old;
+
+    pthread_mutex_lock (&shard->lock);
+
+    /* Another reader may have loaded the same block. */
+    old = g_hash_table_lookup (shard->entries, entry->key);
+    if (old) {
+        g_atomic_int_inc (&old->ref);
+        pthread_mutex_unlock (&shard->lock);
+        cache_entry_unref (entry);
+        return old;
+    }
+
+    entry->ref = 2;
+    g_hash_table_insert (shard->entries, entry->key, entry);
+    lru_push_head (shard, entry);
+    shard->size += entry->size;
+
+    while (shard->size > priv->shard_capacity && shard->tail != entry) {
+        remove_entry (shard, shard->tail);
+        ++shard->evictions;
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    return entry;
+}
+
+static void
+cache_invalidate (CachePriv *priv, const char *store_id, const char *block_id)
+{
+    CacheShard *shard = get_shard (priv, block_id);
+    char *key = make_key (store_id, block_id);
+    CacheEntry *entry;
+
+    pthread_mutex_lock (&shard->lock);
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry)
+        remove_entry (shard, entry);
+    pthread_mutex_unlock (&shard->lock);
+
+    g_free (key);
+}
+
+static void
+cache_invalidate_store (CachePriv *priv, const char *store_id)
+{
+    CacheShard *shard;
+    CacheEntry *entry, *next;
+    size_t len = strlen (store_id);
+    int i;
+
+    for (i = 0; i < N_SHARDS; i++) {
+        shard = &priv->shards[i];
+        pthread_mutex_lock (&shard->lock);
+        for (entry = shard->head; entry; entry = next) {
+            next = entry->next;
+            if (strncmp (entry->key, store_id, len) == 0 &&
+                entry->key[len] == '/')
+                remove_entry (shard, entry);
+        }
+        pthread_mutex_unlock (&shard->lock);
+    }
+}
+
+/*
+ * Read the whole block from the inner handle into a new cache entry.
+ * The size isn't known in advance, so at most max_block_size + 1 bytes
+ * are read. If the block is larger than that, NULL is returned and the
+ * bytes read are left in @prefix, to be returned before the rest of the
+ * block is read from the inner handle.
+ *
+ * Returns -1 if the block can't be read.
+ */
+static int
+load_entry (CachePriv *priv, BHandle *inner,
+            const char *store_id, const char *block_id,
+            CacheEntry **pentry, GByteArray **prefix)
+{
+    BlockBackend *bend = priv->inner;
+    GByteArray *buf;
+    CacheEntry *entry;
+    guint32 len, want;
+    int n;
+
+    *pentry = NULL;
+    *prefix = NULL;
+
+    buf = g_byte_array_sized_new (LOAD_CHUNK_SIZE);
+    while (buf->len <= priv->max_block_size) {
+        len = buf->len;
+        want = MIN (MAX (len, LOAD_CHUNK_SIZE),
+                    priv->max_block_size + 1 - len);
+        g_byte_array_set_size (buf, len + want);
+        n = bend->read_block (bend, inner, buf->data + len, want);
+        if (n < 0) {
+            seaf_warning ("[block cache] Failed to read block %s:%s.\n",
+                          store_id, block_id);
+            g_byte_array_free (buf, TRUE);
+            return -1;
+        }
+        g_byte_array_set_size (buf, len + n);
+        if (n == 0)
+            break;
+    }
+
+    if (buf->len > priv->max_block_size) {
+        *prefix = buf;
+        return 0;
+    }
+
+    entry = g_new0 (CacheEntry, 1);
+    entry->size = buf->len;
+    entry->data = (char *)g_byte_array_free (buf, FALSE);
+    entry->key = make_key (store_id, block_id);
+    entry->ref = 1;
+    *pentry = entry;
+    return 0;
+}
+
+static BHandle *
+block_backend_cache_open_block (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                const char *block_id,
+                                int rw_type)
+{
+    CachePriv *priv = bend->be_priv;
+    BlockBackend *inner = priv->inner;
+    BHandle *handle;
+    BHandle *inner_handle;
+    CacheEntry *entry = NULL;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+
+    if (rw_type == BLOCK_READ)
+        entry = cache_lookup (priv, store_id, block_id);
+
+    handle = g_new0 (BHandle, 1);
+    handle->rw_type = rw_type;
+    memcpy (handle->block_id, block_id, 41);
+
+    if (entry) {
+        handle->entry = entry;
+        return handle;
+    }
+
+    inner_handle = inner->open_block (inner, store_id, version,
+                                      block_id, rw_type);
+    if (!inner_handle) {
+        g_free (handle);
+        return NULL;
+    }
+
+    if (rw_type == BLOCK_READ) {
+        if (load_entry (priv, inner_handle, store_id, block_id,
+                        &entry, &handle->prefix) < 0) {
+            inner->block_handle_free (inner, inner_handle);
+            g_free (handle);
+            return NULL;
+        }
+        if (entry) {
+            handle->entry = cache_insert (priv, block_id, entry);
+            inner->block_handle_free (inner, inner_handle);
+            return handle;
+        }
+    }
+
+    handle->inner = inner_handle;
+    return handle;
+}
+
+static int
+block_backend_cache_read_block (BlockBackend *bend,
+                                BHandle *handle,
+                                void *buf, int len)
+{
+    CachePriv *priv = bend->be_priv;
+    CacheEntry *entry = handle->entry;
+    GByteArray *prefix = handle->prefix;
+    guint32 n;
+
+    if (!entry && prefix && handle->pos < prefix->len) {
+        n = MIN ((guint32)len, prefix->len - handle->pos);
+        memcpy (buf, prefix->data + handle->pos, n);
+        handle->pos += n;
+        return (int)n;
+    }
+
+    if (!entry)
+        return priv->inner->read_block (priv->inner, handle->inner, buf, len);
+
+    n = MIN ((guint32)len, entry->size - handle->pos);
+    memcpy (buf, entry->data + handle->pos, n);
+    handle->pos += n;
+
+    return (int)n;
+}
+
+static int
+block_backend_cache_write_block (BlockBackend *bend,
+                                 BHandle *handle,
+                                 const void *buf, int len)
+{
+    CachePriv *priv = bend->be_priv;
+
+    g_return_val_if_fail (handle->inner != NULL, -1);
+
+    return priv->inner->write_block (priv->inner, handle->inner, buf, len);
+}
+
+static int
+block_backend_cache_commit_block (BlockBackend *bend,
+                                  BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+
+    g_return_val_if_fail (handle->inner != NULL, -1);
+
+    return priv->inner->commit_block (priv->inner, handle->inner);
+}
+
+static int
+block_backend_cache_close_block (BlockBackend *bend,
+                                 BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+
+    if (!handle->inner)
+        return 0;
+
+    return priv->inner->close_block (priv->inner, handle->inner);
+}
+
+static void
+block_backend_cache_block_handle_free (BlockBackend *bend,
+                                       BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+
+    if (handle->entry)
+        cache_entry_unref (handle->entry);
+    if (handle->inner)
+        priv->inner->block_handle_free (priv->inner, handle->inner);
+    if (handle->prefix)
+        g_byte_array_free (handle->prefix, TRUE);
+    g_free (handle);
+}
+
+static int
+block_backend_cache_get_block_fd (BlockBackend *bend,
+                                  BHandle *handle,
+                                  gint64 *offset,
+                                  guint32 *size)
+{
+    CachePriv *priv = bend->be_priv;
+
+    /* Cached blocks are read from memory. */
+    if (!handle->inner)
+        return -1;
+
+    return priv->inner->get_block_fd (priv->inner, handle->inner, offset, size);
+}
+
+/*
+ * Existence is always checked in the inner backend. A block removed by
+ * another process, e.g. the GC, may still be cached, but must not be
+ * reported as existing.
+ */
+static int
+block_backend_cache_block_exists (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->inner->exists (priv->inner, store_id, version, block_id);
+}
+
+static int
+block_backend_cache_exists_batch (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  int n,
+                                  const char **block_ids,
+                                  gboolean *results)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->inner->exists_batch (priv->inner, store_id, version,
+                                      n, block_ids, results);
+}
+
+static int
+block_backend_cache_remove_block (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+
+    cache_invalidate (priv, store_id, block_id);
+
+    return priv->inner->remove_block (priv->inner, store_id, version, block_id);
+}
+
+static BMetadata *
+block_backend_cache_stat_block (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->inner->stat_block (priv->inner, store_id, version, block_id);
+}
+
+static BMetadata *
+block_backend_cache_stat_block_by_handle (BlockBackend *bend,
+                                          BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+    BMetadata *block_md;
+
+    if (!handle->entry)
+        return priv->inner->stat_block_by_handle (priv->inner, handle->inner);
+
+    block_md = g_new0(BMetadata, 1);
+    memcpy (block_md->id, handle->block_id, 40);
+    block_md->size = handle->entry->size;
+
+    return block_md;
+}
+
+static int
+block_backend_cache_foreach_block (BlockBackend *bend,
+                                   const char *store_id,
+                                   int version,
+                                   SeafBlockFunc process,
+                                   void *user_data)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->inner->foreach_block (priv->inner, store_id, version,
+                                       process, user_data);
+}
+
+static int
+block_backend_cache_foreach_block_parallel (BlockBackend *bend,
+                                            const char *store_id,
+                                            int version,
+                                            int n_threads,
+                                            SeafBlockFunc process,
+                                            void *user_data)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->inner->foreach_block_parallel (priv->inner, store_id, version,
+                                                n_threads, process, user_data);
+}
+
+static int
+block_backend_cache_copy (BlockBackend *bend,
+                          const char *src_store_id,
+                          int src_version,
+                          const char *dst_store_id,
+                          int dst_version,
+                          const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->inner->copy (priv->inner, src_store_id, src_version,
+                              dst_store_id, dst_version, block_id);
+}
+
+static int
+block_backend_cache_remove_store (BlockBackend *bend, const char *store_id)
+{
+    CachePriv *priv = bend->be_priv;
+
+    cache_invalidate_store (priv, store_id);
+
+    return priv->inner->remove_store (priv->inner, store_id);
+}
+
+static int
+block_backend_cache_compact_store (BlockBackend *bend,
+                                   const char *store_id,
+                                   int version)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->inner->compact_store (priv->inner, store_id, version);
+}
+
+static int
+block_backend_cache_rebalance_store (BlockBackend *bend,
+                                     const char *store_id,
+                                     int version)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->inner->rebalance_store (priv->inner, store_id, version);
+}
+
+BlockBackend *
+block_backend_cache_new (BlockBackend *inner, gint64 capacity)
+{
+    BlockBackend *bend;
+    CachePriv *priv;
+    CacheShard *shard;
+    int i;
+
+    priv = g_new0 (CachePriv, 1);
+    priv->inner = inner;
+    priv->shard_capacity = capacity / N_SHARDS;
+    priv->max_block_size = (guint32) MIN (priv->shard_capacity / 4, G_MAXUINT32);
+
+    for (i = 0; i < N_SHARDS; i++) {
+        shard = &priv->shards[i];
+        pthread_mutex_init (&shard->lock, NULL);
+        shard->entries = g_hash_table_new (g_str_hash, g_str_equal);
+    }
+
+    bend = g_new0 (BlockBackend, 1);
+    bend->be_priv = priv;
+
+    bend->open_block = block_backend_cache_open_block;
+    bend->read_block = block_backend_cache_read_block;
+    bend->write_block = block_backend_cache_write_block;
+    bend->commit_block = block_backend_cache_commit_block;
+    bend->close_block = block_backend_cache_close_block;
+    bend->exists = block_backend_cache_block_exists;
+    if (inner->exists_batch)
+        bend->exists_batch = block_backend_cache_exists_batch;
+    bend->remove_block = block_backend_cache_remove_block;
+    bend->stat_block = block_backend_cache_stat_block;
+    bend->stat_block_by_handle = block_backend_cache_stat_block_by_handle;
+    bend->block_handle_free = block_backend_cache_block_handle_free;
+    if (inner->get_block_fd)
+        bend->get_block_fd = block_backend_cache_get_block_fd;
+    bend->foreach_block = block_backend_cache_foreach_block;
+    if (inner->foreach_block_parallel)
+        bend->foreach_block_parallel = block_backend_cache_foreach_block_parallel;
+    bend->remove_store = block_backend_cache_remove_store;
+    bend->copy = block_backend_cache_copy;
+    if (inner->compact_store)
+        bend->compact_store = block_backend_cache_compact_store;
+    if (inner->rebalance_store)
+        bend->rebalance_store = block_backend_cache_rebalance_store;
+
+    return bend;
+}
+
+void
+block_backend_cache_get_stats (BlockBackend *bend, BlockCacheStats *stats)
+{
+    CachePriv *priv = bend->be_priv;
+    CacheShard *shard;
+    int i;
+
+    memset (stats, 0, sizeof(BlockCacheStats));
+    stats->capacity = priv->shard_capacity * N_SHARDS;
+
+    for (i = 0; i < N_SHARDS; i++) {
+        shard = &priv->shards[i];
+        pthread_mutex_lock (&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->size += shard->size;
+        stats->n_blocks += g_hash_table_size (shard->entries);
+        pthread_mutex_unlock (&shard->lock);
+    }
+}
@@ -0,0 +1,712 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "utils.h"
+#include "block-backend.h"
+
+#include "log.h"
+
+/*
+ * Block backend which compresses blocks before storing them in another
+ * backend. Block ids stay the SHA-1 of the uncompressed content, and
+ * readers always get the uncompressed content.
+ *
+ * A compressed block starts with a header. Blocks written without
+ * compression, because the data doesn't compress or because they were
+ * written before compression was enabled, are stored as is. The header
+ * contains the first bytes of the block id, so raw data which happens to
+ * look like a header is not taken for one.
+ */
+
+#define HEADER_MAGIC "\x89SBZ"
+#define HEADER_SIZE 20
+#define ID_PREFIX_LEN 8
+
+enum {
+    CODEC_NONE = 0,
+    CODEC_ZLIB = 1,
+    CODEC_ZSTD = 2,
+};
+
+/* Data is sampled in windows to estimate how well it compresses. */
+#define PROBE_WINDOWS 8
+#define PROBE_WINDOW_SIZE 512
+
+typedef struct {
+    BlockBackend    *inner;
+    /* Codec for new blocks. CODEC_NONE only decodes existing blocks. */
+    int             codec;
+    int             level;
+
+    pthread_mutex_t lock;
+    BlockCompressStats stats;
+} CompressPriv;
+
+struct _BHandle {
+    int         rw_type;
+    char        block_id[41];
+    BHandle     *inner;
+
+    /* Data written, compressed on commit. The inner handle of a written
+     * block is only closed on commit, after the data is written to it.
+     */
+    GByteArray  *wbuf;
+    gboolean    inner_closed;
+
+    /* Uncompressed content of a compressed block being read. */
+    char        *data;
+    guint32     size;
+    guint32     pos;
+
+    /* Start of a raw block, read to look for a header. It's returned
+     * before reading on from the inner handle.
+     */
+    char        peek[HEADER_SIZE];
+    int         n_peek;
+    int         peek_pos;
+};
+
+static void
+make_header (char *hdr, int codec, guint32 raw_size, const char *block_id)
+{
+    unsigned char id[20];
+
+    hex_to_rawdata (block_id, id, 20);
+
+    memset (hdr, 0, HEADER_SIZE);
+    memcpy (hdr, HEADER_MAGIC, 4);
+    hdr[4] = (char)codec;
+    raw_size = htonl (raw_size);
+    memcpy (hdr + 8, &raw_size, 4);
+    memcpy (hdr + 12, id, ID_PREFIX_LEN);
+}
+
+/* Returns the codec, or -1 if @hdr is not a header for @block_id. */
+static int
+parse_header (const char *hdr, const char *block_id, guint32 *raw_size)
+{
+    char expected[HEADER_SIZE];
+    guint32 size;
+
+    memcpy (&size, hdr + 8, 4);
+    make_header (expected, hdr[4], ntohl (size), block_id);
+    if (memcmp (hdr, expected, HEADER_SIZE) != 0)
+        return -1;
+
+    *raw_size = ntohl (size);
+    return (unsigned char)hdr[4];
+}
+
+/*
+ * Estimate whether @data is worth compressing. Already compressed data
+ * (JPEG, ZIP, video) has nearly uniform byte frequencies. This checks
+ * that the collision entropy of sampled bytes is below 7.5 bits.
+ */
+static gboolean
+looks_compressible (const unsigned char *data, guint32 len)
+{
+    guint32 counts[256];
+    guint64 n = 0, sum = 0;
+    guint32 start, end, step, i;
+    int w;
+
+    memset (counts, 0, sizeof(counts));
+
+    if (len <= PROBE_WINDOWS * PROBE_WINDOW_SIZE) {
+        for (i = 0; i < len; i++)
+            ++counts[data[i]];
+        n = len;
+    } else {
+        step = len / PROBE_WINDOWS;
+        for (w = 0; w < PROBE_WINDOWS; w++) {
+            start = w * step;
+            end = start + PROBE_WINDOW_SIZE;
+            for (i = start; i < end; i++)
+                ++counts[data[i]];
+        }
+        n = PROBE_WINDOWS * PROBE_WINDOW_SIZE;
+    }
+
+    for (i = 0; i < 256; i++)
+        sum += (guint64)counts[i] * counts[i];
+
+    /* sum(p^2) >= 2^-7.5, i.e. about 1/181. */
+    return sum * 181 >= n * n;
+}
+
+/*
+ * Compress @len bytes of @data into a new buffer after a header.
+ * Returns -1 if the codec fails or the data doesn't get smaller.
+ */
+static int
+compress_block (CompressPriv *priv, const char *block_id,
+                const char *data, guint32 len,
+                char **out, guint32 *out_len)
+{
+    char *buf;
+    gsize bound, n = 0;
+
+    if (priv->codec == CODEC_ZLIB) {
+        uLongf dest_len;
+
+        bound = compressBound (len);
+        buf = g_malloc (HEADER_SIZE + bound);
+        dest_len = bound;
+        if (compress2 ((Bytef *)buf + HEADER_SIZE, &dest_len,
+                       (const Bytef *)data, len, priv->level) != Z_OK) {
+            g_free (buf);
+            return -1;
+        }
+        n = dest_len;
+    }
+#ifdef HAVE_ZSTD
+    else if (priv->codec == CODEC_ZSTD) {
+        bound = ZSTD_compressBound (len);
+        buf = g_malloc (HEADER_SIZE + bound);
+        n = ZSTD_compress (buf + HEADER_SIZE, bound, data, len, priv->level);
+        if (ZSTD_isError (n)) {
+            g_free (buf);
+            return -1;
+        }
+    }
+#endif
+    else {
+        return -1;
+    }
+
+    /* Keep the block raw unless it saves at least 1/16. */
+    if (HEADER_SIZE + n > len - len / 16) {
+        g_free (buf);
+        return -1;
+    }
+
+    make_header (buf, priv->codec, len, block_id);
+    *out = buf;
+    *out_len = HEADER_SIZE + n;
+    return 0;
+}
+
+static int
+decompress_block (int codec, const char *block_id,
+                  const char *payload, guint32 len,
+                  char *out, guint32 raw_size)
+{
+    if (codec == CODEC_ZLIB) {
+        uLongf dest_len = raw_size;
+
+        if (uncompress ((Bytef *)out, &dest_len,
+                        (const Bytef *)payload, len) != Z_OK ||
+            dest_len != raw_size)
+            goto error;
+        return 0;
+    }
+#ifdef HAVE_ZSTD
+    if (codec == CODEC_ZSTD) {
+        size_t n = ZSTD_decompress (out, raw_size, payload, len);
+        if (ZSTD_isError (n) || n != raw_size)
+            goto error;
+        return 0;
+    }
+#endif
+
+    seaf_warning ("[block compress] Unsupported codec %d for block %s.\n",
+                  codec, block_id);
+    return -1;
+
+error:
+    seaf_warning ("[block compress] Failed to decompress block %s.\n", block_id);
+    return -1;
+}
+
+/* Read up to @len bytes, returns the number of bytes read or -1. */
+static int
+read_full (BlockBackend *inner, BHandle *ih, char *buf, guint32 len)
+{
+    guint32 done = 0;
+    int n;
+
+    while (done < len) {
+        n = inner->read_block (inner, ih, buf + done, len - done);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+
+    return (int)done;
+}
+
+/* Read the stored block after its header and decompress it into @handle. */
+static int
+load_compressed (CompressPriv *priv, BHandle *handle,
+                 int codec, guint32 raw_size)
+{
+    BlockBackend *inner = priv->inner;
+    BMetadata *md;
+    char *payload;
+    guint32 len;
+    int ret = 0;
+
+    md = inner->stat_block_by_handle (inner, handle->inner);
+    if (!md || md->size < HEADER_SIZE) {
+        seaf_warning ("[block compress] Failed to stat block %s.\n",
+                      handle->block_id);
+        g_free (md);
+        return -1;
+    }
+    len = md->size - HEADER_SIZE;
+    g_free (md);
+
+    payload = g_malloc (len ? len : 1);
+    if (read_full (inner, handle->inner, payload, len) != (int)len) {
+        seaf_warning ("[block compress] Failed to read block %s.\n",
+                      handle->block_id);
+        g_free (payload);
+        return -1;
+    }
+
+    handle->data = g_malloc (raw_size ? raw_size : 1);
+    handle->size = raw_size;
+    if (decompress_block (codec, handle->block_id, payload, len,
+                          handle->data, raw_size) < 0) {
+        g_free (handle->data);
+        handle->data = NULL;
+        ret = -1;
+    }
+
+    g_free (payload);
+    return ret;
+}
+
+static BHandle *
+block_backend_compress_open_block (BlockBackend *bend,
+                                   const char *store_id,
+                                   int version,
+                                   const char *block_id,
+                                   int rw_type)
+{
+    CompressPriv *priv = bend->be_priv;
+    BlockBackend *inner = priv->inner;
+    BHandle *handle;
+    guint32 raw_size;
+    int n, codec;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+
+    handle = g_new0 (BHandle, 1);
+    handle->rw_type = rw_type;
+    memcpy (handle->block_id, block_id, 41);
+
+    handle->inner = inner->open_block (inner, store_id, version,
+                                       block_id, rw_type);
+    if (!handle->inner) {
+        g_free (handle);
+        return NULL;
+    }
+
+    if (rw_type == BLOCK_WRITE) {
+        handle->wbuf = g_byte_array_new ();
+        return handle;
+    }
+
+    n = read_full (inner, handle->inner, handle->peek, HEADER_SIZE);
+    if (n < 0) {
+        seaf_warning ("[block compress] Failed to read block %s.\n", block_id);
+        goto error;
+    }
+
+    if (n == HEADER_SIZE &&
+        (codec = parse_header (handle->peek, block_id, &raw_size)) >= 0) {
+        if (load_compressed (priv, handle, codec, raw_size) < 0)
+            goto error;
+        return handle;
+    }
+
+    handle->n_peek = n;
+    return handle;
+
+error:
+    inner->block_handle_free (inner, handle->inner);
+    g_free (handle);
+    return NULL;
+}
+
+static int
+block_backend_compress_read_block (BlockBackend *bend,
+                                   BHandle *handle,
+                                   void *buf, int len)
+{
+    CompressPriv *priv = bend->be_priv;
+    int n;
+
+    if (handle->data) {
+        n = MIN ((guint32)len, handle->size - handle->pos);
+        memcpy (buf, handle->data + handle->pos, n);
+        handle->pos += n;
+        return n;
+    }
+
+    if (handle->peek_pos < handle->n_peek) {
+        n = MIN (len, handle->n_peek - handle->peek_pos);
+        memcpy (buf, handle->peek + handle->peek_pos, n);
+        handle->peek_pos += n;
+        return n;
+    }
+
+    return priv->inner->read_block (priv->inner, handle->inner, buf, len);
+}
+
+static int
+block_backend_compress_write_block (BlockBackend *bend,
+                                    BHandle *handle,
+                                    const void *buf, int len)
+{
+    g_return_val_if_fail (handle->wbuf != NULL, -1);
+
+    g_byte_array_append (handle->wbuf, buf, len);
+    return len;
+}
+
+static int
+block_backend_compress_commit_block (BlockBackend *bend,
+                                     BHandle *handle)
+{
+    CompressPriv *priv = bend->be_priv;
+    BlockBackend *inner = priv->inner;
+    const char *data;
+    char *compressed = NULL;
+    guint32 len, out_len = 0;
+    gboolean is_compressed = FALSE;
+    int n;
+
+    g_return_val_if_fail (handle->wbuf != NULL, -1);
+
+    data = (const char *)handle->wbuf->data;
+    len = handle->wbuf->len;
+
+    if (priv->codec != CODEC_NONE &&
+        looks_compressible ((const unsigned char *)data, len) &&
+        compress_block (priv, handle->block_id, data, len,
+                        &compressed, &out_len) == 0) {
+        data = compressed;
+        is_compressed = TRUE;
+    } else {
+        out_len = len;
+    }
+
+    n = inner->write_block (inner, handle->inner, data, out_len);
+    g_free (compressed);
+    if (n != (int)out_len) {
+        seaf_warning ("[block compress] Failed to write block %s.\n",
+                      handle->block_id);
+        return -1;
+    }
+
+    handle->inner_closed = TRUE;
+    if (inner->close_block (inner, handle->inner) < 0) {
+        seaf_warning ("[block compress] Failed to close block %s.\n",
+                      handle->block_id);
+        return -1;
+    }
+
+    if (inner->commit_block (inner, handle->inner) < 0)
+        return -1;
+
+    pthread_mutex_lock (&priv->lock);
+    if (is_compressed) {
+        ++priv->stats.n_compressed;
+        priv->stats.raw_bytes += len;
+        priv->stats.stored_bytes += out_len;
+    } else {
+        ++priv->stats.n_raw;
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    return 0;
+}
+
+static int
+block_backend_compress_close_block (BlockBackend *bend,
+                                    BHandle *handle)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    /* Callers close before committing, but the data of a written block
+     * only reaches the inner handle on commit.
+     */
+    if (handle->rw_type == BLOCK_WRITE)
+        return 0;
+
+    return priv->inner->close_block (priv->inner, handle->inner);
+}
+
+static void
+block_backend_compress_block_handle_free (BlockBackend *bend,
+                                          BHandle *handle)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    /* The block was not committed. */
+    if (handle->rw_type == BLOCK_WRITE && !handle->inner_closed)
+        priv->inner->close_block (priv->inner, handle->inner);
+    priv->inner->block_handle_free (priv->inner, handle->inner);
+    if (handle->wbuf)
+        g_byte_array_free (handle->wbuf, TRUE);
+    g_free (handle->data);
+    g_free (handle);
+}
+
+static int
+block_backend_compress_get_block_fd (BlockBackend *bend,
+                                     BHandle *handle,
+                                     gint64 *offset,
+                                     guint32 *size)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    /* Compressed blocks can't be sent from the file, and written blocks
+     * are compressed on commit.
+     */
+    if (handle->data || handle->rw_type == BLOCK_WRITE)
+        return -1;
+
+    return priv->inner->get_block_fd (priv->inner, handle->inner, offset, size);
+}
+
+static int
+block_backend_compress_block_exists (BlockBackend *bend,
+                                     const char *store_id,
+                                     int version,
+                                     const char *block_id)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->inner->exists (priv->inner, store_id, version, block_id);
+}
+
+static int
+block_backend_compress_exists_batch (BlockBackend *bend,
+                                     const char *store_id,
+                                     int version,
+                                     int n,
+                                     const char **block_ids,
+                                     gboolean *results)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->inner->exists_batch (priv->inner, store_id, version,
+                                      n, block_ids, results);
+}
+
+static int
+block_backend_compress_remove_block (BlockBackend *bend,
+                                     const char *store_id,
+                                     int version,
+                                     const char *block_id)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->inner->remove_block (priv->inner, store_id, version, block_id);
+}
+
+/* Only the header is read to get the uncompressed size. */
+static BMetadata *
+block_backend_compress_stat_block (BlockBackend *bend,
+                                   const char *store_id,
+                                   int version,
+                                   const char *block_id)
+{
+    CompressPriv *priv = bend->be_priv;
+    BlockBackend *inner = priv->inner;
+    BHandle *ih;
+    BMetadata *block_md;
+    char hdr[HEADER_SIZE];
+    guint32 raw_size;
+    int n;
+
+    ih = inner->open_block (inner, store_id, version, block_id, BLOCK_READ);
+    if (!ih)
+        return NULL;
+
+    n = read_full (inner, ih, hdr, HEADER_SIZE);
+    if (n == HEADER_SIZE && parse_header (hdr, block_id, &raw_size) >= 0) {
+        block_md = g_new0 (BMetadata, 1);
+        memcpy (block_md->id, block_id, 40);
+        block_md->size = raw_size;
+    } else {
+        block_md = inner->stat_block_by_handle (inner, ih);
+    }
+
+    inner->close_block (inner, ih);
+    inner->block_handle_free (inner, ih);
+    return block_md;
+}
+
+static BMetadata *
+block_backend_compress_stat_block_by_handle (BlockBackend *bend,
+                                             BHandle *handle)
+{
+    CompressPriv *priv = bend->be_priv;
+    BMetadata *block_md;
+
+    if (!handle->data)
+        return priv->inner->stat_block_by_handle (priv->inner, handle->inner);
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, handle->block_id, 40);
+    block_md->size = handle->size;
+
+    return block_md;
+}
+
+static int
+block_backend_compress_foreach_block (BlockBackend *bend,
+                                      const char *store_id,
+                                      int version,
+                                      SeafBlockFunc process,
+                                      void *user_data)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->inner->foreach_block (priv->inner, store_id, version,
+                                       process, user_data);
+}
+
+static int
+block_backend_compress_foreach_block_parallel (BlockBackend *bend,
+                                               const char *store_id,
+                                               int version,
+                                               int n_threads,
+                                               SeafBlockFunc process,
+                                               void *user_data)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->inner->foreach_block_parallel (priv->inner, store_id, version,
+                                                n_threads, process, user_data);
+}
+
+/* The stored form is copied, it doesn't depend on the store. */
+static int
+block_backend_compress_copy (BlockBackend *bend,
+                             const char *src_store_id,
+                             int src_version,
+                             const char *dst_store_id,
+                             int dst_version,
+                             const char *block_id)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->inner->copy (priv->inner, src_store_id, src_version,
+                              dst_store_id, dst_version, block_id);
+}
+
+static int
+block_backend_compress_remove_store (BlockBackend *bend, const char *store_id)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->inner->remove_store (priv->inner, store_id);
+}
+
+static int
+block_backend_compress_compact_store (BlockBackend *bend,
+                                      const char *store_id,
+                                      int version)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->inner->compact_store (priv->inner, store_id, version);
+}
+
+static int
+block_backend_compress_rebalance_store (BlockBackend *bend,
+                                        const char *store_id,
+                                        int version)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    return priv->inner->rebalance_store (priv->inner, store_id, version);
+}
+
+BlockBackend *
+block_backend_compress_new (BlockBackend *inner, const char *codec, int level)
+{
+    BlockBackend *bend;
+    CompressPriv *priv;
+
+    priv = g_new0 (CompressPriv, 1);
+    priv->inner = inner;
+
+    if (!codec || strcmp (codec, "none") == 0) {
+        priv->codec = CODEC_NONE;
+    } else if (strcmp (codec, "zlib") == 0) {
+        priv->codec = CODEC_ZLIB;
+        priv->level = (level > 0) ? level : Z_DEFAULT_COMPRESSION;
+    } else if (strcmp (codec, "zstd") == 0) {
+#ifdef HAVE_ZSTD
+        priv->codec = CODEC_ZSTD;
+        priv->level = (level > 0) ? level : 3;
+#else
+        seaf_warning ("[block compress] Not built with zstd support.\n");
+        g_free (priv);
+        return NULL;
+#endif
+    } else {
+        seaf_warning ("[block compress] Unknown codec %s.\n", codec);
+        g_free (priv);
+        return NULL;
+    }
+
+    pthread_mutex_init (&priv->lock, NULL);
+
+    bend = g_new0 (BlockBackend, 1);
+    bend->be_priv = priv;
+
+    bend->open_block = block_backend_compress_open_block;
+    bend->read_block = block_backend_compress_read_block;
+    bend->write_block = block_backend_compress_write_block;
+    bend->commit_block = block_backend_compress_commit_block;
+    bend->close_block = block_backend_compress_close_block;
+    bend->exists = block_backend_compress_block_exists;
+    if (inner->exists_batch)
+        bend->exists_batch = block_backend_compress_exists_batch;
+    bend->remove_block = block_backend_compress_remove_block;
+    bend->stat_block = block_backend_compress_stat_block;
+    bend->stat_block_by_handle = block_backend_compress_stat_block_by_handle;
+    bend->block_handle_free = block_backend_compress_block_handle_free;
+    if (inner->get_block_fd)
+        bend->get_block_fd = block_backend_compress_get_block_fd;
+    bend->foreach_block = block_backend_compress_foreach_block;
+    if (inner->foreach_block_parallel)
+        bend->foreach_block_parallel = block_backend_compress_foreach_block_parallel;
+    bend->remove_store = block_backend_compress_remove_store;
+    bend->copy = block_backend_compress_copy;
+    if (inner->compact_store)
+        bend->compact_store = block_backend_compress_compact_store;
+    if (inner->rebalance_store)
+        bend->rebalance_store = block_backend_compress_rebalance_store;
+
+    return bend;
+}
+
+void
+block_backend_compress_get_stats (BlockBackend *bend, BlockCompressStats *stats)
+{
+    CompressPriv *priv = bend->be_priv;
+
+    pthread_mutex_lock (&priv->lock);
+    memcpy (stats, &priv->stats, sizeof(BlockCompressStats));
+    pthread_mutex_unlock (&priv->lock);
+}
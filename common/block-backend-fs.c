@@ -195,6 +195,33 @@ block_backend_fs_block_exists (BlockBackend *bend,
         return FALSE;
 }
 
+static int
+block_backend_fs_exists_batch (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               int n,
+                               const char **block_ids,
+                               gboolean *results)
+{
+    FsPriv *priv = bend->be_priv;
+    char *dir;
+    int ret;
+
+#if defined MIGRATION
+    if (version > 0)
+        dir = g_build_filename (priv->block_dir, store_id, NULL);
+    else
+        dir = g_strdup (priv->v0_block_dir);
+#else
+    dir = g_build_filename (priv->block_dir, store_id, NULL);
+#endif
+
+    ret = objstore_objs_exist (dir, n, block_ids, results);
+
+    g_free (dir);
+    return ret;
+}
+
 static int
 block_backend_fs_remove_block (BlockBackend *bend,
                                const char *store_id,
@@ -249,6 +276,46 @@ block_backend_fs_stat_block_by_handle (BlockBackend *bend,
     return block_md;
 }
 
+static int
+block_backend_fs_get_block_fd (BlockBackend *bend,
+                               BHandle *handle,
+                               gint64 *offset,
+                               guint32 *size)
+{
+    SeafStat st;
+    int fd;
+
+    /* For a write handle this is the tmp file, renamed on commit. */
+    if (seaf_fstat (handle->fd, &st) < 0) {
+        seaf_warning ("[block bend] Failed to stat block %s.\n", handle->block_id);
+        return -1;
+    }
+
+    fd = dup (handle->fd);
+    if (fd < 0) {
+        seaf_warning ("[block bend] Failed to dup fd of block %s: %s.\n",
+                      handle->block_id, strerror(errno));
+        return -1;
+    }
+
+    *offset = 0;
+    *size = (guint32) st.st_size;
+    return fd;
+}
+
+static char *
+get_store_block_dir (FsPriv *priv, const char *store_id, int version)
+{
+#if defined MIGRATION
+    if (version > 0)
+        return g_build_filename (priv->block_dir, store_id, NULL);
+    else
+        return g_strdup(priv->v0_block_dir);
+#else
+    return g_build_filename (priv->block_dir, store_id, NULL);
+#endif
+}
+
 static int
 block_backend_fs_foreach_block (BlockBackend *bend,
                                 const char *store_id,
@@ -265,14 +332,7 @@ block_backend_fs_foreach_block (BlockBackend *bend,
     char path[SEAF_PATH_MAX], *pos;
     int ret = 0;
 
-#if defined MIGRATION
-    if (version > 0)
-        block_dir = g_build_filename (priv->block_dir, store_id, NULL);
-    else
-        block_dir = g_strdup(priv->v0_block_dir);
-#else
-    block_dir = g_build_filename (priv->block_dir, store_id, NULL);
-#endif
+    block_dir = get_store_block_dir (priv, store_id, version);
     dir_len = strlen (block_dir);
 
     dir1 = g_dir_open (block_dir, 0, NULL);
@@ -310,6 +370,105 @@ out:
     return ret;
 }
 
+typedef struct ForeachData {
+    const char      *store_id;
+    int             version;
+    const char      *block_dir;
+    SeafBlockFunc   process;
+    void            *user_data;
+    /* Set when a callback returns FALSE. */
+    gint            stop;
+} ForeachData;
+
+/* Thread pool job, lists the blocks in one prefix directory. */
+static void
+foreach_block_in_dir (gpointer vdname, gpointer vdata)
+{
+    char *dname1 = vdname;
+    ForeachData *data = vdata;
+    GDir *dir;
+    const char *dname2;
+    char block_id[128];
+    char path[SEAF_PATH_MAX];
+
+    if (g_atomic_int_get (&data->stop))
+        goto out;
+
+    snprintf (path, sizeof(path), "%s/%s", data->block_dir, dname1);
+    dir = g_dir_open (path, 0, NULL);
+    if (!dir) {
+        seaf_warning ("Failed to open block dir %s.\n", path);
+        goto out;
+    }
+
+    while ((dname2 = g_dir_read_name(dir)) != NULL) {
+        if (g_atomic_int_get (&data->stop))
+            break;
+        snprintf (block_id, sizeof(block_id), "%s%s", dname1, dname2);
+        if (!data->process (data->store_id, data->version,
+                            block_id, data->user_data)) {
+            g_atomic_int_set (&data->stop, 1);
+            break;
+        }
+    }
+    g_dir_close (dir);
+
+out:
+    g_free (dname1);
+}
+
+static int
+block_backend_fs_foreach_block_parallel (BlockBackend *bend,
+                                         const char *store_id,
+                                         int version,
+                                         int n_threads,
+                                         SeafBlockFunc process,
+                                         void *user_data)
+{
+    FsPriv *priv = bend->be_priv;
+    ForeachData data;
+    GThreadPool *pool;
+    GDir *dir1;
+    const char *dname1;
+    GError *error = NULL;
+    int ret = 0;
+
+    memset (&data, 0, sizeof(data));
+    data.store_id = store_id;
+    data.version = version;
+    data.process = process;
+    data.user_data = user_data;
+    data.block_dir = get_store_block_dir (priv, store_id, version);
+
+    dir1 = g_dir_open (data.block_dir, 0, NULL);
+    if (!dir1)
+        goto out;
+
+    pool = g_thread_pool_new (foreach_block_in_dir, &data,
+                              n_threads, FALSE, &error);
+    if (!pool) {
+        seaf_warning ("Failed to create thread pool: %s.\n", error->message);
+        g_clear_error (&error);
+        g_dir_close (dir1);
+        ret = -1;
+        goto out;
+    }
+
+    while ((dname1 = g_dir_read_name(dir1)) != NULL) {
+        if (g_atomic_int_get (&data.stop))
+            break;
+        g_thread_pool_push (pool, g_strdup(dname1), NULL);
+    }
+    g_dir_close (dir1);
+
+    /* Wait for the queued directories to be done. */
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+out:
+    g_free ((char *)data.block_dir);
+    return ret;
+}
+
 static int
 block_backend_fs_copy (BlockBackend *bend,
                        const char *src_store_id,
@@ -484,11 +643,14 @@ block_backend_fs_new (const char *seaf_dir, const char *tmp_dir)
     bend->commit_block = block_backend_fs_commit_block;
     bend->close_block = block_backend_fs_close_block;
     bend->exists = block_backend_fs_block_exists;
+    bend->exists_batch = block_backend_fs_exists_batch;
     bend->remove_block = block_backend_fs_remove_block;
     bend->stat_block = block_backend_fs_stat_block;
     bend->stat_block_by_handle = block_backend_fs_stat_block_by_handle;
     bend->block_handle_free = block_backend_fs_block_handle_free;
+    bend->get_block_fd = block_backend_fs_get_block_fd;
     bend->foreach_block = block_backend_fs_foreach_block;
+    bend->foreach_block_parallel = block_backend_fs_foreach_block_parallel;
     bend->remove_store = block_backend_fs_remove_store;
     bend->copy = block_backend_fs_copy;
 
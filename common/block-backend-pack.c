@@ -0,0 +1,357 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "utils.h"
+
+#include "log.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "block-backend.h"
+#include "pack-store.h"
+
+/*
+ * Block backend which appends blocks to pack files, see pack-store.h.
+ * Blocks being written are buffered in memory until they're committed.
+ */
+
+struct _BHandle {
+    char    *store_id;
+    int     version;
+    char    block_id[41];
+    int     rw_type;
+
+    /* For read. */
+    int         fd;
+    PackEntry   entry;
+    guint32     pos;
+
+    /* For write. */
+    GByteArray *buf;
+};
+
+typedef struct {
+    PackStore *packs;
+} PackPriv;
+
+static BHandle *
+block_backend_pack_open_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id,
+                               int rw_type)
+{
+    PackPriv *priv = bend->be_priv;
+    BHandle *handle;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+    g_return_val_if_fail (rw_type == BLOCK_READ || rw_type == BLOCK_WRITE, NULL);
+
+    handle = g_new0 (BHandle, 1);
+    handle->fd = -1;
+
+    if (rw_type == BLOCK_READ) {
+        handle->fd = pack_store_open_entry (priv->packs, store_id, block_id,
+                                            &handle->entry);
+        if (handle->fd < 0) {
+            seaf_warning ("[block bend] failed to open block %s for read.\n",
+                          block_id);
+            g_free (handle);
+            return NULL;
+        }
+    } else {
+        handle->buf = g_byte_array_new ();
+    }
+
+    memcpy (handle->block_id, block_id, 41);
+    handle->rw_type = rw_type;
+    handle->store_id = g_strdup (store_id);
+    handle->version = version;
+
+    return handle;
+}
+
+static int
+block_backend_pack_read_block (BlockBackend *bend,
+                               BHandle *handle,
+                               void *buf, int len)
+{
+    char *ptr = buf;
+    guint32 n;
+    ssize_t ret;
+
+    n = MIN ((guint32)len, handle->entry.size - handle->pos);
+    while (n > 0) {
+        ret = pread (handle->fd, ptr, n, handle->entry.offset + handle->pos);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0)
+            break;
+        handle->pos += ret;
+        ptr += ret;
+        n -= ret;
+    }
+
+    return (int)(ptr - (char *)buf);
+}
+
+static int
+block_backend_pack_write_block (BlockBackend *bend,
+                                BHandle *handle,
+                                const void *buf, int len)
+{
+    g_byte_array_append (handle->buf, buf, len);
+    return len;
+}
+
+static int
+block_backend_pack_close_block (BlockBackend *bend,
+                                BHandle *handle)
+{
+    int ret = 0;
+
+    if (handle->fd >= 0) {
+        ret = close (handle->fd);
+        handle->fd = -1;
+    }
+
+    return ret;
+}
+
+static void
+block_backend_pack_block_handle_free (BlockBackend *bend,
+                                      BHandle *handle)
+{
+    if (handle->fd >= 0)
+        close (handle->fd);
+    if (handle->buf)
+        g_byte_array_free (handle->buf, TRUE);
+    g_free (handle->store_id);
+    g_free (handle);
+}
+
+static int
+block_backend_pack_commit_block (BlockBackend *bend,
+                                 BHandle *handle)
+{
+    PackPriv *priv = bend->be_priv;
+
+    g_return_val_if_fail (handle->rw_type == BLOCK_WRITE, -1);
+
+    if (pack_store_write (priv->packs, handle->store_id, handle->block_id,
+                          handle->buf->data, handle->buf->len) < 0) {
+        seaf_warning ("[block bend] failed to commit block %s.\n",
+                      handle->block_id);
+        return -1;
+    }
+
+    /* A committed block must survive a crash. When blocks are committed
+     * concurrently, one sync covers all the blocks written before it.
+     */
+    if (pack_store_sync (priv->packs, handle->store_id) < 0) {
+        seaf_warning ("[block bend] failed to sync block %s.\n",
+                      handle->block_id);
+        return -1;
+    }
+
+    return 0;
+}
+
+static gboolean
+block_backend_pack_block_exists (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_sha1)
+{
+    PackPriv *priv = bend->be_priv;
+
+    return pack_store_exists (priv->packs, store_id, block_sha1);
+}
+
+static int
+block_backend_pack_exists_batch (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 int n,
+                                 const char **block_ids,
+                                 gboolean *results)
+{
+    PackPriv *priv = bend->be_priv;
+
+    return pack_store_exists_batch (priv->packs, store_id, n, block_ids, results);
+}
+
+static int
+block_backend_pack_remove_block (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id)
+{
+    PackPriv *priv = bend->be_priv;
+
+    return pack_store_remove (priv->packs, store_id, block_id);
+}
+
+static BMetadata *
+block_backend_pack_stat_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id)
+{
+    PackPriv *priv = bend->be_priv;
+    BMetadata *block_md;
+    guint32 size;
+
+    if (pack_store_stat (priv->packs, store_id, block_id, &size) < 0) {
+        seaf_warning ("[block bend] Failed to stat block %s.\n", block_id);
+        return NULL;
+    }
+    block_md = g_new0(BMetadata, 1);
+    memcpy (block_md->id, block_id, 40);
+    block_md->size = size;
+
+    return block_md;
+}
+
+static BMetadata *
+block_backend_pack_stat_block_by_handle (BlockBackend *bend,
+                                         BHandle *handle)
+{
+    BMetadata *block_md;
+
+    block_md = g_new0(BMetadata, 1);
+    memcpy (block_md->id, handle->block_id, 40);
+    if (handle->rw_type == BLOCK_READ)
+        block_md->size = handle->entry.size;
+    else
+        block_md->size = handle->buf->len;
+
+    return block_md;
+}
+
+static int
+block_backend_pack_get_block_fd (BlockBackend *bend,
+                                 BHandle *handle,
+                                 gint64 *offset,
+                                 guint32 *size)
+{
+    int fd;
+
+    if (handle->rw_type != BLOCK_READ)
+        return -1;
+
+    fd = dup (handle->fd);
+    if (fd < 0) {
+        seaf_warning ("[block bend] Failed to dup fd of block %s: %s.\n",
+                      handle->block_id, strerror(errno));
+        return -1;
+    }
+
+    *offset = handle->entry.offset;
+    *size = handle->entry.size;
+    return fd;
+}
+
+typedef struct {
+    int version;
+    SeafBlockFunc process;
+    void *user_data;
+} ForeachData;
+
+static gboolean
+foreach_block_cb (const char *store_id, const char *id, void *vdata)
+{
+    ForeachData *data = vdata;
+
+    return data->process (store_id, data->version, id, data->user_data);
+}
+
+static int
+block_backend_pack_foreach_block (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  SeafBlockFunc process,
+                                  void *user_data)
+{
+    PackPriv *priv = bend->be_priv;
+    ForeachData data;
+
+    data.version = version;
+    data.process = process;
+    data.user_data = user_data;
+
+    return pack_store_foreach (priv->packs, store_id, foreach_block_cb, &data);
+}
+
+static int
+block_backend_pack_copy (BlockBackend *bend,
+                         const char *src_store_id,
+                         int src_version,
+                         const char *dst_store_id,
+                         int dst_version,
+                         const char *block_id)
+{
+    PackPriv *priv = bend->be_priv;
+
+    return pack_store_copy (priv->packs, src_store_id, dst_store_id, block_id);
+}
+
+static int
+block_backend_pack_remove_store (BlockBackend *bend, const char *store_id)
+{
+    PackPriv *priv = bend->be_priv;
+
+    return pack_store_remove_store (priv->packs, store_id);
+}
+
+static int
+block_backend_pack_compact_store (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version)
+{
+    PackPriv *priv = bend->be_priv;
+
+    return pack_store_compact (priv->packs, store_id);
+}
+
+BlockBackend *
+block_backend_pack_new (const char *pack_dir, gint64 max_pack_size)
+{
+    BlockBackend *bend;
+    PackPriv *priv;
+
+    priv = g_new0 (PackPriv, 1);
+    priv->packs = pack_store_new (pack_dir, max_pack_size);
+    if (!priv->packs) {
+        g_free (priv);
+        return NULL;
+    }
+
+    bend = g_new0 (BlockBackend, 1);
+    bend->be_priv = priv;
+
+    bend->open_block = block_backend_pack_open_block;
+    bend->read_block = block_backend_pack_read_block;
+    bend->write_block = block_backend_pack_write_block;
+    bend->commit_block = block_backend_pack_commit_block;
+    bend->close_block = block_backend_pack_close_block;
+    bend->exists = block_backend_pack_block_exists;
+    bend->exists_batch = block_backend_pack_exists_batch;
+    bend->remove_block = block_backend_pack_remove_block;
+    bend->stat_block = block_backend_pack_stat_block;
+    bend->stat_block_by_handle = block_backend_pack_stat_block_by_handle;
+    bend->block_handle_free = block_backend_pack_block_handle_free;
+    bend->get_block_fd = block_backend_pack_get_block_fd;
+    bend->foreach_block = block_backend_pack_foreach_block;
+    bend->remove_store = block_backend_pack_remove_store;
+    bend->copy = block_backend_pack_copy;
+    bend->compact_store = block_backend_pack_compact_store;
+
+    return bend;
+}
@@ -0,0 +1,871 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "block-backend.h"
+
+#include "log.h"
+
+/*
+ * Block backend which spreads blocks over several directories, usually
+ * on different disks, each holding a filesystem backend.
+ *
+ * A block is placed by rendezvous hashing: each shard gets a score from
+ * the hash of its configured name and the block id, and the block goes to
+ * the shards with the highest scores. Names rather than dirs are hashed,
+ * so a disk can be mounted elsewhere without moving any block. A shard
+ * with weight w takes the best of w scores, so it gets a share of the
+ * blocks proportional to w. Weight 0 drains a shard.
+ *
+ * Adding a shard only moves the blocks for which it gets the highest
+ * score, about 1/N of them. Until they are moved by rebalance_store(),
+ * blocks are also looked up on their shards in the previous layout, and
+ * in the single block dir used before sharding. A lookup probes at most
+ * the replicas in both layouts and the old dir, whatever the number of
+ * shards.
+ *
+ * With more than one replica, each block is written to several shards,
+ * and reads go to the replica with the fewest reads in progress.
+ */
+
+#define MAX_SHARDS 64
+#define MAX_REPLICAS 4
+#define MAX_WEIGHT 16
+/* Replicas in the current and previous layouts, and the old block dir. */
+#define MAX_LOCATIONS (2 * MAX_REPLICAS + 1)
+#define COPY_BUF_SIZE (64 * 1024)
+
+typedef struct Shard {
+    char            *name;
+    BlockBackend    *bend;
+    /* Number of blocks open for read. */
+    gint            n_reading;
+} Shard;
+
+/* Placement of the blocks over some of the shards. */
+typedef struct Layout {
+    /* Indexes in ShardPriv.shards, and the weight of each. */
+    int             idx[MAX_SHARDS];
+    int             weight[MAX_SHARDS];
+    int             n;
+} Layout;
+
+typedef struct {
+    /* The shards, then the old block dir if it's configured. */
+    Shard           shards[MAX_SHARDS + 1];
+    int             n_shards;
+    /* Dirs holding blocks, n_shards or n_shards + 1. */
+    int             n_dirs;
+    Layout          layout;
+    /* Empty if no blocks are left from a previous layout. */
+    Layout          prev;
+    int             n_replicas;
+} ShardPriv;
+
+struct _BHandle {
+    int         rw_type;
+    /* Shards the block is read from or written to. */
+    int         shards[MAX_REPLICAS];
+    BHandle     *inner[MAX_REPLICAS];
+    int         n;
+};
+
+static guint64
+mix64 (guint64 h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Weighted rendezvous score of the block on the shard. */
+static guint64
+shard_score (const char *name, int weight, const char *block_id)
+{
+    guint64 h = 0xcbf29ce484222325ULL, hk, score = 0;
+    const char *p;
+    int k;
+
+    /* FNV-1a of the shard name and the block id. */
+    for (p = name; *p; ++p)
+        h = (h ^ (guchar)*p) * 0x100000001b3ULL;
+    h = (h ^ '/') * 0x100000001b3ULL;
+    for (p = block_id; *p; ++p)
+        h = (h ^ (guchar)*p) * 0x100000001b3ULL;
+
+    for (k = 0; k < weight; k++) {
+        hk = mix64 (h + k * 0x9e3779b97f4a7c15ULL);
+        if (hk > score)
+            score = hk;
+    }
+
+    return score;
+}
+
+/* Fill @order with the shard indexes of @layout, highest score first. */
+static void
+rank_shards (ShardPriv *priv, const Layout *layout,
+             const char *block_id, int *order)
+{
+    guint64 scores[MAX_SHARDS];
+    guint64 score;
+    int i, j;
+
+    for (i = 0; i < layout->n; i++) {
+        score = shard_score (priv->shards[layout->idx[i]].name,
+                             layout->weight[i], block_id);
+        for (j = i; j > 0 && scores[j - 1] < score; --j) {
+            scores[j] = scores[j - 1];
+            order[j] = order[j - 1];
+        }
+        scores[j] = score;
+        order[j] = layout->idx[i];
+    }
+}
+
+/*
+ * Fill @locs with the dirs where the block may be, in lookup order: its
+ * shards, then its shards in the previous layout, then the old block dir.
+ * With @for_read, the replicas are ordered by read load.
+ * Returns the number of locations.
+ */
+static int
+block_locations (ShardPriv *priv, const char *block_id,
+                 gboolean for_read, int *locs)
+{
+    int order[MAX_SHARDS];
+    int i, j, idx, n = 0;
+
+    rank_shards (priv, &priv->layout, block_id, order);
+    for (i = 0; i < priv->n_replicas; i++) {
+        idx = order[i];
+        for (j = n; for_read && j > 0 &&
+                 g_atomic_int_get (&priv->shards[locs[j - 1]].n_reading) >
+                 g_atomic_int_get (&priv->shards[idx].n_reading); --j)
+            locs[j] = locs[j - 1];
+        locs[j] = idx;
+        ++n;
+    }
+
+    if (priv->prev.n > 0) {
+        rank_shards (priv, &priv->prev, block_id, order);
+        for (i = 0; i < MIN (priv->n_replicas, priv->prev.n); i++) {
+            for (j = 0; j < n && locs[j] != order[i]; j++)
+                ;
+            if (j == n)
+                locs[n++] = order[i];
+        }
+    }
+
+    if (priv->n_dirs > priv->n_shards)
+        locs[n++] = priv->n_shards;
+
+    return n;
+}
+
+/* Returns the first location of the block which has it, or -1. */
+static int
+find_block (ShardPriv *priv,
+            const char *store_id,
+            int version,
+            const char *block_id,
+            gboolean for_read)
+{
+    int locs[MAX_LOCATIONS];
+    BlockBackend *inner;
+    int i, n;
+
+    n = block_locations (priv, block_id, for_read, locs);
+    for (i = 0; i < n; i++) {
+        inner = priv->shards[locs[i]].bend;
+        if (inner->exists (inner, store_id, version, block_id))
+            return locs[i];
+    }
+
+    return -1;
+}
+
+static void
+close_inner_handles (ShardPriv *priv, BHandle *handle)
+{
+    BlockBackend *inner;
+    int i;
+
+    for (i = 0; i < handle->n; i++) {
+        inner = priv->shards[handle->shards[i]].bend;
+        inner->close_block (inner, handle->inner[i]);
+    }
+}
+
+static void
+free_inner_handles (ShardPriv *priv, BHandle *handle)
+{
+    BlockBackend *inner;
+    int i;
+
+    for (i = 0; i < handle->n; i++) {
+        inner = priv->shards[handle->shards[i]].bend;
+        inner->block_handle_free (inner, handle->inner[i]);
+    }
+}
+
+static BHandle *
+block_backend_shard_open_block (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                const char *block_id,
+                                int rw_type)
+{
+    ShardPriv *priv = bend->be_priv;
+    int order[MAX_SHARDS];
+    BlockBackend *inner;
+    BHandle *handle, *h;
+    int i, idx;
+
+    handle = g_new0 (BHandle, 1);
+    handle->rw_type = rw_type;
+
+    if (rw_type == BLOCK_READ) {
+        idx = find_block (priv, store_id, version, block_id, TRUE);
+        if (idx < 0) {
+            seaf_warning ("[block bend] Block %s:%s is not on any shard.\n",
+                          store_id, block_id);
+            g_free (handle);
+            return NULL;
+        }
+
+        inner = priv->shards[idx].bend;
+        h = inner->open_block (inner, store_id, version, block_id, BLOCK_READ);
+        if (!h) {
+            g_free (handle);
+            return NULL;
+        }
+
+        g_atomic_int_inc (&priv->shards[idx].n_reading);
+        handle->shards[0] = idx;
+        handle->inner[0] = h;
+        handle->n = 1;
+        return handle;
+    }
+
+    rank_shards (priv, &priv->layout, block_id, order);
+
+    for (i = 0; i < priv->n_replicas; i++) {
+        inner = priv->shards[order[i]].bend;
+        h = inner->open_block (inner, store_id, version, block_id, BLOCK_WRITE);
+        if (!h) {
+            close_inner_handles (priv, handle);
+            free_inner_handles (priv, handle);
+            g_free (handle);
+            return NULL;
+        }
+        handle->shards[i] = order[i];
+        handle->inner[i] = h;
+        handle->n = i + 1;
+    }
+
+    return handle;
+}
+
+static int
+block_backend_shard_read_block (BlockBackend *bend,
+                                BHandle *handle,
+                                void *buf, int len)
+{
+    ShardPriv *priv = bend->be_priv;
+    BlockBackend *inner = priv->shards[handle->shards[0]].bend;
+
+    return inner->read_block (inner, handle->inner[0], buf, len);
+}
+
+static int
+block_backend_shard_write_block (BlockBackend *bend,
+                                 BHandle *handle,
+                                 const void *buf, int len)
+{
+    ShardPriv *priv = bend->be_priv;
+    BlockBackend *inner;
+    int i, n = len;
+
+    for (i = 0; i < handle->n; i++) {
+        inner = priv->shards[handle->shards[i]].bend;
+        n = inner->write_block (inner, handle->inner[i], buf, len);
+        if (n != len)
+            return -1;
+    }
+
+    return n;
+}
+
+static int
+block_backend_shard_commit_block (BlockBackend *bend, BHandle *handle)
+{
+    ShardPriv *priv = bend->be_priv;
+    BlockBackend *inner;
+    int i;
+
+    g_return_val_if_fail (handle->rw_type == BLOCK_WRITE, -1);
+
+    for (i = 0; i < handle->n; i++) {
+        inner = priv->shards[handle->shards[i]].bend;
+        if (inner->commit_block (inner, handle->inner[i]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+block_backend_shard_close_block (BlockBackend *bend, BHandle *handle)
+{
+    close_inner_handles (bend->be_priv, handle);
+    return 0;
+}
+
+static void
+block_backend_shard_block_handle_free (BlockBackend *bend, BHandle *handle)
+{
+    ShardPriv *priv = bend->be_priv;
+
+    if (handle->rw_type == BLOCK_READ)
+        g_atomic_int_add (&priv->shards[handle->shards[0]].n_reading, -1);
+
+    free_inner_handles (priv, handle);
+    g_free (handle);
+}
+
+static gboolean
+block_backend_shard_block_exists (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  const char *block_id)
+{
+    ShardPriv *priv = bend->be_priv;
+
+    return (find_block (priv, store_id, version, block_id, FALSE) >= 0);
+}
+
+static int
+block_backend_shard_remove_block (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  const char *block_id)
+{
+    ShardPriv *priv = bend->be_priv;
+    int locs[MAX_LOCATIONS];
+    BlockBackend *inner;
+    int i, n, ret = 0;
+
+    /* Remove all copies, including ones not moved yet after a change of
+     * shards. Copies elsewhere can't be read, rebalancing removes them.
+     */
+    n = block_locations (priv, block_id, FALSE, locs);
+    for (i = 0; i < n; i++) {
+        inner = priv->shards[locs[i]].bend;
+        if (inner->exists (inner, store_id, version, block_id) &&
+            inner->remove_block (inner, store_id, version, block_id) < 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+static BMetadata *
+block_backend_shard_stat_block (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                const char *block_id)
+{
+    ShardPriv *priv = bend->be_priv;
+    BlockBackend *inner;
+    int idx;
+
+    idx = find_block (priv, store_id, version, block_id, FALSE);
+    if (idx < 0)
+        return NULL;
+
+    inner = priv->shards[idx].bend;
+    return inner->stat_block (inner, store_id, version, block_id);
+}
+
+static BMetadata *
+block_backend_shard_stat_block_by_handle (BlockBackend *bend, BHandle *handle)
+{
+    ShardPriv *priv = bend->be_priv;
+    BlockBackend *inner = priv->shards[handle->shards[0]].bend;
+
+    return inner->stat_block_by_handle (inner, handle->inner[0]);
+}
+
+static int
+block_backend_shard_get_block_fd (BlockBackend *bend,
+                                  BHandle *handle,
+                                  gint64 *offset,
+                                  guint32 *size)
+{
+    ShardPriv *priv = bend->be_priv;
+    BlockBackend *inner = priv->shards[handle->shards[0]].bend;
+
+    /* Replicas have to be written through every inner handle. */
+    if (!inner->get_block_fd || handle->n != 1)
+        return -1;
+    return inner->get_block_fd (inner, handle->inner[0], offset, size);
+}
+
+typedef struct ForeachData {
+    ShardPriv       *priv;
+    /* The shard being listed. */
+    int             idx;
+    SeafBlockFunc   process;
+    void            *user_data;
+    /* Shared by the shards listed at once, set when @process returns FALSE. */
+    gint            *stop;
+} ForeachData;
+
+/* Report each block once, from its first location that has it. Blocks
+ * on their first shard don't need any lookup. Copies outside the block's
+ * locations can't be read, and are skipped until they are rebalanced.
+ */
+static gboolean
+foreach_block_cb (const char *store_id,
+                  int version,
+                  const char *block_id,
+                  void *vdata)
+{
+    ForeachData *data = vdata;
+    ShardPriv *priv = data->priv;
+    int locs[MAX_LOCATIONS];
+    BlockBackend *inner;
+    int i, n;
+
+    if (g_atomic_int_get (data->stop))
+        return FALSE;
+
+    n = block_locations (priv, block_id, FALSE, locs);
+
+    for (i = 0; i < n && locs[i] != data->idx; i++) {
+        inner = priv->shards[locs[i]].bend;
+        if (inner->exists (inner, store_id, version, block_id))
+            return TRUE;
+    }
+    if (i == n)
+        return TRUE;
+
+    if (!data->process (store_id, version, block_id, data->user_data)) {
+        g_atomic_int_set (data->stop, 1);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static int
+block_backend_shard_foreach_block (BlockBackend *bend,
+                                   const char *store_id,
+                                   int version,
+                                   SeafBlockFunc process,
+                                   void *user_data)
+{
+    ShardPriv *priv = bend->be_priv;
+    BlockBackend *inner;
+    ForeachData data;
+    gint stop = 0;
+    int i;
+
+    memset (&data, 0, sizeof(data));
+    data.priv = priv;
+    data.process = process;
+    data.user_data = user_data;
+    data.stop = &stop;
+
+    for (i = 0; i < priv->n_dirs && !stop; i++) {
+        inner = priv->shards[i].bend;
+        data.idx = i;
+        if (inner->foreach_block (inner, store_id, version,
+                                  foreach_block_cb, &data) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+typedef struct ForeachJob {
+    ForeachData     *data;
+    const char      *store_id;
+    int             version;
+    int             n_threads;
+    int             ret;
+} ForeachJob;
+
+static void
+foreach_shard_job (gpointer vjob, gpointer vdata)
+{
+    ForeachJob *job = vjob;
+    ForeachData *data = job->data;
+    BlockBackend *inner = data->priv->shards[data->idx].bend;
+
+    if (inner->foreach_block_parallel && job->n_threads > 1)
+        job->ret = inner->foreach_block_parallel (inner, job->store_id,
+                                                  job->version, job->n_threads,
+                                                  foreach_block_cb, data);
+    else
+        job->ret = inner->foreach_block (inner, job->store_id, job->version,
+                                         foreach_block_cb, data);
+}
+
+/* List all dirs at once, splitting the threads among them. */
+static int
+block_backend_shard_foreach_block_parallel (BlockBackend *bend,
+                                            const char *store_id,
+                                            int version,
+                                            int n_threads,
+                                            SeafBlockFunc process,
+                                            void *user_data)
+{
+    ShardPriv *priv = bend->be_priv;
+    ForeachData data[MAX_SHARDS + 1];
+    ForeachJob jobs[MAX_SHARDS + 1];
+    GThreadPool *pool;
+    GError *error = NULL;
+    gint stop = 0;
+    int i, ret = 0;
+
+    pool = g_thread_pool_new (foreach_shard_job, NULL,
+                              MIN (n_threads, priv->n_dirs), FALSE, &error);
+    if (!pool) {
+        seaf_warning ("Failed to create thread pool: %s.\n", error->message);
+        g_clear_error (&error);
+        return -1;
+    }
+
+    for (i = 0; i < priv->n_dirs; i++) {
+        memset (&data[i], 0, sizeof(ForeachData));
+        data[i].priv = priv;
+        data[i].idx = i;
+        data[i].process = process;
+        data[i].user_data = user_data;
+        data[i].stop = &stop;
+
+        jobs[i].data = &data[i];
+        jobs[i].store_id = store_id;
+        jobs[i].version = version;
+        jobs[i].n_threads = MAX (n_threads / priv->n_dirs, 1);
+        jobs[i].ret = 0;
+
+        g_thread_pool_push (pool, &jobs[i], NULL);
+    }
+
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+    for (i = 0; i < priv->n_dirs; i++) {
+        if (jobs[i].ret < 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+static int
+block_backend_shard_copy (BlockBackend *bend,
+                          const char *src_store_id,
+                          int src_version,
+                          const char *dst_store_id,
+                          int dst_version,
+                          const char *block_id)
+{
+    ShardPriv *priv = bend->be_priv;
+    BlockBackend *inner;
+    int idx;
+
+    /* Copies stay in the dir of the source block, where the same block
+     * id is looked up for the destination store.
+     */
+    idx = find_block (priv, src_store_id, src_version, block_id, FALSE);
+    if (idx < 0) {
+        seaf_warning ("[block bend] Block %s:%s is not on any shard.\n",
+                      src_store_id, block_id);
+        return -1;
+    }
+
+    inner = priv->shards[idx].bend;
+    return inner->copy (inner, src_store_id, src_version,
+                        dst_store_id, dst_version, block_id);
+}
+
+static int
+block_backend_shard_remove_store (BlockBackend *bend, const char *store_id)
+{
+    ShardPriv *priv = bend->be_priv;
+    BlockBackend *inner;
+    int i, ret = 0;
+
+    for (i = 0; i < priv->n_dirs; i++) {
+        inner = priv->shards[i].bend;
+        if (inner->remove_store (inner, store_id) < 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+/* Copy the block to another dir, synced before it's committed. */
+static int
+copy_block_to (BlockBackend *src,
+               BlockBackend *dst,
+               const char *store_id,
+               int version,
+               const char *block_id)
+{
+    BHandle *in, *out;
+    char *buf;
+    gint64 offset;
+    guint32 size;
+    int fd, n, ret = -1;
+
+    in = src->open_block (src, store_id, version, block_id, BLOCK_READ);
+    if (!in)
+        return -1;
+
+    out = dst->open_block (dst, store_id, version, block_id, BLOCK_WRITE);
+    if (!out) {
+        src->close_block (src, in);
+        src->block_handle_free (src, in);
+        return -1;
+    }
+
+    buf = g_malloc (COPY_BUF_SIZE);
+    while ((n = src->read_block (src, in, buf, COPY_BUF_SIZE)) > 0) {
+        if (dst->write_block (dst, out, buf, n) != n)
+            break;
+    }
+    g_free (buf);
+
+    if (n == 0 && dst->get_block_fd) {
+        fd = dst->get_block_fd (dst, out, &offset, &size);
+        if (fd < 0 || fsync (fd) < 0)
+            n = -1;
+        if (fd >= 0)
+            close (fd);
+    }
+
+    if (dst->close_block (dst, out) == 0 && n == 0 &&
+        dst->commit_block (dst, out) == 0)
+        ret = 0;
+
+    src->close_block (src, in);
+    src->block_handle_free (src, in);
+    dst->block_handle_free (dst, out);
+    return ret;
+}
+
+typedef struct RebalanceData {
+    ShardPriv       *priv;
+    /* The dir being listed. */
+    int             idx;
+    guint64         n_moved;
+    int             ret;
+} RebalanceData;
+
+static gboolean
+rebalance_block_cb (const char *store_id,
+                    int version,
+                    const char *block_id,
+                    void *vdata)
+{
+    RebalanceData *data = vdata;
+    ShardPriv *priv = data->priv;
+    BlockBackend *src = priv->shards[data->idx].bend, *dst;
+    int order[MAX_SHARDS];
+    gboolean placed = FALSE;
+    int i;
+
+    rank_shards (priv, &priv->layout, block_id, order);
+
+    for (i = 0; i < priv->n_replicas; i++) {
+        if (order[i] == data->idx) {
+            placed = TRUE;
+            continue;
+        }
+
+        dst = priv->shards[order[i]].bend;
+        if (dst->exists (dst, store_id, version, block_id))
+            continue;
+        if (copy_block_to (src, dst, store_id, version, block_id) < 0) {
+            seaf_warning ("[block bend] Failed to move block %s:%s to "
+                          "shard %s.\n", store_id, block_id,
+                          priv->shards[order[i]].name);
+            data->ret = -1;
+            return TRUE;
+        }
+    }
+
+    if (placed)
+        return TRUE;
+
+    if (src->remove_block (src, store_id, version, block_id) < 0) {
+        seaf_warning ("[block bend] Failed to remove moved block %s:%s.\n",
+                      store_id, block_id);
+        data->ret = -1;
+        return TRUE;
+    }
+
+    ++data->n_moved;
+    return TRUE;
+}
+
+/* Move the blocks of the store to their shards in the current layout,
+ * from the other shards and the old block dir.
+ */
+static int
+block_backend_shard_rebalance_store (BlockBackend *bend,
+                                     const char *store_id,
+                                     int version)
+{
+    ShardPriv *priv = bend->be_priv;
+    BlockBackend *inner;
+    RebalanceData data;
+    int i;
+
+    memset (&data, 0, sizeof(data));
+    data.priv = priv;
+
+    for (i = 0; i < priv->n_dirs; i++) {
+        inner = priv->shards[i].bend;
+        data.idx = i;
+        if (inner->foreach_block (inner, store_id, version,
+                                  rebalance_block_cb, &data) < 0)
+            data.ret = -1;
+    }
+
+    if (data.n_moved > 0)
+        seaf_message ("[block bend] Moved %"G_GUINT64_FORMAT" blocks of "
+                      "store %s.\n", data.n_moved, store_id);
+
+    return data.ret;
+}
+
+static int
+find_shard (ShardPriv *priv, const char *name)
+{
+    int i;
+
+    for (i = 0; i < priv->n_shards; i++) {
+        if (strcmp (priv->shards[i].name, name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static void
+shard_priv_free (ShardPriv *priv)
+{
+    int i;
+
+    for (i = 0; i < priv->n_shards; i++)
+        g_free (priv->shards[i].name);
+    g_free (priv);
+}
+
+BlockBackend *
+block_backend_shard_new (BlockBackend **shards,
+                         char **names,
+                         const int *weights,
+                         int n_shards,
+                         int n_replicas,
+                         char **prev_names,
+                         const int *prev_weights,
+                         int n_prev,
+                         BlockBackend *old_bend)
+{
+    BlockBackend *bend;
+    ShardPriv *priv;
+    int i, idx, n_weighted = 0;
+
+    if (n_shards <= 0 || n_shards > MAX_SHARDS) {
+        seaf_warning ("[block bend] Need 1 to %d shards, got %d.\n",
+                      MAX_SHARDS, n_shards);
+        return NULL;
+    }
+
+    if (n_replicas <= 0)
+        n_replicas = 1;
+    if (n_replicas > MIN (n_shards, MAX_REPLICAS)) {
+        seaf_warning ("[block bend] Too many replicas: %d.\n", n_replicas);
+        return NULL;
+    }
+
+    priv = g_new0 (ShardPriv, 1);
+    for (i = 0; i < n_shards; i++) {
+        if (find_shard (priv, names[i]) >= 0) {
+            seaf_warning ("[block bend] Duplicate shard name %s.\n", names[i]);
+            goto error;
+        }
+        priv->shards[i].bend = shards[i];
+        priv->shards[i].name = g_strdup (names[i]);
+        priv->n_shards = i + 1;
+
+        priv->layout.idx[i] = i;
+        priv->layout.weight[i] = weights ? CLAMP (weights[i], 0, MAX_WEIGHT) : 1;
+        if (priv->layout.weight[i] > 0)
+            ++n_weighted;
+    }
+    priv->layout.n = n_shards;
+    priv->n_replicas = n_replicas;
+
+    /* Drained shards don't take any replica. */
+    if (n_weighted < n_replicas) {
+        seaf_warning ("[block bend] Only %d shards have a weight, need %d.\n",
+                      n_weighted, n_replicas);
+        goto error;
+    }
+
+    for (i = 0; i < n_prev && i < MAX_SHARDS; i++) {
+        idx = find_shard (priv, prev_names[i]);
+        if (idx < 0) {
+            seaf_warning ("[block bend] Previous shard %s is not configured.\n",
+                          prev_names[i]);
+            goto error;
+        }
+        priv->prev.idx[i] = idx;
+        priv->prev.weight[i] = prev_weights ?
+            CLAMP (prev_weights[i], 0, MAX_WEIGHT) : 1;
+        priv->prev.n = i + 1;
+    }
+
+    priv->n_dirs = n_shards;
+    if (old_bend) {
+        priv->shards[n_shards].bend = old_bend;
+        priv->shards[n_shards].name = "old block dir";
+        priv->n_dirs = n_shards + 1;
+    }
+
+    bend = g_new0 (BlockBackend, 1);
+    bend->be_priv = priv;
+
+    bend->open_block = block_backend_shard_open_block;
+    bend->read_block = block_backend_shard_read_block;
+    bend->write_block = block_backend_shard_write_block;
+    bend->commit_block = block_backend_shard_commit_block;
+    bend->close_block = block_backend_shard_close_block;
+    bend->exists = block_backend_shard_block_exists;
+    bend->remove_block = block_backend_shard_remove_block;
+    bend->stat_block = block_backend_shard_stat_block;
+    bend->stat_block_by_handle = block_backend_shard_stat_block_by_handle;
+    bend->block_handle_free = block_backend_shard_block_handle_free;
+    bend->get_block_fd = block_backend_shard_get_block_fd;
+    bend->foreach_block = block_backend_shard_foreach_block;
+    bend->foreach_block_parallel = block_backend_shard_foreach_block_parallel;
+    bend->remove_store = block_backend_shard_remove_store;
+    bend->copy = block_backend_shard_copy;
+    bend->rebalance_store = block_backend_shard_rebalance_store;
+
+    return bend;
+
+error:
+    shard_priv_free (priv);
+    return NULL;
+}
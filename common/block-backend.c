@@ -6,22 +6,36 @@
 extern BlockBackend *
 block_backend_fs_new (const char *block_dir, const char *tmp_dir);
 
+#ifdef SEAFILE_SERVER
+extern BlockBackend *
+block_backend_pack_new (const char *pack_dir, gint64 max_pack_size);
+
+#define DEFAULT_PACK_SIZE 256 /* MB */
+#endif
+
 BlockBackend*
-load_filesystem_block_backend(GKeyFile *config)
+load_filesystem_block_backend(GKeyFile *config,
+                              const char *seaf_dir,
+                              const char *default_tmp_dir)
 {
     BlockBackend *bend;
     char *tmp_dir;
     char *block_dir;
     
     block_dir = g_key_file_get_string (config, "block_backend", "block_dir", NULL);
+    if (!block_dir)
+        block_dir = g_strdup (seaf_dir);
     if (!block_dir) {
         g_warning ("Block dir not set in config.\n");
         return NULL;
     }
 
     tmp_dir = g_key_file_get_string (config, "block_backend", "tmp_dir", NULL);
+    if (!tmp_dir)
+        tmp_dir = g_strdup (default_tmp_dir);
     if (!tmp_dir) {
         g_warning ("Block tmp dir not set in config.\n");
+        g_free (block_dir);
         return NULL;
     }
 
@@ -32,8 +46,123 @@ load_filesystem_block_backend(GKeyFile *config)
     return bend;
 }
 
+#ifdef SEAFILE_SERVER
 BlockBackend*
-load_block_backend (GKeyFile *config)
+load_pack_block_backend(GKeyFile *config, const char *seaf_dir)
+{
+    BlockBackend *bend;
+    char *pack_dir;
+    int pack_size;
+
+    pack_dir = g_key_file_get_string (config, "block_backend", "pack_dir", NULL);
+    if (!pack_dir)
+        pack_dir = g_build_filename (seaf_dir, "storage", "packs", "blocks", NULL);
+
+    pack_size = g_key_file_get_integer (config, "block_backend", "pack_size", NULL);
+    if (pack_size <= 0)
+        pack_size = DEFAULT_PACK_SIZE;
+
+    bend = block_backend_pack_new (pack_dir, (gint64)pack_size << 20);
+
+    g_free (pack_dir);
+    return bend;
+}
+#endif
+
+#ifdef SEAFILE_SERVER
+BlockBackend*
+load_sharded_block_backend(GKeyFile *config)
+{
+    BlockBackend *bend = NULL;
+    BlockBackend **shards = NULL;
+    BlockBackend *old_bend = NULL;
+    char **dirs = NULL, **names = NULL, **prev_names = NULL;
+    int *weights = NULL, *prev_weights = NULL;
+    gsize n_dirs = 0, n_names = 0, n_weights = 0;
+    gsize n_prev = 0, n_prev_weights = 0;
+    int n_replicas;
+    char *tmp_dir, *old_dir = NULL;
+    gsize i;
+
+    dirs = g_key_file_get_string_list (config, "block_backend", "shard_dirs",
+                                       &n_dirs, NULL);
+    if (!dirs || n_dirs == 0) {
+        g_warning ("Shard dirs not set in config.\n");
+        goto out;
+    }
+
+    /* Blocks are placed by the names, so the dirs can be moved. */
+    names = g_key_file_get_string_list (config, "block_backend", "shard_names",
+                                        &n_names, NULL);
+    if (!names || n_names != n_dirs) {
+        g_warning ("Each shard dir needs a name in shard_names.\n");
+        goto out;
+    }
+
+    weights = g_key_file_get_integer_list (config, "block_backend",
+                                           "shard_weights", &n_weights, NULL);
+    if (weights && n_weights != n_dirs) {
+        g_warning ("Number of shard weights doesn't match shard dirs.\n");
+        goto out;
+    }
+
+    n_replicas = g_key_file_get_integer (config, "block_backend",
+                                         "shard_replicas", NULL);
+
+    /* Where blocks not rebalanced yet are, after shards are changed. */
+    prev_names = g_key_file_get_string_list (config, "block_backend",
+                                             "previous_shard_names",
+                                             &n_prev, NULL);
+    prev_weights = g_key_file_get_integer_list (config, "block_backend",
+                                                "previous_shard_weights",
+                                                &n_prev_weights, NULL);
+    if (prev_weights && n_prev_weights != n_prev) {
+        g_warning ("Number of previous shard weights doesn't match "
+                   "previous shard names.\n");
+        goto out;
+    }
+
+    old_dir = g_key_file_get_string (config, "block_backend",
+                                     "old_block_dir", NULL);
+    if (old_dir) {
+        tmp_dir = g_build_filename (old_dir, "tmpfiles", NULL);
+        old_bend = block_backend_fs_new (old_dir, tmp_dir);
+        g_free (tmp_dir);
+        if (!old_bend)
+            goto out;
+    }
+
+    /* Each shard has its own tmp dir, so blocks are committed by renaming
+     * on the same filesystem.
+     */
+    shards = g_new0 (BlockBackend *, n_dirs);
+    for (i = 0; i < n_dirs; i++) {
+        tmp_dir = g_build_filename (dirs[i], "tmpfiles", NULL);
+        shards[i] = block_backend_fs_new (dirs[i], tmp_dir);
+        g_free (tmp_dir);
+        if (!shards[i])
+            goto out;
+    }
+
+    bend = block_backend_shard_new (shards, names, weights,
+                                    (int)n_dirs, n_replicas,
+                                    prev_names, prev_weights, (int)n_prev,
+                                    old_bend);
+
+out:
+    g_free (shards);
+    g_strfreev (dirs);
+    g_strfreev (names);
+    g_free (weights);
+    g_strfreev (prev_names);
+    g_free (prev_weights);
+    g_free (old_dir);
+    return bend;
+}
+#endif
+
+BlockBackend*
+load_block_backend (GKeyFile *config, const char *seaf_dir, const char *tmp_dir)
 {
     char *backend;
     BlockBackend *bend;
@@ -44,11 +173,26 @@ load_block_backend (GKeyFile *config)
     }
 
     if (strcmp(backend, "filesystem") == 0) {
-        bend = load_filesystem_block_backend(config);
+        bend = load_filesystem_block_backend(config, seaf_dir, tmp_dir);
+        g_free (backend);
+        return bend;
+    }
+
+#ifdef SEAFILE_SERVER
+    if (strcmp(backend, "pack") == 0) {
+        bend = load_pack_block_backend(config, seaf_dir);
+        g_free (backend);
+        return bend;
+    }
+
+    if (strcmp(backend, "sharded") == 0) {
+        bend = load_sharded_block_backend(config);
         g_free (backend);
         return bend;
     }
+#endif
 
     g_warning ("Unknown backend\n");
+    g_free (backend);
     return NULL;
 }
@@ -25,6 +25,14 @@ struct BlockBackend {
                         const char *store_id, int version,
                         const char *block_id);
 
+    /* Check the existence of @n blocks at once. Results are stored in
+     * @results. Can be NULL, then exists() is called for each block.
+     */
+    int      (*exists_batch) (BlockBackend *bend,
+                              const char *store_id, int version,
+                              int n, const char **block_ids,
+                              gboolean *results);
+
     int      (*remove_block) (BlockBackend *bend,
                               const char *store_id, int version,
                               const char *block_id);
@@ -37,12 +45,31 @@ struct BlockBackend {
 
     void     (*block_handle_free) (BlockBackend *bend, BHandle *handle);
 
+    /* Return a new file descriptor from which the content of the block
+     * opened for read can be read, starting at @offset. For a block opened
+     * for write, the content can be written there before the commit.
+     * The caller owns the fd. Can be NULL, or return -1, if the block is
+     * not in a file.
+     */
+    int      (*get_block_fd) (BlockBackend *bend, BHandle *handle,
+                              gint64 *offset, guint32 *size);
+
     int      (*foreach_block) (BlockBackend *bend,
                                const char *store_id,
                                int version,
                                SeafBlockFunc process,
                                void *user_data);
 
+    /* Can be NULL. Like foreach_block, but calls @process from up to
+     * @n_threads threads at once, see seaf_block_manager_foreach_block_parallel().
+     */
+    int      (*foreach_block_parallel) (BlockBackend *bend,
+                                        const char *store_id,
+                                        int version,
+                                        int n_threads,
+                                        SeafBlockFunc process,
+                                        void *user_data);
+
     int         (*copy) (BlockBackend *bend,
                          const char *src_store_id,
                          int src_version,
@@ -54,11 +81,93 @@ struct BlockBackend {
     int      (*remove_store) (BlockBackend *bend,
                               const char *store_id);
 
+    /* Reclaim space of removed blocks. Can be NULL if the backend
+     * frees the space on removal.
+     */
+    int      (*compact_store) (BlockBackend *bend,
+                               const char *store_id,
+                               int version);
+
+    /* Can be NULL. Move the blocks of the store to where the backend
+     * places them now, e.g. after shards are added.
+     */
+    int      (*rebalance_store) (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version);
+
     void*    be_priv;           /* backend private field */
 
 };
 
 
-BlockBackend* load_block_backend (GKeyFile *config);
+typedef struct BlockCacheStats {
+    guint64 hits;
+    guint64 misses;
+    guint64 evictions;
+    guint64 n_blocks;
+    gint64  size;
+    gint64  capacity;
+} BlockCacheStats;
+
+/*
+ * Keep the contents of recently read blocks of @inner in memory, using at
+ * most @capacity bytes.
+ */
+BlockBackend *
+block_backend_cache_new (BlockBackend *inner, gint64 capacity);
+
+void
+block_backend_cache_get_stats (BlockBackend *bend, BlockCacheStats *stats);
+
+typedef struct BlockCompressStats {
+    /* Blocks written compressed, and their sizes before and after. */
+    guint64 n_compressed;
+    guint64 raw_bytes;
+    guint64 stored_bytes;
+    /* Blocks written as is because they don't compress. */
+    guint64 n_raw;
+} BlockCompressStats;
+
+/*
+ * Compress new blocks with @codec ("zstd", "zlib" or "none") before
+ * storing them in @inner. Blocks stored by @inner without compression
+ * are still read. @level <= 0 selects the codec's default level.
+ */
+BlockBackend *
+block_backend_compress_new (BlockBackend *inner, const char *codec, int level);
+
+void
+block_backend_compress_get_stats (BlockBackend *bend, BlockCompressStats *stats);
+
+/*
+ * Spread blocks over @n_shards backends by rendezvous hashing of the block
+ * ids. @names identify the shards in the hash, so a shard must keep its
+ * name. A shard gets a share of the blocks proportional to its weight;
+ * @weights can be NULL for equal weights. Each block is stored on
+ * @n_replicas shards.
+ *
+ * Until the stores are rebalanced after a change of shards, blocks are
+ * also looked up with the previous layout given by @prev_names and
+ * @prev_weights, which must be names of current shards, and in @old_bend,
+ * the backend used before sharding. @n_prev can be 0 and @old_bend NULL.
+ */
+BlockBackend *
+block_backend_shard_new (BlockBackend **shards,
+                         char **names,
+                         const int *weights,
+                         int n_shards,
+                         int n_replicas,
+                         char **prev_names,
+                         const int *prev_weights,
+                         int n_prev,
+                         BlockBackend *old_bend);
+
+/*
+ * Load the backend configured in the [block_backend] group of @config.
+ * @seaf_dir and @tmp_dir are the defaults for backend dirs not set in it.
+ */
+BlockBackend* load_block_backend (GKeyFile *config,
+                                  const char *seaf_dir,
+                                  const char *tmp_dir);
 
 #endif
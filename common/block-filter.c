@@ -0,0 +1,535 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "utils.h"
+#include "block-backend.h"
+#include "block-filter.h"
+
+#include "log.h"
+
+#define BLOOM_HASHES 4
+
+/* Bits per block when a filter is built. About 0.2% false positives. */
+#define BITS_PER_BLOCK 16
+/* The filter is rebuilt when it has fewer bits per block than this. */
+#define MIN_BITS_PER_BLOCK 8
+#define MIN_FILTER_BITS (1 << 16)
+
+/*
+ * A bloom filter whose bits are set and tested with atomic operations, so
+ * it can be used by several threads holding the read lock of the block
+ * filter. The size is a power of 2.
+ */
+typedef struct Bits {
+    guint64     mask;
+    guint       *words;
+} Bits;
+
+typedef struct StoreFilter {
+    char        *store_id;
+    int         version;
+    int         ref;
+    gint        removed;
+
+    /* The filter in use, NULL before the first build completes. */
+    Bits        *bloom;
+    /* Blocks in the filter, updated atomically. Only blocks which set a
+     * new bit are counted, so adding a block again doesn't count it twice.
+     */
+    gint        n_blocks;
+    gint        capacity;
+
+    /* The filter being built in the background. */
+    Bits        *building;
+    gint        n_building;
+    gboolean    build_scheduled;
+
+    gint        last_used;
+} StoreFilter;
+
+struct BlockFilter {
+    struct BlockBackend *bend;
+    int             max_stores;
+
+    /* store_id -> StoreFilter. The read lock is enough to query and add
+     * to the filters, the write lock is needed to add or remove stores and
+     * to replace filters.
+     */
+    GHashTable      *stores;
+    gint            clock;
+    pthread_rwlock_t lock;
+
+    /* BlockHandle -> WriteEntry, blocks being written. */
+    GHashTable      *writes;
+    pthread_mutex_t writes_lock;
+
+    GThreadPool     *build_pool;
+};
+
+typedef struct WriteEntry {
+    char *store_id;
+    char block_id[41];
+} WriteEntry;
+
+static Bits *
+bits_new (guint64 n_bits)
+{
+    Bits *bits = g_new0 (Bits, 1);
+
+    bits->mask = n_bits - 1;
+    bits->words = g_try_malloc0 (n_bits / 8);
+    if (!bits->words) {
+        g_free (bits);
+        return NULL;
+    }
+    return bits;
+}
+
+static void
+bits_free (Bits *bits)
+{
+    g_free (bits->words);
+    g_free (bits);
+}
+
+/*
+ * Block ids are SHA-1 hashes, so the bit indexes are derived from the id
+ * itself by double hashing with its first two 64-bit words.
+ */
+static gboolean
+block_id_hashes (const char *block_id, guint64 *h1, guint64 *h2)
+{
+    unsigned char raw[16];
+
+    if (hex_to_rawdata (block_id, raw, 16) < 0)
+        return FALSE;
+
+    memcpy (h1, raw, 8);
+    memcpy (h2, raw + 8, 8);
+    /* An odd step gives distinct bits in a power of 2 sized filter. */
+    *h2 |= 1;
+    return TRUE;
+}
+
+/* Returns TRUE if any of the bits of the block wasn't set yet. */
+static gboolean
+bits_add (Bits *bits, guint64 h1, guint64 h2)
+{
+    guint64 bit;
+    guint mask, old;
+    gboolean new_bit = FALSE;
+    int i;
+
+    for (i = 0; i < BLOOM_HASHES; ++i) {
+        bit = (h1 + i * h2) & bits->mask;
+        mask = 1U << (bit % 32);
+        old = g_atomic_int_or (&bits->words[bit / 32], mask);
+        if (!(old & mask))
+            new_bit = TRUE;
+    }
+
+    return new_bit;
+}
+
+static gboolean
+bits_test (Bits *bits, guint64 h1, guint64 h2)
+{
+    guint64 bit;
+    int i;
+
+    for (i = 0; i < BLOOM_HASHES; ++i) {
+        bit = (h1 + i * h2) & bits->mask;
+        if (!(g_atomic_int_get (&bits->words[bit / 32]) & (1U << (bit % 32))))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+store_filter_unref (StoreFilter *sf)
+{
+    if (--sf->ref > 0)
+        return;
+
+    if (sf->bloom)
+        bits_free (sf->bloom);
+    if (sf->building)
+        bits_free (sf->building);
+    g_free (sf->store_id);
+    g_free (sf);
+}
+
+static void
+write_entry_free (WriteEntry *entry)
+{
+    g_free (entry->store_id);
+    g_free (entry);
+}
+
+static guint64
+filter_bits_for (guint64 n_blocks)
+{
+    guint64 bits = MIN_FILTER_BITS;
+
+    while (bits < n_blocks * BITS_PER_BLOCK)
+        bits <<= 1;
+    return bits;
+}
+
+/* Called with the write lock held. */
+static void
+schedule_build (BlockFilter *filter, StoreFilter *sf)
+{
+    GError *error = NULL;
+
+    if (sf->build_scheduled)
+        return;
+
+    sf->build_scheduled = TRUE;
+    ++sf->ref;
+    g_thread_pool_push (filter->build_pool, sf, &error);
+    if (error) {
+        seaf_warning ("Failed to start building block filter for %.8s: %s.\n",
+                      sf->store_id, error->message);
+        g_clear_error (&error);
+        sf->build_scheduled = FALSE;
+        --sf->ref;
+    }
+}
+
+/* Called with the write lock held. */
+static void
+remove_store_filter (BlockFilter *filter, StoreFilter *sf)
+{
+    g_hash_table_remove (filter->stores, sf->store_id);
+    g_atomic_int_set (&sf->removed, 1);
+    store_filter_unref (sf);
+}
+
+/* Called with the write lock held. */
+static void
+evict_least_recently_used (BlockFilter *filter)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    StoreFilter *sf, *lru = NULL;
+
+    g_hash_table_iter_init (&iter, filter->stores);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        sf = value;
+        if (!lru || sf->last_used < lru->last_used)
+            lru = sf;
+    }
+
+    if (lru)
+        remove_store_filter (filter, lru);
+}
+
+/*
+ * Called with the read lock held. Returns TRUE if the filter in use has
+ * more blocks than it was sized for.
+ */
+static gboolean
+add_to_store_filter (StoreFilter *sf, guint64 h1, guint64 h2)
+{
+    gboolean full = FALSE;
+
+    if (sf->bloom && bits_add (sf->bloom, h1, h2))
+        full = (g_atomic_int_add (&sf->n_blocks, 1) + 1 > sf->capacity);
+    if (sf->building && bits_add (sf->building, h1, h2))
+        g_atomic_int_add (&sf->n_building, 1);
+
+    return full;
+}
+
+static void
+add_block (BlockFilter *filter, const char *store_id, const char *block_id)
+{
+    StoreFilter *sf;
+    guint64 h1, h2;
+    gboolean full = FALSE;
+
+    if (!block_id_hashes (block_id, &h1, &h2))
+        return;
+
+    pthread_rwlock_rdlock (&filter->lock);
+    /* Without a filter, the block will be listed when one is built. */
+    sf = g_hash_table_lookup (filter->stores, store_id);
+    if (sf)
+        full = add_to_store_filter (sf, h1, h2);
+    pthread_rwlock_unlock (&filter->lock);
+
+    if (!full)
+        return;
+
+    pthread_rwlock_wrlock (&filter->lock);
+    sf = g_hash_table_lookup (filter->stores, store_id);
+    if (sf && sf->bloom && g_atomic_int_get (&sf->n_blocks) > sf->capacity)
+        schedule_build (filter, sf);
+    pthread_rwlock_unlock (&filter->lock);
+}
+
+static gboolean
+count_listed_block (const char *store_id, int version,
+                    const char *block_id, void *vdata)
+{
+    StoreFilter *sf = vdata;
+
+    ++sf->n_building;
+    return !g_atomic_int_get (&sf->removed);
+}
+
+typedef struct BuildData {
+    BlockFilter *filter;
+    StoreFilter *sf;
+} BuildData;
+
+static gboolean
+add_listed_block (const char *store_id, int version,
+                  const char *block_id, void *vdata)
+{
+    BuildData *data = vdata;
+    BlockFilter *filter = data->filter;
+    StoreFilter *sf = data->sf;
+    guint64 h1, h2;
+    gboolean removed;
+
+    if (!block_id_hashes (block_id, &h1, &h2))
+        return TRUE;
+
+    pthread_rwlock_rdlock (&filter->lock);
+    removed = g_atomic_int_get (&sf->removed);
+    if (!removed && bits_add (sf->building, h1, h2))
+        g_atomic_int_add (&sf->n_building, 1);
+    pthread_rwlock_unlock (&filter->lock);
+
+    return !removed;
+}
+
+static void
+build_store_filter (gpointer vsf, gpointer vfilter)
+{
+    StoreFilter *sf = vsf;
+    BlockFilter *filter = vfilter;
+    struct BlockBackend *bend = filter->bend;
+    BuildData data;
+    Bits *building;
+    guint64 n_blocks, bits;
+    int ret = 0;
+
+    pthread_rwlock_rdlock (&filter->lock);
+    n_blocks = sf->bloom ? g_atomic_int_get (&sf->n_blocks) : 0;
+    pthread_rwlock_unlock (&filter->lock);
+
+    /* The first time, count the blocks to size the filter. Only this
+     * thread uses n_building until the new filter is published.
+     */
+    if (n_blocks == 0) {
+        sf->n_building = 0;
+        ret = bend->foreach_block (bend, sf->store_id, sf->version,
+                                   count_listed_block, sf);
+        n_blocks = sf->n_building;
+    }
+
+    bits = filter_bits_for (n_blocks);
+    building = (ret == 0) ? bits_new (bits) : NULL;
+    if (ret == 0 && !building) {
+        seaf_warning ("Failed to allocate block filter for %.8s.\n",
+                      sf->store_id);
+        ret = -1;
+    }
+
+    if (building) {
+        pthread_rwlock_wrlock (&filter->lock);
+        sf->building = building;
+        sf->n_building = 0;
+        pthread_rwlock_unlock (&filter->lock);
+
+        data.filter = filter;
+        data.sf = sf;
+        ret = bend->foreach_block (bend, sf->store_id, sf->version,
+                                   add_listed_block, &data);
+    }
+
+    pthread_rwlock_wrlock (&filter->lock);
+
+    /* Blocks committed during the build were added to sf->building by
+     * add_block(), so the new filter misses none of them.
+     */
+    if (ret == 0 && !sf->removed) {
+        if (sf->bloom)
+            bits_free (sf->bloom);
+        sf->bloom = sf->building;
+        sf->n_blocks = sf->n_building;
+        sf->capacity = (gint) MIN (bits / MIN_BITS_PER_BLOCK, G_MAXINT);
+    } else if (sf->building) {
+        bits_free (sf->building);
+    }
+    sf->building = NULL;
+    sf->build_scheduled = FALSE;
+
+    /* The store has more blocks than we guessed. */
+    if (ret == 0 && !sf->removed && sf->n_blocks > sf->capacity)
+        schedule_build (filter, sf);
+
+    store_filter_unref (sf);
+
+    pthread_rwlock_unlock (&filter->lock);
+}
+
+BlockFilter *
+block_filter_new (struct BlockBackend *bend, int max_stores)
+{
+    BlockFilter *filter;
+    GError *error = NULL;
+
+    filter = g_new0 (BlockFilter, 1);
+    filter->bend = bend;
+    filter->max_stores = max_stores;
+    filter->stores = g_hash_table_new (g_str_hash, g_str_equal);
+    filter->writes = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                            NULL,
+                                            (GDestroyNotify)write_entry_free);
+    pthread_rwlock_init (&filter->lock, NULL);
+    pthread_mutex_init (&filter->writes_lock, NULL);
+
+    filter->build_pool = g_thread_pool_new (build_store_filter, filter,
+                                            1, FALSE, &error);
+    if (!filter->build_pool) {
+        seaf_warning ("Failed to create block filter thread pool: %s.\n",
+                      error->message);
+        g_clear_error (&error);
+        g_hash_table_destroy (filter->stores);
+        g_hash_table_destroy (filter->writes);
+        pthread_rwlock_destroy (&filter->lock);
+        pthread_mutex_destroy (&filter->writes_lock);
+        g_free (filter);
+        return NULL;
+    }
+
+    return filter;
+}
+
+gboolean
+block_filter_maybe_contains (BlockFilter *filter,
+                             const char *store_id,
+                             int version,
+                             const char *block_id)
+{
+    StoreFilter *sf;
+    guint64 h1, h2;
+    gboolean ret = TRUE;
+
+    if (!block_id_hashes (block_id, &h1, &h2))
+        return TRUE;
+
+    pthread_rwlock_rdlock (&filter->lock);
+    sf = g_hash_table_lookup (filter->stores, store_id);
+    if (sf) {
+        g_atomic_int_set (&sf->last_used,
+                          g_atomic_int_add (&filter->clock, 1) + 1);
+        if (sf->bloom)
+            ret = bits_test (sf->bloom, h1, h2);
+    }
+    pthread_rwlock_unlock (&filter->lock);
+
+    if (sf)
+        return ret;
+
+    pthread_rwlock_wrlock (&filter->lock);
+
+    sf = g_hash_table_lookup (filter->stores, store_id);
+    if (!sf) {
+        if (g_hash_table_size (filter->stores) >= filter->max_stores)
+            evict_least_recently_used (filter);
+
+        sf = g_new0 (StoreFilter, 1);
+        sf->store_id = g_strdup (store_id);
+        sf->version = version;
+        sf->ref = 1;
+        g_hash_table_insert (filter->stores, sf->store_id, sf);
+        schedule_build (filter, sf);
+    }
+    sf->last_used = ++filter->clock;
+    if (sf->bloom)
+        ret = bits_test (sf->bloom, h1, h2);
+
+    pthread_rwlock_unlock (&filter->lock);
+
+    return ret;
+}
+
+void
+block_filter_add (BlockFilter *filter,
+                  const char *store_id,
+                  const char *block_id)
+{
+    add_block (filter, store_id, block_id);
+}
+
+void
+block_filter_write_begin (BlockFilter *filter,
+                          void *handle,
+                          const char *store_id,
+                          const char *block_id)
+{
+    WriteEntry *entry;
+
+    add_block (filter, store_id, block_id);
+
+    entry = g_new0 (WriteEntry, 1);
+    entry->store_id = g_strdup (store_id);
+    memcpy (entry->block_id, block_id, 40);
+
+    pthread_mutex_lock (&filter->writes_lock);
+    g_hash_table_replace (filter->writes, handle, entry);
+    pthread_mutex_unlock (&filter->writes_lock);
+}
+
+void
+block_filter_write_commit (BlockFilter *filter, void *handle)
+{
+    WriteEntry *entry;
+    char *store_id = NULL;
+    char block_id[41];
+
+    pthread_mutex_lock (&filter->writes_lock);
+    entry = g_hash_table_lookup (filter->writes, handle);
+    if (entry) {
+        store_id = g_strdup (entry->store_id);
+        memcpy (block_id, entry->block_id, 41);
+    }
+    pthread_mutex_unlock (&filter->writes_lock);
+
+    /* Only sets bits in a filter built since the write began. */
+    if (store_id) {
+        add_block (filter, store_id, block_id);
+        g_free (store_id);
+    }
+}
+
+void
+block_filter_write_end (BlockFilter *filter, void *handle)
+{
+    pthread_mutex_lock (&filter->writes_lock);
+    g_hash_table_remove (filter->writes, handle);
+    pthread_mutex_unlock (&filter->writes_lock);
+}
+
+void
+block_filter_remove_store (BlockFilter *filter, const char *store_id)
+{
+    StoreFilter *sf;
+
+    pthread_rwlock_wrlock (&filter->lock);
+
+    sf = g_hash_table_lookup (filter->stores, store_id);
+    if (sf)
+        remove_store_filter (filter, sf);
+
+    pthread_rwlock_unlock (&filter->lock);
+}
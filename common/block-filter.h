@@ -0,0 +1,68 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef BLOCK_FILTER_H
+#define BLOCK_FILTER_H
+
+#include <glib.h>
+
+struct BlockBackend;
+
+/*
+ * In-memory presence filter for blocks, one bloom filter per store.
+ *
+ * A negative answer means the block doesn't exist, so the block backend
+ * doesn't need to be asked. Blocks are added to the filter before they
+ * are written to the backend. Removed blocks are not taken out of the
+ * filter, they only become false positives until the filter is rebuilt.
+ *
+ * The filter of a store is built in the background by listing the blocks
+ * in the backend, the first time the store is queried. It's rebuilt when
+ * it gets too full. Until it's ready, every block is reported as maybe
+ * present.
+ *
+ * The filter only knows about blocks written by this process, so it must
+ * only be enabled when no other process writes to the block stores.
+ */
+
+typedef struct BlockFilter BlockFilter;
+
+/*
+ * @max_stores: the filters of the least recently used stores are dropped
+ *              when there are more stores than this.
+ */
+BlockFilter *
+block_filter_new (struct BlockBackend *bend, int max_stores);
+
+/* Returns FALSE if the block definitely doesn't exist. */
+gboolean
+block_filter_maybe_contains (BlockFilter *filter,
+                             const char *store_id,
+                             int version,
+                             const char *block_id);
+
+void
+block_filter_add (BlockFilter *filter,
+                  const char *store_id,
+                  const char *block_id);
+
+/*
+ * Track a block being written through @handle. The block is added when
+ * the write begins and again after it's committed, so that a filter
+ * being built concurrently doesn't miss it.
+ */
+void
+block_filter_write_begin (BlockFilter *filter,
+                          void *handle,
+                          const char *store_id,
+                          const char *block_id);
+
+void
+block_filter_write_commit (BlockFilter *filter, void *handle);
+
+void
+block_filter_write_end (BlockFilter *filter, void *handle);
+
+void
+block_filter_remove_store (BlockFilter *filter, const char *store_id);
+
+#endif
@@ -15,11 +15,24 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <glib/gstdio.h>
 
+#include <openssl/sha.h>
+
 #include "block-backend.h"
+#include "block-filter.h"
+#include "sha1-mb.h"
+
+#ifdef SEAFILE_SERVER
+#include "async-io.h"
+#endif
 
 #define SEAF_BLOCK_DIR "blocks"
+#define DEFAULT_FILTER_MAX_STORES 1000
+#define ASYNC_IO_QUEUE_DEPTH 64
+/* Threads to list blocks with in seaf_block_manager_get_block_number(). */
+#define FOREACH_THREADS 16
 
 
 extern BlockBackend *
@@ -35,12 +48,71 @@ seaf_block_manager_new (struct _SeafileSession *seaf,
     mgr = g_new0 (SeafBlockManager, 1);
     mgr->seaf = seaf;
 
+#ifdef SEAFILE_SERVER
+    if (g_key_file_has_key (seaf->config, "block_backend", "name", NULL))
+        mgr->backend = load_block_backend (seaf->config,
+                                           seaf_dir, seaf->tmp_file_dir);
+    else
+#endif
     mgr->backend = block_backend_fs_new (seaf_dir, seaf->tmp_file_dir);
     if (!mgr->backend) {
         g_warning ("[Block mgr] Failed to load backend.\n");
         goto onerror;
     }
 
+#ifdef SEAFILE_SERVER
+    /* Once blocks have been compressed, the codec must stay configured,
+     * or set to "none" to keep reading them without compressing new ones.
+     */
+    char *codec = g_key_file_get_string (seaf->config,
+                                         "block_backend", "compression", NULL);
+    if (codec) {
+        int level = g_key_file_get_integer (seaf->config, "block_backend",
+                                            "compression_level", NULL);
+        mgr->compress = block_backend_compress_new (mgr->backend,
+                                                    codec, level);
+        g_free (codec);
+        if (!mgr->compress) {
+            g_warning ("[Block mgr] Failed to load block compression.\n");
+            goto onerror;
+        }
+        mgr->backend = mgr->compress;
+    }
+#endif
+
+    mgr->storage = mgr->backend;
+
+#ifdef SEAFILE_SERVER
+    /* Size of the block cache in MB, disabled by default. */
+    gint64 cache_size = g_key_file_get_int64 (seaf->config,
+                                              "block_cache", "size", NULL);
+    if (cache_size > 0) {
+        mgr->cache = block_backend_cache_new (mgr->backend,
+                                              cache_size * 1024 * 1024);
+        mgr->backend = mgr->cache;
+    }
+#endif
+
+    /* The presence filter is only correct when no other process writes
+     * blocks. That's always the case for the client. Servers sharing the
+     * block storage with other nodes must leave it disabled.
+     */
+#ifdef SEAFILE_SERVER
+    if (g_key_file_get_boolean (seaf->config,
+                                "block_backend", "presence_filter", NULL)) {
+        int max_stores = g_key_file_get_integer (seaf->config, "block_backend",
+                                                 "presence_filter_max_stores",
+                                                 NULL);
+        if (max_stores <= 0)
+            max_stores = DEFAULT_FILTER_MAX_STORES;
+        mgr->filter = block_filter_new (mgr->backend, max_stores);
+    }
+
+    mgr->aio = async_io_new (ASYNC_IO_QUEUE_DEPTH);
+#else
+    mgr->filter = block_filter_new (mgr->backend, DEFAULT_FILTER_MAX_STORES);
+#endif
+
     return mgr;
 
 onerror:
@@ -63,9 +135,15 @@ seaf_block_manager_open_block (SeafBlockManager *mgr,
                                const char *block_id,
                                int rw_type)
 {
-    return mgr->backend->open_block (mgr->backend,
-                                     store_id, version,
-                                     block_id, rw_type);
+    BlockHandle *handle;
+
+    handle = mgr->backend->open_block (mgr->backend,
+                                       store_id, version,
+                                       block_id, rw_type);
+    if (handle && rw_type == BLOCK_WRITE && mgr->filter)
+        block_filter_write_begin (mgr->filter, handle, store_id, block_id);
+
+    return handle;
 }
 
 int
@@ -95,24 +173,224 @@ void
 seaf_block_manager_block_handle_free (SeafBlockManager *mgr,
                                       BlockHandle *handle)
 {
+    if (mgr->filter)
+        block_filter_write_end (mgr->filter, handle);
     return mgr->backend->block_handle_free (mgr->backend, handle);
 }
 
+int
+seaf_block_manager_get_block_fd (SeafBlockManager *mgr,
+                                 BlockHandle *handle,
+                                 gint64 *offset,
+                                 guint32 *size)
+{
+    if (!mgr->backend->get_block_fd)
+        return -1;
+    return mgr->backend->get_block_fd (mgr->backend, handle, offset, size);
+}
+
 int
 seaf_block_manager_commit_block (SeafBlockManager *mgr,
                                  BlockHandle *handle)
 {
-    return mgr->backend->commit_block (mgr->backend, handle);
+    int ret;
+
+    ret = mgr->backend->commit_block (mgr->backend, handle);
+    if (ret == 0 && mgr->filter)
+        block_filter_write_commit (mgr->filter, handle);
+
+    return ret;
+}
+
+/* Close and commit a block whose content has been written. */
+static int
+commit_written_block (SeafBlockManager *mgr,
+                      BlockHandle *handle,
+                      const char *block_id)
+{
+    if (seaf_block_manager_close_block (mgr, handle) < 0) {
+        seaf_warning ("Failed to close block %.8s.\n", block_id);
+        return -1;
+    }
+
+    if (seaf_block_manager_commit_block (mgr, handle) < 0) {
+        seaf_warning ("Failed to commit block %.8s.\n", block_id);
+        return -1;
+    }
+
+    return 0;
+}
+
+#ifdef SEAFILE_SERVER
+
+typedef struct BlockWrite {
+    SeafBlockManager        *mgr;
+    BlockHandle             *handle;
+    char                    block_id[41];
+    /* The write, then the sync of the same fd. */
+    AsyncIORequest          reqs[2];
+    SeafBlockWriteDoneFunc  done;
+    void                    *user_data;
+} BlockWrite;
+
+static void
+block_write_done (AsyncIORequest *reqs, int n, void *vdata)
+{
+    BlockWrite *data = vdata;
+    int status = 0;
+
+    close (reqs[0].fd);
+
+    if (reqs[0].result != (int)reqs[0].len || reqs[1].result < 0) {
+        seaf_warning ("Failed to write block %.8s: %s.\n", data->block_id,
+                      reqs[0].result < 0 ? strerror(-reqs[0].result) :
+                      reqs[1].result < 0 ? strerror(-reqs[1].result) :
+                      "short write");
+        seaf_block_manager_close_block (data->mgr, data->handle);
+        status = -1;
+    } else if (commit_written_block (data->mgr, data->handle,
+                                     data->block_id) < 0) {
+        status = -1;
+    }
+
+    seaf_block_manager_block_handle_free (data->mgr, data->handle);
+
+    data->done (status, data->user_data);
+    g_free (data);
 }
-    
+
+#endif  /* SEAFILE_SERVER */
+
+void
+seaf_block_manager_write_block_async (SeafBlockManager *mgr,
+                                      const char *store_id,
+                                      int version,
+                                      const char *block_id,
+                                      const void *buf,
+                                      int len,
+                                      SeafBlockWriteDoneFunc done,
+                                      void *user_data)
+{
+    BlockHandle *handle;
+    int status = 0;
+
+    handle = seaf_block_manager_open_block (mgr, store_id, version,
+                                            block_id, BLOCK_WRITE);
+    if (!handle) {
+        seaf_warning ("Failed to open block %.8s:%s.\n", store_id, block_id);
+        done (-1, user_data);
+        return;
+    }
+
+#ifdef SEAFILE_SERVER
+    if (mgr->aio && len > 0) {
+        gint64 offset;
+        guint32 size;
+        int fd = seaf_block_manager_get_block_fd (mgr, handle, &offset, &size);
+
+        if (fd >= 0) {
+            BlockWrite *data = g_new0 (BlockWrite, 1);
+
+            data->mgr = mgr;
+            data->handle = handle;
+            memcpy (data->block_id, block_id, 41);
+            data->reqs[0].type = ASYNC_IO_WRITE;
+            data->reqs[0].fd = fd;
+            data->reqs[0].offset = offset;
+            data->reqs[0].buf = (void *)buf;
+            data->reqs[0].len = len;
+            data->reqs[1].type = ASYNC_IO_SYNC;
+            data->reqs[1].fd = fd;
+            data->done = done;
+            data->user_data = user_data;
+
+            async_io_submit (mgr->aio, data->reqs, 2, block_write_done, data);
+            return;
+        }
+    }
+#endif
+
+    if (seaf_block_manager_write_block (mgr, handle, buf, len) != len) {
+        seaf_warning ("Failed to write block %.8s:%s.\n", store_id, block_id);
+        seaf_block_manager_close_block (mgr, handle);
+        status = -1;
+    } else if (commit_written_block (mgr, handle, block_id) < 0) {
+        status = -1;
+    }
+
+    seaf_block_manager_block_handle_free (mgr, handle);
+    done (status, user_data);
+}
+
 gboolean seaf_block_manager_block_exists (SeafBlockManager *mgr,
                                           const char *store_id,
                                           int version,
                                           const char *block_id)
 {
+    if (mgr->filter &&
+        !block_filter_maybe_contains (mgr->filter, store_id, version, block_id))
+        return FALSE;
+
     return mgr->backend->exists (mgr->backend, store_id, version, block_id);
 }
 
+int
+seaf_block_manager_blocks_exist (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 int n,
+                                 const char **block_ids,
+                                 gboolean *results)
+{
+    BlockBackend *bend = mgr->backend;
+    const char **maybe_ids;
+    gboolean *maybe_results;
+    int *maybe_idx;
+    int n_maybe = 0;
+    int i, ret = 0;
+
+    if (!mgr->filter) {
+        if (bend->exists_batch)
+            return bend->exists_batch (bend, store_id, version,
+                                       n, block_ids, results);
+
+        for (i = 0; i < n; i++)
+            results[i] = bend->exists (bend, store_id, version, block_ids[i]);
+        return 0;
+    }
+
+    /* Only ask the backend about the blocks that may exist. */
+    maybe_ids = g_new (const char *, n + 1);
+    maybe_idx = g_new (int, n + 1);
+    for (i = 0; i < n; i++) {
+        results[i] = FALSE;
+        if (block_filter_maybe_contains (mgr->filter, store_id, version,
+                                         block_ids[i])) {
+            maybe_ids[n_maybe] = block_ids[i];
+            maybe_idx[n_maybe] = i;
+            ++n_maybe;
+        }
+    }
+
+    maybe_results = g_new0 (gboolean, n_maybe + 1);
+    if (bend->exists_batch) {
+        ret = bend->exists_batch (bend, store_id, version,
+                                  n_maybe, maybe_ids, maybe_results);
+    } else {
+        for (i = 0; i < n_maybe; i++)
+            maybe_results[i] = bend->exists (bend, store_id, version,
+                                             maybe_ids[i]);
+    }
+
+    for (i = 0; i < n_maybe; i++)
+        results[maybe_idx[i]] = maybe_results[i];
+
+    g_free (maybe_ids);
+    g_free (maybe_idx);
+    g_free (maybe_results);
+    return ret;
+}
+
 int
 seaf_block_manager_remove_block (SeafBlockManager *mgr,
                                  const char *store_id,
@@ -150,6 +428,25 @@ seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                         process, user_data);
 }
 
+int
+seaf_block_manager_foreach_block_parallel (SeafBlockManager *mgr,
+                                           const char *store_id,
+                                           int version,
+                                           int n_threads,
+                                           SeafBlockFunc process,
+                                           void *user_data)
+{
+    if (!mgr->backend->foreach_block_parallel || n_threads <= 1)
+        return mgr->backend->foreach_block (mgr->backend,
+                                            store_id, version,
+                                            process, user_data);
+
+    return mgr->backend->foreach_block_parallel (mgr->backend,
+                                                 store_id, version,
+                                                 n_threads,
+                                                 process, user_data);
+}
+
 int
 seaf_block_manager_copy_block (SeafBlockManager *mgr,
                                const char *src_store_id,
@@ -158,26 +455,43 @@ seaf_block_manager_copy_block (SeafBlockManager *mgr,
                                int dst_version,
                                const char *block_id)
 {
+    int ret;
+
     if (strcmp (block_id, EMPTY_SHA1) == 0)
         return 0;
 
-    return mgr->backend->copy (mgr->backend,
-                               src_store_id,
-                               src_version,
-                               dst_store_id,
-                               dst_version,
-                               block_id);
+    ret = mgr->backend->copy (mgr->backend,
+                              src_store_id,
+                              src_version,
+                              dst_store_id,
+                              dst_version,
+                              block_id);
+
+    /* Also goes into a filter being built, so the block can't be missed
+     * by a listing that ran during the copy.
+     */
+    if (ret == 0 && mgr->filter)
+        block_filter_add (mgr->filter, dst_store_id, block_id);
+
+    return ret;
 }
 
+typedef struct BlockCount {
+    pthread_mutex_t lock;
+    guint64         n_blocks;
+} BlockCount;
+
 static gboolean
 get_block_number (const char *store_id,
                   int version,
                   const char *block_id,
                   void *data)
 {
-    guint64 *n_blocks = data;
+    BlockCount *count = data;
 
-    ++(*n_blocks);
+    pthread_mutex_lock (&count->lock);
+    ++count->n_blocks;
+    pthread_mutex_unlock (&count->lock);
 
     return TRUE;
 }
@@ -187,66 +501,555 @@ seaf_block_manager_get_block_number (SeafBlockManager *mgr,
                                      const char *store_id,
                                      int version)
 {
-    guint64 n_blocks = 0;
+    BlockCount count;
+
+    pthread_mutex_init (&count.lock, NULL);
+    count.n_blocks = 0;
 
-    seaf_block_manager_foreach_block (mgr, store_id, version,
-                                      get_block_number, &n_blocks);
+    seaf_block_manager_foreach_block_parallel (mgr, store_id, version,
+                                               FOREACH_THREADS,
+                                               get_block_number, &count);
 
-    return n_blocks;
+    pthread_mutex_destroy (&count.lock);
+    return count.n_blocks;
 }
 
-gboolean
-seaf_block_manager_verify_block (SeafBlockManager *mgr,
-                                 const char *store_id,
-                                 int version,
-                                 const char *block_id,
-                                 gboolean *io_error)
+/* Read the whole block from an open handle into a newly allocated buffer. */
+static int
+read_handle_contents (BlockBackend *bend,
+                      BlockHandle *h,
+                      const char *block_id,
+                      char **content,
+                      int *len)
 {
-    BlockHandle *h;
-    char buf[10240];
-    int n;
-    SHA_CTX ctx;
-    guint8 sha1[20];
-    char check_id[41];
+    BlockMetadata *md;
+    char *buf;
+    int size, n, total = 0;
 
-    h = seaf_block_manager_open_block (mgr,
-                                       store_id, version,
-                                       block_id, BLOCK_READ);
-    if (!h) {
-        seaf_warning ("Failed to open block %.8s.\n", block_id);
-        *io_error = TRUE;
-        return FALSE;
+    md = bend->stat_block_by_handle (bend, h);
+    if (!md) {
+        seaf_warning ("Failed to stat block %.8s.\n", block_id);
+        return -1;
     }
+    size = md->size;
+    g_free (md);
 
-    SHA1_Init (&ctx);
+    /* Read one more byte than the size to detect a growing block. */
+    buf = g_malloc (size + 1);
     while (1) {
-        n = seaf_block_manager_read_block (mgr, h, buf, sizeof(buf));
+        n = bend->read_block (bend, h, buf + total, size + 1 - total);
         if (n < 0) {
             seaf_warning ("Failed to read block %.8s.\n", block_id);
-            *io_error = TRUE;
-            return FALSE;
+            g_free (buf);
+            return -1;
         }
         if (n == 0)
             break;
+        total += n;
+        if (total > size) {
+            seaf_warning ("Block %.8s changed while reading.\n", block_id);
+            g_free (buf);
+            return -1;
+        }
+    }
+
+    *content = buf;
+    *len = total;
+    return 0;
+}
+
+/* Read the whole block into a newly allocated buffer. */
+static int
+read_block_contents (BlockBackend *bend,
+                     const char *store_id,
+                     int version,
+                     const char *block_id,
+                     char **content,
+                     int *len)
+{
+    BlockHandle *h;
+    int ret;
 
-        SHA1_Update (&ctx, buf, n);
+    h = bend->open_block (bend, store_id, version, block_id, BLOCK_READ);
+    if (!h) {
+        seaf_warning ("Failed to open block %.8s.\n", block_id);
+        return -1;
     }
 
-    seaf_block_manager_close_block (mgr, h);
-    seaf_block_manager_block_handle_free (mgr, h);
+    ret = read_handle_contents (bend, h, block_id, content, len);
 
-    SHA1_Final (sha1, &ctx);
-    rawdata_to_hex (sha1, check_id, 20);
+    bend->close_block (bend, h);
+    bend->block_handle_free (bend, h);
+    return ret;
+}
+
+#ifdef SEAFILE_SERVER
+
+/* Open the block and set up a read of its content from the backend file.
+ * If the backend can't give a file for the block, it's read through the
+ * already open handle instead. Returns 0 if @req is set up, 1 if the
+ * content has been read, or -1 on error.
+ */
+static int
+prepare_block_read (BlockBackend *bend,
+                    const char *store_id,
+                    int version,
+                    const char *block_id,
+                    AsyncIORequest *req,
+                    char **content,
+                    int *len)
+{
+    BlockHandle *h;
+    gint64 offset;
+    guint32 size;
+    int fd = -1, ret = 1;
+
+    if (!bend->get_block_fd)
+        return read_block_contents (bend, store_id, version, block_id,
+                                    content, len) < 0 ? -1 : 1;
+
+    h = bend->open_block (bend, store_id, version, block_id, BLOCK_READ);
+    if (!h) {
+        seaf_warning ("Failed to open block %.8s.\n", block_id);
+        return -1;
+    }
+
+    /* The fd is a dup, it stays valid after the handle is closed. */
+    fd = bend->get_block_fd (bend, h, &offset, &size);
+    if (fd < 0 && read_handle_contents (bend, h, block_id, content, len) < 0)
+        ret = -1;
+
+    bend->close_block (bend, h);
+    bend->block_handle_free (bend, h);
+
+    if (fd < 0)
+        return ret;
+
+    req->type = ASYNC_IO_READ;
+    req->fd = fd;
+    req->offset = offset;
+    req->len = size;
+    req->buf = g_malloc (size + 1);
+
+    *content = req->buf;
+    *len = size;
+    return 0;
+}
+
+#endif  /* SEAFILE_SERVER */
+
+static int
+read_blocks (SeafBlockManager *mgr,
+             BlockBackend *bend,
+             const char *store_id,
+             int version,
+             int n,
+             const char **block_ids,
+             char **contents,
+             int *lens)
+{
+    int i, ret = 0;
+
+    memset (contents, 0, n * sizeof(char *));
+    memset (lens, 0, n * sizeof(int));
 
+#ifdef SEAFILE_SERVER
+    if (mgr->aio) {
+        AsyncIORequest *reqs = g_new0 (AsyncIORequest, n);
+        int *req_idx = g_new0 (int, n);
+        int n_reqs = 0;
+        int r;
+
+        for (i = 0; i < n; i++) {
+            r = prepare_block_read (bend, store_id, version, block_ids[i],
+                                    &reqs[n_reqs], &contents[i], &lens[i]);
+            if (r < 0) {
+                ret = -1;
+            } else if (r == 0) {
+                if (lens[i] > 0)
+                    req_idx[n_reqs++] = i;
+                else
+                    close (reqs[n_reqs].fd);
+            }
+        }
+
+        async_io_run (mgr->aio, reqs, n_reqs);
+
+        for (i = 0; i < n_reqs; i++) {
+            close (reqs[i].fd);
+            if (reqs[i].result != (int)reqs[i].len) {
+                seaf_warning ("Failed to read block %.8s: %s.\n",
+                              block_ids[req_idx[i]],
+                              reqs[i].result < 0 ? strerror(-reqs[i].result) :
+                              "short read");
+                g_free (contents[req_idx[i]]);
+                contents[req_idx[i]] = NULL;
+                ret = -1;
+            }
+        }
+
+        g_free (reqs);
+        g_free (req_idx);
+        return ret;
+    }
+#endif
+
+    for (i = 0; i < n; i++) {
+        if (read_block_contents (bend, store_id, version, block_ids[i],
+                                 &contents[i], &lens[i]) < 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+int
+seaf_block_manager_read_blocks (SeafBlockManager *mgr,
+                                const char *store_id,
+                                int version,
+                                int n,
+                                const char **block_ids,
+                                char **contents,
+                                int *lens)
+{
+    return read_blocks (mgr, mgr->backend, store_id, version,
+                        n, block_ids, contents, lens);
+}
+
+/*
+ * Blocks are checked in pieces of this size, so the memory used doesn't
+ * depend on the size of the blocks.
+ */
+#define CHECK_PIECE_SIZE (256 * 1024)
+
+typedef struct BlockCheck {
+    BlockHandle *h;
+    /* Set if the block is read from the backend file with async I/O. */
+    int         fd;
+    gint64      offset;
+    guint32     size;
+
+    char        *buf;
+    /* Bytes in buf. */
+    int         n;
+    gint64      pos;
+    gboolean    active;
+    SHA_CTX     ctx;
+} BlockCheck;
+
+static void
+block_check_open (SeafBlockManager *mgr, BlockBackend *bend,
+                  const char *store_id, int version,
+                  const char *block_id, BlockCheck *check)
+{
+    memset (check, 0, sizeof(*check));
+    check->fd = -1;
+
+    check->h = bend->open_block (bend, store_id, version, block_id, BLOCK_READ);
+    if (!check->h) {
+        seaf_warning ("Failed to open block %.8s.\n", block_id);
+        return;
+    }
+
+#ifdef SEAFILE_SERVER
+    /* The fd is a dup, it stays valid after the handle is closed. */
+    if (mgr->aio && bend->get_block_fd)
+        check->fd = bend->get_block_fd (bend, check->h,
+                                        &check->offset, &check->size);
+    if (check->fd >= 0) {
+        bend->close_block (bend, check->h);
+        bend->block_handle_free (bend, check->h);
+        check->h = NULL;
+    }
+#endif
+
+    check->buf = g_malloc (CHECK_PIECE_SIZE);
+    check->active = TRUE;
+}
+
+static void
+block_check_close (BlockBackend *bend, BlockCheck *check)
+{
+    if (check->fd >= 0)
+        close (check->fd);
+    if (check->h) {
+        bend->close_block (bend, check->h);
+        bend->block_handle_free (bend, check->h);
+    }
+    g_free (check->buf);
+}
+
+/* Read the next piece of a block through the backend. */
+static int
+block_check_read_handle (BlockBackend *bend, BlockCheck *check)
+{
+    int n;
+
+    check->n = 0;
+    while (check->n < CHECK_PIECE_SIZE) {
+        n = bend->read_block (bend, check->h, check->buf + check->n,
+                              CHECK_PIECE_SIZE - check->n);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        check->n += n;
+    }
+
+    return 0;
+}
+
+/* Read the next piece of all active blocks. Blocks that fail to read are
+ * marked unreadable and deactivated.
+ */
+static void
+block_check_read_pieces (SeafBlockManager *mgr, BlockBackend *bend,
+                         int n, const char **block_ids,
+                         BlockCheck *checks, int *status)
+{
+    int i;
+
+#ifdef SEAFILE_SERVER
+    AsyncIORequest reqs[SHA1_MB_LANES];
+    int req_idx[SHA1_MB_LANES];
+    int n_reqs = 0;
+
+    for (i = 0; i < n; ++i) {
+        if (!checks[i].active || checks[i].fd < 0)
+            continue;
+        memset (&reqs[n_reqs], 0, sizeof(AsyncIORequest));
+        reqs[n_reqs].type = ASYNC_IO_READ;
+        reqs[n_reqs].fd = checks[i].fd;
+        reqs[n_reqs].offset = checks[i].offset + checks[i].pos;
+        reqs[n_reqs].buf = checks[i].buf;
+        reqs[n_reqs].len = MIN (CHECK_PIECE_SIZE,
+                                checks[i].size - checks[i].pos);
+        req_idx[n_reqs++] = i;
+    }
+
+    if (n_reqs > 0)
+        async_io_run (mgr->aio, reqs, n_reqs);
+
+    for (i = 0; i < n_reqs; ++i) {
+        BlockCheck *check = &checks[req_idx[i]];
+        if (reqs[i].result != (int)reqs[i].len) {
+            seaf_warning ("Failed to read block %.8s: %s.\n",
+                          block_ids[req_idx[i]],
+                          reqs[i].result < 0 ? strerror(-reqs[i].result) :
+                          "short read");
+            status[req_idx[i]] = BLOCK_CHECK_UNREADABLE;
+            check->active = FALSE;
+        } else {
+            check->n = reqs[i].len;
+        }
+    }
+#endif
+
+    for (i = 0; i < n; ++i) {
+        if (!checks[i].active || checks[i].fd >= 0)
+            continue;
+        if (block_check_read_handle (bend, &checks[i]) < 0) {
+            seaf_warning ("Failed to read block %.8s.\n", block_ids[i]);
+            status[i] = BLOCK_CHECK_UNREADABLE;
+            checks[i].active = FALSE;
+        }
+    }
+}
+
+static gboolean
+block_check_at_end (BlockCheck *check)
+{
+    if (check->fd >= 0)
+        return check->pos >= check->size;
+    return check->n < CHECK_PIECE_SIZE;
+}
+
+static void
+block_check_set_status (const unsigned char *sha1, const char *block_id,
+                        int *status)
+{
+    char check_id[41];
+
+    rawdata_to_hex (sha1, check_id, 20);
     if (strcmp (check_id, block_id) == 0)
-        return TRUE;
+        *status = BLOCK_CHECK_OK;
     else
+        *status = BLOCK_CHECK_CORRUPT;
+}
+
+/* Check up to SHA1_MB_LANES blocks, reading them from storage so that
+ * copies in the block cache are not trusted. Returns the bytes read.
+ *
+ * The blocks are read and hashed piece by piece. Blocks that fit in the
+ * first piece are hashed together in parallel lanes.
+ */
+static gint64
+check_block_group (SeafBlockManager *mgr,
+                   const char *store_id,
+                   int version,
+                   int n,
+                   const char **block_ids,
+                   int *status)
+{
+    BlockBackend *bend = mgr->storage;
+    BlockCheck checks[SHA1_MB_LANES];
+    const unsigned char *bufs[SHA1_MB_LANES];
+    size_t lens[SHA1_MB_LANES];
+    unsigned char sha1s[SHA1_MB_LANES * 20];
+    unsigned char sha1[20];
+    int idx[SHA1_MB_LANES];
+    gboolean first = TRUE;
+    gint64 bytes = 0;
+    int i, n_mb, n_active;
+
+    for (i = 0; i < n; ++i) {
+        block_check_open (mgr, bend, store_id, version, block_ids[i],
+                          &checks[i]);
+        if (!checks[i].active)
+            status[i] = BLOCK_CHECK_UNREADABLE;
+    }
+
+    while (1) {
+        n_active = 0;
+        for (i = 0; i < n; ++i)
+            if (checks[i].active)
+                ++n_active;
+        if (n_active == 0)
+            break;
+
+        block_check_read_pieces (mgr, bend, n, block_ids, checks, status);
+
+        n_mb = 0;
+        for (i = 0; i < n; ++i) {
+            BlockCheck *check = &checks[i];
+            if (!check->active)
+                continue;
+
+            check->pos += check->n;
+            bytes += check->n;
+
+            if (first && block_check_at_end (check)) {
+                bufs[n_mb] = (const unsigned char *)check->buf;
+                lens[n_mb] = check->n;
+                idx[n_mb++] = i;
+                check->active = FALSE;
+                continue;
+            }
+
+            if (first)
+                SHA1_Init (&check->ctx);
+            SHA1_Update (&check->ctx, check->buf, check->n);
+            if (block_check_at_end (check)) {
+                SHA1_Final (sha1, &check->ctx);
+                block_check_set_status (sha1, block_ids[i], &status[i]);
+                check->active = FALSE;
+            }
+        }
+
+        if (n_mb > 0) {
+            sha1_mb_digest (n_mb, bufs, lens, sha1s);
+            for (i = 0; i < n_mb; ++i)
+                block_check_set_status (sha1s + i * 20, block_ids[idx[i]],
+                                        &status[idx[i]]);
+        }
+
+        first = FALSE;
+    }
+
+    for (i = 0; i < n; ++i)
+        block_check_close (bend, &checks[i]);
+
+    return bytes;
+}
+
+gint64
+seaf_block_manager_check_blocks (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 int n_blocks,
+                                 const char **block_ids,
+                                 int *status)
+{
+    gint64 bytes = 0;
+    int i, n;
+
+    for (i = 0; i < n_blocks; i += n) {
+        n = MIN (n_blocks - i, SHA1_MB_LANES);
+        bytes += check_block_group (mgr, store_id, version,
+                                    n, block_ids + i, status + i);
+    }
+
+    return bytes;
+}
+
+gboolean
+seaf_block_manager_verify_block (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id,
+                                 gboolean *io_error)
+{
+    int status;
+
+    seaf_block_manager_check_blocks (mgr, store_id, version,
+                                     1, &block_id, &status);
+    if (status == BLOCK_CHECK_UNREADABLE) {
+        *io_error = TRUE;
         return FALSE;
+    }
+
+    return (status == BLOCK_CHECK_OK);
 }
 
 int
 seaf_block_manager_remove_store (SeafBlockManager *mgr,
                                  const char *store_id)
 {
+    if (mgr->filter)
+        block_filter_remove_store (mgr->filter, store_id);
     return mgr->backend->remove_store (mgr->backend, store_id);
 }
+
+gboolean
+seaf_block_manager_get_cache_stats (SeafBlockManager *mgr,
+                                    BlockCacheStats *stats)
+{
+    if (!mgr->cache)
+        return FALSE;
+
+    block_backend_cache_get_stats (mgr->cache, stats);
+    return TRUE;
+}
+
+gboolean
+seaf_block_manager_get_compress_stats (SeafBlockManager *mgr,
+                                       BlockCompressStats *stats)
+{
+#ifdef SEAFILE_SERVER
+    if (mgr->compress) {
+        block_backend_compress_get_stats (mgr->compress, stats);
+        return TRUE;
+    }
+#endif
+    return FALSE;
+}
+
+int
+seaf_block_manager_compact_store (SeafBlockManager *mgr,
+                                  const char *store_id,
+                                  int version)
+{
+    if (!mgr->backend->compact_store)
+        return 0;
+    return mgr->backend->compact_store (mgr->backend, store_id, version);
+}
+
+int
+seaf_block_manager_rebalance_store (SeafBlockManager *mgr,
+                                    const char *store_id,
+                                    int version)
+{
+    if (!mgr->backend->rebalance_store)
+        return 0;
+    return mgr->backend->rebalance_store (mgr->backend, store_id, version);
+}
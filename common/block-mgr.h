@@ -17,6 +17,25 @@ struct _SeafBlockManager {
     struct _SeafileSession *seaf;
 
     struct BlockBackend *backend;
+
+    /* Presence filter to skip backend lookups for new blocks. Can be NULL. */
+    struct BlockFilter *filter;
+
+    /* In-memory cache of block contents, wrapping the real backend.
+     * Same as backend when enabled, otherwise NULL.
+     */
+    struct BlockBackend *cache;
+
+    /* Compression layer under the cache, NULL when not configured. */
+    struct BlockBackend *compress;
+
+    /* The backend under the cache, blocks are verified against it. */
+    struct BlockBackend *storage;
+
+    /* Reads blocks in parallel for seaf_block_manager_read_blocks().
+     * NULL on the client, blocks are read one by one then.
+     */
+    struct AsyncIO *aio;
 };
 
 
@@ -70,6 +89,23 @@ seaf_block_manager_write_block (SeafBlockManager *mgr,
                                 BlockHandle *handle,
                                 const void *buf, int len);
 
+/*
+ * Get a file descriptor for the content of a block, so that it can be sent
+ * without copying through user space. For a block opened for write, the
+ * content can be written to the fd at @offset before committing.
+ *
+ * @offset: offset of the block content in the file.
+ * @size: size of the block.
+ *
+ * Returns: a new fd owned by the caller, or -1 if the backend doesn't
+ *          store the block in a file.
+ */
+int
+seaf_block_manager_get_block_fd (SeafBlockManager *mgr,
+                                 BlockHandle *handle,
+                                 gint64 *offset,
+                                 guint32 *size);
+
 /*
  * Commit a block to storage.
  * The block must be opened for write.
@@ -82,6 +118,27 @@ int
 seaf_block_manager_commit_block (SeafBlockManager *mgr,
                                  BlockHandle *handle);
 
+typedef void (*SeafBlockWriteDoneFunc) (int status, void *user_data);
+
+/*
+ * Write, sync and commit a whole block without blocking the caller on
+ * disk I/O. @buf must stay valid until @done is called.
+ *
+ * When the backend stores the block in a file, the data is written and
+ * synced by the async I/O engine, and @done is called from an I/O thread.
+ * Otherwise the block is written synchronously and @done is called before
+ * returning. @done is always called once, with status 0 on success or -1.
+ */
+void
+seaf_block_manager_write_block_async (SeafBlockManager *mgr,
+                                      const char *store_id,
+                                      int version,
+                                      const char *block_id,
+                                      const void *buf,
+                                      int len,
+                                      SeafBlockWriteDoneFunc done,
+                                      void *user_data);
+
 /*
  * Close an open block.
  *
@@ -103,6 +160,18 @@ seaf_block_manager_block_exists (SeafBlockManager *mgr,
                                  int version,
                                  const char *block_id);
 
+/*
+ * Check the existence of @n blocks. Results are stored in @results.
+ * Returns -1 if the check cannot be done.
+ */
+int
+seaf_block_manager_blocks_exist (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 int n,
+                                 const char **block_ids,
+                                 gboolean *results);
+
 int
 seaf_block_manager_remove_block (SeafBlockManager *mgr,
                                  const char *store_id,
@@ -126,6 +195,24 @@ seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                   SeafBlockFunc process,
                                   void *user_data);
 
+/*
+ * Like seaf_block_manager_foreach_block(), but the blocks are listed by up
+ * to @n_threads threads, if the backend supports it.
+ *
+ * @process is called concurrently from these threads, so it must protect
+ * any state it shares through @user_data. Blocks are visited in no
+ * particular order. When @process returns FALSE, no new blocks are
+ * handed out, but calls already running in other threads still complete.
+ * All calls have returned when this function returns.
+ */
+int
+seaf_block_manager_foreach_block_parallel (SeafBlockManager *mgr,
+                                           const char *store_id,
+                                           int version,
+                                           int n_threads,
+                                           SeafBlockFunc process,
+                                           void *user_data);
+
 int
 seaf_block_manager_copy_block (SeafBlockManager *mgr,
                                const char *src_store_id,
@@ -139,6 +226,34 @@ int
 seaf_block_manager_remove_store (SeafBlockManager *mgr,
                                  const char *store_id);
 
+struct BlockCacheStats;
+
+/* Returns FALSE if the block cache is not enabled. */
+gboolean
+seaf_block_manager_get_cache_stats (SeafBlockManager *mgr,
+                                    struct BlockCacheStats *stats);
+
+struct BlockCompressStats;
+
+/* Returns FALSE if block compression is not configured. */
+gboolean
+seaf_block_manager_get_compress_stats (SeafBlockManager *mgr,
+                                       struct BlockCompressStats *stats);
+
+/* Reclaim the space of removed blocks, if the backend defers it. */
+int
+seaf_block_manager_compact_store (SeafBlockManager *mgr,
+                                  const char *store_id,
+                                  int version);
+
+/* Move the blocks of the store to where the backend places them now,
+ * if the backend can change placement, e.g. after shards are added.
+ */
+int
+seaf_block_manager_rebalance_store (SeafBlockManager *mgr,
+                                    const char *store_id,
+                                    int version);
+
 guint64
 seaf_block_manager_get_block_number (SeafBlockManager *mgr,
                                      const char *store_id,
@@ -151,4 +266,39 @@ seaf_block_manager_verify_block (SeafBlockManager *mgr,
                                  const char *block_id,
                                  gboolean *io_error);
 
+/*
+ * Read the whole content of @n blocks into newly allocated buffers
+ * returned in @contents, with sizes in @lens. The reads are issued in
+ * parallel when the backend stores blocks in files.
+ * Returns -1 if any block could not be read, its content is set to NULL.
+ * The caller frees the contents in any case.
+ */
+int
+seaf_block_manager_read_blocks (SeafBlockManager *mgr,
+                                const char *store_id,
+                                int version,
+                                int n,
+                                const char **block_ids,
+                                char **contents,
+                                int *lens);
+
+enum {
+    BLOCK_CHECK_OK = 0,
+    BLOCK_CHECK_CORRUPT,
+    BLOCK_CHECK_UNREADABLE,
+};
+
+/*
+ * Check every block in @block_ids, setting status[i] to one of
+ * BLOCK_CHECK_*. Blocks are read from storage, bypassing the block cache.
+ * Returns the number of bytes read.
+ */
+gint64
+seaf_block_manager_check_blocks (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 int n_blocks,
+                                 const char **block_ids,
+                                 int *status);
+
 #endif
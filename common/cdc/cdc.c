@@ -9,9 +9,15 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <glib/gstdio.h>
 
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
 #include "utils.h"
+#include "sha1-mb.h"
 
 #include "cdc.h"
 #include "../seafile-crypt.h"
@@ -20,7 +26,22 @@
 #define finger rabin_checksum
 #define rolling_finger rabin_rolling_checksum
 
-#define READ_SIZE 1024 * 4
+#include "gear-hash.h"
+
+/* Normalized chunking: below the expected block size the gear engine uses
+ * a mask with NORMAL_LEVEL more bits, above it a mask with NORMAL_LEVEL
+ * fewer bits. This narrows the chunk size distribution around block_sz.
+ */
+#define NORMAL_LEVEL 2
+
+/* In read mode, file data is read into a window of at least this size
+ * (and at least 4 times block_max_sz). Chunks point into the window, which
+ * is only shifted when less than block_max_sz bytes are left in it.
+ */
+#define READ_WINDOW_SZ (16 * 1024 * 1024)
+
+/* Larger files are not mapped when the address space is small. */
+#define MMAP_MAX_SZ_32BIT ((uint64_t)256 * 1024 * 1024)
 
 #define BYTE_TO_HEX(b)  (((b)>=10)?('a'+b-10):('0'+b))
 
@@ -70,31 +91,550 @@ static int init_cdc_file_descriptor (int fd,
     return 0;
 }
 
-#define WRITE_CDC_BLOCK(block_sz, write_data)                \
+/*
+ * Scan buf[*cur, tail) for a chunk break point with the rabin engine.
+ * The chunk starts at buf[0]. Returns TRUE if a break point is found,
+ * with *cur set to the last byte of the chunk. Otherwise *cur is set to
+ * tail and the scan can be resumed after more data is read.
+ */
+static gboolean
+rabin_find_break (CDCFileDescriptor *file_descr,
+                  char *buf, int tail, int *cur,
+                  unsigned int *fingerprint)
+{
+    int block_min_sz = file_descr->block_min_sz;
+    int block_max_sz = file_descr->block_max_sz;
+    uint32_t block_mask = file_descr->block_sz - 1;
+    unsigned int fp = *fingerprint;
+    int i = *cur;
+
+    while (i < tail) {
+        fp = (i == block_min_sz - 1) ?
+            finger(buf + i - BLOCK_WIN_SZ + 1, BLOCK_WIN_SZ) :
+            rolling_finger (fp, BLOCK_WIN_SZ,
+                            *(buf+i-BLOCK_WIN_SZ), *(buf + i));
+
+        if (((fp & block_mask) ==  ((BREAK_VALUE & block_mask)))
+            || i + 1 >= block_max_sz)
+        {
+            *cur = i;
+            *fingerprint = fp;
+            return TRUE;
+        }
+        ++i;
+    }
+
+    *cur = i;
+    *fingerprint = fp;
+    return FALSE;
+}
+
+static int
+bits_of (uint32_t v)
+{
+    int n = 0;
+
+    while (v > 1) {
+        v >>= 1;
+        ++n;
+    }
+    return n;
+}
+
+#define GEAR_STEP(k)                                         \
 do {                                                         \
-    int _block_sz = (block_sz);                              \
-    chunk_descr.len = _block_sz;                             \
-    chunk_descr.offset = offset;                             \
-    ret = file_descr->write_block (file_descr->repo_id,      \
-                                   file_descr->version,      \
-                                   &chunk_descr,             \
-            crypt, chunk_descr.checksum,                     \
-                                   (write_data));            \
-    if (ret < 0) {                                           \
-        free (buf);                                          \
-        g_warning ("CDC: failed to write chunk.\n");         \
-        return -1;                                           \
+    fp = gear_rolling_checksum (fp, p[i + (k)]);             \
+    if (G_UNLIKELY (!(fp & mask))) {                         \
+        i += (k);                                            \
+        goto found;                                          \
     }                                                        \
-    memcpy (file_descr->blk_sha1s +                          \
-            file_descr->block_nr * CHECKSUM_LENGTH,          \
-            chunk_descr.checksum, CHECKSUM_LENGTH);          \
-    SHA1_Update (&file_ctx, chunk_descr.checksum, 20);       \
+} while (0)
+
+/*
+ * Scan p[i, end) for a position where the gear fingerprint has all
+ * @mask bits cleared. The loop is unrolled since the per-byte work is only
+ * a shift, an add and a table lookup.
+ * Returns the position, or -1 if none is found.
+ */
+static inline int
+gear_scan (const unsigned char *p, int i, int end,
+           uint64_t mask, uint64_t *fingerprint)
+{
+    uint64_t fp = *fingerprint;
+
+    for (; i + 4 <= end; i += 4) {
+        GEAR_STEP (0);
+        GEAR_STEP (1);
+        GEAR_STEP (2);
+        GEAR_STEP (3);
+    }
+    for (; i < end; ++i)
+        GEAR_STEP (0);
+
+    *fingerprint = fp;
+    return -1;
+
+found:
+    *fingerprint = fp;
+    return i;
+}
+
+/*
+ * Gear engine counterpart of rabin_find_break(), with FastCDC style
+ * normalized chunking around block_sz.
+ */
+static gboolean
+gear_find_break (CDCFileDescriptor *file_descr,
+                 char *buf, int tail, int *cur,
+                 uint64_t *fingerprint)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    int block_min_sz = file_descr->block_min_sz;
+    int block_max_sz = file_descr->block_max_sz;
+    int normal_sz = file_descr->block_sz;
+    int bits = bits_of (file_descr->block_sz);
+    int i = *cur, pos, end;
+
+    /* The fingerprint only depends on the last GEAR_WIN_SZ bytes, prime it
+     * with the bytes before the first candidate position.
+     */
+    if (i == block_min_sz - 1)
+        *fingerprint = gear_checksum (p + i - GEAR_WIN_SZ + 1, GEAR_WIN_SZ - 1);
+
+    /* Chunks shorter than block_sz must satisfy the stricter mask. */
+    end = MIN (tail, normal_sz - 1);
+    if (i < end) {
+        pos = gear_scan (p, i, end, gear_mask (bits + NORMAL_LEVEL), fingerprint);
+        if (pos >= 0) {
+            *cur = pos;
+            return TRUE;
+        }
+        i = end;
+    }
+
+    end = MIN (tail, block_max_sz - 1);
+    if (i < end) {
+        pos = gear_scan (p, i, end, gear_mask (bits - NORMAL_LEVEL), fingerprint);
+        if (pos >= 0) {
+            *cur = pos;
+            return TRUE;
+        }
+        i = end;
+    }
+
+    /* Force a break point when the chunk reaches block_max_sz. */
+    if (i < tail && i + 1 >= block_max_sz) {
+        *cur = i;
+        return TRUE;
+    }
+
+    *cur = i;
+    return FALSE;
+}
+
+/*
+ * Pipelined mode: the thread calling file_chunk_cdc() only finds chunk
+ * boundaries. Each chunk is handed to a bounded pool of workers which run
+ * write_block (SHA-1, encryption and block writes). Workers store the
+ * checksum into its slot in blk_sha1s, so the file checksum is still
+ * computed over the block ids in file order.
+ *
+ * Chunks point into the data window, so the window must not be changed
+ * until the pipeline is idle.
+ */
+typedef struct CDCPipeline {
+    GThreadPool *tpool;
+    /* The pool was created for this file, not shared. */
+    gboolean own_tpool;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int in_flight;
+    int max_in_flight;
+    gboolean error;
+
+    CDCFileDescriptor *file_descr;
+    SeafileCrypt *crypt;
+    gboolean write_data;
+} CDCPipeline;
+
+typedef struct CDCTask {
+    CDCPipeline *pipeline;
+    CDCDescriptor chunk;
+    uint32_t idx;
+} CDCTask;
+
+static void
+pipeline_worker (gpointer data, gpointer user_data)
+{
+    CDCTask *task = data;
+    CDCPipeline *pipeline = task->pipeline;
+    CDCFileDescriptor *file_descr = pipeline->file_descr;
+    gboolean error;
+    int ret = -1;
+
+    pthread_mutex_lock (&pipeline->lock);
+    error = pipeline->error;
+    pthread_mutex_unlock (&pipeline->lock);
+
+    /* Don't waste time on the rest of the file after a failure. */
+    if (!error) {
+        ret = file_descr->write_block (file_descr->repo_id,
+                                       file_descr->version,
+                                       &task->chunk,
+                                       pipeline->crypt,
+                                       task->chunk.checksum,
+                                       pipeline->write_data);
+        if (ret >= 0)
+            memcpy (file_descr->blk_sha1s + task->idx * CHECKSUM_LENGTH,
+                    task->chunk.checksum, CHECKSUM_LENGTH);
+        else
+            g_warning ("CDC: failed to write chunk.\n");
+    }
+
+    g_free (task);
+
+    pthread_mutex_lock (&pipeline->lock);
+    if (ret < 0)
+        pipeline->error = TRUE;
+    --pipeline->in_flight;
+    pthread_cond_signal (&pipeline->cond);
+    pthread_mutex_unlock (&pipeline->lock);
+}
+
+GThreadPool *
+cdc_worker_pool_new (int n_workers)
+{
+    GThreadPool *tpool;
+    GError *error = NULL;
+
+    tpool = g_thread_pool_new (pipeline_worker, NULL, n_workers, FALSE, &error);
+    if (error) {
+        g_warning ("CDC: failed to create worker pool: %s.\n", error->message);
+        g_clear_error (&error);
+        return NULL;
+    }
+
+    return tpool;
+}
+
+static CDCPipeline *
+pipeline_new (CDCFileDescriptor *file_descr,
+              SeafileCrypt *crypt,
+              gboolean write_data)
+{
+    CDCPipeline *pipeline = g_new0 (CDCPipeline, 1);
+
+    if (file_descr->worker_pool) {
+        pipeline->tpool = file_descr->worker_pool;
+    } else {
+        pipeline->tpool = cdc_worker_pool_new (file_descr->n_workers);
+        if (!pipeline->tpool) {
+            g_free (pipeline);
+            return NULL;
+        }
+        pipeline->own_tpool = TRUE;
+    }
+
+    pthread_mutex_init (&pipeline->lock, NULL);
+    pthread_cond_init (&pipeline->cond, NULL);
+    /* Bounds the memory held by chunks waiting for a worker. */
+    pipeline->max_in_flight = file_descr->n_workers * 2;
+    pipeline->file_descr = file_descr;
+    pipeline->crypt = crypt;
+    pipeline->write_data = write_data;
+
+    return pipeline;
+}
+
+static int
+pipeline_submit (CDCPipeline *pipeline, CDCDescriptor *chunk_descr, uint32_t idx)
+{
+    CDCTask *task;
+    GError *error = NULL;
+
+    pthread_mutex_lock (&pipeline->lock);
+    while (pipeline->in_flight >= pipeline->max_in_flight && !pipeline->error)
+        pthread_cond_wait (&pipeline->cond, &pipeline->lock);
+    if (pipeline->error) {
+        pthread_mutex_unlock (&pipeline->lock);
+        return -1;
+    }
+    ++pipeline->in_flight;
+    pthread_mutex_unlock (&pipeline->lock);
+
+    task = g_new0 (CDCTask, 1);
+    task->pipeline = pipeline;
+    task->chunk.offset = chunk_descr->offset;
+    task->chunk.len = chunk_descr->len;
+    task->chunk.block_buf = chunk_descr->block_buf;
+    task->idx = idx;
+
+    g_thread_pool_push (pipeline->tpool, task, &error);
+    if (error) {
+        g_warning ("CDC: failed to dispatch chunk.\n");
+        g_clear_error (&error);
+        g_free (task);
+        pthread_mutex_lock (&pipeline->lock);
+        pipeline->error = TRUE;
+        --pipeline->in_flight;
+        pthread_mutex_unlock (&pipeline->lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Wait for all dispatched chunks. Returns -1 if any chunk failed. */
+static int
+pipeline_wait_idle (CDCPipeline *pipeline)
+{
+    int ret;
+
+    pthread_mutex_lock (&pipeline->lock);
+    while (pipeline->in_flight > 0)
+        pthread_cond_wait (&pipeline->cond, &pipeline->lock);
+    ret = pipeline->error ? -1 : 0;
+    pthread_mutex_unlock (&pipeline->lock);
+
+    return ret;
+}
+
+static int
+pipeline_finish (CDCPipeline *pipeline)
+{
+    int ret = pipeline_wait_idle (pipeline);
+
+    if (pipeline->own_tpool)
+        g_thread_pool_free (pipeline->tpool, FALSE, TRUE);
+    pthread_mutex_destroy (&pipeline->lock);
+    pthread_cond_destroy (&pipeline->cond);
+    g_free (pipeline);
+
+    return ret;
+}
+
+/*
+ * Serial mode without encryption: chunk ids are the SHA-1 of the chunk
+ * data, so several chunks are collected and hashed together in parallel
+ * lanes before write_block is called for each of them. Like in pipelined
+ * mode, chunks point into the window, so the batch must be flushed before
+ * the window is changed.
+ */
+typedef struct CDCBatch {
+    int n;
+    CDCDescriptor chunks[SHA1_MB_LANES];
+    uint32_t idx[SHA1_MB_LANES];
+} CDCBatch;
+
+static int
+batch_flush (CDCFileDescriptor *file_descr,
+             CDCBatch *batch,
+             gboolean write_data)
+{
+    const unsigned char *bufs[SHA1_MB_LANES];
+    size_t lens[SHA1_MB_LANES];
+    unsigned char sha1s[SHA1_MB_LANES * 20];
+    CDCDescriptor *chunk;
+    int i, n = batch->n;
+
+    if (n == 0)
+        return 0;
+    batch->n = 0;
+
+    for (i = 0; i < n; ++i) {
+        bufs[i] = (const unsigned char *)batch->chunks[i].block_buf;
+        lens[i] = batch->chunks[i].len;
+    }
+    sha1_mb_digest (n, bufs, lens, sha1s);
+
+    for (i = 0; i < n; ++i) {
+        chunk = &batch->chunks[i];
+        memcpy (chunk->checksum, sha1s + i * 20, 20);
+        chunk->has_checksum = TRUE;
+
+        if (file_descr->write_block (file_descr->repo_id,
+                                     file_descr->version,
+                                     chunk, NULL, chunk->checksum,
+                                     write_data) < 0) {
+            g_warning ("CDC: failed to write chunk.\n");
+            return -1;
+        }
+
+        memcpy (file_descr->blk_sha1s + batch->idx[i] * CHECKSUM_LENGTH,
+                chunk->checksum, CHECKSUM_LENGTH);
+    }
+
+    return 0;
+}
+
+static int
+write_chunk (CDCFileDescriptor *file_descr,
+             CDCPipeline *pipeline,
+             CDCBatch *batch,
+             CDCDescriptor *chunk_descr,
+             SeafileCrypt *crypt,
+             gboolean write_data)
+{
+    int ret;
+
+    if (pipeline)
+        return pipeline_submit (pipeline, chunk_descr, file_descr->block_nr);
+
+    if (batch) {
+        batch->chunks[batch->n] = *chunk_descr;
+        batch->idx[batch->n] = file_descr->block_nr;
+        if (++batch->n == SHA1_MB_LANES)
+            return batch_flush (file_descr, batch, write_data);
+        return 0;
+    }
+
+    ret = file_descr->write_block (file_descr->repo_id,
+                                   file_descr->version,
+                                   chunk_descr,
+                                   crypt, chunk_descr->checksum,
+                                   write_data);
+    if (ret < 0) {
+        g_warning ("CDC: failed to write chunk.\n");
+        return -1;
+    }
+
+    memcpy (file_descr->blk_sha1s +
+            file_descr->block_nr * CHECKSUM_LENGTH,
+            chunk_descr->checksum, CHECKSUM_LENGTH);
+    return 0;
+}
+
+/*
+ * The part of the file that is currently accessible in memory.
+ * In mmap mode the whole file is mapped. In read mode a large buffer is
+ * filled with sequential reads and shifted when it runs low, so each
+ * chunk handed to write_block is a pointer into the window in both modes.
+ */
+typedef struct CDCWindow {
+    int fd;
+    uint64_t file_size;
+    /* data[0, len) is valid. */
+    char *data;
+    uint64_t len;
+    /* No more data after data[len - 1]. */
+    gboolean eof;
+
+    void *map;
+    char *buf;
+    uint64_t buf_sz;
+    uint64_t read_sz;
+} CDCWindow;
+
+static gboolean
+window_map (CDCWindow *win)
+{
+#ifndef WIN32
+    if (win->file_size == 0)
+        return FALSE;
+    if (sizeof(void *) < 8 && win->file_size > MMAP_MAX_SZ_32BIT)
+        return FALSE;
+
+    win->map = mmap (NULL, (size_t)win->file_size, PROT_READ, MAP_PRIVATE,
+                     win->fd, 0);
+    if (win->map == MAP_FAILED) {
+        win->map = NULL;
+        return FALSE;
+    }
+    madvise (win->map, (size_t)win->file_size, MADV_SEQUENTIAL);
+
+    win->data = win->map;
+    win->len = win->file_size;
+    win->eof = TRUE;
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+static int
+window_open (CDCWindow *win, int fd, uint64_t file_size,
+             CDCFileDescriptor *file_descr)
+{
+    memset (win, 0, sizeof(CDCWindow));
+    win->fd = fd;
+    win->file_size = file_size;
+
+    /* Fall back to read mode if the file can't be mapped. */
+    if (file_descr->use_mmap && window_map (win))
+        return 0;
+
+#if defined __linux__
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    win->buf_sz = MAX (READ_WINDOW_SZ, (uint64_t)file_descr->block_max_sz * 4);
+    if (win->buf_sz > file_size)
+        win->buf_sz = file_size;
+    win->buf = win->data = malloc (win->buf_sz > 0 ? win->buf_sz : 1);
+    if (!win->buf)
+        return -1;
+    win->eof = (file_size == 0);
+
+    return 0;
+}
+
+/* Discard data before @pos and read more data into the window. */
+static int
+window_refill (CDCWindow *win, uint64_t pos)
+{
+    int n;
+    char c;
+
+    if (pos > 0) {
+        memmove (win->buf, win->buf + pos, win->len - pos);
+        win->len -= pos;
+    }
+
+    n = readn (win->fd, win->buf + win->len, win->buf_sz - win->len);
+    if (n < 0) {
+        g_warning ("CDC: failed to read: %s.\n", strerror(errno));
+        return -1;
+    }
+    win->len += n;
+    win->read_sz += n;
+
+    if (win->read_sz >= win->file_size) {
+        /* Make sure the file didn't grow. */
+        if (readn (win->fd, &c, 1) != 0) {
+            g_warning ("File size changed while chunking.\n");
+            return -1;
+        }
+        win->eof = TRUE;
+    } else if (win->len < win->buf_sz) {
+        /* File is truncated. */
+        win->eof = TRUE;
+    }
+
+    return 0;
+}
+
+static void
+window_close (CDCWindow *win)
+{
+#ifndef WIN32
+    if (win->map)
+        munmap (win->map, (size_t)win->file_size);
+#endif
+    free (win->buf);
+}
+
+#define WRITE_CDC_BLOCK(data, block_sz, write_data)          \
+do {                                                         \
+    chunk_descr.block_buf = (data);                          \
+    chunk_descr.len = (block_sz);                            \
+    chunk_descr.offset = offset;                             \
+    ret = write_chunk (file_descr, pipeline, batch,          \
+                       &chunk_descr, crypt, (write_data));   \
+    if (ret < 0)                                             \
+        goto out;                                            \
     file_descr->block_nr++;                                  \
-    offset += _block_sz;                                     \
-                                                             \
-    memmove (buf, buf + _block_sz, tail - _block_sz);        \
-    tail = tail - _block_sz;                                 \
-    cur = 0;                                                 \
+    offset += chunk_descr.len;                               \
 }while(0);
 
 /* content-defined chunking */
@@ -103,11 +643,11 @@ int file_chunk_cdc(int fd_src,
                    SeafileCrypt *crypt,
                    gboolean write_data)
 {
-    char *buf;
-    uint32_t buf_sz;
+    CDCWindow win;
     SHA_CTX file_ctx;
     CDCDescriptor chunk_descr;
-    SHA1_Init (&file_ctx);
+    CDCPipeline *pipeline = NULL;
+    CDCBatch batch_buf, *batch = NULL;
 
     SeafStat sb;
     if (seaf_fstat (fd_src, &sb) < 0) {
@@ -118,95 +658,116 @@ int file_chunk_cdc(int fd_src,
 
     init_cdc_file_descriptor (fd_src, expected_size, file_descr);
     uint32_t block_min_sz = file_descr->block_min_sz;
-    uint32_t block_mask = file_descr->block_sz - 1;
+    uint32_t block_max_sz = file_descr->block_max_sz;
 
-    int fingerprint = 0;
-    int offset = 0;
+    unsigned int fingerprint = 0;
+    uint64_t gear_fp = 0;
+    gboolean found;
+    uint64_t offset = 0;
+    uint64_t pos, avail;
     int ret = 0;
-    int tail, cur, rsize;
+    int tail, cur;
 
-    buf_sz = file_descr->block_max_sz;
-    buf = chunk_descr.block_buf = malloc (buf_sz);
-    if (!buf)
+    if (window_open (&win, fd_src, expected_size, file_descr) < 0)
         return -1;
 
-    /* buf: a fix-sized buffer.
-     * cur: data behind (inclusive) this offset has been scanned.
-     *      cur + 1 is the bytes that has been scanned.
-     * tail: length of data loaded into memory. buf[tail] is invalid.
+    if (file_descr->n_workers > 1) {
+        pipeline = pipeline_new (file_descr, crypt, write_data);
+        if (!pipeline) {
+            window_close (&win);
+            return -1;
+        }
+    } else if (!crypt && CHECKSUM_LENGTH == 20) {
+        batch_buf.n = 0;
+        batch = &batch_buf;
+    }
+
+    memset (&chunk_descr, 0, sizeof(chunk_descr));
+
+    /* pos: start of the next chunk in the window.
+     * A chunk can be emitted once block_max_sz bytes are available,
+     * or we reach the end of the file.
      */
-    tail = cur = 0;
+    pos = 0;
     while (1) {
-        if (tail < block_min_sz) {
-            rsize = block_min_sz - tail + READ_SIZE;
-        } else {
-            rsize = (buf_sz - tail < READ_SIZE) ? (buf_sz - tail) : READ_SIZE;
-        }
-        ret = readn (fd_src, buf + tail, rsize);
-        if (ret < 0) {
-            g_warning ("CDC: failed to read: %s.\n", strerror(errno));
-            free (buf);
-            return -1;
+        avail = win.len - pos;
+
+        if (avail < block_max_sz && !win.eof) {
+            /* In-flight chunks point into the window. */
+            if (pipeline && pipeline_wait_idle (pipeline) < 0) {
+                ret = -1;
+                goto out;
+            }
+            if (batch && batch_flush (file_descr, batch, write_data) < 0) {
+                ret = -1;
+                goto out;
+            }
+            if (window_refill (&win, pos) < 0) {
+                ret = -1;
+                goto out;
+            }
+            pos = 0;
+            continue;
         }
-        tail += ret;
-        file_descr->file_size += ret;
 
-        if (file_descr->file_size > expected_size) {
-            g_warning ("File size changed while chunking.\n");
-            free (buf);
-            return -1;
+        if (avail == 0)
+            break;
+
+        if (file_descr->block_nr == file_descr->max_block_nr) {
+            g_warning ("Block id array is not large enough, bail out.\n");
+            ret = -1;
+            goto out;
         }
 
-        /* We've read all the data in this file. Output the block immediately
-         * in two cases:
+        /* Output the rest of the file as one block in two cases:
          * 1. The data left in the file is less than block_min_sz;
          * 2. We cannot find the break value until the end of this file.
          */
-        if (tail < block_min_sz || cur >= tail) {
-            if (tail > 0) {
-                if (file_descr->block_nr == file_descr->max_block_nr) {
-                    g_warning ("Block id array is not large enough, bail out.\n");
-                    free (buf);
-                    return -1;
-                }
-                WRITE_CDC_BLOCK (tail, write_data);
-            }
-            break;
+        if (avail < block_min_sz) {
+            WRITE_CDC_BLOCK (win.data + pos, avail, write_data);
+            pos += avail;
+            continue;
         }
 
-        /* 
-         * A block is at least of size block_min_sz.
-         */
-        if (cur < block_min_sz - 1)
-            cur = block_min_sz - 1;
-
-        while (cur < tail) {
-            fingerprint = (cur == block_min_sz - 1) ?
-                finger(buf + cur - BLOCK_WIN_SZ + 1, BLOCK_WIN_SZ) :
-                rolling_finger (fingerprint, BLOCK_WIN_SZ, 
-                                *(buf+cur-BLOCK_WIN_SZ), *(buf + cur));
-
-            /* get a chunk, write block info to chunk file */
-            if (((fingerprint & block_mask) ==  ((BREAK_VALUE & block_mask)))
-                || cur + 1 >= file_descr->block_max_sz)
-            {
-                if (file_descr->block_nr == file_descr->max_block_nr) {
-                    g_warning ("Block id array is not large enough, bail out.\n");
-                    free (buf);
-                    return -1;
-                }
-
-                WRITE_CDC_BLOCK (cur + 1, write_data);
-                break;
-            } else {
-                cur ++;
-            }
-        }
+        /* A block is at least of size block_min_sz. */
+        tail = (int) MIN (avail, block_max_sz);
+        cur = block_min_sz - 1;
+
+        if (file_descr->engine == CDC_ENGINE_GEAR)
+            found = gear_find_break (file_descr, win.data + pos, tail,
+                                     &cur, &gear_fp);
+        else
+            found = rabin_find_break (file_descr, win.data + pos, tail,
+                                      &cur, &fingerprint);
+
+        /* get a chunk, write block info to chunk file */
+        WRITE_CDC_BLOCK (win.data + pos, found ? cur + 1 : tail, write_data);
+        pos += chunk_descr.len;
     }
 
-    SHA1_Final (file_descr->file_sum, &file_ctx);
+    if (batch && batch_flush (file_descr, batch, write_data) < 0) {
+        ret = -1;
+        goto out;
+    }
 
-    free (buf);
+    ret = 0;
+
+out:
+    /* Workers use the window and blk_sha1s, wait for them even on failure. */
+    if (pipeline && pipeline_finish (pipeline) < 0)
+        ret = -1;
+    window_close (&win);
+
+    if (ret < 0)
+        return -1;
+
+    file_descr->file_size = offset;
+
+    /* The file checksum is the SHA-1 of all block ids in file order. */
+    SHA1_Init (&file_ctx);
+    SHA1_Update (&file_ctx, file_descr->blk_sha1s,
+                 file_descr->block_nr * CHECKSUM_LENGTH);
+    SHA1_Final (file_descr->file_sum, &file_ctx);
 
     return 0;
 }
@@ -227,7 +788,15 @@ int filename_chunk_cdc(const char *filename,
     return ret;
 }
 
+int cdc_engine_for_repo_version (int version)
+{
+    if (version >= CDC_GEAR_MIN_REPO_VERSION)
+        return CDC_ENGINE_GEAR;
+    return CDC_ENGINE_RABIN;
+}
+
 void cdc_init ()
 {
     rabin_init (BLOCK_WIN_SZ);
+    gear_init ();
 }
@@ -15,6 +15,20 @@
 
 #define BREAK_VALUE     0x0013    ///0x0513
 
+/* Chunking engines. The engine decides where chunk boundaries fall, so it
+ * is fixed per repo version to keep block ids of existing repos stable.
+ */
+enum {
+    CDC_ENGINE_RABIN = 0,
+    CDC_ENGINE_GEAR,
+};
+
+/* Repos with this version or newer are chunked with the gear engine. The
+ * engine only decides block boundaries, so version 2 repos can be read by
+ * any client. Newer versions add other format changes on top.
+ */
+#define CDC_GEAR_MIN_REPO_VERSION 2
+
 
 #ifdef HAVE_MD5
 #include "md5.h"
@@ -57,6 +71,28 @@ typedef struct _CDCFileDescriptor {
 
     char repo_id[37];
     int version;
+
+    /* CDC_ENGINE_RABIN or CDC_ENGINE_GEAR. */
+    int engine;
+
+    /* If larger than 1, chunks are handed to worker threads which run
+     * write_block concurrently, while boundary detection stays on the
+     * calling thread. write_block must then be thread-safe. At most
+     * 2 * n_workers chunks of the file are in flight.
+     */
+    int n_workers;
+
+    /* Pool from cdc_worker_pool_new() shared by all files chunked at the
+     * same time. If NULL, a pool of n_workers threads is created for the
+     * file.
+     */
+    GThreadPool *worker_pool;
+
+    /* Map the file instead of reading it. The file must not be truncated
+     * while it's chunked, since accessing the unbacked part of the mapping
+     * raises SIGBUS. Read mode is used if the file can't be mapped.
+     */
+    gboolean use_mmap;
 } CDCFileDescriptor;
 
 typedef struct _CDCDescriptor {
@@ -64,6 +100,11 @@ typedef struct _CDCDescriptor {
     uint32_t len;
     uint8_t  checksum[CHECKSUM_LENGTH];
     char    *block_buf;
+    /* checksum already holds the SHA-1 of block_buf. Only set for
+     * unencrypted chunks, since the id of an encrypted block is the
+     * checksum of the encrypted data.
+     */
+    gboolean has_checksum;
 } CDCDescriptor;
 
 int file_chunk_cdc(int fd_src,
@@ -76,6 +117,10 @@ int filename_chunk_cdc(const char *filename,
                        struct SeafileCrypt *crypt,
                        gboolean write_data);
 
+int cdc_engine_for_repo_version (int version);
+
+GThreadPool *cdc_worker_pool_new (int n_workers);
+
 void cdc_init ();
 
 #endif
@@ -0,0 +1,53 @@
+#include "gear-hash.h"
+
+uint64_t gear_table[256];
+
+/*
+ * The table must never change once chunks have been produced with it,
+ * otherwise chunk boundaries (and hence block ids) of the same content
+ * would differ between clients and servers. It is generated from a fixed
+ * seed with splitmix64 instead of being read from the system RNG.
+ */
+#define GEAR_SEED 0x5eaf11e0c0ffee11ULL
+
+static uint64_t
+splitmix64 (uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+uint64_t
+gear_checksum (const unsigned char *buf, int len)
+{
+    uint64_t fp = 0;
+    int i;
+
+    for (i = 0; i < len; ++i)
+        fp = gear_rolling_checksum (fp, buf[i]);
+
+    return fp;
+}
+
+uint64_t
+gear_mask (int bits)
+{
+    if (bits <= 0)
+        return 0;
+    if (bits >= 64)
+        return ~0ULL;
+    return ~0ULL << (64 - bits);
+}
+
+void
+gear_init ()
+{
+    uint64_t state = GEAR_SEED;
+    int i;
+
+    for (i = 0; i < 256; ++i)
+        gear_table[i] = splitmix64 (&state);
+}
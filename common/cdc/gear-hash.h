@@ -0,0 +1,27 @@
+#ifndef _GEAR_HASH_H
+#define _GEAR_HASH_H
+
+#include <stdint.h>
+
+/* Number of bytes that contribute to a gear fingerprint. Each new byte
+ * shifts the fingerprint left by one bit, so a byte falls out of the
+ * fingerprint 64 bytes later.
+ */
+#define GEAR_WIN_SZ 64
+
+extern uint64_t gear_table[256];
+
+#define gear_rolling_checksum(fp, c) (((fp) << 1) + gear_table[(unsigned char)(c)])
+
+uint64_t gear_checksum (const unsigned char *buf, int len);
+
+/*
+ * Returns a mask of the @bits most significant bits. Only the high bits of
+ * a gear fingerprint depend on the whole window, so break conditions must
+ * be tested against them.
+ */
+uint64_t gear_mask (int bits);
+
+void gear_init ();
+
+#endif
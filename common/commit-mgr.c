@@ -2,6 +2,7 @@
 
 #include "common.h"
 
+#include <pthread.h>
 #include <jansson.h>
 #include <openssl/sha.h>
 
@@ -15,8 +16,35 @@
 
 #define MAX_TIME_SKEW 259200    /* 3 days */
 
+/* Max number of commits in the cache. */
+#define DEFAULT_COMMIT_CACHE_SIZE 10000
+#define COMMIT_CACHE_SHARDS 16
+
+typedef struct CommitCacheEntry {
+    /* "<repo_id>/<version>/<commit_id>" */
+    char        *key;
+    /* The entry holds one reference. */
+    SeafCommit  *commit;
+
+    struct CommitCacheEntry *prev, *next;
+} CommitCacheEntry;
+
+typedef struct CommitCacheShard {
+    pthread_mutex_t lock;
+    GHashTable      *entries;
+    /* Most recently used at the head. */
+    CommitCacheEntry *head, *tail;
+    int             n_entries;
+
+    guint64         hits;
+    guint64         misses;
+    guint64         evictions;
+} CommitCacheShard;
+
 struct _SeafCommitManagerPriv {
-    int dummy;
+    /* NULL when the commit cache is disabled. */
+    CommitCacheShard *cache;
+    int               shard_capacity;
 };
 
 static SeafCommit *
@@ -170,7 +198,7 @@ seaf_commit_free (SeafCommit *commit)
 void
 seaf_commit_ref (SeafCommit *commit)
 {
-    commit->ref++;
+    g_atomic_int_inc (&commit->ref);
 }
 
 void
@@ -179,10 +207,178 @@ seaf_commit_unref (SeafCommit *commit)
     if (!commit)
         return;
 
-    if (--commit->ref <= 0)
+    if (g_atomic_int_dec_and_test (&commit->ref))
         seaf_commit_free (commit);
 }
 
+/*
+ * Commit objects never change, so the cache only has to drop commits when
+ * they're deleted. Cached commits are shared with callers and must not be
+ * modified.
+ */
+
+static void
+commit_cache_init (SeafCommitManagerPriv *priv, int capacity)
+{
+    CommitCacheShard *shard;
+    int i;
+
+    priv->cache = g_new0 (CommitCacheShard, COMMIT_CACHE_SHARDS);
+    priv->shard_capacity = MAX (capacity / COMMIT_CACHE_SHARDS, 1);
+
+    for (i = 0; i < COMMIT_CACHE_SHARDS; i++) {
+        shard = &priv->cache[i];
+        pthread_mutex_init (&shard->lock, NULL);
+        shard->entries = g_hash_table_new (g_str_hash, g_str_equal);
+    }
+}
+
+static char *
+commit_cache_key (const char *repo_id, int version, const char *commit_id)
+{
+    return g_strdup_printf ("%s/%d/%s", repo_id, version, commit_id);
+}
+
+static CommitCacheShard *
+commit_cache_get_shard (SeafCommitManagerPriv *priv, const char *commit_id)
+{
+    return &priv->cache[g_str_hash (commit_id) % COMMIT_CACHE_SHARDS];
+}
+
+/* Called with shard->lock held. */
+static void
+commit_cache_lru_unlink (CommitCacheShard *shard, CommitCacheEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        shard->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        shard->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+/* Called with shard->lock held. */
+static void
+commit_cache_lru_push_head (CommitCacheShard *shard, CommitCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head)
+        shard->head->prev = entry;
+    shard->head = entry;
+    if (!shard->tail)
+        shard->tail = entry;
+}
+
+/* Called with shard->lock held. The caller must free the returned entry. */
+static CommitCacheEntry *
+commit_cache_remove_entry (CommitCacheShard *shard, CommitCacheEntry *entry)
+{
+    commit_cache_lru_unlink (shard, entry);
+    g_hash_table_remove (shard->entries, entry->key);
+    --shard->n_entries;
+    return entry;
+}
+
+static void
+commit_cache_entry_free (CommitCacheEntry *entry)
+{
+    seaf_commit_unref (entry->commit);
+    g_free (entry->key);
+    g_free (entry);
+}
+
+static SeafCommit *
+commit_cache_lookup (SeafCommitManagerPriv *priv, const char *repo_id,
+                     int version, const char *commit_id)
+{
+    CommitCacheShard *shard = commit_cache_get_shard (priv, commit_id);
+    char *key = commit_cache_key (repo_id, version, commit_id);
+    CommitCacheEntry *entry;
+    SeafCommit *commit = NULL;
+
+    pthread_mutex_lock (&shard->lock);
+
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry) {
+        commit_cache_lru_unlink (shard, entry);
+        commit_cache_lru_push_head (shard, entry);
+        commit = entry->commit;
+        seaf_commit_ref (commit);
+        ++shard->hits;
+    } else {
+        ++shard->misses;
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    g_free (key);
+    return commit;
+}
+
+static void
+commit_cache_insert (SeafCommitManagerPriv *priv, const char *repo_id,
+                     int version, SeafCommit *commit)
+{
+    CommitCacheShard *shard = commit_cache_get_shard (priv, commit->commit_id);
+    CommitCacheEntry *entry, *victim = NULL;
+
+    entry = g_new0 (CommitCacheEntry, 1);
+    entry->key = commit_cache_key (repo_id, version, commit->commit_id);
+    entry->commit = commit;
+
+    pthread_mutex_lock (&shard->lock);
+
+    /* Another thread may have loaded the same commit. */
+    if (g_hash_table_lookup (shard->entries, entry->key)) {
+        pthread_mutex_unlock (&shard->lock);
+        g_free (entry->key);
+        g_free (entry);
+        return;
+    }
+
+    seaf_commit_ref (commit);
+    g_hash_table_insert (shard->entries, entry->key, entry);
+    commit_cache_lru_push_head (shard, entry);
+    ++shard->n_entries;
+
+    if (shard->n_entries > priv->shard_capacity) {
+        victim = commit_cache_remove_entry (shard, shard->tail);
+        ++shard->evictions;
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    if (victim)
+        commit_cache_entry_free (victim);
+}
+
+static void
+commit_cache_remove (SeafCommitManagerPriv *priv, const char *repo_id,
+                     int version, const char *commit_id)
+{
+    CommitCacheShard *shard = commit_cache_get_shard (priv, commit_id);
+    char *key = commit_cache_key (repo_id, version, commit_id);
+    CommitCacheEntry *entry;
+
+    pthread_mutex_lock (&shard->lock);
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry)
+        commit_cache_remove_entry (shard, entry);
+    pthread_mutex_unlock (&shard->lock);
+
+    /* Callers may still hold references, the commit is freed with the
+     * last one.
+     */
+    if (entry)
+        commit_cache_entry_free (entry);
+
+    g_free (key);
+}
+
 SeafCommitManager*
 seaf_commit_manager_new (SeafileSession *seaf)
 {
@@ -192,9 +388,48 @@ seaf_commit_manager_new (SeafileSession *seaf)
     mgr->seaf = seaf;
     mgr->obj_store = seaf_obj_store_new (mgr->seaf, "commits");
 
+#ifdef SEAFILE_SERVER
+    /* Max number of cached commits, 0 disables the cache. */
+    GError *error = NULL;
+    int cache_size = g_key_file_get_integer (seaf->config,
+                                             "commit_cache", "size", &error);
+    if (error) {
+        cache_size = DEFAULT_COMMIT_CACHE_SIZE;
+        g_clear_error (&error);
+    }
+    if (cache_size > 0)
+        commit_cache_init (mgr->priv, cache_size);
+#endif
+
     return mgr;
 }
 
+gboolean
+seaf_commit_manager_get_cache_stats (SeafCommitManager *mgr,
+                                     CommitCacheStats *stats)
+{
+    CommitCacheShard *shard;
+    int i;
+
+    if (!mgr->priv->cache)
+        return FALSE;
+
+    memset (stats, 0, sizeof(*stats));
+    stats->capacity = mgr->priv->shard_capacity * COMMIT_CACHE_SHARDS;
+
+    for (i = 0; i < COMMIT_CACHE_SHARDS; i++) {
+        shard = &mgr->priv->cache[i];
+        pthread_mutex_lock (&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->n_commits += shard->n_entries;
+        pthread_mutex_unlock (&shard->lock);
+    }
+
+    return TRUE;
+}
+
 int
 seaf_commit_manager_init (SeafCommitManager *mgr)
 {
@@ -222,31 +457,15 @@ seaf_commit_manager_init (SeafCommitManager *mgr)
     return 0;
 }
 
-#if 0
-inline static void
-add_commit_to_cache (SeafCommitManager *mgr, SeafCommit *commit)
-{
-    g_hash_table_insert (mgr->priv->commit_cache,
-                         g_strdup(commit->commit_id),
-                         commit);
-    seaf_commit_ref (commit);
-}
-
-inline static void
-remove_commit_from_cache (SeafCommitManager *mgr, SeafCommit *commit)
-{
-    g_hash_table_remove (mgr->priv->commit_cache, commit->commit_id);
-    seaf_commit_unref (commit);
-}
-#endif
-
 int
 seaf_commit_manager_add_commit (SeafCommitManager *mgr,
                                 SeafCommit *commit)
 {
     int ret;
 
-    /* add_commit_to_cache (mgr, commit); */
+    /* New commits are not cached, since callers may still change them
+     * after adding. They're cached when read back.
+     */
     if ((ret = save_commit (mgr, commit->repo_id, commit->version, commit)) < 0)
         return -1;
     
@@ -261,20 +480,8 @@ seaf_commit_manager_del_commit (SeafCommitManager *mgr,
 {
     g_return_if_fail (id != NULL);
 
-#if 0
-    commit = g_hash_table_lookup(mgr->priv->commit_cache, id);
-    if (!commit)
-        goto delete;
-
-    /*
-     * Catch ref count bug here. We have bug in commit ref, the
-     * following assert can't pass. TODO: fix the commit ref bug
-     */
-    /* g_assert (commit->ref <= 1); */
-    remove_commit_from_cache (mgr, commit);
-
-delete:
-#endif
+    if (mgr->priv->cache)
+        commit_cache_remove (mgr->priv, repo_id, version, id);
 
     delete_commit (mgr, repo_id, version, id);
 }
@@ -287,19 +494,18 @@ seaf_commit_manager_get_commit (SeafCommitManager *mgr,
 {
     SeafCommit *commit;
 
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL) {
-        seaf_commit_ref (commit);
-        return commit;
+    if (mgr->priv->cache) {
+        commit = commit_cache_lookup (mgr->priv, repo_id, version, id);
+        if (commit)
+            return commit;
     }
-#endif
 
     commit = load_commit (mgr, repo_id, version, id);
     if (!commit)
         return NULL;
 
-    /* add_commit_to_cache (mgr, commit); */
+    if (mgr->priv->cache)
+        commit_cache_insert (mgr->priv, repo_id, version, commit);
 
     return commit;
 }
@@ -98,16 +98,13 @@ seaf_commit_manager_init (SeafCommitManager *mgr);
 /**
  * Add a commit to commit manager and persist it to disk.
  * Any new commit should be added to commit manager before used.
- * This function increments ref count of the commit object.
- * Not MT safe.
  */
 int
 seaf_commit_manager_add_commit (SeafCommitManager *mgr, SeafCommit *commit);
 
 /**
  * Delete a commit from commit manager and permanently remove it from disk.
- * A commit object to be deleted should have ref cournt <= 1.
- * Not MT safe.
+ * Objects already returned for the commit stay valid until unref'ed.
  */
 void
 seaf_commit_manager_del_commit (SeafCommitManager *mgr,
@@ -118,7 +115,7 @@ seaf_commit_manager_del_commit (SeafCommitManager *mgr,
 /**
  * Find a commit object.
  * This function increments ref count of returned object.
- * Not MT safe.
+ * The object may be shared with the commit cache, don't modify it.
  */
 SeafCommit* 
 seaf_commit_manager_get_commit (SeafCommitManager *mgr,
@@ -186,4 +183,17 @@ seaf_commit_manager_commit_exists (SeafCommitManager *mgr,
                                    int version,
                                    const char *id);
 
+typedef struct CommitCacheStats {
+    guint64 hits;
+    guint64 misses;
+    guint64 evictions;
+    guint64 n_commits;
+    guint64 capacity;
+} CommitCacheStats;
+
+/* Returns FALSE if the commit cache is not enabled. */
+gboolean
+seaf_commit_manager_get_cache_stats (SeafCommitManager *mgr,
+                                     CommitCacheStats *stats);
+
 #endif
@@ -29,6 +29,13 @@
 
 #define CURRENT_REPO_VERSION 1
 
+/* Repos of this version store dir and file objects in the binary format.
+ * Older clients can't read them, so servers only create such repos when
+ * configured to. Version 2 only changes the chunking engine, see
+ * CDC_GEAR_MIN_REPO_VERSION in cdc/cdc.h.
+ */
+#define BINARY_FS_REPO_VERSION 3
+
 /* For compatibility with the old protocol, use an UUID for signature.
  * Listen manager on the server will use the new block tx protocol if it
  * receives this signature as "token".
@@ -12,6 +12,8 @@
     #include <arpa/inet.h>
 #endif
 
+#include <pthread.h>
+
 #include <openssl/sha.h>
 #include <searpc-utils.h>
 
@@ -21,6 +23,7 @@
 #include "block-mgr.h"
 #include "utils.h"
 #include "seaf-utils.h"
+#include "sha1-mb.h"
 #include "log.h"
 #include "../common/seafile-crypt.h"
 
@@ -33,9 +36,77 @@
 
 #define SEAF_TMP_EXT "~"
 
+/* Files at least this large are chunked with a pool of worker threads
+ * doing SHA-1, encryption and block writes in parallel.
+ */
+#define PIPELINE_MIN_FILE_SIZE (16 * 1024 * 1024)
+#define MAX_INDEX_WORKERS 8
+
+/* Size of the parsed object cache in MB. */
+#define DEFAULT_FS_CACHE_SIZE 64
+#define FS_CACHE_SHARDS 16
+
+typedef struct FSCacheEntry {
+    /* "<store_id>/<obj_id>" */
+    char        *key;
+    int         type;
+    /* Seafile or SeafDir, the entry holds one reference. */
+    void        *obj;
+    gint64      size;
+
+    struct FSCacheEntry *prev, *next;
+} FSCacheEntry;
+
+typedef struct FSCacheShard {
+    pthread_mutex_t lock;
+    GHashTable      *entries;
+    /* Most recently used at the head. */
+    FSCacheEntry    *head, *tail;
+    gint64          size;
+} FSCacheShard;
+
+/* Max number of cached path lookups. */
+#define DEFAULT_PATH_CACHE_SIZE 100000
+#define PATH_CACHE_SHARDS 16
+
+typedef struct PathCacheEntry {
+    /* "<store_id>/<dir_id>/<path>", path is relative to the dir. */
+    char        *key;
+    char        obj_id[41];
+    guint32     mode;
+
+    struct PathCacheEntry *prev, *next;
+} PathCacheEntry;
+
+typedef struct PathCacheShard {
+    pthread_mutex_t lock;
+    GHashTable      *entries;
+    /* Most recently used at the head. */
+    PathCacheEntry  *head, *tail;
+    int             n_entries;
+
+    guint64         hits;
+    guint64         misses;
+    guint64         evictions;
+} PathCacheShard;
+
 struct _SeafFSManagerPriv {
-    /* GHashTable      *seafile_cache; */
+    /* Parsed Seafile and SeafDir objects. NULL when disabled. */
+    FSCacheShard    *cache;
+    gint64           cache_shard_capacity;
+
+    /* Resolved paths. NULL when disabled. */
+    PathCacheShard  *path_cache;
+    int              path_cache_shard_capacity;
+
     GHashTable      *bl_cache;
+
+    /* Worker threads hashing and writing the chunks of large files. The
+     * pool is shared by all files indexed at the same time, so the number
+     * of threads stays bounded. NULL if large files are chunked serially.
+     */
+    GThreadPool     *chunk_pool;
+    int              index_workers;
 };
 
 typedef struct SeafileOndisk {
@@ -56,6 +127,12 @@ typedef struct SeafdirOndisk {
     char    dirents[0];
 } __attribute__((gcc_struct, __packed__)) SeafdirOndisk;
 
+/* Entries of a dir sorted by name in ascending order. */
+struct _SeafDirIndex {
+    int          n_entries;
+    SeafDirent  *dents[0];
+};
+
 #ifndef SEAFILE_SERVER
 uint32_t
 calculate_chunk_size (uint64_t total_size);
@@ -66,6 +143,389 @@ write_seafile (SeafFSManager *fs_mgr,
                unsigned char *obj_sha1);
 #endif  /* SEAFILE_SERVER */
 
+/*
+ * Fs objects are immutable, so cached objects never need to be
+ * invalidated. They're only evicted when a shard goes over its share of
+ * the memory budget.
+ */
+
+static void
+fs_cache_init (SeafFSManagerPriv *priv, gint64 capacity)
+{
+    FSCacheShard *shard;
+    int i;
+
+    priv->cache = g_new0 (FSCacheShard, FS_CACHE_SHARDS);
+    priv->cache_shard_capacity = capacity / FS_CACHE_SHARDS;
+
+    for (i = 0; i < FS_CACHE_SHARDS; i++) {
+        shard = &priv->cache[i];
+        pthread_mutex_init (&shard->lock, NULL);
+        shard->entries = g_hash_table_new (g_str_hash, g_str_equal);
+    }
+}
+
+static char *
+fs_cache_key (const char *store_id, const char *obj_id)
+{
+    return g_strconcat (store_id, "/", obj_id, NULL);
+}
+
+static FSCacheShard *
+fs_cache_get_shard (SeafFSManagerPriv *priv, const char *obj_id)
+{
+    return &priv->cache[g_str_hash (obj_id) % FS_CACHE_SHARDS];
+}
+
+static void
+fs_cache_obj_unref (int type, void *obj)
+{
+    if (type == SEAF_METADATA_TYPE_FILE)
+        seafile_unref ((Seafile *)obj);
+    else
+        seaf_dir_free ((SeafDir *)obj);
+}
+
+/* Called with shard->lock held. */
+static void
+fs_cache_lru_unlink (FSCacheShard *shard, FSCacheEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        shard->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        shard->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+/* Called with shard->lock held. */
+static void
+fs_cache_lru_push_head (FSCacheShard *shard, FSCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head)
+        shard->head->prev = entry;
+    shard->head = entry;
+    if (!shard->tail)
+        shard->tail = entry;
+}
+
+/* Returns a new reference to the cached object, or NULL. */
+static void *
+fs_cache_lookup (SeafFSManagerPriv *priv, int type,
+                 const char *store_id, const char *obj_id)
+{
+    FSCacheShard *shard = fs_cache_get_shard (priv, obj_id);
+    char *key = fs_cache_key (store_id, obj_id);
+    FSCacheEntry *entry;
+    void *obj = NULL;
+
+    pthread_mutex_lock (&shard->lock);
+
+    entry = g_hash_table_lookup (shard->entries, key);
+    /* A file and a dir can't have the same id, unless the store is
+     * corrupted. Don't return an object of the wrong type anyway.
+     */
+    if (entry && entry->type == type) {
+        fs_cache_lru_unlink (shard, entry);
+        fs_cache_lru_push_head (shard, entry);
+        obj = entry->obj;
+        if (type == SEAF_METADATA_TYPE_FILE)
+            seafile_ref ((Seafile *)obj);
+        else
+            seaf_dir_ref ((SeafDir *)obj);
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    g_free (key);
+    return obj;
+}
+
+/* Adds a reference to @obj for the cache. */
+static void
+fs_cache_insert (SeafFSManagerPriv *priv, int type,
+                 const char *store_id, const char *obj_id,
+                 void *obj, gint64 size)
+{
+    FSCacheShard *shard = fs_cache_get_shard (priv, obj_id);
+    FSCacheEntry *entry, *victim;
+    GList *evicted = NULL, *ptr;
+
+    /* Don't let one huge object flush the whole shard. */
+    if (size > priv->cache_shard_capacity / 4)
+        return;
+
+    entry = g_new0 (FSCacheEntry, 1);
+    entry->key = fs_cache_key (store_id, obj_id);
+    entry->type = type;
+    entry->obj = obj;
+    entry->size = size;
+
+    pthread_mutex_lock (&shard->lock);
+
+    /* Another thread may have loaded the same object. */
+    if (g_hash_table_lookup (shard->entries, entry->key)) {
+        pthread_mutex_unlock (&shard->lock);
+        g_free (entry->key);
+        g_free (entry);
+        return;
+    }
+
+    if (type == SEAF_METADATA_TYPE_FILE)
+        seafile_ref ((Seafile *)obj);
+    else
+        seaf_dir_ref ((SeafDir *)obj);
+
+    g_hash_table_insert (shard->entries, entry->key, entry);
+    fs_cache_lru_push_head (shard, entry);
+    shard->size += entry->size;
+
+    while (shard->size > priv->cache_shard_capacity && shard->tail != entry) {
+        victim = shard->tail;
+        fs_cache_lru_unlink (shard, victim);
+        g_hash_table_remove (shard->entries, victim->key);
+        shard->size -= victim->size;
+        evicted = g_list_prepend (evicted, victim);
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    /* Free evicted objects outside of the lock. */
+    for (ptr = evicted; ptr; ptr = ptr->next) {
+        victim = ptr->data;
+        fs_cache_obj_unref (victim->type, victim->obj);
+        g_free (victim->key);
+        g_free (victim);
+    }
+    g_list_free (evicted);
+}
+
+/* Rough estimates of the heap memory used by parsed objects. */
+
+#define ALLOC_OVERHEAD 16
+
+static gint64
+seafile_mem_size (Seafile *seafile)
+{
+    /* Block offsets may be added while the file is cached. */
+    return sizeof(Seafile) + 3 * ALLOC_OVERHEAD +
+        (gint64)seafile->n_blocks * 20 +
+        (gint64)(seafile->n_blocks + 1) * sizeof(guint64);
+}
+
+static gint64
+seaf_dir_mem_size (SeafDir *dir)
+{
+    gint64 size = sizeof(SeafDir) + ALLOC_OVERHEAD + dir->ondisk_size;
+    SeafDirent *dent;
+    GList *ptr;
+
+    /* Cached dirs are looked up by name, so count the sorted index too. */
+    size += sizeof(struct _SeafDirIndex) + ALLOC_OVERHEAD;
+
+    /* Binary dirs keep their names in ondisk. */
+    if (dir->dent_array)
+        return size + g_list_length (dir->entries) *
+            (sizeof(SeafDirent) + sizeof(GList) + sizeof(SeafDirent *)) +
+            2 * ALLOC_OVERHEAD;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        size += sizeof(GList) + sizeof(SeafDirent) + sizeof(SeafDirent *) +
+            dent->name_len + 1 + 3 * ALLOC_OVERHEAD;
+        if (dent->modifier)
+            size += strlen (dent->modifier) + 1 + ALLOC_OVERHEAD;
+    }
+
+    return size;
+}
+
+/*
+ * Path cache. Maps a path relative to a dir to the id and mode of the
+ * object it points to. Since dirs are immutable, the mapping never
+ * changes. Each component of a resolved path is cached under its parent
+ * dir, and a path of several components is also cached as a whole under
+ * the dir it was resolved from, so a warm path takes one lookup.
+ */
+
+static void
+path_cache_init (SeafFSManagerPriv *priv, int capacity)
+{
+    PathCacheShard *shard;
+    int i;
+
+    priv->path_cache = g_new0 (PathCacheShard, PATH_CACHE_SHARDS);
+    priv->path_cache_shard_capacity = MAX (capacity / PATH_CACHE_SHARDS, 1);
+
+    for (i = 0; i < PATH_CACHE_SHARDS; i++) {
+        shard = &priv->path_cache[i];
+        pthread_mutex_init (&shard->lock, NULL);
+        shard->entries = g_hash_table_new (g_str_hash, g_str_equal);
+    }
+}
+
+static char *
+path_cache_key (const char *store_id, const char *dir_id, const char *path)
+{
+    return g_strconcat (store_id, "/", dir_id, "/", path, NULL);
+}
+
+static PathCacheShard *
+path_cache_get_shard (SeafFSManagerPriv *priv, const char *key)
+{
+    return &priv->path_cache[g_str_hash (key) % PATH_CACHE_SHARDS];
+}
+
+/* Called with shard->lock held. */
+static void
+path_cache_lru_unlink (PathCacheShard *shard, PathCacheEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        shard->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        shard->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+/* Called with shard->lock held. */
+static void
+path_cache_lru_push_head (PathCacheShard *shard, PathCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head)
+        shard->head->prev = entry;
+    shard->head = entry;
+    if (!shard->tail)
+        shard->tail = entry;
+}
+
+/* Copies the cached id to @obj_id, which must hold 41 bytes. */
+static gboolean
+path_cache_lookup (SeafFSManagerPriv *priv, const char *store_id,
+                   const char *dir_id, const char *path,
+                   char *obj_id, guint32 *mode)
+{
+    char *key = path_cache_key (store_id, dir_id, path);
+    PathCacheShard *shard = path_cache_get_shard (priv, key);
+    PathCacheEntry *entry;
+
+    pthread_mutex_lock (&shard->lock);
+
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry) {
+        path_cache_lru_unlink (shard, entry);
+        path_cache_lru_push_head (shard, entry);
+        memcpy (obj_id, entry->obj_id, 41);
+        *mode = entry->mode;
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    g_free (key);
+    return (entry != NULL);
+}
+
+/*
+ * Counts one resolved path. It's a hit if no dir object had to be loaded.
+ * The counter shard is picked by @root_id to spread the lock contention.
+ */
+static void
+path_cache_count (SeafFSManagerPriv *priv, const char *root_id, gboolean hit)
+{
+    PathCacheShard *shard;
+
+    shard = &priv->path_cache[g_str_hash (root_id) % PATH_CACHE_SHARDS];
+
+    pthread_mutex_lock (&shard->lock);
+    if (hit)
+        ++shard->hits;
+    else
+        ++shard->misses;
+    pthread_mutex_unlock (&shard->lock);
+}
+
+static void
+path_cache_insert (SeafFSManagerPriv *priv, const char *store_id,
+                   const char *dir_id, const char *path,
+                   const char *obj_id, guint32 mode)
+{
+    PathCacheEntry *entry, *victim = NULL;
+    PathCacheShard *shard;
+
+    entry = g_new0 (PathCacheEntry, 1);
+    entry->key = path_cache_key (store_id, dir_id, path);
+    memcpy (entry->obj_id, obj_id, 40);
+    entry->mode = mode;
+
+    shard = path_cache_get_shard (priv, entry->key);
+
+    pthread_mutex_lock (&shard->lock);
+
+    /* Another thread may have resolved the same path. */
+    if (g_hash_table_lookup (shard->entries, entry->key)) {
+        pthread_mutex_unlock (&shard->lock);
+        g_free (entry->key);
+        g_free (entry);
+        return;
+    }
+
+    g_hash_table_insert (shard->entries, entry->key, entry);
+    path_cache_lru_push_head (shard, entry);
+    ++shard->n_entries;
+
+    if (shard->n_entries > priv->path_cache_shard_capacity) {
+        victim = shard->tail;
+        path_cache_lru_unlink (shard, victim);
+        g_hash_table_remove (shard->entries, victim->key);
+        --shard->n_entries;
+        ++shard->evictions;
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    if (victim) {
+        g_free (victim->key);
+        g_free (victim);
+    }
+}
+
+gboolean
+seaf_fs_manager_get_path_cache_stats (SeafFSManager *mgr,
+                                      PathCacheStats *stats)
+{
+    PathCacheShard *shard;
+    int i;
+
+    if (!mgr->priv->path_cache)
+        return FALSE;
+
+    memset (stats, 0, sizeof(*stats));
+    stats->capacity = (guint64)mgr->priv->path_cache_shard_capacity *
+        PATH_CACHE_SHARDS;
+
+    for (i = 0; i < PATH_CACHE_SHARDS; i++) {
+        shard = &mgr->priv->path_cache[i];
+        pthread_mutex_lock (&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->n_entries += shard->n_entries;
+        pthread_mutex_unlock (&shard->lock);
+    }
+
+    return TRUE;
+}
+
 SeafFSManager *
 seaf_fs_manager_new (SeafileSession *seaf,
                      const char *seaf_dir)
@@ -82,6 +542,43 @@ seaf_fs_manager_new (SeafileSession *seaf,
 
     mgr->priv = g_new0(SeafFSManagerPriv, 1);
 
+    mgr->priv->index_workers = MIN (get_cpu_count (), MAX_INDEX_WORKERS);
+#ifdef SEAFILE_SERVER
+    int workers = g_key_file_get_integer (seaf->config,
+                                          "fileserver", "index_workers",
+                                          NULL);
+    if (workers > 0)
+        mgr->priv->index_workers = workers;
+
+    /* Parsed objects are shared with callers, who must not modify them.
+     * Only the server code has been checked for that, so the cache is
+     * not available to the client.
+     */
+    GError *error = NULL;
+    gint64 cache_size = g_key_file_get_int64 (seaf->config,
+                                              "fs_cache", "size", &error);
+    if (error) {
+        cache_size = DEFAULT_FS_CACHE_SIZE;
+        g_clear_error (&error);
+    }
+    if (cache_size > 0)
+        fs_cache_init (mgr->priv, cache_size * 1024 * 1024);
+
+    /* Max number of cached path lookups, 0 disables the cache. */
+    int path_cache_size = g_key_file_get_integer (seaf->config,
+                                                  "path_cache", "size",
+                                                  &error);
+    if (error) {
+        path_cache_size = DEFAULT_PATH_CACHE_SIZE;
+        g_clear_error (&error);
+    }
+    if (path_cache_size > 0)
+        path_cache_init (mgr->priv, path_cache_size);
+
+    if (mgr->priv->index_workers > 1)
+        mgr->priv->chunk_pool = cdc_worker_pool_new (mgr->priv->index_workers);
+#endif
+
     return mgr;
 }
 
@@ -107,6 +604,12 @@ seaf_fs_manager_init (SeafFSManager *mgr)
         g_warning ("[fs mgr] Failed to init fs object store.\n");
         return -1;
     }
+
+    /* With several index workers, the repo manager already indexes files
+     * in parallel, and each worker chunks its file serially.
+     */
+    if (seaf->index_workers <= 1 && mgr->priv->index_workers > 1)
+        mgr->priv->chunk_pool = cdc_worker_pool_new (mgr->priv->index_workers);
 #endif
 
     return 0;
@@ -238,7 +741,7 @@ seaf_fs_manager_checkout_file (SeafFSManager *mgr,
                                const char *email)
 {
     Seafile *seafile;
-    char *blk_id;
+    char blk_id[41];
     int wfd;
     int i;
     char *tmp_path;
@@ -264,7 +767,7 @@ seaf_fs_manager_checkout_file (SeafFSManager *mgr,
     }
 
     for (i = 0; i < seafile->n_blocks; ++i) {
-        blk_id = seafile->blk_sha1s[i];
+        seafile_get_block_id (seafile, i, blk_id);
         if (checkout_block (repo_id, version, blk_id, wfd, crypt) < 0)
             goto bad;
     }
@@ -349,6 +852,94 @@ bad:
 
 #endif /* SEAFILE_SERVER */
 
+/*
+ * Binary fs objects (version 2). All integers are in network byte order.
+ *
+ *   magic          4 bytes, BINARY_OBJ_MAGIC
+ *   type           u32, SEAF_METADATA_TYPE_FILE or SEAF_METADATA_TYPE_DIR
+ *
+ * Files continue with:
+ *
+ *   file_size      u64
+ *   n_blocks       u32
+ *   block_ids      n_blocks raw 20-byte SHA-1s
+ *
+ * Dirs continue with:
+ *
+ *   n_entries      u32
+ *   offsets        n_entries u32, the offset of each entry from the start
+ *                  of the object, in descending name order
+ *   entries, each:
+ *     mode         u32
+ *     id           raw 20-byte SHA-1
+ *     mtime        u64
+ *     size         u64, 0 for dirs
+ *     name_len     u16
+ *     modifier_len u16, 0 for dirs
+ *     name         name_len bytes and a NUL
+ *     modifier     modifier_len bytes and a NUL, for files only
+ *
+ * Objects are stored uncompressed, and the object id is the SHA-1 of the
+ * whole object. The magic can't start a zlib stream, so binary objects can
+ * be told apart from JSON ones.
+ */
+
+#define BINARY_OBJ_MAGIC "\x89SF2"
+#define BINARY_OBJ_HDR_SIZE 8
+#define BINARY_FILE_HDR_SIZE (BINARY_OBJ_HDR_SIZE + 12)
+#define BINARY_DIR_HDR_SIZE (BINARY_OBJ_HDR_SIZE + 4)
+#define BINARY_DIRENT_HDR_SIZE (4 + 20 + 8 + 8 + 2 + 2)
+
+static gboolean
+is_binary_fs_object (const uint8_t *data, int len)
+{
+    return (len >= BINARY_OBJ_HDR_SIZE &&
+            memcmp (data, BINARY_OBJ_MAGIC, 4) == 0);
+}
+
+static uint8_t *
+put_binary_obj_header (uint8_t *ptr, int type)
+{
+    memcpy (ptr, BINARY_OBJ_MAGIC, 4);
+    ptr += 4;
+    put32bit (&ptr, type);
+    return ptr;
+}
+
+/* Returns the object with its header written. Block ids go to @block_ids. */
+static uint8_t *
+alloc_seafile_v2 (guint64 file_size, guint32 n_blocks,
+                  int *len, uint8_t **block_ids)
+{
+    uint8_t *data, *ptr;
+
+    *len = BINARY_FILE_HDR_SIZE + n_blocks * 20;
+    data = g_new0 (uint8_t, *len);
+
+    ptr = put_binary_obj_header (data, SEAF_METADATA_TYPE_FILE);
+    put64bit (&ptr, file_size);
+    put32bit (&ptr, n_blocks);
+    *block_ids = ptr;
+
+    return data;
+}
+
+static void *
+create_seafile_v2 (CDCFileDescriptor *cdc, int *ondisk_size, char *seafile_id)
+{
+    uint8_t *data, *block_ids;
+    unsigned char sha1[20];
+
+    data = alloc_seafile_v2 (cdc->file_size, cdc->block_nr,
+                             ondisk_size, &block_ids);
+    memcpy (block_ids, cdc->blk_sha1s, cdc->block_nr * 20);
+
+    calculate_sha1 (sha1, (const char *)data, *ondisk_size);
+    rawdata_to_hex (sha1, seafile_id, 20);
+
+    return data;
+}
+
 static void *
 create_seafile_v0 (CDCFileDescriptor *cdc, int *ondisk_size, char *seafile_id)
 {
@@ -412,6 +1003,15 @@ seaf_fs_manager_calculate_seafile_id_json (int repo_version,
 {
     json_t *object, *block_id_array;
 
+    if (seafile_version_from_repo_version (repo_version) >= BINARY_FS_OBJ_VERSION) {
+        char seafile_id[41];
+        int len;
+
+        g_free (create_seafile_v2 (cdc, &len, seafile_id));
+        hex_to_rawdata (seafile_id, file_id_sha1, 20);
+        return;
+    }
+
     object = json_object ();
 
     json_object_set_int_member (object, "type", SEAF_METADATA_TYPE_FILE);
@@ -453,7 +1053,14 @@ write_seafile (SeafFSManager *fs_mgr,
     void *ondisk;
     int ondisk_size;
 
-    if (version > 0) {
+    if (seafile_version_from_repo_version (version) >= BINARY_FS_OBJ_VERSION) {
+        ondisk = create_seafile_v2 (cdc, &ondisk_size, seafile_id);
+
+        if (seaf_obj_store_write_obj (fs_mgr->obj_store, repo_id, version, seafile_id,
+                                      ondisk, ondisk_size, FALSE) < 0)
+            ret = -1;
+        g_free (ondisk);
+    } else if (version > 0) {
         ondisk = create_seafile_json (version, cdc, &ondisk_size, seafile_id);
 
         guint8 *compressed;
@@ -586,9 +1193,15 @@ seafile_write_chunk (const char *repo_id,
         g_free (encrypted_buf);
     } else {
         /* not a encrypted repo, go ahead */
-        SHA1_Init (&ctx);
-        SHA1_Update (&ctx, chunk->block_buf, chunk->len);
-        SHA1_Final (checksum, &ctx);
+        if (chunk->has_checksum) {
+            /* Already hashed in a batch by the chunker. */
+            if (checksum != chunk->checksum)
+                memcpy (checksum, chunk->checksum, 20);
+        } else {
+            SHA1_Init (&ctx);
+            SHA1_Update (&ctx, chunk->block_buf, chunk->len);
+            SHA1_Final (checksum, &ctx);
+        }
 
         if (write_data)
             ret = do_write_chunk (repo_id, version, checksum, chunk->block_buf, chunk->len);
@@ -635,6 +1248,18 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
         cdc.write_block = seafile_write_chunk;
         memcpy (cdc.repo_id, repo_id, 36);
         cdc.version = version;
+        cdc.engine = cdc_engine_for_repo_version (version);
+        if (sb.st_size >= PIPELINE_MIN_FILE_SIZE && mgr->priv->chunk_pool) {
+            cdc.n_workers = mgr->priv->index_workers;
+            cdc.worker_pool = mgr->priv->chunk_pool;
+        }
+#ifdef SEAFILE_SERVER
+        /* Files indexed on the server are uploaded temp files that are not
+         * modified while chunking. Worktree files on the client may be
+         * truncated under us, so the client uses read mode.
+         */
+        cdc.use_mmap = TRUE;
+#endif
         if (filename_chunk_cdc (file_path, &cdc, crypt, write_data) < 0) {
             g_warning ("Failed to chunk file with CDC.\n");
             return -1;
@@ -654,43 +1279,57 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
     return 0;
 }
 
+/*
+ * Check that the content of each block file matches its id and write it
+ * into the block store. The blocks are hashed together in parallel lanes.
+ */
 static int
-check_and_write_block (const char *repo_id, int version,
-                       const char *path, unsigned char *sha1, const char *block_id)
-{
-    char *content;
+check_and_write_blocks (const char *repo_id, int version,
+                        int n, char **paths, unsigned char *sha1s,
+                        char **block_ids)
+{
+    const unsigned char *contents[SHA1_MB_LANES];
+    size_t lens[SHA1_MB_LANES];
+    unsigned char checksums[SHA1_MB_LANES * 20];
+    char *content = NULL;
     gsize len;
     GError *error = NULL;
+    int i, n_read = 0;
     int ret = 0;
 
-    if (!g_file_get_contents (path, &content, &len, &error)) {
-        if (error) {
-            seaf_warning ("Failed to read %s: %s.\n", path, error->message);
+    for (i = 0; i < n; ++i) {
+        content = NULL;
+        if (!g_file_get_contents (paths[i], &content, &len, &error)) {
+            seaf_warning ("Failed to read %s: %s.\n", paths[i],
+                          error ? error->message : "unknown error");
             g_clear_error (&error);
-            return -1;
+            ret = -1;
+            goto out;
         }
+        contents[i] = (const unsigned char *)content;
+        lens[i] = len;
+        ++n_read;
     }
 
-    SHA_CTX block_ctx;
-    unsigned char checksum[20];
-
-    SHA1_Init (&block_ctx);
-    SHA1_Update (&block_ctx, content, len);
-    SHA1_Final (checksum, &block_ctx);
+    sha1_mb_digest (n, contents, lens, checksums);
 
-    if (memcmp (checksum, sha1, 20) != 0) {
-        seaf_warning ("Block id %s doesn't match content.\n", block_id);
-        ret = -1;
-        goto out;
-    }
+    for (i = 0; i < n; ++i) {
+        if (memcmp (checksums + i * 20, sha1s + i * 20, 20) != 0) {
+            seaf_warning ("Block id %s doesn't match content.\n", block_ids[i]);
+            ret = -1;
+            goto out;
+        }
 
-    if (do_write_chunk (repo_id, version, sha1, content, len) < 0) {
-        ret = -1;
-        goto out;
+        if (do_write_chunk (repo_id, version, sha1s + i * 20,
+                            (const char *)contents[i], lens[i]) < 0) {
+            ret = -1;
+            goto out;
+        }
     }
 
 out:
-    g_free (content);
+    for (i = 0; i < n_read; ++i)
+        g_free ((char *)contents[i]);
     return ret;
 }
 
@@ -699,24 +1338,34 @@ check_and_write_file_blocks (CDCFileDescriptor *cdc, GList *paths, GList *blocki
 {
     GList *ptr, *q;
     SHA_CTX file_ctx;
+    char *batch_paths[SHA1_MB_LANES];
+    char *batch_ids[SHA1_MB_LANES];
+    int n_batch = 0;
     int ret = 0;
 
     SHA1_Init (&file_ctx);
     for (ptr = paths, q = blockids; ptr; ptr = ptr->next, q = q->next) {
         char *path = ptr->data;
         char *blk_id = q->data;
-        unsigned char sha1[20];
+        unsigned char *sha1 = cdc->blk_sha1s + cdc->block_nr * CHECKSUM_LENGTH;
 
         hex_to_rawdata (blk_id, sha1, 20);
-        ret = check_and_write_block (cdc->repo_id, cdc->version, path, sha1, blk_id);
-        if (ret < 0)
-            goto out;
-
-        memcpy (cdc->blk_sha1s + cdc->block_nr * CHECKSUM_LENGTH,
-                sha1, CHECKSUM_LENGTH);
         cdc->block_nr++;
-
         SHA1_Update (&file_ctx, sha1, 20);
+
+        batch_paths[n_batch] = path;
+        batch_ids[n_batch] = blk_id;
+        if (++n_batch < SHA1_MB_LANES && ptr->next)
+            continue;
+
+        ret = check_and_write_blocks (cdc->repo_id, cdc->version, n_batch,
+                                      batch_paths,
+                                      cdc->blk_sha1s +
+                                      (cdc->block_nr - n_batch) * CHECKSUM_LENGTH,
+                                      batch_ids);
+        n_batch = 0;
+        if (ret < 0)
+            goto out;
     }
 
     SHA1_Final (cdc->file_sum, &file_ctx);
@@ -793,20 +1442,14 @@ out:
 void
 seafile_ref (Seafile *seafile)
 {
-    ++seafile->ref_count;
+    g_atomic_int_inc (&seafile->ref_count);
 }
 
 static void
 seafile_free (Seafile *seafile)
 {
-    int i;
-
-    if (seafile->blk_sha1s) {
-        for (i = 0; i < seafile->n_blocks; ++i)
-            g_free (seafile->blk_sha1s[i]);
-        g_free (seafile->blk_sha1s);
-    }
-
+    g_free (seafile->blk_ids);
+    g_free (seafile->blk_offsets);
     g_free (seafile);
 }
 
@@ -816,10 +1459,73 @@ seafile_unref (Seafile *seafile)
     if (!seafile)
         return;
 
-    if (--seafile->ref_count <= 0)
+    if (g_atomic_int_dec_and_test (&seafile->ref_count))
         seafile_free (seafile);
 }
 
+char *
+seafile_get_block_id (Seafile *file, int i, char *block_id)
+{
+    rawdata_to_hex (file->blk_ids + i * 20, block_id, 20);
+    return block_id;
+}
+
+const guint64 *
+seafile_get_block_offsets (Seafile *file, const char *store_id, int version)
+{
+    guint64 *offsets;
+    BlockMetadata *bmd;
+    char block_id[41];
+    int i;
+
+    offsets = g_atomic_pointer_get (&file->blk_offsets);
+    if (offsets)
+        return offsets;
+
+    offsets = g_new (guint64, file->n_blocks + 1);
+    offsets[0] = 0;
+    for (i = 0; i < file->n_blocks; ++i) {
+        seafile_get_block_id (file, i, block_id);
+        bmd = seaf_block_manager_stat_block (seaf->block_mgr,
+                                             store_id, version, block_id);
+        if (!bmd) {
+            seaf_warning ("Failed to stat block %s:%s.\n", store_id, block_id);
+            g_free (offsets);
+            return NULL;
+        }
+        offsets[i + 1] = offsets[i] + bmd->size;
+        g_free (bmd);
+    }
+
+    /* The file may be cached and shared with other threads. */
+    if (!g_atomic_pointer_compare_and_exchange (&file->blk_offsets,
+                                                NULL, offsets)) {
+        g_free (offsets);
+        offsets = g_atomic_pointer_get (&file->blk_offsets);
+    }
+
+    return offsets;
+}
+
+int
+seafile_find_block (Seafile *file, const guint64 *offsets, guint64 offset)
+{
+    int low = 0, high = (int)file->n_blocks - 1, mid;
+
+    if (file->n_blocks == 0 || offset >= offsets[file->n_blocks])
+        return -1;
+
+    while (low < high) {
+        mid = low + (high - low + 1) / 2;
+        if (offsets[mid] <= offset)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    return low;
+}
+
 static Seafile *
 seafile_from_v0_data (const char *id, const void *data, int len)
 {
@@ -852,16 +1558,47 @@ seafile_from_v0_data (const char *id, const void *data, int len)
     seafile->file_size = ntoh64 (ondisk->file_size);
     seafile->n_blocks = n_blocks;
 
-    seafile->blk_sha1s = g_new0 (char*, seafile->n_blocks);
-    const unsigned char *blk_sha1_ptr = ondisk->block_ids;
-    int i;
-    for (i = 0; i < seafile->n_blocks; ++i) {
-        char *blk_sha1 = g_new0 (char, 41);
-        seafile->blk_sha1s[i] = blk_sha1;
-        rawdata_to_hex (blk_sha1_ptr, blk_sha1, 20);
-        blk_sha1_ptr += 20;
+    seafile->blk_ids = g_memdup (ondisk->block_ids, id_list_len);
+
+    seafile->ref_count = 1;
+    return seafile;
+}
+
+static Seafile *
+seafile_from_v2_data (const char *id, const uint8_t *data, int len)
+{
+    const uint8_t *ptr = data + 4;
+    Seafile *seafile;
+    guint64 file_size;
+    guint32 n_blocks;
+
+    if (len < BINARY_FILE_HDR_SIZE) {
+        seaf_warning ("[fs mgr] Corrupt seafile object %s.\n", id);
+        return NULL;
+    }
+
+    if (get32bit (&ptr) != SEAF_METADATA_TYPE_FILE) {
+        seaf_warning ("[fs mgr] %s is not a file.\n", id);
+        return NULL;
+    }
+
+    file_size = get64bit (&ptr);
+    n_blocks = get32bit (&ptr);
+    if ((guint64)(len - BINARY_FILE_HDR_SIZE) != (guint64)n_blocks * 20) {
+        seaf_warning ("[fs mgr] Corrupt seafile object %s.\n", id);
+        return NULL;
     }
 
+    seafile = g_new0 (Seafile, 1);
+
+    seafile->object.type = SEAF_METADATA_TYPE_FILE;
+    seafile->version = BINARY_FS_OBJ_VERSION;
+    memcpy (seafile->file_id, id, 40);
+    seafile->file_size = file_size;
+    seafile->n_blocks = n_blocks;
+
+    seafile->blk_ids = g_memdup (ptr, n_blocks * 20);
+
     seafile->ref_count = 1;
     return seafile;
 }
@@ -905,7 +1642,7 @@ seafile_from_json_object (const char *id, json_t *object)
     seafile->version = version;
     seafile->file_size = file_size;
     seafile->n_blocks = json_array_size (block_id_array);
-    seafile->blk_sha1s = g_new0 (char *, seafile->n_blocks);
+    seafile->blk_ids = g_new0 (guint8, seafile->n_blocks * 20);
 
     int i;
     json_t *block_id_obj;
@@ -913,11 +1650,12 @@ seafile_from_json_object (const char *id, json_t *object)
     for (i = 0; i < seafile->n_blocks; ++i) {
         block_id_obj = json_array_get (block_id_array, i);
         block_id = json_string_value (block_id_obj);
-        if (!block_id) {
+        if (!block_id || strlen (block_id) != 40 ||
+            hex_to_rawdata (block_id, seafile->blk_ids + i * 20, 20) < 0) {
+            seaf_warning ("Invalid block id in seafile object %s.\n", id);
             seafile_free (seafile);
             return NULL;
         }
-        seafile->blk_sha1s[i] = g_strdup(block_id);
     }
 
     seafile->ref_count = 1;
@@ -958,7 +1696,9 @@ seafile_from_json (const char *id, void *data, int len)
 static Seafile *
 seafile_from_data (const char *id, void *data, int len, gboolean is_json)
 {
-    if (is_json)
+    if (is_json && is_binary_fs_object (data, len))
+        return seafile_from_v2_data (id, data, len);
+    else if (is_json)
         return seafile_from_json (id, data, len);
     else
         return seafile_from_v0_data (id, data, len);
@@ -974,14 +1714,6 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr,
     int len;
     Seafile *seafile;
 
-#if 0
-    seafile = g_hash_table_lookup (mgr->priv->seafile_cache, file_id);
-    if (seafile) {
-        seafile_ref (seafile);
-        return seafile;
-    }
-#endif
-
     if (memcmp (file_id, EMPTY_SHA1, 40) == 0) {
         seafile = g_new0 (Seafile, 1);
         memset (seafile->file_id, '0', 40);
@@ -989,6 +1721,13 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr,
         return seafile;
     }
 
+    if (mgr->priv->cache) {
+        seafile = fs_cache_lookup (mgr->priv, SEAF_METADATA_TYPE_FILE,
+                                   repo_id, file_id);
+        if (seafile)
+            return seafile;
+    }
+
     if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
                                  file_id, &data, &len) < 0) {
         g_warning ("[fs mgr] Failed to read file %s.\n", file_id);
@@ -998,13 +1737,10 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr,
     seafile = seafile_from_data (file_id, data, len, (version > 0));
     g_free (data);
 
-#if 0
-    /*
-     * Add to cache. Also increase ref count.
-     */
-    seafile_ref (seafile);
-    g_hash_table_insert (mgr->priv->seafile_cache, g_strdup(file_id), seafile);
-#endif
+    if (seafile && mgr->priv->cache)
+        fs_cache_insert (mgr->priv, SEAF_METADATA_TYPE_FILE,
+                         repo_id, file_id,
+                         seafile, seafile_mem_size (seafile));
 
     return seafile;
 }
@@ -1020,12 +1756,7 @@ seafile_to_v0_data (Seafile *file, int *len)
     ondisk->type = htonl(SEAF_METADATA_TYPE_FILE);
     ondisk->file_size = hton64 (file->file_size);
 
-    guint8 *ptr = ondisk->block_ids;
-    int i;
-    for (i = 0; i < file->n_blocks; ++i) {
-        hex_to_rawdata (file->blk_sha1s[i], ptr, 20);
-        ptr += 20;
-    }
+    memcpy (ondisk->block_ids, file->blk_ids, file->n_blocks * 20);
 
     return (guint8 *)ondisk;
 }
@@ -1044,8 +1775,10 @@ seafile_to_json (Seafile *file, int *len)
 
     block_id_array = json_array ();
     int i;
+    char block_id[41];
     for (i = 0; i < file->n_blocks; ++i) {
-        json_array_append_new (block_id_array, json_string(file->blk_sha1s[i]));
+        seafile_get_block_id (file, i, block_id);
+        json_array_append_new (block_id_array, json_string(block_id));
     }
     json_object_set_new (object, "block_ids", block_id_array);
 
@@ -1061,9 +1794,26 @@ seafile_to_json (Seafile *file, int *len)
 }
 
 static guint8 *
+seafile_to_v2_data (Seafile *file, int *len)
+{
+    uint8_t *data, *block_ids;
+    unsigned char sha1[20];
+
+    data = alloc_seafile_v2 (file->file_size, file->n_blocks, len, &block_ids);
+    memcpy (block_ids, file->blk_ids, file->n_blocks * 20);
+
+    calculate_sha1 (sha1, (const char *)data, *len);
+    rawdata_to_hex (sha1, file->file_id, 20);
+
+    return data;
+}
+
+void *
 seafile_to_data (Seafile *file, int *len)
 {
-    if (file->version > 0) {
+    if (file->version >= BINARY_FS_OBJ_VERSION)
+        return seafile_to_v2_data (file, len);
+    else if (file->version > 0) {
         guint8 *data;
         int orig_len;
         guint8 *compressed;
@@ -1143,6 +1893,7 @@ seaf_dir_new (const char *id, GList *entries, int version)
 
     dir = g_new0(SeafDir, 1);
 
+    dir->ref_count = 1;
     dir->version = version;
     if (id != NULL) {
         memcpy(dir->dir_id, id, 40);
@@ -1160,21 +1911,62 @@ seaf_dir_new (const char *id, GList *entries, int version)
     return dir;
 }
 
+void
+seaf_dir_ref (SeafDir *dir)
+{
+    g_atomic_int_inc (&dir->ref_count);
+}
+
 void
 seaf_dir_free (SeafDir *dir)
 {
-    if (dir == NULL)
-        return;
+    if (dir == NULL)
+        return;
+
+    if (!g_atomic_int_dec_and_test (&dir->ref_count))
+        return;
+
+    if (dir->dent_array) {
+        g_free (dir->link_array);
+        g_free (dir->dent_array);
+    } else {
+        GList *ptr = dir->entries;
+        while (ptr) {
+            seaf_dirent_free ((SeafDirent *)ptr->data);
+            ptr = ptr->next;
+        }
+
+        g_list_free (dir->entries);
+    }
+    g_free (dir->index);
+    g_free (dir->ondisk);
+    g_free(dir);
+}
+
+SeafDir *
+seaf_dir_dup (SeafDir *dir)
+{
+    SeafDir *new_dir;
+    GList *ptr;
+
+    new_dir = g_new0 (SeafDir, 1);
+    new_dir->object.type = dir->object.type;
+    new_dir->version = dir->version;
+    memcpy (new_dir->dir_id, dir->dir_id, 41);
 
-    GList *ptr = dir->entries;
-    while (ptr) {
-        seaf_dirent_free ((SeafDirent *)ptr->data);
-        ptr = ptr->next;
+    for (ptr = dir->entries; ptr; ptr = ptr->next)
+        new_dir->entries = g_list_prepend (new_dir->entries,
+                                           seaf_dirent_dup (ptr->data));
+    new_dir->entries = g_list_reverse (new_dir->entries);
+
+    if (dir->ondisk) {
+        new_dir->ondisk = g_memdup (dir->ondisk, dir->ondisk_size);
+        new_dir->ondisk_size = dir->ondisk_size;
     }
 
-    g_list_free (dir->entries);
-    g_free (dir->ondisk);
-    g_free(dir);
+    new_dir->ref_count = 1;
+
+    return new_dir;
 }
 
 SeafDirent *
@@ -1250,6 +2042,7 @@ seaf_dir_from_v0_data (const char *dir_id, const uint8_t *data, int len)
     root->version = 0;
     memcpy(root->dir_id, dir_id, 40);
     root->dir_id[40] = '\0';
+    root->ref_count = 1;
 
     dirent_base_size = 2 * sizeof(guint32) + 40;
     while (remain > dirent_base_size) {
@@ -1285,6 +2078,104 @@ bad:
     return NULL;
 }
 
+/*
+ * Parse a binary dir. With @take_data the dir keeps @data on success,
+ * otherwise it keeps a copy.
+ */
+static SeafDir *
+seaf_dir_from_v2_data (const char *dir_id, uint8_t *data, int len,
+                       gboolean take_data)
+{
+    const uint8_t *ptr = data + 4, *offsets, *p;
+    SeafDir *dir;
+    SeafDirent *dent;
+    uint8_t *buf;
+    guint32 n_entries, i;
+    gint64 off, need;
+    guint16 name_len, modifier_len;
+
+    if (len < BINARY_DIR_HDR_SIZE) {
+        seaf_warning ("Corrupt dir object %s.\n", dir_id);
+        return NULL;
+    }
+
+    if (get32bit (&ptr) != SEAF_METADATA_TYPE_DIR) {
+        seaf_warning ("Object %s is not a dir.\n", dir_id);
+        return NULL;
+    }
+
+    n_entries = get32bit (&ptr);
+    if (n_entries > (guint32)(len - BINARY_DIR_HDR_SIZE) / 4) {
+        seaf_warning ("Corrupt dir object %s.\n", dir_id);
+        return NULL;
+    }
+
+    buf = take_data ? data : g_memdup (data, len);
+
+    dir = g_new0 (SeafDir, 1);
+    dir->object.type = SEAF_METADATA_TYPE_DIR;
+    dir->version = BINARY_FS_OBJ_VERSION;
+    memcpy (dir->dir_id, dir_id, 40);
+    dir->ondisk = buf;
+    dir->ondisk_size = len;
+    dir->ref_count = 1;
+
+    if (n_entries == 0)
+        return dir;
+
+    dir->dent_array = g_new0 (SeafDirent, n_entries);
+    dir->link_array = g_new0 (GList, n_entries);
+
+    offsets = buf + BINARY_DIR_HDR_SIZE;
+    for (i = 0; i < n_entries; ++i) {
+        off = get32bit (&offsets);
+        if (off < BINARY_DIR_HDR_SIZE + (gint64)n_entries * 4 ||
+            off + BINARY_DIRENT_HDR_SIZE > len)
+            goto bad;
+
+        p = buf + off;
+        dent = &dir->dent_array[i];
+        dent->version = BINARY_FS_OBJ_VERSION;
+        dent->mode = get32bit (&p);
+        rawdata_to_hex (p, dent->id, 20);
+        p += 20;
+        dent->mtime = (gint64)get64bit (&p);
+        dent->size = (gint64)get64bit (&p);
+        name_len = get16bit (&p);
+        modifier_len = get16bit (&p);
+
+        need = name_len + 1;
+        if (S_ISREG(dent->mode))
+            need += modifier_len + 1;
+        if (off + BINARY_DIRENT_HDR_SIZE + need > len || p[name_len] != '\0')
+            goto bad;
+
+        dent->name = (char *)p;
+        dent->name_len = name_len;
+        if (S_ISREG(dent->mode)) {
+            dent->modifier = (char *)p + name_len + 1;
+            if (dent->modifier[modifier_len] != '\0')
+                goto bad;
+        }
+
+        dir->link_array[i].data = dent;
+        if (i > 0) {
+            dir->link_array[i].prev = &dir->link_array[i - 1];
+            dir->link_array[i - 1].next = &dir->link_array[i];
+        }
+    }
+    dir->entries = dir->link_array;
+
+    return dir;
+
+bad:
+    seaf_warning ("Corrupt dir object %s.\n", dir_id);
+    if (take_data)
+        dir->ondisk = NULL;
+    seaf_dir_free (dir);
+    return NULL;
+}
+
 static SeafDirent *
 parse_dirent (const char *dir_id, int version, json_t *object)
 {
@@ -1368,6 +2259,7 @@ seaf_dir_from_json_object (const char *dir_id, json_t *object)
 
     memcpy (dir->dir_id, dir_id, 40);
     dir->version = version;
+    dir->ref_count = 1;
 
     size_t n_dirents = json_array_size (dirent_array);
     int i;
@@ -1421,7 +2313,9 @@ SeafDir *
 seaf_dir_from_data (const char *dir_id, uint8_t *data, int len,
                     gboolean is_json)
 {
-    if (is_json)
+    if (is_json && is_binary_fs_object (data, len))
+        return seaf_dir_from_v2_data (dir_id, data, len, FALSE);
+    else if (is_json)
         return seaf_dir_from_json (dir_id, data, len);
     else
         return seaf_dir_from_v0_data (dir_id, data, len);
@@ -1469,6 +2363,66 @@ seaf_dir_to_v0_data (SeafDir *dir, int *len)
     return (void *)ondisk;
 }
 
+static void *
+seaf_dir_to_v2_data (SeafDir *dir, int *len)
+{
+    int n_entries = 0, size = BINARY_DIR_HDR_SIZE;
+    uint8_t *data, *ptr, *offsets;
+    int modifier_len;
+    unsigned char sha1[20];
+    SeafDirent *dent;
+    GList *p;
+
+    for (p = dir->entries; p; p = p->next) {
+        dent = p->data;
+        if (dent->name_len > G_MAXUINT16) {
+            seaf_warning ("Name of %s is too long.\n", dent->id);
+            return NULL;
+        }
+        size += 4 + BINARY_DIRENT_HDR_SIZE + dent->name_len + 1;
+        if (S_ISREG(dent->mode))
+            size += (dent->modifier ? strlen(dent->modifier) : 0) + 1;
+        ++n_entries;
+    }
+
+    data = g_new0 (uint8_t, size);
+
+    ptr = put_binary_obj_header (data, SEAF_METADATA_TYPE_DIR);
+    put32bit (&ptr, n_entries);
+    offsets = ptr;
+    ptr += n_entries * 4;
+
+    for (p = dir->entries; p; p = p->next) {
+        dent = p->data;
+        put32bit (&offsets, ptr - data);
+
+        modifier_len = 0;
+        if (S_ISREG(dent->mode) && dent->modifier)
+            modifier_len = MIN (strlen(dent->modifier), G_MAXUINT16);
+
+        put32bit (&ptr, dent->mode);
+        hex_to_rawdata (dent->id, ptr, 20);
+        ptr += 20;
+        put64bit (&ptr, dent->mtime);
+        put64bit (&ptr, S_ISREG(dent->mode) ? dent->size : 0);
+        put16bit (&ptr, dent->name_len);
+        put16bit (&ptr, modifier_len);
+        memcpy (ptr, dent->name, dent->name_len);
+        ptr += dent->name_len + 1;
+        if (S_ISREG(dent->mode)) {
+            memcpy (ptr, dent->modifier, modifier_len);
+            ptr += modifier_len + 1;
+        }
+    }
+
+    *len = ptr - data;
+
+    calculate_sha1 (sha1, (const char *)data, *len);
+    rawdata_to_hex (sha1, dir->dir_id, 20);
+
+    return data;
+}
+
 static void
 add_to_dirent_array (json_t *array, SeafDirent *dirent)
 {
@@ -1521,7 +2475,9 @@ seaf_dir_to_json (SeafDir *dir, int *len)
 void *
 seaf_dir_to_data (SeafDir *dir, int *len)
 {
-    if (dir->version > 0) {
+    if (dir->version >= BINARY_FS_OBJ_VERSION)
+        return seaf_dir_to_v2_data (dir, len);
+    else if (dir->version > 0) {
         guint8 *data;
         int orig_len;
         guint8 *compressed;
@@ -1571,22 +2527,40 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
     int len;
     SeafDir *dir;
 
-    /* TODO: add hash cache */
-
     if (memcmp (dir_id, EMPTY_SHA1, 40) == 0) {
         dir = g_new0 (SeafDir, 1);
         memset (dir->dir_id, '0', 40);
+        dir->ref_count = 1;
         return dir;
     }
 
+    if (mgr->priv->cache) {
+        dir = fs_cache_lookup (mgr->priv, SEAF_METADATA_TYPE_DIR,
+                               repo_id, dir_id);
+        if (dir)
+            return dir;
+    }
+
     if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
                                  dir_id, &data, &len) < 0) {
         g_warning ("[fs mgr] Failed to read dir %s.\n", dir_id);
         return NULL;
     }
 
-    dir = seaf_dir_from_data (dir_id, data, len, (version > 0));
-    g_free (data);
+    if (version > 0 && is_binary_fs_object (data, len)) {
+        /* The dir keeps the data, entry names point into it. */
+        dir = seaf_dir_from_v2_data (dir_id, data, len, TRUE);
+        if (!dir)
+            g_free (data);
+    } else {
+        dir = seaf_dir_from_data (dir_id, data, len, (version > 0));
+        g_free (data);
+    }
+
+    if (dir && mgr->priv->cache)
+        fs_cache_insert (mgr->priv, SEAF_METADATA_TYPE_DIR,
+                         repo_id, dir_id,
+                         dir, seaf_dir_mem_size (dir));
 
     return dir;
 }
@@ -1622,6 +2596,101 @@ is_dirents_sorted (GList *dirents)
     return ret;
 }
 
+static int
+compare_dirent_ptrs (const void *a, const void *b)
+{
+    const SeafDirent *denta = *(SeafDirent **)a, *dentb = *(SeafDirent **)b;
+
+    return strcmp (denta->name, dentb->name);
+}
+
+static struct _SeafDirIndex *
+build_dir_index (SeafDir *dir)
+{
+    struct _SeafDirIndex *index;
+    GList *ptr;
+    int n = g_list_length (dir->entries), i;
+
+    index = g_malloc (sizeof(struct _SeafDirIndex) + n * sizeof(SeafDirent *));
+    index->n_entries = n;
+
+    /* Entries are normally stored in descending order, so fill them in
+     * backwards. Some very old dirs need sorting.
+     */
+    if (is_dirents_sorted (dir->entries)) {
+        for (ptr = dir->entries, i = n - 1; ptr; ptr = ptr->next, --i)
+            index->dents[i] = ptr->data;
+    } else {
+        for (ptr = dir->entries, i = 0; ptr; ptr = ptr->next, ++i)
+            index->dents[i] = ptr->data;
+        qsort (index->dents, n, sizeof(SeafDirent *), compare_dirent_ptrs);
+    }
+
+    return index;
+}
+
+static struct _SeafDirIndex *
+get_dir_index (SeafDir *dir)
+{
+    struct _SeafDirIndex *index;
+
+    index = g_atomic_pointer_get (&dir->index);
+    if (index)
+        return index;
+
+    /* Cached dirs are shared between threads. If another thread got
+     * there first, use its index.
+     */
+    index = build_dir_index (dir);
+    if (!g_atomic_pointer_compare_and_exchange (&dir->index, NULL, index)) {
+        g_free (index);
+        index = g_atomic_pointer_get (&dir->index);
+    }
+
+    return index;
+}
+
+SeafDirent *
+seaf_dir_lookup (SeafDir *dir, const char *name)
+{
+    struct _SeafDirIndex *index = get_dir_index (dir);
+    int low = 0, high = index->n_entries - 1, mid, cmp;
+
+    while (low <= high) {
+        mid = low + (high - low) / 2;
+        cmp = strcmp (index->dents[mid]->name, name);
+        if (cmp == 0)
+            return index->dents[mid];
+        else if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+
+    return NULL;
+}
+
+SeafDirent **
+seaf_dir_get_sorted_entries (SeafDir *dir, int *n_entries)
+{
+    struct _SeafDirIndex *index = get_dir_index (dir);
+
+    *n_entries = index->n_entries;
+    return index->dents;
+}
+
+/* Dirs may be shared, so sort a private copy. Takes over @dir. */
+static SeafDir *
+sort_seafdir_copy (SeafDir *dir)
+{
+    SeafDir *sorted = seaf_dir_dup (dir);
+
+    seaf_dir_free (dir);
+    sorted->entries = g_list_sort (sorted->entries, compare_dirents);
+
+    return sorted;
+}
+
 SeafDir *
 seaf_fs_manager_get_seafdir_sorted (SeafFSManager *mgr,
                                     const char *repo_id,
@@ -1638,7 +2707,7 @@ seaf_fs_manager_get_seafdir_sorted (SeafFSManager *mgr,
         return dir;
 
     if (!is_dirents_sorted (dir->entries))
-        dir->entries = g_list_sort (dir->entries, compare_dirents);
+        dir = sort_seafdir_copy (dir);
 
     return dir;
 }
@@ -1662,7 +2731,7 @@ seaf_fs_manager_get_seafdir_sorted_by_path (SeafFSManager *mgr,
         return dir;
 
     if (!is_dirents_sorted (dir->entries))
-        dir->entries = g_list_sort (dir->entries, compare_dirents);
+        dir = sort_seafdir_copy (dir);
 
     return dir;
 }
@@ -1712,7 +2781,10 @@ int
 seaf_metadata_type_from_data (const char *obj_id,
                               uint8_t *data, int len, gboolean is_json)
 {
-    if (is_json)
+    if (is_json && is_binary_fs_object (data, len)) {
+        const uint8_t *ptr = data + 4;
+        return (int)get32bit (&ptr);
+    } else if (is_json)
         return parse_metadata_type_json (obj_id, data, len);
     else
         return parse_metadata_type_v0 (data, len);
@@ -1775,12 +2847,30 @@ fs_object_from_json (const char *obj_id, uint8_t *data, int len)
     return fs_obj;
 }
 
+static SeafFSObject *
+fs_object_from_v2_data (const char *obj_id, uint8_t *data, int len)
+{
+    const uint8_t *ptr = data + 4;
+    int type = (int)get32bit (&ptr);
+
+    if (type == SEAF_METADATA_TYPE_FILE)
+        return (SeafFSObject *)seafile_from_v2_data (obj_id, data, len);
+    else if (type == SEAF_METADATA_TYPE_DIR)
+        return (SeafFSObject *)seaf_dir_from_v2_data (obj_id, data, len, FALSE);
+    else {
+        seaf_warning ("Invalid fs type %d.\n", type);
+        return NULL;
+    }
+}
+
 SeafFSObject *
 seaf_fs_object_from_data (const char *obj_id,
                           uint8_t *data, int len,
                           gboolean is_json)
 {
-    if (is_json)
+    if (is_json && is_binary_fs_object (data, len))
+        return fs_object_from_v2_data (obj_id, data, len);
+    else if (is_json)
         return fs_object_from_json (obj_id, data, len);
     else
         return fs_object_from_v0_data (obj_id, data, len);
@@ -2031,6 +3121,7 @@ fill_blocklist (SeafFSManager *mgr,
 {
     BlockList *bl = user_data;
     Seafile *seafile;
+    char block_id[41];
     int i;
 
     if (type == SEAF_METADATA_TYPE_FILE) {
@@ -2041,7 +3132,7 @@ fill_blocklist (SeafFSManager *mgr,
         }
 
         for (i = 0; i < seafile->n_blocks; ++i)
-            block_list_insert (bl, seafile->blk_sha1s[i]);
+            block_list_insert (bl, seafile_get_block_id (seafile, i, block_id));
 
         seafile_unref (seafile);
     }
@@ -2074,6 +3165,29 @@ seaf_fs_manager_object_exists (SeafFSManager *mgr,
     return seaf_obj_store_obj_exists (mgr->obj_store, repo_id, version, id);
 }
 
+int
+seaf_fs_manager_objects_exist (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               int n,
+                               const char **ids,
+                               gboolean *results)
+{
+    int i;
+
+    if (seaf_obj_store_objs_exist (mgr->obj_store, repo_id, version,
+                                   n, ids, results) < 0)
+        return -1;
+
+    /* Empty file and dir always exists. */
+    for (i = 0; i < n; i++) {
+        if (!results[i] && memcmp (ids[i], EMPTY_SHA1, 40) == 0)
+            results[i] = TRUE;
+    }
+
+    return 0;
+}
+
 void
 seaf_fs_manager_delete_object (SeafFSManager *mgr,
                                const char *repo_id,
@@ -2202,60 +3316,142 @@ seaf_fs_manager_count_fs_files (SeafFSManager *mgr,
      return count_dir_files (mgr, repo_id, version, root_id);
 }
 
-SeafDir *
-seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
-                                     const char *repo_id,
-                                     int version,
-                                     const char *root_id,
-                                     const char *path,
-                                     GError **error)
-{
+/*
+ * Resolves @path relative to the dir @root_id. On success the id of the
+ * object is copied to @obj_id, which must hold 41 bytes. Sets
+ * SEAF_ERR_PATH_NO_EXIST if a component doesn't exist or a parent isn't
+ * a dir, and SEAF_ERR_DIR_MISSING if a dir object can't be loaded.
+ */
+static int
+resolve_path (SeafFSManager *mgr,
+              const char *repo_id,
+              int version,
+              const char *root_id,
+              const char *path,
+              char *obj_id,
+              guint32 *mode,
+              GError **error)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+    char **parts, **name;
+    GString *rel_path;
+    char dir_id[41];
+    guint32 dir_mode = S_IFDIR;
     SeafDir *dir;
     SeafDirent *dent;
-    const char *dir_id = root_id;
-    char *name, *saveptr;
-    char *tmp_path = g_strdup(path);
+    gboolean multi;
+    gboolean loaded = FALSE;
+    int ret = 0;
 
-    dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, dir_id);
-    if (!dir) {
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING, "directory is missing");
-        return NULL;
+    /* Empty components are skipped, "/a//b/" is the same as "a/b". */
+    parts = g_strsplit (path, "/", -1);
+    rel_path = g_string_new (NULL);
+    for (name = parts; *name; name++) {
+        if (**name == '\0')
+            continue;
+        if (rel_path->len > 0)
+            g_string_append_c (rel_path, '/');
+        g_string_append (rel_path, *name);
     }
 
-    name = strtok_r (tmp_path, "/", &saveptr);
-    while (name != NULL) {
-        GList *l;
-        for (l = dir->entries; l != NULL; l = l->next) {
-            dent = l->data;
+    g_strlcpy (dir_id, root_id, sizeof(dir_id));
 
-            if (strcmp(dent->name, name) == 0 && S_ISDIR(dent->mode)) {
-                dir_id = dent->id;
-                break;
-            }
-        }
+    if (rel_path->len == 0)
+        goto out;
+
+    multi = (strchr (rel_path->str, '/') != NULL);
+    if (priv->path_cache && multi &&
+        path_cache_lookup (priv, repo_id, root_id, rel_path->str,
+                           dir_id, &dir_mode))
+        goto out;
+
+    for (name = parts; *name; name++) {
+        if (**name == '\0')
+            continue;
 
-        if (!l) {
+        if (!S_ISDIR(dir_mode)) {
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST,
                          "Path does not exists %s", path);
-            seaf_dir_free (dir);
-            dir = NULL;
-            break;
+            ret = -1;
+            goto out;
         }
 
-        SeafDir *prev = dir;
-        dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, dir_id);
-        seaf_dir_free (prev);
+        if (priv->path_cache &&
+            path_cache_lookup (priv, repo_id, dir_id, *name,
+                               dir_id, &dir_mode))
+            continue;
 
+        loaded = TRUE;
+        dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, dir_id);
         if (!dir) {
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
                          "directory is missing");
-            break;
+            ret = -1;
+            goto out;
+        }
+
+        dent = seaf_dir_lookup (dir, *name);
+        if (!dent) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST,
+                         "Path does not exists %s", path);
+            seaf_dir_free (dir);
+            ret = -1;
+            goto out;
         }
 
-        name = strtok_r (NULL, "/", &saveptr);
+        if (priv->path_cache)
+            path_cache_insert (priv, repo_id, dir_id, *name,
+                               dent->id, dent->mode);
+        g_strlcpy (dir_id, dent->id, sizeof(dir_id));
+        dir_mode = dent->mode;
+        seaf_dir_free (dir);
+    }
+
+    if (priv->path_cache && multi)
+        path_cache_insert (priv, repo_id, root_id, rel_path->str,
+                           dir_id, dir_mode);
+
+out:
+    if (priv->path_cache)
+        path_cache_count (priv, root_id, !loaded);
+    if (ret == 0) {
+        memcpy (obj_id, dir_id, 41);
+        *mode = dir_mode;
+    }
+    g_string_free (rel_path, TRUE);
+    g_strfreev (parts);
+    return ret;
+}
+
+SeafDir *
+seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
+                                     const char *repo_id,
+                                     int version,
+                                     const char *root_id,
+                                     const char *path,
+                                     GError **error)
+{
+    SeafDir *dir;
+    char dir_id[41];
+    guint32 mode;
+
+    if (resolve_path (mgr, repo_id, version, root_id, path,
+                      dir_id, &mode, error) < 0)
+        return NULL;
+
+    if (!S_ISDIR(mode)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST,
+                     "Path does not exists %s", path);
+        return NULL;
+    }
+
+    dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, dir_id);
+    if (!dir) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
+                     "directory is missing");
+        return NULL;
     }
 
-    g_free (tmp_path);
     return dir;
 }
 
@@ -2268,75 +3464,34 @@ seaf_fs_manager_path_to_obj_id (SeafFSManager *mgr,
                                 guint32 *mode,
                                 GError **error)
 {
-    char *copy = g_strdup (path);
-    int off = strlen(copy) - 1;
-    char *slash, *name;
-    SeafDir *base_dir = NULL;
-    SeafDirent *dent;
-    GList *p;
-    char *obj_id = NULL;
+    char obj_id[41];
+    guint32 obj_mode;
+    GError *tmp_error = NULL;
 
-    while (off >= 0 && copy[off] == '/')
-        copy[off--] = 0;
-
-    if (strlen(copy) == 0) {
-        /* the path is root "/" */
-        if (mode) {
-            *mode = S_IFDIR;
+    if (resolve_path (mgr, repo_id, version, root_id, path,
+                      obj_id, &obj_mode, &tmp_error) < 0) {
+        /* The path doesn't exist in this commit. */
+        if (g_error_matches (tmp_error, SEAFILE_DOMAIN,
+                             SEAF_ERR_PATH_NO_EXIST)) {
+            g_clear_error (&tmp_error);
+            return NULL;
         }
-        obj_id = g_strdup(root_id);
-        goto out;
-    }
-
-    slash = strrchr (copy, '/');
-    if (!slash) {
-        base_dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, root_id);
-        if (!base_dir) {
+        if (g_error_matches (tmp_error, SEAFILE_DOMAIN,
+                             SEAF_ERR_DIR_MISSING) &&
+            !seaf_fs_manager_object_exists (mgr, repo_id, version, root_id)) {
             g_warning ("Failed to find root dir %s.\n", root_id);
+            g_clear_error (&tmp_error);
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, " ");
-            goto out;
-        }
-        name = copy;
-    } else {
-        *slash = 0;
-        name = slash + 1;
-        GError *tmp_error = NULL;
-        base_dir = seaf_fs_manager_get_seafdir_by_path (mgr,
-                                                        repo_id,
-                                                        version,
-                                                        root_id,
-                                                        copy,
-                                                        &tmp_error);
-        if (tmp_error &&
-            !g_error_matches(tmp_error,
-                             SEAFILE_DOMAIN,
-                             SEAF_ERR_PATH_NO_EXIST)) {
-            g_warning ("Failed to get dir for %s.\n", copy);
-            g_propagate_error (error, tmp_error);
-            goto out;
-        }
-
-        /* The path doesn't exist in this commit. */
-        if (!base_dir)
-            goto out;
-    }
-
-    for (p = base_dir->entries; p != NULL; p = p->next) {
-        dent = p->data;
-        if (strcmp (dent->name, name) == 0) {
-            obj_id = g_strdup (dent->id);
-            if (mode) {
-                *mode = dent->mode;
-            }
-            break;
+            return NULL;
         }
+        g_warning ("Failed to resolve path %s.\n", path);
+        g_propagate_error (error, tmp_error);
+        return NULL;
     }
 
-out:
-    if (base_dir)
-        seaf_dir_free (base_dir);
-    g_free (copy);
-    return obj_id;
+    if (mode)
+        *mode = obj_mode;
+    return g_strdup (obj_id);
 }
 
 char *
@@ -2416,14 +3571,9 @@ seaf_fs_manager_get_dirent_by_path (SeafFSManager *mgr,
         goto out;
     }
 
-    GList *p;
-    for (p = dir->entries; p; p = p->next) {
-        SeafDirent *d = p->data;
-        if (strcmp (d->name, file_name) == 0) {
-            dent = seaf_dirent_dup(d);
-            break;
-        }
-    }
+    SeafDirent *d = seaf_dir_lookup (dir, file_name);
+    if (d)
+        dent = seaf_dirent_dup(d);
 
 out:
     if (dir)
@@ -2517,6 +3667,15 @@ verify_fs_object_json (const char *obj_id, uint8_t *data, int len)
     unsigned char sha1[20];
     char hex[41];
 
+    /* Repos of version 2 and above may also have binary objects, which
+     * are hashed as stored.
+     */
+    if (is_binary_fs_object (data, len)) {
+        calculate_sha1 (sha1, (const char *)data, len);
+        rawdata_to_hex (sha1, hex, 20);
+        return (strcmp(hex, obj_id) == 0);
+    }
+
     if (seaf_decompress (data, len, &decompressed, &outlen) < 0) {
         seaf_warning ("Failed to decompress fs object %s.\n", obj_id);
         return FALSE;
@@ -2705,6 +3864,8 @@ dir_version_from_repo_version (int repo_version)
 {
     if (repo_version == 0)
         return 0;
+    else if (repo_version >= BINARY_FS_REPO_VERSION)
+        return BINARY_FS_OBJ_VERSION;
     else
         return CURRENT_DIR_OBJ_VERSION;
 }
@@ -2714,6 +3875,8 @@ seafile_version_from_repo_version (int repo_version)
 {
     if (repo_version == 0)
         return 0;
+    else if (repo_version >= BINARY_FS_REPO_VERSION)
+        return BINARY_FS_OBJ_VERSION;
     else
         return CURRENT_SEAFILE_OBJ_VERSION;
 }
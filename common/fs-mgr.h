@@ -15,6 +15,11 @@
 #define CURRENT_DIR_OBJ_VERSION 1
 #define CURRENT_SEAFILE_OBJ_VERSION 1
 
+/* Dir and file objects of this version use the binary format. They're
+ * created for repos of version BINARY_FS_REPO_VERSION and above.
+ */
+#define BINARY_FS_OBJ_VERSION 2
+
 typedef struct _SeafFSManager SeafFSManager;
 typedef struct _SeafFSObject SeafFSObject;
 typedef struct _Seafile Seafile;
@@ -39,8 +44,14 @@ struct _Seafile {
     char        file_id[41];
     guint64     file_size;
     guint32     n_blocks;
-    char        **blk_sha1s;
+    /* Raw 20-byte block ids, stored one after another. */
+    guint8      *blk_ids;
     int         ref_count;
+
+    /* Start offset of each block, followed by the end of the last one.
+     * NULL until seafile_get_block_offsets() is called.
+     */
+    guint64     *blk_offsets;
 };
 
 void
@@ -49,12 +60,37 @@ seafile_ref (Seafile *seafile);
 void
 seafile_unref (Seafile *seafile);
 
+/* Writes the hex id of block @i into @block_id, which must hold 41 bytes.
+ * Returns @block_id.
+ */
+char *
+seafile_get_block_id (Seafile *file, int i, char *block_id);
+
+/*
+ * Returns the n_blocks + 1 block offsets of @file. They are computed from
+ * the block sizes on the first call and kept with the file, so later
+ * reads of a cached file don't stat its blocks again.
+ * Returns NULL if a block can't be found.
+ */
+const guint64 *
+seafile_get_block_offsets (Seafile *file, const char *store_id, int version);
+
+/* Returns the index of the block containing @offset, or -1 if @offset is
+ * beyond the end of the file.
+ */
+int
+seafile_find_block (Seafile *file, const guint64 *offsets, guint64 offset);
+
 int
 seafile_save (SeafFSManager *fs_mgr,
               const char *repo_id,
               int version,
               Seafile *file);
 
+/* Serialize @file according to its version. Also sets file->file_id. */
+void *
+seafile_to_data (Seafile *file, int *len);
+
 #define SEAF_DIR_NAME_LEN 256
 
 struct _SeafDirent {
@@ -79,18 +115,52 @@ struct _SeafDir {
     /* data in on-disk format. */
     void  *ondisk;
     int    ondisk_size;
+
+    int    ref_count;
+
+    /* Binary dirs are parsed in place: the entries and their list links
+     * are allocated as two arrays, and names point into ondisk.
+     */
+    SeafDirent *dent_array;
+    GList      *link_array;
+
+    /* Entries sorted by name, built on the first lookup. */
+    struct _SeafDirIndex *index;
 };
 
 SeafDir *
 seaf_dir_new (const char *id, GList *entries, int version);
 
+void
+seaf_dir_ref (SeafDir *dir);
+
+/* Drops a reference, the dir is freed with the last one. */
 void 
 seaf_dir_free (SeafDir *dir);
 
+/* Deep copy of @dir, for callers who need to modify the entries. */
+SeafDir *
+seaf_dir_dup (SeafDir *dir);
+
 SeafDir *
 seaf_dir_from_data (const char *dir_id, uint8_t *data, int len,
                     gboolean is_json);
 
+/*
+ * Finds the entry called @name with a binary search. The dir keeps an
+ * array of its entries sorted by name, built on the first lookup, so
+ * entries must not be added or removed after a dir has been searched.
+ * Returns NULL if there is no such entry.
+ */
+SeafDirent *
+seaf_dir_lookup (SeafDir *dir, const char *name);
+
+/* Returns the entries sorted by name in ascending order. The array
+ * belongs to @dir.
+ */
+SeafDirent **
+seaf_dir_get_sorted_entries (SeafDir *dir, int *n_entries);
+
 void *
 seaf_dir_to_data (SeafDir *dir, int *len);
 
@@ -207,6 +277,11 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
                               SeafileCrypt *crypt,
                               gboolean write_data);
 
+/*
+ * Seafile and SeafDir objects returned by the fs manager may be shared
+ * with its object cache and with other threads. They must be treated as
+ * read-only: use seaf_dir_dup() or dup the entries before changing them.
+ */
 Seafile *
 seaf_fs_manager_get_seafile (SeafFSManager *mgr,
                              const char *repo_id,
@@ -282,6 +357,18 @@ seaf_fs_manager_object_exists (SeafFSManager *mgr,
                                int version,
                                const char *id);
 
+/*
+ * Check the existence of @n objects. Results are stored in @results.
+ * Returns -1 if the check cannot be done.
+ */
+int
+seaf_fs_manager_objects_exist (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               int n,
+                               const char **ids,
+                               gboolean *results);
+
 void
 seaf_fs_manager_delete_object (SeafFSManager *mgr,
                                const char *repo_id,
@@ -363,6 +450,20 @@ seaf_fs_manager_get_dirent_by_path (SeafFSManager *mgr,
                                     const char *path,
                                     GError **error);
 
+/* @hits and @misses count path resolutions, one per looked up path. */
+typedef struct PathCacheStats {
+    guint64 hits;
+    guint64 misses;
+    guint64 evictions;
+    guint64 n_entries;
+    guint64 capacity;
+} PathCacheStats;
+
+/* Returns FALSE if the path cache is not enabled. */
+gboolean
+seaf_fs_manager_get_path_cache_stats (SeafFSManager *mgr,
+                                      PathCacheStats *stats);
+
 /* Check object integrity. */
 
 gboolean
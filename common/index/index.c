@@ -971,57 +971,81 @@ int add_index_entry(struct index_state *istate, struct cache_entry *ce, int opti
     return 0;
 }
 
-int add_to_index(const char *repo_id,
-                 int version,
-                 struct index_state *istate,
-                 const char *path,
-                 const char *full_path,
-                 SeafStat *st,
-                 int flags,
-                 SeafileCrypt *crypt,
-                 IndexCB index_cb,
-                 const char *modifier,
-                 gboolean *added)
+int index_check_entry(struct index_state *istate,
+                      const char *path,
+                      SeafStat *st,
+                      unsigned char *old_sha1,
+                      gboolean *verify_id)
+{
+    struct cache_entry *alias;
+    unsigned ce_option = CE_MATCH_IGNORE_VALID|CE_MATCH_IGNORE_SKIP_WORKTREE|CE_MATCH_RACY_IS_DIRTY;
+
+    *verify_id = FALSE;
+
+    alias = index_name_exists(istate, path, strlen(path), 0);
+    if (!alias)
+        return 0;
+
+    if (!ce_stage(alias) && !ie_match_stat(alias, st, ce_option)) {
+        /* Nothing changed, really */
+        if (!S_ISGITLINK(alias->ce_mode))
+            ce_mark_uptodate(alias);
+        return 1;
+    }
+
+#ifdef WIN32
+    /* Fix daylight saving time bug on Windows.
+     * See http://www.codeproject.com/Articles/1144/Beating-the-Daylight-Savings-Time-bug-and-getting
+     * If ce and wt timestamp has a 1 hour gap, it may be affected by the bug.
+     * We then compare the file's id with the id in ce. If they're the same,
+     * we don't need to copy the blocks again. Only update the index.
+     */
+    if (!ce_stage(alias) &&
+        (ABS(alias->ce_mtime.sec - st->st_mtime) == 3600 ||
+         ABS(alias->ce_ctime.sec - st->st_ctime) == 3600)) {
+        memcpy (old_sha1, alias->sha1, 20);
+        *verify_id = TRUE;
+    }
+#endif
+
+    return 0;
+}
+
+void index_mark_entry_added(struct index_state *istate, const char *path)
+{
+    struct cache_entry *alias;
+
+    alias = index_name_exists(istate, path, strlen(path), 0);
+    if (alias)
+        alias->ce_flags |= CE_ADDED;
+}
+
+int add_to_index_with_sha1(struct index_state *istate,
+                           const char *path,
+                           SeafStat *st,
+                           const unsigned char *sha1,
+                           const char *modifier,
+                           gboolean *added)
 {
     int size, namelen;
-    mode_t st_mode = st->st_mode;
     struct cache_entry *ce, *alias;
-    unsigned char sha1[20];
-    unsigned ce_option = CE_MATCH_IGNORE_VALID|CE_MATCH_IGNORE_SKIP_WORKTREE|CE_MATCH_RACY_IS_DIRTY;
     int add_option = (ADD_CACHE_OK_TO_ADD|ADD_CACHE_OK_TO_REPLACE);
+    gboolean changed;
 
     *added = FALSE;
 
-    if (!S_ISREG(st_mode) && !S_ISLNK(st_mode) && !S_ISDIR(st_mode)) {
-        g_warning("%s: can only add regular files, symbolic links or git-directories\n", path);
-        return -1;
-    }
-
     namelen = strlen(path);
-    /* if (S_ISDIR(st_mode)) { */
-    /*     while (namelen && path[namelen-1] == '/') */
-    /*         namelen--; */
-    /* } */
     size = cache_entry_size(namelen);
     ce = calloc(1, size);
     memcpy(ce->name, path, namelen);
     ce->ce_flags = namelen;
     fill_stat_cache_info(ce, st);
 
-    ce->ce_mode = create_ce_mode(st_mode);
+    ce->ce_mode = create_ce_mode(st->st_mode);
 
     alias = index_name_exists(istate, ce->name, ce_namelen(ce), 0);
-    if (alias) {
-        if (!ce_stage(alias) && !ie_match_stat(alias, st, ce_option)) {
-            /* Nothing changed, really */
-            free(ce);
-            if (!S_ISGITLINK(alias->ce_mode))
-                ce_mark_uptodate(alias);
-            alias->ce_flags |= CE_ADDED;
-            return 0;
-        }
-    } else {
 #if defined WIN32 || defined __APPLE__
+    if (!alias) {
         alias = index_name_exists (istate, ce->name, ce_namelen(ce), 1);
         /* If file exists case-insensitively but doesn't exist case-sensitively,
          * that file is actually being renamed.
@@ -1030,8 +1054,8 @@ int add_to_index(const char *repo_id,
             remove_file_from_index (istate, alias->name);
             alias = NULL;
         }
-#endif
     }
+#endif
 
 #ifdef WIN32
     /* On Windows, no 'x' bit in file mode.
@@ -1041,46 +1065,65 @@ int add_to_index(const char *repo_id,
         ce->ce_mode = alias->ce_mode;
 #endif
 
-#ifdef WIN32
-    /* Fix daylight saving time bug on Windows.
-     * See http://www.codeproject.com/Articles/1144/Beating-the-Daylight-Savings-Time-bug-and-getting
-     * If ce and wt timestamp has a 1 hour gap, it may be affected by the bug.
-     * We then compare the file's id with the id in ce. If they're the same,
-     * we don't need to copy the blocks again. Only update the index.
-     */
-    if (alias && !ce_stage(alias) &&
-        (ABS(alias->ce_mtime.sec - st->st_mtime) == 3600 ||
-         ABS(alias->ce_ctime.sec - st->st_ctime) == 3600)) {
-        if (index_cb (repo_id, version, full_path, sha1, crypt, FALSE) < 0) {
-            free (ce);
-            return 0;
-        }
-        if (memcmp (alias->sha1, sha1, 20) == 0)
-            goto update_index;
-    }
-#endif
-
-    if (index_cb (repo_id, version, full_path, sha1, crypt, TRUE) < 0) {
-        free (ce);
-        return -1;
-    }
-
-update_index:
     memcpy (ce->sha1, sha1, 20);
     ce->ce_flags |= CE_ADDED;
     ce->modifier = g_strdup(modifier);
 
+    /* alias is freed if it's replaced by ce. */
+    changed = (!alias || memcmp (alias->sha1, sha1, 20) != 0);
+
     if (add_index_entry(istate, ce, add_option)) {
         g_warning("unable to add %s to index\n",path);
         return -1;
     }
 
-    if (!alias || memcmp (alias->sha1, sha1, 20) != 0)
-        *added = TRUE;
+    *added = changed;
 
     return 0;
 }
 
+int add_to_index(const char *repo_id,
+                 int version,
+                 struct index_state *istate,
+                 const char *path,
+                 const char *full_path,
+                 SeafStat *st,
+                 int flags,
+                 SeafileCrypt *crypt,
+                 IndexCB index_cb,
+                 const char *modifier,
+                 gboolean *added)
+{
+    mode_t st_mode = st->st_mode;
+    unsigned char sha1[20], old_sha1[20];
+    gboolean verify_id;
+
+    *added = FALSE;
+
+    if (!S_ISREG(st_mode) && !S_ISLNK(st_mode) && !S_ISDIR(st_mode)) {
+        g_warning("%s: can only add regular files, symbolic links or git-directories\n", path);
+        return -1;
+    }
+
+    if (index_check_entry (istate, path, st, old_sha1, &verify_id)) {
+        index_mark_entry_added (istate, path);
+        return 0;
+    }
+
+    if (verify_id) {
+        if (index_cb (repo_id, version, full_path, sha1, crypt, FALSE) < 0)
+            return 0;
+        if (memcmp (old_sha1, sha1, 20) == 0)
+            goto update_index;
+    }
+
+    if (index_cb (repo_id, version, full_path, sha1, crypt, TRUE) < 0)
+        return -1;
+
+update_index:
+    return add_to_index_with_sha1 (istate, path, st, sha1, modifier, added);
+}
+
 /*
  * Check whether the empty dir conflicts with existing files
  */
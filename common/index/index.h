@@ -433,6 +433,36 @@ int add_to_index(const char *repo_id,
                  const char *modifier,
                  gboolean *added);
 
+/*
+ * add_to_index() in two steps, so that files can be hashed by other
+ * threads while the index is only changed by one thread.
+ *
+ * index_check_entry() returns 1 if the entry of @path is up to date with
+ * @st, in which case the file needn't be indexed. The entry should then be
+ * marked as added with index_mark_entry_added(), unless the file goes into
+ * a later commit.
+ * On Windows, *verify_id is set if only the timestamps may be off by the
+ * DST bug; the file should then be hashed without writing blocks first,
+ * and only written if its id differs from @old_sha1.
+ *
+ * add_to_index_with_sha1() adds or updates the entry with the id computed
+ * by the index callback.
+ */
+int index_check_entry(struct index_state *istate,
+                      const char *path,
+                      SeafStat *st,
+                      unsigned char *old_sha1,
+                      gboolean *verify_id);
+
+void index_mark_entry_added(struct index_state *istate, const char *path);
+
+int add_to_index_with_sha1(struct index_state *istate,
+                           const char *path,
+                           SeafStat *st,
+                           const unsigned char *sha1,
+                           const char *modifier,
+                           gboolean *added);
+
 int
 add_empty_dir_to_index (struct index_state *istate,
                         const char *path,
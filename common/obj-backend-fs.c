@@ -10,6 +10,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#endif
+
+#ifdef SEAFILE_SERVER
+#include "async-io.h"
 #endif
 
 #ifdef WIN32
@@ -25,8 +30,68 @@ typedef struct FsPriv {
     int v0_dir_len;
     char *obj_dir;
     int   dir_len;
+
+#ifndef WIN32
+    /* WriteBatch of the calling thread, NULL outside of a batch. */
+    pthread_key_t batch_key;
+#endif
+
+#ifdef SEAFILE_SERVER
+    /* Syncs the objects of a batch in parallel, created on first use. */
+    AsyncIO *aio;
+    pthread_mutex_t aio_lock;
+#endif
 } FsPriv;
 
+#ifndef WIN32
+
+#define BATCH_SYNC_QUEUE_DEPTH 64
+
+/*
+ * Group commit. Objects written with need_sync by a thread between
+ * begin_batch() and commit_batch() are renamed into place without syncing.
+ * On commit, the data of all of them is synced in one go, and then each
+ * parent dir is synced once. This replaces two serial fsyncs per object.
+ * Objects written without need_sync are not recorded and never synced.
+ */
+typedef struct WriteBatch {
+    /* Batches can be nested, only the outermost commit syncs. */
+    int         depth;
+    GPtrArray   *paths;
+    /* Parent dirs of the objects. */
+    GHashTable  *dirs;
+} WriteBatch;
+
+static WriteBatch *
+get_write_batch (FsPriv *priv)
+{
+    return pthread_getspecific (priv->batch_key);
+}
+
+static void
+write_batch_add (WriteBatch *batch, const char *path)
+{
+    char *dir;
+
+    g_ptr_array_add (batch->paths, g_strdup (path));
+
+    dir = g_path_get_dirname (path);
+    if (g_hash_table_lookup (batch->dirs, dir))
+        g_free (dir);
+    else
+        g_hash_table_insert (batch->dirs, dir, dir);
+}
+
+static void
+write_batch_free (WriteBatch *batch)
+{
+    g_ptr_array_free (batch->paths, TRUE);
+    g_hash_table_destroy (batch->dirs);
+    g_free (batch);
+}
+
+#endif  /* WIN32 */
+
 static void
 id_to_path (FsPriv *priv, const char *obj_id, char path[],
             const char *repo_id, int version)
@@ -296,6 +361,13 @@ obj_backend_fs_write (ObjBackend *bend,
                       gboolean need_sync)
 {
     char path[SEAF_PATH_MAX];
+#ifndef WIN32
+    WriteBatch *batch = need_sync ? get_write_batch (bend->priv) : NULL;
+
+    /* The object is synced when the batch is committed. */
+    if (batch)
+        need_sync = FALSE;
+#endif
 
     id_to_path (bend->priv, obj_id, path, repo_id, version);
 
@@ -313,6 +385,11 @@ obj_backend_fs_write (ObjBackend *bend,
         return -1;
     }
 
+#ifndef WIN32
+    if (batch)
+        write_batch_add (batch, path);
+#endif
+
     /* g_get_current_time (&e); */
 
     /* seaf_message ("write obj time: %ldus.\n", */
@@ -338,6 +415,33 @@ obj_backend_fs_exists (ObjBackend *bend,
     return FALSE;
 }
 
+static int
+obj_backend_fs_exists_batch (ObjBackend *bend,
+                             const char *repo_id,
+                             int version,
+                             int n,
+                             const char **obj_ids,
+                             gboolean *results)
+{
+    FsPriv *priv = bend->priv;
+    char *obj_dir;
+    int ret;
+
+#if defined MIGRATION || defined SEAFILE_CLIENT
+    if (version > 0)
+        obj_dir = g_build_filename (priv->obj_dir, repo_id, NULL);
+    else
+        obj_dir = g_strdup(priv->v0_obj_dir);
+#else
+    obj_dir = g_build_filename (priv->obj_dir, repo_id, NULL);
+#endif
+
+    ret = objstore_objs_exist (obj_dir, n, obj_ids, results);
+
+    g_free (obj_dir);
+    return ret;
+}
+
 static void
 obj_backend_fs_delete (ObjBackend *bend,
                        const char *repo_id,
@@ -350,6 +454,19 @@ obj_backend_fs_delete (ObjBackend *bend,
     g_unlink (path);
 }
 
+static char *
+get_repo_obj_dir (FsPriv *priv, const char *repo_id, int version)
+{
+#if defined MIGRATION || defined SEAFILE_CLIENT
+    if (version > 0)
+        return g_build_filename (priv->obj_dir, repo_id, NULL);
+    else
+        return g_strdup(priv->v0_obj_dir);
+#else
+    return g_build_filename (priv->obj_dir, repo_id, NULL);
+#endif
+}
+
 static int
 obj_backend_fs_foreach_obj (ObjBackend *bend,
                             const char *repo_id,
@@ -366,14 +483,7 @@ obj_backend_fs_foreach_obj (ObjBackend *bend,
     char path[SEAF_PATH_MAX], *pos;
     int ret = 0;
 
-#if defined MIGRATION || defined SEAFILE_CLIENT
-    if (version > 0)
-        obj_dir = g_build_filename (priv->obj_dir, repo_id, NULL);
-    else
-        obj_dir = g_strdup(priv->v0_obj_dir);
-#else
-    obj_dir = g_build_filename (priv->obj_dir, repo_id, NULL);
-#endif
+    obj_dir = get_repo_obj_dir (priv, repo_id, version);
     dir_len = strlen (obj_dir);
 
     dir1 = g_dir_open (obj_dir, 0, NULL);
@@ -411,6 +521,105 @@ out:
     return ret;
 }
 
+typedef struct ForeachData {
+    const char      *repo_id;
+    int             version;
+    const char      *obj_dir;
+    SeafObjFunc     process;
+    void            *user_data;
+    /* Set when a callback returns FALSE. */
+    gint            stop;
+} ForeachData;
+
+/* Thread pool job, lists the objects in one prefix directory. */
+static void
+foreach_obj_in_dir (gpointer vdname, gpointer vdata)
+{
+    char *dname1 = vdname;
+    ForeachData *data = vdata;
+    GDir *dir;
+    const char *dname2;
+    char obj_id[128];
+    char path[SEAF_PATH_MAX];
+
+    if (g_atomic_int_get (&data->stop))
+        goto out;
+
+    snprintf (path, sizeof(path), "%s/%s", data->obj_dir, dname1);
+    dir = g_dir_open (path, 0, NULL);
+    if (!dir) {
+        g_warning ("Failed to open object dir %s.\n", path);
+        goto out;
+    }
+
+    while ((dname2 = g_dir_read_name(dir)) != NULL) {
+        if (g_atomic_int_get (&data->stop))
+            break;
+        snprintf (obj_id, sizeof(obj_id), "%s%s", dname1, dname2);
+        if (!data->process (data->repo_id, data->version,
+                            obj_id, data->user_data)) {
+            g_atomic_int_set (&data->stop, 1);
+            break;
+        }
+    }
+    g_dir_close (dir);
+
+out:
+    g_free (dname1);
+}
+
+static int
+obj_backend_fs_foreach_obj_parallel (ObjBackend *bend,
+                                     const char *repo_id,
+                                     int version,
+                                     int n_threads,
+                                     SeafObjFunc process,
+                                     void *user_data)
+{
+    FsPriv *priv = bend->priv;
+    ForeachData data;
+    GThreadPool *pool;
+    GDir *dir1;
+    const char *dname1;
+    GError *error = NULL;
+    int ret = 0;
+
+    memset (&data, 0, sizeof(data));
+    data.repo_id = repo_id;
+    data.version = version;
+    data.process = process;
+    data.user_data = user_data;
+    data.obj_dir = get_repo_obj_dir (priv, repo_id, version);
+
+    dir1 = g_dir_open (data.obj_dir, 0, NULL);
+    if (!dir1)
+        goto out;
+
+    pool = g_thread_pool_new (foreach_obj_in_dir, &data,
+                              n_threads, FALSE, &error);
+    if (!pool) {
+        seaf_warning ("Failed to create thread pool: %s.\n", error->message);
+        g_clear_error (&error);
+        g_dir_close (dir1);
+        ret = -1;
+        goto out;
+    }
+
+    while ((dname1 = g_dir_read_name(dir1)) != NULL) {
+        if (g_atomic_int_get (&data.stop))
+            break;
+        g_thread_pool_push (pool, g_strdup(dname1), NULL);
+    }
+    g_dir_close (dir1);
+
+    /* Wait for the queued directories to be done. */
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+out:
+    g_free ((char *)data.obj_dir);
+    return ret;
+}
+
 static int
 obj_backend_fs_copy (ObjBackend *bend,
                      const char *src_repo_id,
@@ -452,6 +661,170 @@ obj_backend_fs_copy (ObjBackend *bend,
 #endif
 }
 
+#ifndef WIN32
+
+static void
+obj_backend_fs_begin_batch (ObjBackend *bend)
+{
+    FsPriv *priv = bend->priv;
+    WriteBatch *batch = get_write_batch (priv);
+
+    if (!batch) {
+        batch = g_new0 (WriteBatch, 1);
+        batch->paths = g_ptr_array_new_with_free_func (g_free);
+        batch->dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, NULL);
+        pthread_setspecific (priv->batch_key, batch);
+    }
+
+    ++batch->depth;
+}
+
+#ifdef SEAFILE_SERVER
+
+static AsyncIO *
+get_async_io (FsPriv *priv)
+{
+    AsyncIO *aio;
+
+    pthread_mutex_lock (&priv->aio_lock);
+    if (!priv->aio)
+        priv->aio = async_io_new (BATCH_SYNC_QUEUE_DEPTH);
+    aio = priv->aio;
+    pthread_mutex_unlock (&priv->aio_lock);
+
+    return aio;
+}
+
+#endif
+
+/* Flush the data of the objects in @fds. Entries of -1 are skipped. */
+static int
+sync_objects (FsPriv *priv, int *fds, int n)
+{
+    int i, ret = 0;
+
+#ifdef SEAFILE_SERVER
+    AsyncIO *aio = get_async_io (priv);
+
+    if (aio) {
+        AsyncIORequest *reqs = g_new0 (AsyncIORequest, n);
+        int n_reqs = 0;
+
+        for (i = 0; i < n; i++) {
+            if (fds[i] < 0)
+                continue;
+            reqs[n_reqs].type = ASYNC_IO_SYNC;
+            reqs[n_reqs].fd = fds[i];
+            ++n_reqs;
+        }
+
+        async_io_run (aio, reqs, n_reqs);
+
+        /* Some file systems don't support fsync, ignore EINVAL. */
+        for (i = 0; i < n_reqs; i++) {
+            if (reqs[i].result < 0 && reqs[i].result != -EINVAL) {
+                seaf_warning ("Failed to fsync: %s.\n",
+                              strerror(-reqs[i].result));
+                ret = -1;
+            }
+        }
+
+        g_free (reqs);
+        return ret;
+    }
+#endif
+
+    for (i = 0; i < n; i++) {
+        if (fds[i] >= 0 && fsync_obj_contents (fds[i]) < 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+static int
+sync_write_batch (FsPriv *priv, WriteBatch *batch)
+{
+    int n = batch->paths->len;
+    int fds[BATCH_SYNC_QUEUE_DEPTH];
+    GHashTableIter iter;
+    gpointer key, value;
+    const char *path;
+    int i, start, n_fds, dir_fd, ret = 0;
+
+    /* A batch can hold thousands of objects. Only keep a window of them
+     * open at a time, so that we don't run out of fds.
+     */
+    for (start = 0; start < n; start += n_fds) {
+        n_fds = MIN (n - start, BATCH_SYNC_QUEUE_DEPTH);
+
+        for (i = 0; i < n_fds; i++) {
+            path = g_ptr_array_index (batch->paths, start + i);
+            fds[i] = open (path, O_RDONLY);
+            if (fds[i] < 0) {
+                seaf_warning ("Failed to open %s: %s.\n",
+                              path, strerror(errno));
+                ret = -1;
+            }
+        }
+
+        if (sync_objects (priv, fds, n_fds) < 0)
+            ret = -1;
+
+        for (i = 0; i < n_fds; i++) {
+            if (fds[i] >= 0)
+                close (fds[i]);
+        }
+    }
+
+    /* Sync the dir entries after the data, as rename_and_sync() does. */
+    g_hash_table_iter_init (&iter, batch->dirs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        path = key;
+        dir_fd = open (path, O_RDONLY);
+        if (dir_fd < 0) {
+            seaf_warning ("Failed to open dir %s: %s.\n", path, strerror(errno));
+            ret = -1;
+            continue;
+        }
+        if (fsync (dir_fd) < 0 && errno != EINVAL) {
+            seaf_warning ("Failed to fsync dir %s: %s.\n",
+                          path, strerror(errno));
+            ret = -1;
+        }
+        close (dir_fd);
+    }
+
+    return ret;
+}
+
+static int
+obj_backend_fs_commit_batch (ObjBackend *bend)
+{
+    FsPriv *priv = bend->priv;
+    WriteBatch *batch = get_write_batch (priv);
+    int ret;
+
+    if (!batch)
+        return 0;
+
+    if (--batch->depth > 0)
+        return 0;
+
+    pthread_setspecific (priv->batch_key, NULL);
+
+    ret = sync_write_batch (priv, batch);
+    if (ret < 0)
+        seaf_warning ("[obj backend] Failed to sync %u objects.\n",
+                      batch->paths->len);
+
+    write_batch_free (batch);
+    return ret;
+}
+
+#endif  /* WIN32 */
+
 ObjBackend *
 obj_backend_fs_new (const char *seaf_dir, const char *obj_type)
 {
@@ -483,10 +856,22 @@ obj_backend_fs_new (const char *seaf_dir, const char *obj_type)
     bend->read = obj_backend_fs_read;
     bend->write = obj_backend_fs_write;
     bend->exists = obj_backend_fs_exists;
+    bend->exists_batch = obj_backend_fs_exists_batch;
     bend->delete = obj_backend_fs_delete;
     bend->foreach_obj = obj_backend_fs_foreach_obj;
+    bend->foreach_obj_parallel = obj_backend_fs_foreach_obj_parallel;
     bend->copy = obj_backend_fs_copy;
 
+#ifndef WIN32
+    pthread_key_create (&priv->batch_key, NULL);
+    bend->begin_batch = obj_backend_fs_begin_batch;
+    bend->commit_batch = obj_backend_fs_commit_batch;
+#endif
+
+#ifdef SEAFILE_SERVER
+    pthread_mutex_init (&priv->aio_lock, NULL);
+#endif
+
     return bend;
 
 onerror:
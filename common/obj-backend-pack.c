@@ -0,0 +1,266 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "utils.h"
+#include "obj-backend.h"
+#include "pack-store.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+/*
+ * Object backend which appends fs objects and commits to pack files, see
+ * pack-store.h. Each repo has its own packs and index, instead of one small
+ * file per object. Objects are appended in the order they're written, so
+ * the objects of a tree uploaded or migrated together are read mostly
+ * sequentially.
+ */
+
+typedef struct PackPriv {
+    PackStore *packs;
+
+    /* WriteBatch of the calling thread, NULL outside of a batch. */
+    pthread_key_t batch_key;
+} PackPriv;
+
+/*
+ * Group commit. Objects written with need_sync by a thread between
+ * begin_batch() and commit_batch() are not synced one by one. On commit,
+ * each store they were written to is synced once.
+ */
+typedef struct WriteBatch {
+    /* Batches can be nested, only the outermost commit syncs. */
+    int         depth;
+    /* Stores written to in the batch. */
+    GHashTable  *stores;
+} WriteBatch;
+
+static WriteBatch *
+get_write_batch (PackPriv *priv)
+{
+    return pthread_getspecific (priv->batch_key);
+}
+
+static int
+obj_backend_pack_read (ObjBackend *bend,
+                       const char *repo_id,
+                       int version,
+                       const char *obj_id,
+                       void **data,
+                       int *len)
+{
+    PackPriv *priv = bend->priv;
+
+    if (pack_store_read (priv->packs, repo_id, obj_id, data, len) < 0) {
+        seaf_debug ("[obj backend] Failed to read object %s:%s.\n",
+                    repo_id, obj_id);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+obj_backend_pack_write (ObjBackend *bend,
+                        const char *repo_id,
+                        int version,
+                        const char *obj_id,
+                        void *data,
+                        int len,
+                        gboolean need_sync)
+{
+    PackPriv *priv = bend->priv;
+    WriteBatch *batch = get_write_batch (priv);
+
+    if (pack_store_write (priv->packs, repo_id, obj_id, data, len) < 0) {
+        seaf_warning ("[obj backend] Failed to write object %s:%s.\n",
+                      repo_id, obj_id);
+        return -1;
+    }
+
+    /* The store is synced when the batch is committed. */
+    if (batch && need_sync) {
+        if (!g_hash_table_lookup (batch->stores, repo_id))
+            g_hash_table_insert (batch->stores, g_strdup (repo_id), batch);
+        return 0;
+    }
+
+    if (need_sync && pack_store_sync (priv->packs, repo_id) < 0) {
+        seaf_warning ("[obj backend] Failed to sync object %s:%s.\n",
+                      repo_id, obj_id);
+        return -1;
+    }
+
+    return 0;
+}
+
+static gboolean
+obj_backend_pack_exists (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
+                         const char *obj_id)
+{
+    PackPriv *priv = bend->priv;
+
+    return pack_store_exists (priv->packs, repo_id, obj_id);
+}
+
+static int
+obj_backend_pack_exists_batch (ObjBackend *bend,
+                               const char *repo_id,
+                               int version,
+                               int n,
+                               const char **obj_ids,
+                               gboolean *results)
+{
+    PackPriv *priv = bend->priv;
+
+    return pack_store_exists_batch (priv->packs, repo_id, n, obj_ids, results);
+}
+
+static void
+obj_backend_pack_delete (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
+                         const char *obj_id)
+{
+    PackPriv *priv = bend->priv;
+
+    pack_store_remove (priv->packs, repo_id, obj_id);
+}
+
+typedef struct {
+    int version;
+    SeafObjFunc process;
+    void *user_data;
+} ForeachData;
+
+static gboolean
+foreach_obj_cb (const char *store_id, const char *id, void *vdata)
+{
+    ForeachData *data = vdata;
+
+    return data->process (store_id, data->version, id, data->user_data);
+}
+
+static int
+obj_backend_pack_foreach_obj (ObjBackend *bend,
+                              const char *repo_id,
+                              int version,
+                              SeafObjFunc process,
+                              void *user_data)
+{
+    PackPriv *priv = bend->priv;
+    ForeachData data;
+
+    data.version = version;
+    data.process = process;
+    data.user_data = user_data;
+
+    return pack_store_foreach (priv->packs, repo_id, foreach_obj_cb, &data);
+}
+
+static int
+obj_backend_pack_copy (ObjBackend *bend,
+                       const char *src_repo_id,
+                       int src_version,
+                       const char *dst_repo_id,
+                       int dst_version,
+                       const char *obj_id)
+{
+    PackPriv *priv = bend->priv;
+
+    return pack_store_copy (priv->packs, src_repo_id, dst_repo_id, obj_id);
+}
+
+static int
+obj_backend_pack_compact (ObjBackend *bend,
+                          const char *repo_id,
+                          int version)
+{
+    PackPriv *priv = bend->priv;
+
+    return pack_store_compact (priv->packs, repo_id);
+}
+
+static void
+obj_backend_pack_begin_batch (ObjBackend *bend)
+{
+    PackPriv *priv = bend->priv;
+    WriteBatch *batch = get_write_batch (priv);
+
+    if (!batch) {
+        batch = g_new0 (WriteBatch, 1);
+        batch->stores = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, NULL);
+        pthread_setspecific (priv->batch_key, batch);
+    }
+
+    ++batch->depth;
+}
+
+static int
+obj_backend_pack_commit_batch (ObjBackend *bend)
+{
+    PackPriv *priv = bend->priv;
+    WriteBatch *batch = get_write_batch (priv);
+    GHashTableIter iter;
+    gpointer key, value;
+    int ret = 0;
+
+    if (!batch)
+        return 0;
+
+    if (--batch->depth > 0)
+        return 0;
+
+    pthread_setspecific (priv->batch_key, NULL);
+
+    g_hash_table_iter_init (&iter, batch->stores);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (pack_store_sync (priv->packs, (const char *)key) < 0) {
+            seaf_warning ("[obj backend] Failed to sync objects of %s.\n",
+                          (const char *)key);
+            ret = -1;
+        }
+    }
+
+    g_hash_table_destroy (batch->stores);
+    g_free (batch);
+    return ret;
+}
+
+ObjBackend *
+obj_backend_pack_new (const char *pack_dir, gint64 max_pack_size)
+{
+    ObjBackend *bend;
+    PackPriv *priv;
+
+    priv = g_new0 (PackPriv, 1);
+    priv->packs = pack_store_new (pack_dir, max_pack_size);
+    if (!priv->packs) {
+        seaf_warning ("[obj backend] Failed to open packs in %s.\n", pack_dir);
+        g_free (priv);
+        return NULL;
+    }
+    pthread_key_create (&priv->batch_key, NULL);
+
+    bend = g_new0 (ObjBackend, 1);
+    bend->priv = priv;
+
+    bend->read = obj_backend_pack_read;
+    bend->write = obj_backend_pack_write;
+    bend->exists = obj_backend_pack_exists;
+    bend->exists_batch = obj_backend_pack_exists_batch;
+    bend->delete = obj_backend_pack_delete;
+    bend->foreach_obj = obj_backend_pack_foreach_obj;
+    bend->copy = obj_backend_pack_copy;
+    bend->compact = obj_backend_pack_compact;
+    bend->begin_batch = obj_backend_pack_begin_batch;
+    bend->commit_batch = obj_backend_pack_commit_batch;
+
+    return bend;
+}
@@ -27,6 +27,14 @@ struct ObjBackend {
                            int version,
                            const char *obj_id);
 
+    /* Can be NULL, then exists() is called for each object. */
+    int         (*exists_batch) (ObjBackend *bend,
+                                 const char *repo_id,
+                                 int version,
+                                 int n,
+                                 const char **obj_ids,
+                                 gboolean *results);
+
     void        (*delete) (ObjBackend *bend,
                            const char *repo_id,
                            int version,
@@ -38,6 +46,16 @@ struct ObjBackend {
                                 SeafObjFunc process,
                                 void *user_data);
 
+    /* Can be NULL. Like foreach_obj, but calls @process from up to
+     * @n_threads threads at once, see seaf_obj_store_foreach_obj_parallel().
+     */
+    int         (*foreach_obj_parallel) (ObjBackend *bend,
+                                         const char *repo_id,
+                                         int version,
+                                         int n_threads,
+                                         SeafObjFunc process,
+                                         void *user_data);
+
     int         (*copy) (ObjBackend *bend,
                          const char *src_repo_id,
                          int src_version,
@@ -45,6 +63,20 @@ struct ObjBackend {
                          int dst_version,
                          const char *obj_id);
 
+    /* Can be NULL. Reclaim the space of deleted objects,
+     * see seaf_obj_store_compact().
+     */
+    int         (*compact) (ObjBackend *bend,
+                            const char *repo_id,
+                            int version);
+
+    /* Can be NULL. Group commit of the writes from the calling thread,
+     * see seaf_obj_store_begin_batch().
+     */
+    void        (*begin_batch) (ObjBackend *bend);
+
+    int         (*commit_batch) (ObjBackend *bend);
+
     void *priv;
 };
 
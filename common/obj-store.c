@@ -1,14 +1,18 @@
 #include "common.h"
 
+#include <pthread.h>
+
 #include <ccnet/cevent.h>
 #include "seafile-session.h"
 
 #include "obj-backend.h"
 #include "obj-store.h"
 
-#define MAX_READER_THREADS 2
-#define MAX_WRITER_THREADS 2
-#define MAX_STAT_THREADS 2
+#define DEFAULT_READER_THREADS 2
+#define DEFAULT_WRITER_THREADS 2
+#define DEFAULT_STAT_THREADS 2
+
+struct AsyncBatch;
 
 typedef struct AsyncTask {
     guint32 rw_id;
@@ -17,35 +21,71 @@ typedef struct AsyncTask {
     int     len;
     gboolean need_sync;
     gboolean success;
+    gint64  submit_time;
+    /* When a pool thread picked up the task. */
+    gint64  start_time;
+
+    /* Set for the objects of a batch. */
+    struct AsyncBatch *batch;
+    int     index;
 } AsyncTask;
 
+/* The objects of a batch are spread over the thread pool. The thread
+ * finishing the last one sends a single event for the whole batch.
+ */
+typedef struct AsyncBatch {
+    guint32 rw_id;
+    char    repo_id[37];
+    int     version;
+    int     n;
+    gint    remaining;
+    AsyncTask *tasks;
+} AsyncBatch;
+
 typedef struct OSCallbackStruct {
     char repo_id[37];
     int version;
     OSAsyncCallback cb;
+    OSAsyncBatchCallback batch_cb;
     void *cb_data;
 } OSCallbackStruct;
 
+typedef struct AsyncPool {
+    GThreadPool *tpool;
+    int n_threads;
+
+    pthread_mutex_t stats_lock;
+    guint64 n_ops;
+    guint64 n_failed;
+    guint64 total_queue_usec;
+    guint64 max_queue_usec;
+    guint64 total_io_usec;
+    guint64 max_io_usec;
+} AsyncPool;
+
 struct SeafObjStore {
     ObjBackend   *bend;
 
     CEventManager *ev_mgr;
+    gboolean     async_enabled;
 
     /* For async read. */
     guint32      next_rd_id;
-    GThreadPool *read_tpool;
+    AsyncPool    read_pool;
     GHashTable  *readers;
     guint32      read_ev_id;
+    guint32      read_batch_ev_id;
 
     /* For async write. */
     guint32      next_wr_id;
-    GThreadPool *write_tpool;
+    AsyncPool    write_pool;
     GHashTable  *writers;
     guint32      write_ev_id;
+    guint32      write_batch_ev_id;
 
     /* For async stat. */
     guint32      next_st_id;
-    GThreadPool *stat_tpool;
+    AsyncPool    stat_pool;
     GHashTable  *stats;
     guint32      stat_ev_id;
 };
@@ -64,28 +104,118 @@ static void
 on_write_done (CEvent *event, void *data);
 static void
 on_stat_done (CEvent *event, void *data);
+static void
+on_read_batch_done (CEvent *event, void *data);
+static void
+on_write_batch_done (CEvent *event, void *data);
 
 extern ObjBackend *
 obj_backend_fs_new (const char *seaf_dir, const char *obj_type);
 
-struct SeafObjStore *
-seaf_obj_store_new (SeafileSession *seaf, const char *obj_type)
+#ifdef SEAFILE_SERVER
+extern ObjBackend *
+obj_backend_pack_new (const char *pack_dir, gint64 max_pack_size);
+
+#define DEFAULT_PACK_SIZE 64 /* MB */
+
+/*
+ * The backend is set in the [object_backend] group of the server config.
+ * It's shared by fs objects and commits, which are kept apart in
+ * sub-directories named after @obj_type.
+ */
+static ObjBackend *
+load_obj_backend (SeafileSession *seaf, const char *obj_type)
 {
-    SeafObjStore *store = g_new0 (SeafObjStore, 1);
+    ObjBackend *bend = NULL;
+    char *name, *pack_dir, *dir;
+    int pack_size;
+
+    name = g_key_file_get_string (seaf->config, "object_backend", "name", NULL);
+    if (!name || strcmp (name, "filesystem") == 0) {
+        bend = obj_backend_fs_new (seaf->seaf_dir, obj_type);
+    } else if (strcmp (name, "pack") == 0) {
+        pack_dir = g_key_file_get_string (seaf->config, "object_backend",
+                                          "pack_dir", NULL);
+        if (!pack_dir)
+            pack_dir = g_build_filename (seaf->seaf_dir, "storage", "packs",
+                                         NULL);
+        dir = g_build_filename (pack_dir, obj_type, NULL);
+
+        pack_size = g_key_file_get_integer (seaf->config, "object_backend",
+                                            "pack_size", NULL);
+        if (pack_size <= 0)
+            pack_size = DEFAULT_PACK_SIZE;
+
+        bend = obj_backend_pack_new (dir, (gint64)pack_size << 20);
+
+        g_free (pack_dir);
+        g_free (dir);
+    } else {
+        seaf_warning ("Unknown object backend %s.\n", name);
+    }
 
-    if (!store)
-        return NULL;
+    g_free (name);
+    return bend;
+}
+#endif
 
-    store->bend = obj_backend_fs_new (seaf->seaf_dir, obj_type);
-    if (!store->bend) {
+static struct SeafObjStore *
+obj_store_new (SeafileSession *seaf, ObjBackend *bend)
+{
+    SeafObjStore *store;
+
+    if (!bend) {
         g_warning ("[Object store] Failed to load backend.\n");
-        g_free (store);
         return NULL;
     }
 
+    store = g_new0 (SeafObjStore, 1);
+    store->bend = bend;
+
+    store->read_pool.n_threads = DEFAULT_READER_THREADS;
+    store->write_pool.n_threads = DEFAULT_WRITER_THREADS;
+    store->stat_pool.n_threads = DEFAULT_STAT_THREADS;
+
+#ifdef SEAFILE_SERVER
+    int n;
+
+    n = g_key_file_get_integer (seaf->config, "object_store",
+                                "read_threads", NULL);
+    if (n > 0)
+        store->read_pool.n_threads = n;
+    n = g_key_file_get_integer (seaf->config, "object_store",
+                                "write_threads", NULL);
+    if (n > 0)
+        store->write_pool.n_threads = n;
+    n = g_key_file_get_integer (seaf->config, "object_store",
+                                "stat_threads", NULL);
+    if (n > 0)
+        store->stat_pool.n_threads = n;
+#endif
+
+    pthread_mutex_init (&store->read_pool.stats_lock, NULL);
+    pthread_mutex_init (&store->write_pool.stats_lock, NULL);
+    pthread_mutex_init (&store->stat_pool.stats_lock, NULL);
+
     return store;
 }
 
+struct SeafObjStore *
+seaf_obj_store_new (SeafileSession *seaf, const char *obj_type)
+{
+#ifdef SEAFILE_SERVER
+    return obj_store_new (seaf, load_obj_backend (seaf, obj_type));
+#else
+    return obj_store_new (seaf, obj_backend_fs_new (seaf->seaf_dir, obj_type));
+#endif
+}
+
+struct SeafObjStore *
+seaf_obj_store_new_fs (SeafileSession *seaf, const char *obj_type)
+{
+    return obj_store_new (seaf, obj_backend_fs_new (seaf->seaf_dir, obj_type));
+}
+
 static int
 async_init (SeafObjStore *obj_store, CEventManager *ev_mgr)
 {
@@ -93,11 +223,12 @@ async_init (SeafObjStore *obj_store, CEventManager *ev_mgr)
 
     obj_store->ev_mgr = ev_mgr;
 
-    obj_store->read_tpool = g_thread_pool_new (reader_thread,
-                                               obj_store,
-                                               MAX_READER_THREADS,
-                                               FALSE,
-                                               &error);
+    obj_store->read_pool.tpool =
+        g_thread_pool_new (reader_thread,
+                           obj_store,
+                           obj_store->read_pool.n_threads,
+                           FALSE,
+                           &error);
     if (error) {
         g_warning ("Failed to start reader thread pool: %s.\n", error->message);
         g_clear_error (&error);
@@ -109,12 +240,16 @@ async_init (SeafObjStore *obj_store, CEventManager *ev_mgr)
     obj_store->read_ev_id = cevent_manager_register (ev_mgr,
                                                      on_read_done,
                                                      obj_store);
-
-    obj_store->write_tpool = g_thread_pool_new (writer_thread,
-                                                obj_store,
-                                                MAX_WRITER_THREADS,
-                                                FALSE,
-                                                &error);
+    obj_store->read_batch_ev_id = cevent_manager_register (ev_mgr,
+                                                           on_read_batch_done,
+                                                           obj_store);
+
+    obj_store->write_pool.tpool =
+        g_thread_pool_new (writer_thread,
+                           obj_store,
+                           obj_store->write_pool.n_threads,
+                           FALSE,
+                           &error);
     if (error) {
         g_warning ("Failed to start writer thread pool: %s.\n", error->message);
         g_clear_error (&error);
@@ -126,12 +261,16 @@ async_init (SeafObjStore *obj_store, CEventManager *ev_mgr)
     obj_store->write_ev_id = cevent_manager_register (ev_mgr,
                                                       on_write_done,
                                                       obj_store);
-
-    obj_store->stat_tpool = g_thread_pool_new (stat_thread,
-                                               obj_store,
-                                               MAX_STAT_THREADS,
-                                               FALSE,
-                                               &error);
+    obj_store->write_batch_ev_id = cevent_manager_register (ev_mgr,
+                                                            on_write_batch_done,
+                                                            obj_store);
+
+    obj_store->stat_pool.tpool =
+        g_thread_pool_new (stat_thread,
+                           obj_store,
+                           obj_store->stat_pool.n_threads,
+                           FALSE,
+                           &error);
     if (error) {
         g_warning ("Failed to start statr thread pool: %s.\n", error->message);
         g_clear_error (&error);
@@ -144,6 +283,8 @@ async_init (SeafObjStore *obj_store, CEventManager *ev_mgr)
                                                      on_stat_done,
                                                      obj_store);
 
+    obj_store->async_enabled = TRUE;
+
     return 0;
 }
 
@@ -185,6 +326,25 @@ seaf_obj_store_write_obj (struct SeafObjStore *obj_store,
     return bend->write (bend, repo_id, version, obj_id, data, len, need_sync);
 }
 
+void
+seaf_obj_store_begin_batch (struct SeafObjStore *obj_store)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (bend->begin_batch)
+        bend->begin_batch (bend);
+}
+
+int
+seaf_obj_store_commit_batch (struct SeafObjStore *obj_store)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (!bend->commit_batch)
+        return 0;
+    return bend->commit_batch (bend);
+}
+
 gboolean
 seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
                            const char *repo_id,
@@ -196,6 +356,25 @@ seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
     return bend->exists (bend, repo_id, version, obj_id);
 }
 
+int
+seaf_obj_store_objs_exist (struct SeafObjStore *obj_store,
+                           const char *repo_id,
+                           int version,
+                           int n,
+                           const char **obj_ids,
+                           gboolean *results)
+{
+    ObjBackend *bend = obj_store->bend;
+    int i;
+
+    if (bend->exists_batch)
+        return bend->exists_batch (bend, repo_id, version, n, obj_ids, results);
+
+    for (i = 0; i < n; i++)
+        results[i] = bend->exists (bend, repo_id, version, obj_ids[i]);
+    return 0;
+}
+
 void
 seaf_obj_store_delete_obj (struct SeafObjStore *obj_store,
                            const char *repo_id,
@@ -219,6 +398,23 @@ seaf_obj_store_foreach_obj (struct SeafObjStore *obj_store,
     return bend->foreach_obj (bend, repo_id, version, process, user_data);
 }
 
+int
+seaf_obj_store_foreach_obj_parallel (struct SeafObjStore *obj_store,
+                                     const char *repo_id,
+                                     int version,
+                                     int n_threads,
+                                     SeafObjFunc process,
+                                     void *user_data)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (!bend->foreach_obj_parallel || n_threads <= 1)
+        return bend->foreach_obj (bend, repo_id, version, process, user_data);
+
+    return bend->foreach_obj_parallel (bend, repo_id, version,
+                                       n_threads, process, user_data);
+}
+
 int
 seaf_obj_store_copy_obj (struct SeafObjStore *obj_store,
                          const char *src_repo_id,
@@ -235,6 +431,62 @@ seaf_obj_store_copy_obj (struct SeafObjStore *obj_store,
     return bend->copy (bend, src_repo_id, src_version, dst_repo_id, dst_version, obj_id);
 }
 
+int
+seaf_obj_store_compact (struct SeafObjStore *obj_store,
+                        const char *repo_id,
+                        int version)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (!bend->compact)
+        return 0;
+    return bend->compact (bend, repo_id, version);
+}
+
+static void
+record_op (AsyncPool *pool, AsyncTask *task)
+{
+    guint64 queue_usec = (guint64)(task->start_time - task->submit_time);
+    guint64 io_usec = (guint64)(g_get_monotonic_time () - task->start_time);
+
+    pthread_mutex_lock (&pool->stats_lock);
+    ++(pool->n_ops);
+    if (!task->success)
+        ++(pool->n_failed);
+    pool->total_queue_usec += queue_usec;
+    if (queue_usec > pool->max_queue_usec)
+        pool->max_queue_usec = queue_usec;
+    pool->total_io_usec += io_usec;
+    if (io_usec > pool->max_io_usec)
+        pool->max_io_usec = io_usec;
+    pthread_mutex_unlock (&pool->stats_lock);
+}
+
+static int
+push_task (AsyncPool *pool, AsyncTask *task)
+{
+    GError *error = NULL;
+
+    task->submit_time = g_get_monotonic_time ();
+
+    g_thread_pool_push (pool->tpool, task, &error);
+    if (error) {
+        g_clear_error (&error);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+batch_task_done (SeafObjStore *obj_store, AsyncTask *task, guint32 ev_id)
+{
+    AsyncBatch *batch = task->batch;
+
+    if (g_atomic_int_dec_and_test (&batch->remaining))
+        cevent_manager_add_event (obj_store->ev_mgr, ev_id, batch);
+}
+
 static void
 reader_thread (void *data, void *user_data)
 {
@@ -243,6 +495,19 @@ reader_thread (void *data, void *user_data)
     ObjBackend *bend = obj_store->bend;
     OSCallbackStruct *callback;
 
+    task->start_time = g_get_monotonic_time ();
+
+    if (task->batch) {
+        AsyncBatch *batch = task->batch;
+
+        task->success = (bend->read (bend, batch->repo_id, batch->version,
+                                     task->obj_id,
+                                     &task->data, &task->len) == 0);
+        record_op (&obj_store->read_pool, task);
+        batch_task_done (obj_store, task, obj_store->read_batch_ev_id);
+        return;
+    }
+
     callback = g_hash_table_lookup (obj_store->readers,
                                     (gpointer)(long)(task->rw_id));
     if (callback) {
@@ -252,6 +517,7 @@ reader_thread (void *data, void *user_data)
                         task->obj_id, &task->data, &task->len) < 0)
             task->success = FALSE;
     }
+    record_op (&obj_store->read_pool, task);
 
     cevent_manager_add_event (obj_store->ev_mgr, obj_store->read_ev_id,
                               task);
@@ -265,6 +531,8 @@ stat_thread (void *data, void *user_data)
     ObjBackend *bend = obj_store->bend;
     OSCallbackStruct *callback;
 
+    task->start_time = g_get_monotonic_time ();
+
     callback = g_hash_table_lookup (obj_store->stats,
                                     (gpointer)(long)(task->rw_id));
     if (callback) {
@@ -273,6 +541,7 @@ stat_thread (void *data, void *user_data)
         if (!bend->exists (bend, callback->repo_id, callback->version, task->obj_id))
             task->success = FALSE;
     }
+    record_op (&obj_store->stat_pool, task);
 
     cevent_manager_add_event (obj_store->ev_mgr, obj_store->stat_ev_id,
                               task);
@@ -286,6 +555,19 @@ writer_thread (void *data, void *user_data)
     ObjBackend *bend = obj_store->bend;
     OSCallbackStruct *callback;
 
+    task->start_time = g_get_monotonic_time ();
+
+    if (task->batch) {
+        AsyncBatch *batch = task->batch;
+
+        task->success = (bend->write (bend, batch->repo_id, batch->version,
+                                      task->obj_id, task->data, task->len,
+                                      task->need_sync) == 0);
+        record_op (&obj_store->write_pool, task);
+        batch_task_done (obj_store, task, obj_store->write_batch_ev_id);
+        return;
+    }
+
     callback = g_hash_table_lookup (obj_store->writers,
                                     (gpointer)(long)(task->rw_id));
     if (callback) {
@@ -295,6 +577,7 @@ writer_thread (void *data, void *user_data)
                          task->obj_id, task->data, task->len, task->need_sync) < 0)
             task->success = FALSE;
     }
+    record_op (&obj_store->write_pool, task);
 
     cevent_manager_add_event (obj_store->ev_mgr, obj_store->write_ev_id,
                               task);
@@ -372,26 +655,145 @@ on_write_done (CEvent *event, void *user_data)
     g_free (task);
 }
 
-guint32
-seaf_obj_store_register_async_read (struct SeafObjStore *obj_store,
-                                    const char *repo_id,
-                                    int version,
-                                    OSAsyncCallback callback,
-                                    void *cb_data)
+static void
+batch_done (AsyncBatch *batch, GHashTable *table)
+{
+    OSCallbackStruct *callback;
+    OSAsyncResult *results;
+    AsyncTask *task;
+    int i;
+
+    callback = g_hash_table_lookup (table, (gpointer)(long)(batch->rw_id));
+    if (callback && callback->batch_cb) {
+        results = g_new (OSAsyncResult, batch->n);
+        for (i = 0; i < batch->n; ++i) {
+            task = &batch->tasks[i];
+            results[i].rw_id = batch->rw_id;
+            memcpy (results[i].obj_id, task->obj_id, 41);
+            results[i].data = task->data;
+            results[i].len = task->len;
+            results[i].success = task->success;
+        }
+
+        callback->batch_cb (results, batch->n, callback->cb_data);
+        g_free (results);
+    }
+
+    for (i = 0; i < batch->n; ++i)
+        g_free (batch->tasks[i].data);
+    g_free (batch->tasks);
+    g_free (batch);
+}
+
+static void
+on_read_batch_done (CEvent *event, void *user_data)
+{
+    SeafObjStore *obj_store = user_data;
+
+    batch_done (event->data, obj_store->readers);
+}
+
+static void
+on_write_batch_done (CEvent *event, void *user_data)
+{
+    SeafObjStore *obj_store = user_data;
+
+    batch_done (event->data, obj_store->writers);
+}
+
+static guint32
+register_callback (GHashTable *table,
+                   guint32 id,
+                   const char *repo_id,
+                   int version,
+                   OSAsyncCallback callback,
+                   OSAsyncBatchCallback batch_callback,
+                   void *cb_data)
 {
-    guint32 id = obj_store->next_rd_id++;
     OSCallbackStruct *cb_struct = g_new0 (OSCallbackStruct, 1);
 
     memcpy (cb_struct->repo_id, repo_id, 36);
     cb_struct->version = version;
     cb_struct->cb = callback;
+    cb_struct->batch_cb = batch_callback;
     cb_struct->cb_data = cb_data;
 
-    g_hash_table_insert (obj_store->readers, (gpointer)(long)id, cb_struct);
+    g_hash_table_insert (table, (gpointer)(long)id, cb_struct);
 
     return id;
 }
 
+/*
+ * Pushes the objects of a batch to the pool. Objects already queued when
+ * a push fails are still completed; the failed ones are reported as
+ * unsuccessful in the batch callback.
+ */
+static int
+submit_batch (AsyncPool *pool, AsyncBatch *batch)
+{
+    int i, n_failed = 0;
+
+    for (i = 0; i < batch->n; ++i) {
+        if (push_task (pool, &batch->tasks[i]) < 0)
+            ++n_failed;
+    }
+
+    return n_failed;
+}
+
+static AsyncBatch *
+new_batch (GHashTable *table, guint32 rw_id, int n, const char **obj_ids)
+{
+    OSCallbackStruct *callback;
+    AsyncBatch *batch;
+    int i;
+
+    callback = g_hash_table_lookup (table, (gpointer)(long)rw_id);
+    if (!callback || !callback->batch_cb) {
+        seaf_warning ("No batch callback registered for id %u.\n", rw_id);
+        return NULL;
+    }
+
+    batch = g_new0 (AsyncBatch, 1);
+    batch->rw_id = rw_id;
+    memcpy (batch->repo_id, callback->repo_id, 37);
+    batch->version = callback->version;
+    batch->n = n;
+    batch->remaining = n;
+    batch->tasks = g_new0 (AsyncTask, n);
+
+    for (i = 0; i < n; ++i) {
+        batch->tasks[i].rw_id = rw_id;
+        memcpy (batch->tasks[i].obj_id, obj_ids[i], 41);
+        batch->tasks[i].batch = batch;
+        batch->tasks[i].index = i;
+    }
+
+    return batch;
+}
+
+guint32
+seaf_obj_store_register_async_read (struct SeafObjStore *obj_store,
+                                    const char *repo_id,
+                                    int version,
+                                    OSAsyncCallback callback,
+                                    void *cb_data)
+{
+    return register_callback (obj_store->readers, obj_store->next_rd_id++,
+                              repo_id, version, callback, NULL, cb_data);
+}
+
+guint32
+seaf_obj_store_register_async_batch_read (struct SeafObjStore *obj_store,
+                                          const char *repo_id,
+                                          int version,
+                                          OSAsyncBatchCallback callback,
+                                          void *cb_data)
+{
+    return register_callback (obj_store->readers, obj_store->next_rd_id++,
+                              repo_id, version, NULL, callback, cb_data);
+}
+
 void
 seaf_obj_store_unregister_async_read (struct SeafObjStore *obj_store,
                                       guint32 reader_id)
@@ -405,13 +807,11 @@ seaf_obj_store_async_read (struct SeafObjStore *obj_store,
                            const char *obj_id)
 {
     AsyncTask *task = g_new0 (AsyncTask, 1);
-    GError *error = NULL;
 
     task->rw_id = reader_id;
     memcpy (task->obj_id, obj_id, 41);
 
-    g_thread_pool_push (obj_store->read_tpool, task, &error);
-    if (error) {
+    if (push_task (&obj_store->read_pool, task) < 0) {
         g_warning ("Failed to start aysnc read of %s.\n", obj_id);
         return -1;
     }
@@ -419,6 +819,34 @@ seaf_obj_store_async_read (struct SeafObjStore *obj_store,
     return 0;
 }
 
+int
+seaf_obj_store_async_read_batch (struct SeafObjStore *obj_store,
+                                 guint32 reader_id,
+                                 int n_objs,
+                                 const char **obj_ids)
+{
+    AsyncBatch *batch;
+    int n_failed;
+
+    if (n_objs <= 0)
+        return -1;
+
+    batch = new_batch (obj_store->readers, reader_id, n_objs, obj_ids);
+    if (!batch)
+        return -1;
+
+    n_failed = submit_batch (&obj_store->read_pool, batch);
+    if (n_failed > 0) {
+        seaf_warning ("Failed to start async read of %d objects.\n", n_failed);
+        /* Account for the objects that never reached the pool. */
+        if (g_atomic_int_add (&batch->remaining, -n_failed) == n_failed)
+            cevent_manager_add_event (obj_store->ev_mgr,
+                                      obj_store->read_batch_ev_id, batch);
+    }
+
+    return 0;
+}
+
 guint32
 seaf_obj_store_register_async_stat (struct SeafObjStore *obj_store,
                                     const char *repo_id,
@@ -426,17 +854,8 @@ seaf_obj_store_register_async_stat (struct SeafObjStore *obj_store,
                                     OSAsyncCallback callback,
                                     void *cb_data)
 {
-    guint32 id = obj_store->next_st_id++;
-    OSCallbackStruct *cb_struct = g_new0 (OSCallbackStruct, 1);
-
-    memcpy (cb_struct->repo_id, repo_id, 36);
-    cb_struct->version = version;
-    cb_struct->cb = callback;
-    cb_struct->cb_data = cb_data;
-
-    g_hash_table_insert (obj_store->stats, (gpointer)(long)id, cb_struct);
-
-    return id;
+    return register_callback (obj_store->stats, obj_store->next_st_id++,
+                              repo_id, version, callback, NULL, cb_data);
 }
 
 void
@@ -452,13 +871,11 @@ seaf_obj_store_async_stat (struct SeafObjStore *obj_store,
                            const char *obj_id)
 {
     AsyncTask *task = g_new0 (AsyncTask, 1);
-    GError *error = NULL;
 
     task->rw_id = stat_id;
     memcpy (task->obj_id, obj_id, 41);
 
-    g_thread_pool_push (obj_store->stat_tpool, task, &error);
-    if (error) {
+    if (push_task (&obj_store->stat_pool, task) < 0) {
         g_warning ("Failed to start aysnc stat of %s.\n", obj_id);
         return -1;
     }
@@ -473,17 +890,19 @@ seaf_obj_store_register_async_write (struct SeafObjStore *obj_store,
                                      OSAsyncCallback callback,
                                      void *cb_data)
 {
-    guint32 id = obj_store->next_rd_id++;
-    OSCallbackStruct *cb_struct = g_new0 (OSCallbackStruct, 1);
-
-    memcpy (cb_struct->repo_id, repo_id, 36);
-    cb_struct->version = version;
-    cb_struct->cb = callback;
-    cb_struct->cb_data = cb_data;
-
-    g_hash_table_insert (obj_store->writers, (gpointer)(long)id, cb_struct);
+    return register_callback (obj_store->writers, obj_store->next_wr_id++,
+                              repo_id, version, callback, NULL, cb_data);
+}
 
-    return id;
+guint32
+seaf_obj_store_register_async_batch_write (struct SeafObjStore *obj_store,
+                                           const char *repo_id,
+                                           int version,
+                                           OSAsyncBatchCallback callback,
+                                           void *cb_data)
+{
+    return register_callback (obj_store->writers, obj_store->next_wr_id++,
+                              repo_id, version, NULL, callback, cb_data);
 }
 
 void
@@ -502,7 +921,6 @@ seaf_obj_store_async_write (struct SeafObjStore *obj_store,
                             gboolean need_sync)
 {
     AsyncTask *task = g_new0 (AsyncTask, 1);
-    GError *error = NULL;
 
     task->rw_id = writer_id;
     memcpy (task->obj_id, obj_id, 41);
@@ -510,11 +928,79 @@ seaf_obj_store_async_write (struct SeafObjStore *obj_store,
     task->len = data_len;
     task->need_sync = need_sync;
 
-    g_thread_pool_push (obj_store->write_tpool, task, &error);
-    if (error) {
+    if (push_task (&obj_store->write_pool, task) < 0) {
         g_warning ("Failed to start aysnc write of %s.\n", obj_id);
         return -1;
     }
 
     return 0;
 }
+
+int
+seaf_obj_store_async_write_batch (struct SeafObjStore *obj_store,
+                                  guint32 writer_id,
+                                  int n_objs,
+                                  const char **obj_ids,
+                                  void **obj_datas,
+                                  const int *data_lens,
+                                  gboolean need_sync)
+{
+    AsyncBatch *batch;
+    int i, n_failed;
+
+    if (n_objs <= 0)
+        return -1;
+
+    batch = new_batch (obj_store->writers, writer_id, n_objs, obj_ids);
+    if (!batch) {
+        for (i = 0; i < n_objs; ++i)
+            g_free (obj_datas[i]);
+        return -1;
+    }
+
+    for (i = 0; i < n_objs; ++i) {
+        batch->tasks[i].data = obj_datas[i];
+        batch->tasks[i].len = data_lens[i];
+        batch->tasks[i].need_sync = need_sync;
+    }
+
+    n_failed = submit_batch (&obj_store->write_pool, batch);
+    if (n_failed > 0) {
+        seaf_warning ("Failed to start async write of %d objects.\n", n_failed);
+        if (g_atomic_int_add (&batch->remaining, -n_failed) == n_failed)
+            cevent_manager_add_event (obj_store->ev_mgr,
+                                      obj_store->write_batch_ev_id, batch);
+    }
+
+    return 0;
+}
+
+static void
+get_pool_stats (AsyncPool *pool, ObjStoreAsyncPoolStats *stats)
+{
+    stats->n_threads = pool->n_threads;
+    stats->queued = g_thread_pool_unprocessed (pool->tpool);
+
+    pthread_mutex_lock (&pool->stats_lock);
+    stats->n_ops = pool->n_ops;
+    stats->n_failed = pool->n_failed;
+    stats->total_queue_usec = pool->total_queue_usec;
+    stats->max_queue_usec = pool->max_queue_usec;
+    stats->total_io_usec = pool->total_io_usec;
+    stats->max_io_usec = pool->max_io_usec;
+    pthread_mutex_unlock (&pool->stats_lock);
+}
+
+int
+seaf_obj_store_get_async_stats (struct SeafObjStore *obj_store,
+                                ObjStoreAsyncStats *stats)
+{
+    if (!obj_store->async_enabled)
+        return -1;
+
+    get_pool_stats (&obj_store->read_pool, &stats->read);
+    get_pool_stats (&obj_store->write_pool, &stats->write);
+    get_pool_stats (&obj_store->stat_pool, &stats->stat);
+
+    return 0;
+}
@@ -11,6 +11,13 @@ struct CEventManager;
 struct SeafObjStore *
 seaf_obj_store_new (struct _SeafileSession *seaf, const char *obj_type);
 
+/*
+ * Open @obj_type objects in the one-file-per-object layout, whatever
+ * backend is configured. Used to migrate objects to another backend.
+ */
+struct SeafObjStore *
+seaf_obj_store_new_fs (struct _SeafileSession *seaf, const char *obj_type);
+
 int
 seaf_obj_store_init (struct SeafObjStore *obj_store,
                      gboolean enable_async,
@@ -35,12 +42,36 @@ seaf_obj_store_write_obj (struct SeafObjStore *obj_store,
                           int len,
                           gboolean need_sync);
 
+/*
+ * Group commit of the writes from the calling thread. Objects written
+ * with @need_sync after begin are not synced one by one; commit makes all
+ * of them durable at once. Objects written without @need_sync are left
+ * unsynced as usual. Call commit before anything refers to the objects,
+ * e.g. before updating a branch. Batches can be nested.
+ *
+ * Returns -1 if some objects could not be synced.
+ */
+void
+seaf_obj_store_begin_batch (struct SeafObjStore *obj_store);
+
+int
+seaf_obj_store_commit_batch (struct SeafObjStore *obj_store);
+
 gboolean
 seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
                            const char *repo_id,
                            int version,
                            const char *obj_id);
 
+/* Check the existence of @n objects. Results are stored in @results. */
+int
+seaf_obj_store_objs_exist (struct SeafObjStore *obj_store,
+                           const char *repo_id,
+                           int version,
+                           int n,
+                           const char **obj_ids,
+                           gboolean *results);
+
 void
 seaf_obj_store_delete_obj (struct SeafObjStore *obj_store,
                            const char *repo_id,
@@ -59,6 +90,24 @@ seaf_obj_store_foreach_obj (struct SeafObjStore *obj_store,
                             SeafObjFunc process,
                             void *user_data);
 
+/*
+ * Like seaf_obj_store_foreach_obj(), but the objects are listed by up to
+ * @n_threads threads, if the backend supports it.
+ *
+ * @process is called concurrently from these threads, so it must protect
+ * any state it shares through @user_data. Objects are visited in no
+ * particular order. When @process returns FALSE, no new objects are
+ * handed out, but calls already running in other threads still complete.
+ * All calls have returned when this function returns.
+ */
+int
+seaf_obj_store_foreach_obj_parallel (struct SeafObjStore *obj_store,
+                                     const char *repo_id,
+                                     int version,
+                                     int n_threads,
+                                     SeafObjFunc process,
+                                     void *user_data);
+
 int
 seaf_obj_store_copy_obj (struct SeafObjStore *obj_store,
                          const char *src_store_id,
@@ -67,6 +116,15 @@ seaf_obj_store_copy_obj (struct SeafObjStore *obj_store,
                          int dst_version,
                          const char *obj_id);
 
+/*
+ * Reclaim the space left by deleted objects of a repo. Only needed by
+ * backends which don't free it on delete, a no-op for the others.
+ */
+int
+seaf_obj_store_compact (struct SeafObjStore *obj_store,
+                        const char *repo_id,
+                        int version);
+
 /* Asynchronous I/O interface. */
 
 typedef struct OSAsyncResult {
@@ -80,6 +138,13 @@ typedef struct OSAsyncResult {
 
 typedef void (*OSAsyncCallback) (OSAsyncResult *res, void *cb_data);
 
+/*
+ * Called once for a whole batch, with the results in the order the
+ * objects were submitted.
+ */
+typedef void (*OSAsyncBatchCallback) (OSAsyncResult *results, int n_results,
+                                      void *cb_data);
+
 /* Async read */
 guint32
 seaf_obj_store_register_async_read (struct SeafObjStore *obj_store,
@@ -97,6 +162,23 @@ seaf_obj_store_async_read (struct SeafObjStore *obj_store,
                            guint32 reader_id,
                            const char *obj_id);
 
+/*
+ * Batch readers are unregistered with seaf_obj_store_unregister_async_read().
+ * The objects of a batch are read in parallel by the reader threads.
+ */
+guint32
+seaf_obj_store_register_async_batch_read (struct SeafObjStore *obj_store,
+                                          const char *repo_id,
+                                          int version,
+                                          OSAsyncBatchCallback callback,
+                                          void *cb_data);
+
+int
+seaf_obj_store_async_read_batch (struct SeafObjStore *obj_store,
+                                 guint32 reader_id,
+                                 int n_objs,
+                                 const char **obj_ids);
+
 /* Async write */
 guint32
 seaf_obj_store_register_async_write (struct SeafObjStore *obj_store,
@@ -117,6 +199,30 @@ seaf_obj_store_async_write (struct SeafObjStore *obj_store,
                             int data_len,
                             gboolean need_sync);
 
+/* Batch writers are unregistered with
+ * seaf_obj_store_unregister_async_write().
+ */
+guint32
+seaf_obj_store_register_async_batch_write (struct SeafObjStore *obj_store,
+                                           const char *repo_id,
+                                           int version,
+                                           OSAsyncBatchCallback callback,
+                                           void *cb_data);
+
+/*
+ * Takes over the buffers in @obj_datas, which must be allocated with
+ * g_malloc(), so that the data is not copied again. They are freed even
+ * if -1 is returned.
+ */
+int
+seaf_obj_store_async_write_batch (struct SeafObjStore *obj_store,
+                                  guint32 writer_id,
+                                  int n_objs,
+                                  const char **obj_ids,
+                                  void **obj_datas,
+                                  const int *data_lens,
+                                  gboolean need_sync);
+
 /* Async stat */
 guint32
 seaf_obj_store_register_async_stat (struct SeafObjStore *obj_store,
@@ -134,4 +240,31 @@ seaf_obj_store_async_stat (struct SeafObjStore *obj_store,
                            guint32 stat_id,
                            const char *obj_id);
 
+/*
+ * Counters of an async thread pool. Queue time runs from submission until
+ * a pool thread picks up the operation, I/O time from then until the
+ * backend call returns.
+ */
+typedef struct ObjStoreAsyncPoolStats {
+    int     n_threads;
+    guint   queued;
+    guint64 n_ops;
+    guint64 n_failed;
+    guint64 total_queue_usec;
+    guint64 max_queue_usec;
+    guint64 total_io_usec;
+    guint64 max_io_usec;
+} ObjStoreAsyncPoolStats;
+
+typedef struct ObjStoreAsyncStats {
+    ObjStoreAsyncPoolStats read;
+    ObjStoreAsyncPoolStats write;
+    ObjStoreAsyncPoolStats stat;
+} ObjStoreAsyncStats;
+
+/* Returns -1 if async I/O is not enabled for @obj_store. */
+int
+seaf_obj_store_get_async_stats (struct SeafObjStore *obj_store,
+                                ObjStoreAsyncStats *stats);
+
 #endif
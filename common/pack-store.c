@@ -0,0 +1,1543 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <glib/gstdio.h>
+
+#include "utils.h"
+#include "log.h"
+
+#include "pack-store.h"
+
+/*
+ * Index file layout (host byte order):
+ *
+ *   header, 64 bytes: magic[8] version:4 tail_pack:4 n_slots:8 n_used:8
+ *                     n_live:8 tail_offset:8, zero padded
+ *   n_slots slots, 40 bytes each: id[20] state:4 pack_id:4 size:4 offset:8
+ *
+ * It's an open addressing hash table with linear probing. Since ids are
+ * SHA-1 hashes, the first 8 bytes of the id are used as the hash value.
+ * Removed entries stay in the table as deleted slots, until the table is
+ * rebuilt.
+ *
+ * Pack record layout:
+ *
+ *   header, 32 bytes: magic:4 type:4 id[20] size:4
+ *   size bytes of object data, or for a tombstone, the location of the
+ *   removed record: pack_id:4 pad:4 offset:8
+ */
+
+#define INDEX_MAGIC "SEAFPIDX"
+#define INDEX_VERSION 1
+#define INDEX_HEADER_SIZE 64
+#define INDEX_SLOT_SIZE 40
+#define INDEX_MIN_SLOTS 1024
+/* Slots read in one go while probing or scanning the index. */
+#define INDEX_PROBE_SLOTS 16
+#define INDEX_SCAN_SLOTS 1024
+/* Reads of the index or a pack retried by lock-free readers. */
+#define LOOKUP_ATTEMPTS 3
+
+#define RECORD_MAGIC 0x4b505353
+#define RECORD_HEADER_SIZE 32
+#define TOMBSTONE_SIZE 16
+
+/* Packs with less live data than this ratio are rewritten by compaction. */
+#define COMPACT_LIVE_RATIO 0.5
+
+#define N_WRITE_LOCKS 64
+
+enum {
+    SLOT_EMPTY = 0,
+    SLOT_LIVE,
+    SLOT_DELETED,
+};
+
+enum {
+    RECORD_DATA = 1,
+    RECORD_TOMBSTONE,
+};
+
+typedef struct IndexHeader {
+    guint64 n_slots;
+    /* Live and deleted slots. */
+    guint64 n_used;
+    guint64 n_live;
+    /* Records before this position are in the index. */
+    guint32 tail_pack;
+    gint64 tail_offset;
+} IndexHeader;
+
+typedef struct IndexSlot {
+    unsigned char id[20];
+    guint32 state;
+    guint32 pack_id;
+    guint32 size;
+    /* Offset of the record header. */
+    gint64 offset;
+} IndexSlot;
+
+typedef struct Record {
+    guint32 type;
+    unsigned char id[20];
+    guint32 size;
+} Record;
+
+struct PackStore {
+    char *pack_dir;
+    gint64 max_pack_size;
+
+    /* Serialize writers in this process. The lock file of the store does
+     * the same across processes.
+     */
+    pthread_mutex_t write_locks[N_WRITE_LOCKS];
+    /* Last writer of each lock, kept open for the next write to the same
+     * store. Protected by the lock.
+     */
+    struct PackWriter *writers[N_WRITE_LOCKS];
+};
+
+/* A store locked for writing. */
+typedef struct PackWriter {
+    char *store_id;
+    char *dir;
+    int lock_idx;
+    int lock_fd;
+    int index_fd;
+    IndexHeader hdr;
+    int append_fd;
+    guint32 append_pack;
+    /* Tail of the store when it was last synced. */
+    guint32 synced_pack;
+    gint64 synced_offset;
+    /* Set when the store is removed, so the writer isn't kept. */
+    gboolean removed;
+} PackWriter;
+
+PackStore *
+pack_store_new (const char *pack_dir, gint64 max_pack_size)
+{
+    PackStore *store;
+    int i;
+
+    if (g_mkdir_with_parents (pack_dir, 0777) < 0) {
+        seaf_warning ("Pack dir %s does not exist and is unable to create\n",
+                      pack_dir);
+        return NULL;
+    }
+
+    store = g_new0 (PackStore, 1);
+    store->pack_dir = g_strdup (pack_dir);
+    store->max_pack_size = max_pack_size;
+    for (i = 0; i < N_WRITE_LOCKS; ++i)
+        pthread_mutex_init (&store->write_locks[i], NULL);
+
+    return store;
+}
+
+static char *
+store_dir (PackStore *store, const char *store_id)
+{
+    return g_build_filename (store->pack_dir, store_id, NULL);
+}
+
+static char *
+pack_path (const char *dir, guint32 pack_id)
+{
+    return g_strdup_printf ("%s/%08x.pack", dir, pack_id);
+}
+
+static gboolean
+pack_exists (const char *dir, guint32 pack_id)
+{
+    char *path = pack_path (dir, pack_id);
+    gboolean ret = (g_access (path, F_OK) == 0);
+
+    g_free (path);
+    return ret;
+}
+
+static int
+preadn (int fd, void *buf, size_t n, gint64 offset)
+{
+    char *ptr = buf;
+    size_t nleft = n;
+    ssize_t nread;
+
+    while (nleft > 0) {
+        nread = pread (fd, ptr, nleft, offset);
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (nread == 0)
+            break;
+        nleft -= nread;
+        ptr += nread;
+        offset += nread;
+    }
+
+    return (int)(n - nleft);
+}
+
+static int
+pwriten (int fd, const void *buf, size_t n, gint64 offset)
+{
+    const char *ptr = buf;
+    size_t nleft = n;
+    ssize_t nwritten;
+
+    while (nleft > 0) {
+        nwritten = pwrite (fd, ptr, nleft, offset);
+        if (nwritten <= 0) {
+            if (nwritten < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        nleft -= nwritten;
+        ptr += nwritten;
+        offset += nwritten;
+    }
+
+    return (int)n;
+}
+
+/* Flush pack @pack_id to disk. Missing packs are skipped. */
+static int
+sync_pack (const char *dir, guint32 pack_id)
+{
+    char *path = pack_path (dir, pack_id);
+    int fd, ret = 0;
+
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        ret = (errno == ENOENT) ? 0 : -1;
+        goto out;
+    }
+    /* Some file systems don't support fsync, ignore EINVAL. */
+    if (fsync (fd) < 0 && errno != EINVAL)
+        ret = -1;
+    close (fd);
+
+out:
+    if (ret < 0)
+        seaf_warning ("Failed to sync pack %s: %s.\n", path, strerror(errno));
+    g_free (path);
+    return ret;
+}
+
+/* Index. */
+
+static int
+read_index_header (int fd, IndexHeader *hdr)
+{
+    unsigned char buf[INDEX_HEADER_SIZE];
+    guint32 version;
+
+    if (preadn (fd, buf, INDEX_HEADER_SIZE, 0) != INDEX_HEADER_SIZE)
+        return -1;
+
+    if (memcmp (buf, INDEX_MAGIC, 8) != 0)
+        return -1;
+    memcpy (&version, buf + 8, 4);
+    if (version != INDEX_VERSION)
+        return -1;
+
+    memcpy (&hdr->tail_pack, buf + 12, 4);
+    memcpy (&hdr->n_slots, buf + 16, 8);
+    memcpy (&hdr->n_used, buf + 24, 8);
+    memcpy (&hdr->n_live, buf + 32, 8);
+    memcpy (&hdr->tail_offset, buf + 40, 8);
+
+    if (hdr->n_slots < INDEX_MIN_SLOTS ||
+        (hdr->n_slots & (hdr->n_slots - 1)) != 0)
+        return -1;
+
+    return 0;
+}
+
+static int
+write_index_header (int fd, const IndexHeader *hdr)
+{
+    unsigned char buf[INDEX_HEADER_SIZE];
+    guint32 version = INDEX_VERSION;
+
+    memset (buf, 0, sizeof(buf));
+    memcpy (buf, INDEX_MAGIC, 8);
+    memcpy (buf + 8, &version, 4);
+    memcpy (buf + 12, &hdr->tail_pack, 4);
+    memcpy (buf + 16, &hdr->n_slots, 8);
+    memcpy (buf + 24, &hdr->n_used, 8);
+    memcpy (buf + 32, &hdr->n_live, 8);
+    memcpy (buf + 40, &hdr->tail_offset, 8);
+
+    if (pwriten (fd, buf, INDEX_HEADER_SIZE, 0) < 0) {
+        seaf_warning ("Failed to write pack index header: %s.\n",
+                      strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline gint64
+slot_offset (guint64 pos)
+{
+    return INDEX_HEADER_SIZE + (gint64)pos * INDEX_SLOT_SIZE;
+}
+
+static void
+decode_slot (const unsigned char *buf, IndexSlot *slot)
+{
+    memcpy (slot->id, buf, 20);
+    memcpy (&slot->state, buf + 20, 4);
+    memcpy (&slot->pack_id, buf + 24, 4);
+    memcpy (&slot->size, buf + 28, 4);
+    memcpy (&slot->offset, buf + 32, 8);
+}
+
+static int
+write_slot (int fd, guint64 pos, const IndexSlot *slot)
+{
+    unsigned char buf[INDEX_SLOT_SIZE];
+
+    memcpy (buf, slot->id, 20);
+    memcpy (buf + 20, &slot->state, 4);
+    memcpy (buf + 24, &slot->pack_id, 4);
+    memcpy (buf + 28, &slot->size, 4);
+    memcpy (buf + 32, &slot->offset, 8);
+
+    if (pwriten (fd, buf, INDEX_SLOT_SIZE, slot_offset(pos)) < 0) {
+        seaf_warning ("Failed to write pack index: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns 1 and the slot if @id is found, 0 and the position of the empty
+ * slot to insert into if not, -1 on error.
+ */
+static int
+index_find (int fd, guint64 n_slots, const unsigned char *id,
+            guint64 *pos, IndexSlot *slot)
+{
+    unsigned char buf[INDEX_PROBE_SLOTS * INDEX_SLOT_SIZE];
+    guint64 hash, i, probed = 0;
+    int n, k;
+
+    memcpy (&hash, id, sizeof(hash));
+    i = hash & (n_slots - 1);
+
+    while (probed < n_slots) {
+        n = (int) MIN ((guint64)INDEX_PROBE_SLOTS, n_slots - i);
+        if (preadn (fd, buf, n * INDEX_SLOT_SIZE, slot_offset(i)) !=
+            n * INDEX_SLOT_SIZE)
+            return -1;
+
+        for (k = 0; k < n; ++k) {
+            decode_slot (buf + k * INDEX_SLOT_SIZE, slot);
+            if (slot->state == SLOT_EMPTY) {
+                *pos = i + k;
+                return 0;
+            }
+            if (memcmp (slot->id, id, 20) == 0) {
+                *pos = i + k;
+                return 1;
+            }
+        }
+
+        probed += n;
+        i = (i + n) & (n_slots - 1);
+    }
+
+    /* The table is never filled up. */
+    return -1;
+}
+
+/*
+ * Set the slot at @pos, which was found by index_find(). @found is its
+ * return value.
+ */
+static int
+index_set (int fd, IndexHeader *hdr, guint64 pos,
+           int found, const IndexSlot *old, const IndexSlot *slot)
+{
+    if (write_slot (fd, pos, slot) < 0)
+        return -1;
+
+    if (!found)
+        ++hdr->n_used;
+    if (found && old->state == SLOT_LIVE)
+        --hdr->n_live;
+    if (slot->state == SLOT_LIVE)
+        ++hdr->n_live;
+
+    return 0;
+}
+
+/*
+ * Find @id from a fresh open of the index, without locking.
+ *
+ * A writer may be updating the index while it's read, so a header or slot
+ * that can't be read is read again from a new open, LOOKUP_ATTEMPTS times.
+ */
+static int
+lookup_slot (PackStore *store, const char *store_id,
+             const unsigned char *id, IndexSlot *slot)
+{
+    char *dir = store_dir (store, store_id);
+    char *path = g_build_filename (dir, "index", NULL);
+    IndexHeader hdr;
+    guint64 pos;
+    int attempt, fd, found;
+    int ret = 0;
+
+    for (attempt = 0; attempt < LOOKUP_ATTEMPTS; ++attempt) {
+        fd = g_open (path, O_RDONLY | O_BINARY, 0);
+        if (fd < 0)
+            break;
+
+        if (read_index_header (fd, &hdr) < 0)
+            found = -1;
+        else
+            found = index_find (fd, hdr.n_slots, id, &pos, slot);
+        close (fd);
+
+        if (found >= 0) {
+            ret = (found && slot->state == SLOT_LIVE);
+            break;
+        }
+    }
+
+    g_free (path);
+    g_free (dir);
+    return ret;
+}
+
+static guint64
+index_size_for (guint64 n_live)
+{
+    guint64 n = INDEX_MIN_SLOTS;
+
+    while (n < (n_live + 1) * 2)
+        n <<= 1;
+    return n;
+}
+
+/*
+ * Write a new index with the live slots of the current one and switch to
+ * it. Without a current index, an empty one is created.
+ */
+static int
+rebuild_index (PackWriter *w, guint64 n_slots)
+{
+    char *path = g_build_filename (w->dir, "index", NULL);
+    char *tmp_path = g_build_filename (w->dir, "index.tmp", NULL);
+    unsigned char *buf = NULL;
+    IndexHeader hdr;
+    IndexSlot slot, old;
+    guint64 i, pos;
+    int fd, n, k, found;
+    int ret = 0;
+
+    memset (&hdr, 0, sizeof(hdr));
+    hdr.n_slots = n_slots;
+    if (w->index_fd >= 0) {
+        hdr.tail_pack = w->hdr.tail_pack;
+        hdr.tail_offset = w->hdr.tail_offset;
+    }
+
+    fd = g_open (tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning ("Failed to create %s: %s.\n", tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    if (ftruncate (fd, slot_offset(n_slots)) < 0) {
+        seaf_warning ("Failed to resize %s: %s.\n", tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    if (w->index_fd >= 0) {
+        buf = g_malloc (INDEX_SCAN_SLOTS * INDEX_SLOT_SIZE);
+        for (i = 0; i < w->hdr.n_slots; i += n) {
+            n = (int) MIN ((guint64)INDEX_SCAN_SLOTS, w->hdr.n_slots - i);
+            if (preadn (w->index_fd, buf, n * INDEX_SLOT_SIZE,
+                        slot_offset(i)) != n * INDEX_SLOT_SIZE) {
+                seaf_warning ("Failed to read pack index in %s.\n", w->dir);
+                ret = -1;
+                goto out;
+            }
+            for (k = 0; k < n; ++k) {
+                decode_slot (buf + k * INDEX_SLOT_SIZE, &slot);
+                if (slot.state != SLOT_LIVE)
+                    continue;
+                found = index_find (fd, n_slots, slot.id, &pos, &old);
+                if (found < 0 ||
+                    index_set (fd, &hdr, pos, found, &old, &slot) < 0) {
+                    ret = -1;
+                    goto out;
+                }
+            }
+        }
+    }
+
+    if (write_index_header (fd, &hdr) < 0 || fsync (fd) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (g_rename (tmp_path, path) < 0) {
+        seaf_warning ("Failed to rename %s: %s.\n", tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    if (w->index_fd >= 0)
+        close (w->index_fd);
+    w->index_fd = fd;
+    w->hdr = hdr;
+    fd = -1;
+
+out:
+    if (fd >= 0) {
+        close (fd);
+        g_unlink (tmp_path);
+    }
+    g_free (buf);
+    g_free (path);
+    g_free (tmp_path);
+    return ret;
+}
+
+static int
+maybe_grow_index (PackWriter *w)
+{
+    if ((w->hdr.n_used + 1) * 4 <= w->hdr.n_slots * 3)
+        return 0;
+    return rebuild_index (w, index_size_for (w->hdr.n_live));
+}
+
+/* Packs. */
+
+static gint
+compare_pack_id (gconstpointer a, gconstpointer b)
+{
+    guint32 x = *(const guint32 *)a, y = *(const guint32 *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+/* Returns the ids of the packs in @dir, sorted. */
+static GArray *
+list_packs (const char *dir)
+{
+    GArray *ids = g_array_new (FALSE, FALSE, sizeof(guint32));
+    GDir *d;
+    const char *dname;
+    unsigned int id;
+    char tail[8];
+
+    d = g_dir_open (dir, 0, NULL);
+    if (!d)
+        return ids;
+
+    while ((dname = g_dir_read_name (d)) != NULL) {
+        if (strlen (dname) != 13 ||
+            sscanf (dname, "%8x%7s", &id, tail) != 2 ||
+            strcmp (tail, ".pack") != 0 || id == 0)
+            continue;
+        guint32 pack_id = id;
+        g_array_append_val (ids, pack_id);
+    }
+    g_dir_close (d);
+
+    g_array_sort (ids, compare_pack_id);
+    return ids;
+}
+
+static int
+read_record (int fd, gint64 offset, Record *rec)
+{
+    unsigned char buf[RECORD_HEADER_SIZE];
+    guint32 magic;
+
+    if (preadn (fd, buf, RECORD_HEADER_SIZE, offset) != RECORD_HEADER_SIZE)
+        return -1;
+
+    memcpy (&magic, buf, 4);
+    memcpy (&rec->type, buf + 4, 4);
+    memcpy (rec->id, buf + 8, 20);
+    memcpy (&rec->size, buf + 28, 4);
+
+    if (magic != RECORD_MAGIC)
+        return -1;
+    if (rec->type == RECORD_DATA)
+        return 0;
+    if (rec->type == RECORD_TOMBSTONE && rec->size == TOMBSTONE_SIZE)
+        return 0;
+    return -1;
+}
+
+static int
+read_tombstone (int fd, gint64 offset, guint32 *pack_id, gint64 *rec_offset)
+{
+    unsigned char buf[TOMBSTONE_SIZE];
+
+    if (preadn (fd, buf, TOMBSTONE_SIZE, offset + RECORD_HEADER_SIZE) !=
+        TOMBSTONE_SIZE)
+        return -1;
+
+    memcpy (pack_id, buf, 4);
+    memcpy (rec_offset, buf + 8, 8);
+    return 0;
+}
+
+static int
+append_record (PackStore *store, PackWriter *w,
+               guint32 type, const unsigned char *id,
+               const void *body, guint32 size,
+               guint32 *pack_id, gint64 *offset)
+{
+    unsigned char buf[RECORD_HEADER_SIZE];
+    guint32 magic = RECORD_MAGIC;
+    guint32 cur = w->hdr.tail_pack;
+    gint64 off = w->hdr.tail_offset;
+
+    if (cur == 0) {
+        cur = 1;
+        off = 0;
+    } else if (off > 0 &&
+               off + RECORD_HEADER_SIZE + size > store->max_pack_size) {
+        /* A full pack is synced once, so pack_store_sync() only has to
+         * sync the last one.
+         */
+        if (w->append_fd >= 0 && w->append_pack == cur) {
+            if (fsync (w->append_fd) < 0 && errno != EINVAL)
+                seaf_warning ("Failed to sync pack %08x in %s: %s.\n",
+                              cur, w->dir, strerror(errno));
+        } else {
+            sync_pack (w->dir, cur);
+        }
+        ++cur;
+        off = 0;
+    }
+
+    if (w->append_fd < 0 || w->append_pack != cur) {
+        char *path = pack_path (w->dir, cur);
+
+        if (w->append_fd >= 0)
+            close (w->append_fd);
+        w->append_fd = g_open (path, O_WRONLY | O_CREAT | O_BINARY, 0666);
+        if (w->append_fd < 0) {
+            seaf_warning ("Failed to open pack %s: %s.\n", path, strerror(errno));
+            g_free (path);
+            return -1;
+        }
+        w->append_pack = cur;
+        g_free (path);
+    }
+
+    memcpy (buf, &magic, 4);
+    memcpy (buf + 4, &type, 4);
+    memcpy (buf + 8, id, 20);
+    memcpy (buf + 28, &size, 4);
+
+    if (pwriten (w->append_fd, buf, RECORD_HEADER_SIZE, off) < 0 ||
+        pwriten (w->append_fd, body, size, off + RECORD_HEADER_SIZE) < 0) {
+        seaf_warning ("Failed to write to pack %08x in %s: %s.\n",
+                      cur, w->dir, strerror(errno));
+        if (ftruncate (w->append_fd, off) < 0)
+            seaf_warning ("Failed to truncate pack %08x in %s.\n", cur, w->dir);
+        return -1;
+    }
+
+    w->hdr.tail_pack = cur;
+    w->hdr.tail_offset = off + RECORD_HEADER_SIZE + size;
+    *pack_id = cur;
+    *offset = off;
+
+    return 0;
+}
+
+/* Apply one pack record to the index. */
+static int
+apply_record (PackWriter *w, int fd, guint32 pack_id, gint64 offset,
+              const Record *rec)
+{
+    IndexSlot slot, old;
+    guint64 pos;
+    guint32 rm_pack;
+    gint64 rm_offset;
+    int found;
+
+    found = index_find (w->index_fd, w->hdr.n_slots, rec->id, &pos, &old);
+    if (found < 0)
+        return -1;
+
+    if (rec->type == RECORD_DATA) {
+        memcpy (slot.id, rec->id, 20);
+        slot.state = SLOT_LIVE;
+        slot.pack_id = pack_id;
+        slot.size = rec->size;
+        slot.offset = offset;
+        if (index_set (w->index_fd, &w->hdr, pos, found, &old, &slot) < 0)
+            return -1;
+        return maybe_grow_index (w);
+    }
+
+    /* A tombstone only removes the record it was written for. */
+    if (read_tombstone (fd, offset, &rm_pack, &rm_offset) < 0)
+        return -1;
+    if (found && old.state == SLOT_LIVE &&
+        old.pack_id == rm_pack && old.offset == rm_offset) {
+        slot = old;
+        slot.state = SLOT_DELETED;
+        return index_set (w->index_fd, &w->hdr, pos, found, &old, &slot);
+    }
+
+    return 0;
+}
+
+static int
+replay_pack (PackWriter *w, guint32 pack_id, gint64 start, gboolean is_last)
+{
+    char *path = pack_path (w->dir, pack_id);
+    SeafStat st;
+    Record rec;
+    gint64 off = start;
+    int fd;
+    int ret = 0;
+
+    fd = g_open (path, O_RDWR | O_BINARY, 0);
+    if (fd < 0 || seaf_fstat (fd, &st) < 0) {
+        seaf_warning ("Failed to open pack %s: %s.\n", path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    while (off + RECORD_HEADER_SIZE <= st.st_size) {
+        if (read_record (fd, off, &rec) < 0 ||
+            off + RECORD_HEADER_SIZE + rec.size > st.st_size)
+            break;
+        if (apply_record (w, fd, pack_id, off, &rec) < 0) {
+            ret = -1;
+            goto out;
+        }
+        off += RECORD_HEADER_SIZE + rec.size;
+    }
+
+    if (off < st.st_size) {
+        /* Only the pack being appended to can end with a partly written
+         * record.
+         */
+        if (is_last) {
+            seaf_warning ("Truncating partly written record at %"G_GINT64_FORMAT
+                          " in %s.\n", off, path);
+            if (ftruncate (fd, off) < 0) {
+                ret = -1;
+                goto out;
+            }
+        } else {
+            seaf_warning ("Pack %s is corrupted at %"G_GINT64_FORMAT".\n",
+                          path, off);
+        }
+    }
+
+    w->hdr.tail_pack = pack_id;
+    w->hdr.tail_offset = is_last ? off : (gint64)st.st_size;
+
+out:
+    if (fd >= 0)
+        close (fd);
+    g_free (path);
+    return ret;
+}
+
+/*
+ * Add records written after the index tail to the index. They're left by
+ * writers which crashed after appending to a pack, or when the index is
+ * rebuilt from scratch.
+ */
+static int
+replay_packs (PackWriter *w)
+{
+    GArray *ids;
+    guint32 id;
+    guint i;
+    int ret = 0;
+
+    if (w->hdr.tail_pack > 0) {
+        char *path = pack_path (w->dir, w->hdr.tail_pack);
+        SeafStat st;
+        gboolean clean;
+
+        /* The tail pack may not be created yet after compaction. */
+        if (seaf_stat (path, &st) == 0)
+            clean = (st.st_size == w->hdr.tail_offset);
+        else
+            clean = (errno == ENOENT && w->hdr.tail_offset == 0);
+        clean = clean && !pack_exists (w->dir, w->hdr.tail_pack + 1);
+        g_free (path);
+        if (clean)
+            return 0;
+    }
+
+    ids = list_packs (w->dir);
+    for (i = 0; i < ids->len; ++i) {
+        id = g_array_index (ids, guint32, i);
+        if (id < w->hdr.tail_pack)
+            continue;
+        if (replay_pack (w, id,
+                         (id == w->hdr.tail_pack) ? w->hdr.tail_offset : 0,
+                         i == ids->len - 1) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    g_array_free (ids, TRUE);
+
+    if (ret == 0)
+        ret = write_index_header (w->index_fd, &w->hdr);
+    return ret;
+}
+
+static void
+writer_free (PackWriter *w)
+{
+    if (w->append_fd >= 0)
+        close (w->append_fd);
+    if (w->index_fd >= 0)
+        close (w->index_fd);
+    /* Closing the file releases the lock. */
+    if (w->lock_fd >= 0)
+        close (w->lock_fd);
+    g_free (w->store_id);
+    g_free (w->dir);
+    g_free (w);
+}
+
+/*
+ * Lock the store with the files of a writer kept from a previous write,
+ * and reload the index header. Fails if the store was removed or the index
+ * was replaced by another process meanwhile.
+ */
+static int
+relock_writer (PackWriter *w)
+{
+    SeafStat st;
+
+    if (flock (w->lock_fd, LOCK_EX) < 0)
+        return -1;
+
+    if (seaf_fstat (w->lock_fd, &st) < 0 || st.st_nlink == 0 ||
+        seaf_fstat (w->index_fd, &st) < 0 || st.st_nlink == 0 ||
+        read_index_header (w->index_fd, &w->hdr) < 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Lock the store for writing, and load its index.
+ *
+ * Returns 0 on success, 1 if the store doesn't exist and @create is FALSE,
+ * -1 on error.
+ */
+static int
+lock_store (PackStore *store, const char *store_id, gboolean create,
+            PackWriter **pw)
+{
+    int idx = g_str_hash(store_id) % N_WRITE_LOCKS;
+    char *lock_path = NULL, *index_path = NULL;
+    PackWriter *w;
+    SeafStat st;
+
+    pthread_mutex_lock (&store->write_locks[idx]);
+
+    w = store->writers[idx];
+    store->writers[idx] = NULL;
+    if (w && strcmp (w->store_id, store_id) == 0 && relock_writer (w) == 0) {
+        if (replay_packs (w) < 0) {
+            writer_free (w);
+            pthread_mutex_unlock (&store->write_locks[idx]);
+            return -1;
+        }
+        *pw = w;
+        return 0;
+    }
+    if (w)
+        writer_free (w);
+
+    w = g_new0 (PackWriter, 1);
+    w->lock_fd = w->index_fd = w->append_fd = -1;
+    w->store_id = g_strdup (store_id);
+    w->dir = store_dir (store, store_id);
+    w->lock_idx = idx;
+    lock_path = g_build_filename (w->dir, "lock", NULL);
+    index_path = g_build_filename (w->dir, "index", NULL);
+
+    while (1) {
+        if (!create && !g_file_test (w->dir, G_FILE_TEST_IS_DIR))
+            goto not_found;
+
+        if (g_mkdir_with_parents (w->dir, 0777) < 0) {
+            seaf_warning ("Failed to create pack dir %s.\n", w->dir);
+            goto error;
+        }
+
+        w->lock_fd = g_open (lock_path, O_RDWR | O_CREAT | O_BINARY, 0666);
+        if (w->lock_fd < 0) {
+            seaf_warning ("Failed to open %s: %s.\n", lock_path, strerror(errno));
+            goto error;
+        }
+        if (flock (w->lock_fd, LOCK_EX) < 0) {
+            seaf_warning ("Failed to lock %s: %s.\n", lock_path, strerror(errno));
+            goto error;
+        }
+
+        /* The store was removed while we were waiting for the lock. */
+        if (seaf_fstat (w->lock_fd, &st) == 0 && st.st_nlink == 0) {
+            close (w->lock_fd);
+            w->lock_fd = -1;
+            continue;
+        }
+        break;
+    }
+
+    w->index_fd = g_open (index_path, O_RDWR | O_BINARY, 0);
+    if (w->index_fd >= 0 && read_index_header (w->index_fd, &w->hdr) < 0) {
+        seaf_warning ("Pack index in %s is corrupted, rebuilding.\n", w->dir);
+        close (w->index_fd);
+        w->index_fd = -1;
+    }
+    if (w->index_fd < 0 && rebuild_index (w, INDEX_MIN_SLOTS) < 0)
+        goto error;
+
+    if (replay_packs (w) < 0)
+        goto error;
+
+    g_free (lock_path);
+    g_free (index_path);
+    *pw = w;
+    return 0;
+
+not_found:
+    writer_free (w);
+    pthread_mutex_unlock (&store->write_locks[idx]);
+    g_free (lock_path);
+    g_free (index_path);
+    return 1;
+
+error:
+    writer_free (w);
+    pthread_mutex_unlock (&store->write_locks[idx]);
+    g_free (lock_path);
+    g_free (index_path);
+    return -1;
+}
+
+/* Unlock the store, keeping its files open for the next writer. */
+static void
+unlock_store (PackStore *store, PackWriter *w)
+{
+    int idx = w->lock_idx;
+
+    if (w->removed) {
+        writer_free (w);
+    } else {
+        flock (w->lock_fd, LOCK_UN);
+        store->writers[idx] = w;
+    }
+    pthread_mutex_unlock (&store->write_locks[idx]);
+}
+
+static int
+id_to_raw (const char *id, unsigned char *raw)
+{
+    if (!id || strlen(id) != 40 || hex_to_sha1 (id, raw) < 0) {
+        seaf_warning ("Invalid object id %s.\n", id ? id : "(null)");
+        return -1;
+    }
+    return 0;
+}
+
+/* Public API. */
+
+int
+pack_store_open_entry (PackStore *store,
+                       const char *store_id,
+                       const char *id,
+                       PackEntry *entry)
+{
+    unsigned char raw[20];
+    IndexSlot slot;
+    Record rec;
+    char *dir, *path;
+    int attempt;
+    int fd;
+
+    if (id_to_raw (id, raw) < 0)
+        return -1;
+
+    dir = store_dir (store, store_id);
+
+    /* The location may be stale or torn if the index is being updated or
+     * the pack was just compacted. Then look it up again.
+     */
+    for (attempt = 0; attempt < LOOKUP_ATTEMPTS; ++attempt) {
+        if (!lookup_slot (store, store_id, raw, &slot))
+            break;
+
+        path = pack_path (dir, slot.pack_id);
+        fd = g_open (path, O_RDONLY | O_BINARY, 0);
+        g_free (path);
+        if (fd < 0)
+            continue;
+
+        if (read_record (fd, slot.offset, &rec) == 0 &&
+            rec.type == RECORD_DATA &&
+            rec.size == slot.size &&
+            memcmp (rec.id, raw, 20) == 0) {
+            entry->pack_id = slot.pack_id;
+            entry->offset = slot.offset + RECORD_HEADER_SIZE;
+            entry->size = slot.size;
+            g_free (dir);
+            return fd;
+        }
+        close (fd);
+    }
+
+    g_free (dir);
+    return -1;
+}
+
+int
+pack_store_read (PackStore *store,
+                 const char *store_id,
+                 const char *id,
+                 void **data,
+                 int *len)
+{
+    PackEntry entry;
+    void *buf;
+    int fd;
+
+    fd = pack_store_open_entry (store, store_id, id, &entry);
+    if (fd < 0)
+        return -1;
+
+    buf = g_malloc (entry.size ? entry.size : 1);
+    if (preadn (fd, buf, entry.size, entry.offset) != (int)entry.size) {
+        seaf_warning ("Failed to read object %s from pack %08x: %s.\n",
+                      id, entry.pack_id, strerror(errno));
+        g_free (buf);
+        close (fd);
+        return -1;
+    }
+    close (fd);
+
+    *data = buf;
+    *len = (int)entry.size;
+    return 0;
+}
+
+int
+pack_store_write (PackStore *store,
+                  const char *store_id,
+                  const char *id,
+                  const void *data,
+                  int len)
+{
+    unsigned char raw[20];
+    PackWriter *w;
+    IndexSlot slot, old;
+    guint64 pos;
+    int found;
+    int ret = 0;
+
+    if (id_to_raw (id, raw) < 0 || len < 0)
+        return -1;
+
+    if (lock_store (store, store_id, TRUE, &w) != 0)
+        return -1;
+
+    found = index_find (w->index_fd, w->hdr.n_slots, raw, &pos, &old);
+    if (found < 0) {
+        ret = -1;
+        goto out;
+    }
+    if (found && old.state == SLOT_LIVE)
+        goto out;
+
+    memcpy (slot.id, raw, 20);
+    slot.state = SLOT_LIVE;
+    slot.size = (guint32)len;
+    if (append_record (store, w, RECORD_DATA, raw, data, (guint32)len,
+                       &slot.pack_id, &slot.offset) < 0 ||
+        index_set (w->index_fd, &w->hdr, pos, found, &old, &slot) < 0 ||
+        write_index_header (w->index_fd, &w->hdr) < 0 ||
+        maybe_grow_index (w) < 0)
+        ret = -1;
+
+out:
+    unlock_store (store, w);
+    return ret;
+}
+
+gboolean
+pack_store_exists (PackStore *store,
+                   const char *store_id,
+                   const char *id)
+{
+    unsigned char raw[20];
+    IndexSlot slot;
+
+    if (id_to_raw (id, raw) < 0)
+        return FALSE;
+
+    return lookup_slot (store, store_id, raw, &slot);
+}
+
+int
+pack_store_exists_batch (PackStore *store,
+                         const char *store_id,
+                         int n,
+                         const char **ids,
+                         gboolean *results)
+{
+    char *dir = store_dir (store, store_id);
+    char *path = g_build_filename (dir, "index", NULL);
+    unsigned char raw[20];
+    IndexHeader hdr;
+    IndexSlot slot;
+    guint64 pos;
+    int fd, i;
+
+    memset (results, 0, sizeof(gboolean) * n);
+
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0)
+        goto out;
+
+    if (read_index_header (fd, &hdr) < 0) {
+        close (fd);
+        goto out;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (id_to_raw (ids[i], raw) < 0)
+            continue;
+        results[i] = (index_find (fd, hdr.n_slots, raw, &pos, &slot) > 0 &&
+                      slot.state == SLOT_LIVE);
+    }
+
+    close (fd);
+
+out:
+    g_free (path);
+    g_free (dir);
+    return 0;
+}
+
+int
+pack_store_stat (PackStore *store,
+                 const char *store_id,
+                 const char *id,
+                 guint32 *size)
+{
+    unsigned char raw[20];
+    IndexSlot slot;
+
+    if (id_to_raw (id, raw) < 0 || !lookup_slot (store, store_id, raw, &slot))
+        return -1;
+
+    *size = slot.size;
+    return 0;
+}
+
+int
+pack_store_remove (PackStore *store,
+                   const char *store_id,
+                   const char *id)
+{
+    unsigned char raw[20];
+    unsigned char body[TOMBSTONE_SIZE];
+    PackWriter *w;
+    IndexSlot slot, old;
+    guint32 pack_id;
+    gint64 offset;
+    guint64 pos;
+    int found;
+    int ret = 0;
+
+    if (id_to_raw (id, raw) < 0)
+        return -1;
+
+    ret = lock_store (store, store_id, FALSE, &w);
+    if (ret != 0)
+        return -1;
+
+    found = index_find (w->index_fd, w->hdr.n_slots, raw, &pos, &old);
+    if (found <= 0 || old.state != SLOT_LIVE) {
+        ret = -1;
+        goto out;
+    }
+
+    memset (body, 0, sizeof(body));
+    memcpy (body, &old.pack_id, 4);
+    memcpy (body + 8, &old.offset, 8);
+
+    slot = old;
+    slot.state = SLOT_DELETED;
+    if (append_record (store, w, RECORD_TOMBSTONE, raw, body, TOMBSTONE_SIZE,
+                       &pack_id, &offset) < 0 ||
+        index_set (w->index_fd, &w->hdr, pos, found, &old, &slot) < 0 ||
+        write_index_header (w->index_fd, &w->hdr) < 0)
+        ret = -1;
+
+out:
+    unlock_store (store, w);
+    return ret;
+}
+
+int
+pack_store_foreach (PackStore *store,
+                    const char *store_id,
+                    PackStoreFunc func,
+                    void *user_data)
+{
+    char *dir = store_dir (store, store_id);
+    char *path = g_build_filename (dir, "index", NULL);
+    unsigned char *buf = NULL;
+    IndexHeader hdr;
+    IndexSlot slot;
+    char hex[41];
+    guint64 i;
+    int fd, n, k;
+    int ret = 0;
+
+    /* The open file stays valid if the index is rebuilt meanwhile. */
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0)
+        goto out;
+
+    if (read_index_header (fd, &hdr) < 0) {
+        seaf_warning ("Pack index %s is corrupted.\n", path);
+        ret = -1;
+        goto out;
+    }
+
+    buf = g_malloc (INDEX_SCAN_SLOTS * INDEX_SLOT_SIZE);
+    for (i = 0; i < hdr.n_slots; i += n) {
+        n = (int) MIN ((guint64)INDEX_SCAN_SLOTS, hdr.n_slots - i);
+        if (preadn (fd, buf, n * INDEX_SLOT_SIZE, slot_offset(i)) !=
+            n * INDEX_SLOT_SIZE) {
+            seaf_warning ("Failed to read pack index %s.\n", path);
+            ret = -1;
+            goto out;
+        }
+        for (k = 0; k < n; ++k) {
+            decode_slot (buf + k * INDEX_SLOT_SIZE, &slot);
+            if (slot.state != SLOT_LIVE)
+                continue;
+            rawdata_to_hex (slot.id, hex, 20);
+            if (!func (store_id, hex, user_data))
+                goto out;
+        }
+    }
+
+out:
+    if (fd >= 0)
+        close (fd);
+    g_free (buf);
+    g_free (path);
+    g_free (dir);
+    return ret;
+}
+
+int
+pack_store_copy (PackStore *store,
+                 const char *src_store_id,
+                 const char *dst_store_id,
+                 const char *id)
+{
+    void *data = NULL;
+    int len;
+    int ret;
+
+    if (pack_store_exists (store, dst_store_id, id))
+        return 0;
+
+    if (pack_store_read (store, src_store_id, id, &data, &len) < 0) {
+        seaf_warning ("Failed to read object %s from store %s.\n",
+                      id, src_store_id);
+        return -1;
+    }
+
+    ret = pack_store_write (store, dst_store_id, id, data, len);
+    g_free (data);
+    return ret;
+}
+
+int
+pack_store_sync (PackStore *store, const char *store_id)
+{
+    PackWriter *w;
+    int ret;
+
+    ret = lock_store (store, store_id, FALSE, &w);
+    if (ret != 0)
+        return (ret > 0) ? 0 : -1;
+
+    /* Nothing was written since the last sync, which may have been done
+     * for another caller's write.
+     */
+    if (w->hdr.tail_pack == w->synced_pack &&
+        w->hdr.tail_offset == w->synced_offset)
+        goto out;
+
+    if (w->hdr.tail_pack > 0) {
+        if (w->append_fd >= 0 && w->append_pack == w->hdr.tail_pack) {
+            if (fsync (w->append_fd) < 0 && errno != EINVAL) {
+                seaf_warning ("Failed to sync pack %08x in %s: %s.\n",
+                              w->append_pack, w->dir, strerror(errno));
+                ret = -1;
+            }
+        } else if (sync_pack (w->dir, w->hdr.tail_pack) < 0) {
+            ret = -1;
+        }
+    }
+    /* The index is synced after the data it points to. */
+    if (ret == 0 && fsync (w->index_fd) < 0 && errno != EINVAL) {
+        seaf_warning ("Failed to sync pack index in %s: %s.\n",
+                      w->dir, strerror(errno));
+        ret = -1;
+    }
+    if (ret == 0) {
+        w->synced_pack = w->hdr.tail_pack;
+        w->synced_offset = w->hdr.tail_offset;
+    }
+
+out:
+    unlock_store (store, w);
+    return ret;
+}
+
+int
+pack_store_remove_store (PackStore *store, const char *store_id)
+{
+    PackWriter *w;
+    GDir *dir;
+    const char *dname;
+    char *path;
+    int ret;
+
+    ret = lock_store (store, store_id, FALSE, &w);
+    if (ret != 0)
+        return (ret > 0) ? 0 : -1;
+
+    dir = g_dir_open (w->dir, 0, NULL);
+    if (dir) {
+        while ((dname = g_dir_read_name (dir)) != NULL) {
+            if (strcmp (dname, "lock") == 0)
+                continue;
+            path = g_build_filename (w->dir, dname, NULL);
+            g_unlink (path);
+            g_free (path);
+        }
+        g_dir_close (dir);
+    }
+
+    /* Writers waiting for the lock notice that it's unlinked. */
+    path = g_build_filename (w->dir, "lock", NULL);
+    g_unlink (path);
+    g_free (path);
+    g_rmdir (w->dir);
+
+    w->removed = TRUE;
+    unlock_store (store, w);
+    return 0;
+}
+
+/*
+ * Returns whether the record at @offset in pack @pack_id has to be kept.
+ * Data records are kept while the index points to them, tombstones while
+ * the record they removed still exists in another pack.
+ */
+static gboolean
+record_is_live (PackWriter *w, int fd, guint32 pack_id, gint64 offset,
+                const Record *rec)
+{
+    IndexSlot slot;
+    guint64 pos;
+    guint32 rm_pack;
+    gint64 rm_offset;
+
+    if (rec->type == RECORD_DATA)
+        return (index_find (w->index_fd, w->hdr.n_slots, rec->id,
+                            &pos, &slot) == 1 &&
+                slot.state == SLOT_LIVE &&
+                slot.pack_id == pack_id && slot.offset == offset);
+
+    if (read_tombstone (fd, offset, &rm_pack, &rm_offset) < 0)
+        return FALSE;
+    return (rm_pack != pack_id && pack_exists (w->dir, rm_pack));
+}
+
+static int
+compact_pack (PackStore *store, PackWriter *w, guint32 pack_id,
+              gint64 *reclaimed)
+{
+    char *path = pack_path (w->dir, pack_id);
+    IndexSlot slot, old;
+    Record rec;
+    SeafStat st;
+    gint64 off, live = 0;
+    guint64 pos;
+    void *body = NULL;
+    guint32 new_pack;
+    gint64 new_offset;
+    int fd, found;
+    int ret = 0;
+
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        ret = (errno == ENOENT) ? 0 : -1;
+        goto out;
+    }
+    if (seaf_fstat (fd, &st) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    for (off = 0; off + RECORD_HEADER_SIZE <= st.st_size;
+         off += RECORD_HEADER_SIZE + rec.size) {
+        if (read_record (fd, off, &rec) < 0)
+            break;
+        if (record_is_live (w, fd, pack_id, off, &rec))
+            live += RECORD_HEADER_SIZE + rec.size;
+    }
+
+    if (live >= st.st_size * COMPACT_LIVE_RATIO)
+        goto out;
+
+    /* Don't append to the pack being compacted. */
+    if (pack_id == w->hdr.tail_pack) {
+        ++w->hdr.tail_pack;
+        w->hdr.tail_offset = 0;
+    }
+
+    for (off = 0; off + RECORD_HEADER_SIZE <= st.st_size;
+         off += RECORD_HEADER_SIZE + rec.size) {
+        if (read_record (fd, off, &rec) < 0)
+            break;
+        if (!record_is_live (w, fd, pack_id, off, &rec))
+            continue;
+
+        body = g_realloc (body, rec.size ? rec.size : 1);
+        if (preadn (fd, body, rec.size, off + RECORD_HEADER_SIZE) !=
+            (int)rec.size) {
+            seaf_warning ("Failed to read pack %s.\n", path);
+            ret = -1;
+            goto out;
+        }
+        if (append_record (store, w, rec.type, rec.id, body, rec.size,
+                           &new_pack, &new_offset) < 0) {
+            ret = -1;
+            goto out;
+        }
+
+        if (rec.type == RECORD_DATA) {
+            found = index_find (w->index_fd, w->hdr.n_slots, rec.id, &pos, &old);
+            if (found != 1) {
+                ret = -1;
+                goto out;
+            }
+            slot = old;
+            slot.pack_id = new_pack;
+            slot.offset = new_offset;
+            if (index_set (w->index_fd, &w->hdr, pos, found, &old, &slot) < 0) {
+                ret = -1;
+                goto out;
+            }
+        }
+    }
+
+    /* The copies must be on disk before the old pack is removed. */
+    if ((w->append_fd >= 0 && fsync (w->append_fd) < 0) ||
+        write_index_header (w->index_fd, &w->hdr) < 0 ||
+        fsync (w->index_fd) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (g_unlink (path) < 0) {
+        seaf_warning ("Failed to remove pack %s: %s.\n", path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+    *reclaimed += st.st_size - live;
+
+out:
+    if (fd >= 0)
+        close (fd);
+    g_free (body);
+    g_free (path);
+    return ret;
+}
+
+int
+pack_store_compact (PackStore *store, const char *store_id)
+{
+    char *dir = store_dir (store, store_id);
+    PackWriter *w;
+    GArray *ids;
+    guint i;
+    gint64 reclaimed = 0;
+    int ret = 0, rc;
+
+    ids = list_packs (dir);
+
+    /* Take the lock for each pack, so that writers aren't blocked for
+     * the whole compaction.
+     */
+    for (i = 0; i < ids->len; ++i) {
+        rc = lock_store (store, store_id, FALSE, &w);
+        if (rc != 0) {
+            ret = (rc > 0) ? 0 : -1;
+            break;
+        }
+
+        ret = compact_pack (store, w, g_array_index (ids, guint32, i),
+                            &reclaimed);
+
+        /* Drop deleted slots when they take a quarter of the index. */
+        if (ret == 0 && i == ids->len - 1 &&
+            (w->hdr.n_used - w->hdr.n_live) * 4 > w->hdr.n_slots)
+            ret = rebuild_index (w, index_size_for (w->hdr.n_live));
+
+        unlock_store (store, w);
+        if (ret < 0)
+            break;
+    }
+    g_array_free (ids, TRUE);
+
+    if (reclaimed > 0)
+        seaf_message ("Reclaimed %"G_GINT64_FORMAT" bytes from packs in %s.\n",
+                      reclaimed, dir);
+
+    g_free (dir);
+    return ret;
+}
@@ -0,0 +1,144 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef PACK_STORE_H
+#define PACK_STORE_H
+
+#include <glib.h>
+
+/*
+ * Pack store keeps content-addressed objects in large append-only pack
+ * files, instead of one file per object.
+ *
+ * Each store (usually a repo) has its own directory under the pack dir:
+ *
+ *   <pack_dir>/<store_id>/00000001.pack ...  append-only pack files
+ *   <pack_dir>/<store_id>/index              on-disk hash table, id -> location
+ *   <pack_dir>/<store_id>/lock               serializes writers across processes
+ *
+ * Every record in a pack has a header with the object id and size, so the
+ * index can always be rebuilt from the packs. Removing an object appends a
+ * tombstone record and marks the index slot as deleted. The space is
+ * reclaimed by pack_store_compact(), which rewrites packs with too few live
+ * records.
+ *
+ * Readers don't take any lock. Every location read from the index is
+ * checked against the record header in the pack, so a stale index is
+ * detected and reloaded.
+ *
+ * Writers keep the files of the last stores they locked open, and only
+ * reload the index header while relocking them.
+ */
+
+typedef struct PackStore PackStore;
+
+typedef struct PackEntry {
+    guint32 pack_id;
+    /* Offset of the object data in the pack. */
+    gint64 offset;
+    guint32 size;
+} PackEntry;
+
+typedef gboolean (*PackStoreFunc) (const char *store_id,
+                                   const char *id,
+                                   void *user_data);
+
+/*
+ * @max_pack_size: a new pack is started when the current one is about to
+ *                 exceed this size.
+ */
+PackStore *
+pack_store_new (const char *pack_dir, gint64 max_pack_size);
+
+/*
+ * Open the pack which contains object @id.
+ *
+ * Returns: a file descriptor for the pack, and the location of the object
+ *          in @entry. -1 if the object doesn't exist.
+ */
+int
+pack_store_open_entry (PackStore *store,
+                       const char *store_id,
+                       const char *id,
+                       PackEntry *entry);
+
+int
+pack_store_read (PackStore *store,
+                 const char *store_id,
+                 const char *id,
+                 void **data,
+                 int *len);
+
+/*
+ * Append object @id to the current pack. Nothing is written if the object
+ * already exists.
+ */
+int
+pack_store_write (PackStore *store,
+                  const char *store_id,
+                  const char *id,
+                  const void *data,
+                  int len);
+
+gboolean
+pack_store_exists (PackStore *store,
+                   const char *store_id,
+                   const char *id);
+
+/*
+ * Check the existence of @n objects with a single open of the index.
+ * Results are stored in @results.
+ */
+int
+pack_store_exists_batch (PackStore *store,
+                         const char *store_id,
+                         int n,
+                         const char **ids,
+                         gboolean *results);
+
+/* Returns 0 and the object size in @size, or -1 if it doesn't exist. */
+int
+pack_store_stat (PackStore *store,
+                 const char *store_id,
+                 const char *id,
+                 guint32 *size);
+
+int
+pack_store_remove (PackStore *store,
+                   const char *store_id,
+                   const char *id);
+
+/*
+ * Call @func for every live object in the store. No lock is held when @func
+ * is called, so it can remove objects.
+ */
+int
+pack_store_foreach (PackStore *store,
+                    const char *store_id,
+                    PackStoreFunc func,
+                    void *user_data);
+
+int
+pack_store_copy (PackStore *store,
+                 const char *src_store_id,
+                 const char *dst_store_id,
+                 const char *id);
+
+/*
+ * Flush the objects written to the store so far to disk. Writes are not
+ * synced by themselves, so callers batch them and sync once. The sync is
+ * skipped if nothing was written since the last one.
+ */
+int
+pack_store_sync (PackStore *store, const char *store_id);
+
+int
+pack_store_remove_store (PackStore *store, const char *store_id);
+
+/*
+ * Rewrite the packs in which less than half of the space is used by live
+ * objects, and remove them.
+ */
+int
+pack_store_compact (PackStore *store, const char *store_id);
+
+#endif
@@ -11,6 +11,7 @@
 
 #include "seafile-session.h"
 #include "fs-mgr.h"
+#include "obj-store.h"
 #include "repo-mgr.h"
 #include "seafile-error.h"
 #include "seafile-rpc.h"
@@ -18,6 +19,7 @@
 #ifdef SEAFILE_SERVER
 #include "monitor-rpc-wrappers.h"
 #include "web-accesstoken-mgr.h"
+#include "block-backend.h"
 #endif
 
 #ifndef SEAFILE_SERVER
@@ -387,16 +389,25 @@ seafile_get_clone_tasks (GError **error)
     GList *ret = NULL;
     CloneTask *task;
     SeafileCloneTask *t;
+    int done_files, total_files;
+    gint64 done_bytes, total_bytes;
 
     tasks = seaf_clone_manager_get_tasks (seaf->clone_mgr);
     for (ptr = tasks; ptr != NULL; ptr = ptr->next) {
         task = ptr->data;
+        index_progress_get (task->index_progress,
+                            &done_files, &total_files,
+                            &done_bytes, &total_bytes);
         t = g_object_new (SEAFILE_TYPE_CLONE_TASK,
                           "state", clone_task_state_to_str(task->state),
                           "error_str", clone_task_error_to_str(task->error),
                           "repo_id", task->repo_id,
                           "repo_name", task->repo_name,
                           "worktree", task->worktree,
+                          "index_done_files", done_files,
+                          "index_total_files", total_files,
+                          "index_done_bytes", done_bytes,
+                          "index_total_bytes", total_bytes,
                           NULL);
         ret = g_list_prepend (ret, t);
     }
@@ -3237,6 +3248,7 @@ seafile_list_file (const char *repo_id,
     SeafRepo *repo;
     Seafile *file;
     GString *buf = g_string_new ("");
+    char block_id[41];
     int index = 0;
 
     if (!repo_id || !is_uuid_valid(repo_id) || file_id == NULL) {
@@ -3271,7 +3283,8 @@ seafile_list_file (const char *repo_id,
             if (index >= offset + limit)
                 break;
         }
-        g_string_append_printf (buf, "%s\n", file->blk_sha1s[index]);
+        g_string_append_printf (buf, "%s\n",
+                                seafile_get_block_id (file, index, block_id));
     }
 
     seafile_unref (file);
@@ -3305,7 +3318,7 @@ seafile_list_dir (const char *repo_id,
     SeafDirent *dent;
     SeafileDirent *d;
     GList *res = NULL;
-    GList *p;
+    GList *sorted, *p;
 
     if (!repo_id || !is_uuid_valid(repo_id) || dir_id == NULL) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_DIR_ID, "Bad dir id");
@@ -3326,14 +3339,15 @@ seafile_list_dir (const char *repo_id,
         return NULL;
     }
 
-    dir->entries = g_list_sort (dir->entries, comp_dirent_func);
+    /* The dir may be shared, sort a copy of the list. */
+    sorted = g_list_sort (g_list_copy (dir->entries), comp_dirent_func);
 
     if (offset < 0) {
         offset = 0;
     }
 
     int index = 0;
-    for (p = dir->entries; p != NULL; p = p->next, index++) {
+    for (p = sorted; p != NULL; p = p->next, index++) {
         if (index < offset) {
             continue;
         }
@@ -3356,6 +3370,7 @@ seafile_list_dir (const char *repo_id,
         res = g_list_prepend (res, d);
     }
 
+    g_list_free (sorted);
     seaf_dir_free (dir);
     seaf_repo_unref (repo);
     res = g_list_reverse (res);
@@ -3852,6 +3867,189 @@ seafile_get_system_default_repo_id (GError **error)
     return get_system_default_repo_id(seaf);
 }
 
+/* Block cache */
+
+char *
+seafile_get_block_cache_stats (GError **error)
+{
+    BlockCacheStats stats;
+
+    if (!seaf_block_manager_get_cache_stats (seaf->block_mgr, &stats)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Block cache is not enabled");
+        return NULL;
+    }
+
+    return g_strdup_printf ("{\"hits\": %"G_GUINT64_FORMAT", "
+                            "\"misses\": %"G_GUINT64_FORMAT", "
+                            "\"evictions\": %"G_GUINT64_FORMAT", "
+                            "\"blocks\": %"G_GUINT64_FORMAT", "
+                            "\"size\": %"G_GINT64_FORMAT", "
+                            "\"capacity\": %"G_GINT64_FORMAT"}",
+                            stats.hits, stats.misses, stats.evictions,
+                            stats.n_blocks, stats.size, stats.capacity);
+}
+
+/* Commit cache */
+
+char *
+seafile_get_commit_cache_stats (GError **error)
+{
+    CommitCacheStats stats;
+
+    if (!seaf_commit_manager_get_cache_stats (seaf->commit_mgr, &stats)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Commit cache is not enabled");
+        return NULL;
+    }
+
+    return g_strdup_printf ("{\"hits\": %"G_GUINT64_FORMAT", "
+                            "\"misses\": %"G_GUINT64_FORMAT", "
+                            "\"evictions\": %"G_GUINT64_FORMAT", "
+                            "\"commits\": %"G_GUINT64_FORMAT", "
+                            "\"capacity\": %"G_GUINT64_FORMAT"}",
+                            stats.hits, stats.misses, stats.evictions,
+                            stats.n_commits, stats.capacity);
+}
+
+/* Path cache */
+
+char *
+seafile_get_path_cache_stats (GError **error)
+{
+    PathCacheStats stats;
+
+    if (!seaf_fs_manager_get_path_cache_stats (seaf->fs_mgr, &stats)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Path cache is not enabled");
+        return NULL;
+    }
+
+    return g_strdup_printf ("{\"hits\": %"G_GUINT64_FORMAT", "
+                            "\"misses\": %"G_GUINT64_FORMAT", "
+                            "\"evictions\": %"G_GUINT64_FORMAT", "
+                            "\"entries\": %"G_GUINT64_FORMAT", "
+                            "\"capacity\": %"G_GUINT64_FORMAT"}",
+                            stats.hits, stats.misses, stats.evictions,
+                            stats.n_entries, stats.capacity);
+}
+
+/* Block compression */
+
+char *
+seafile_get_block_compress_stats (GError **error)
+{
+    BlockCompressStats stats;
+    double ratio = 1.0;
+
+    if (!seaf_block_manager_get_compress_stats (seaf->block_mgr, &stats)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Block compression is not enabled");
+        return NULL;
+    }
+
+    /* Ratio of logical to stored bytes over all blocks written. */
+    if (stats.stored_bytes > 0)
+        ratio = (double)stats.raw_bytes / stats.stored_bytes;
+
+    return g_strdup_printf ("{\"compressed_blocks\": %"G_GUINT64_FORMAT", "
+                            "\"raw_blocks\": %"G_GUINT64_FORMAT", "
+                            "\"compressed_raw_bytes\": %"G_GUINT64_FORMAT", "
+                            "\"compressed_stored_bytes\": %"G_GUINT64_FORMAT", "
+                            "\"compression_ratio\": %.2f}",
+                            stats.n_compressed, stats.n_raw,
+                            stats.raw_bytes, stats.stored_bytes, ratio);
+}
+
+/* Block scrubber */
+
+char *
+seafile_get_block_scrubber_status (GError **error)
+{
+    BlockScrubberStatus st;
+    gint64 n_recorded;
+
+    block_scrubber_get_status (seaf->block_scrubber, &st);
+
+    /* Bad blocks found by all passes and not fixed since. */
+    n_recorded = block_scrubber_count_bad_blocks (seaf->block_scrubber);
+
+    return g_strdup_printf ("{\"enabled\": %s, \"running\": %s, "
+                            "\"passes\": %d, \"repos\": %d, "
+                            "\"repos_done\": %d, "
+                            "\"blocks_checked\": %"G_GINT64_FORMAT", "
+                            "\"bytes_checked\": %"G_GINT64_FORMAT", "
+                            "\"corrupt\": %"G_GINT64_FORMAT", "
+                            "\"unreadable\": %"G_GINT64_FORMAT", "
+                            "\"recorded_bad_blocks\": %"G_GINT64_FORMAT", "
+                            "\"pauses\": %"G_GINT64_FORMAT", "
+                            "\"pass_start_time\": %"G_GINT64_FORMAT", "
+                            "\"last_pass_end_time\": %"G_GINT64_FORMAT"}",
+                            st.enabled ? "true" : "false",
+                            st.running ? "true" : "false",
+                            st.n_passes, st.n_repos, st.n_repos_done,
+                            st.n_blocks_checked, st.bytes_checked,
+                            st.n_corrupt, st.n_unreadable,
+                            n_recorded, st.n_pauses,
+                            st.pass_start_time, st.last_pass_end_time);
+}
+
+/* Object store thread pools */
+
+static void
+format_obj_pool_stats (GString *buf, const char *name,
+                       ObjStoreAsyncPoolStats *st)
+{
+    g_string_append_printf (buf, "\"%s\": {\"threads\": %d, "
+                            "\"queued\": %u, "
+                            "\"ops\": %"G_GUINT64_FORMAT", "
+                            "\"failed\": %"G_GUINT64_FORMAT", "
+                            "\"avg_queue_usec\": %"G_GUINT64_FORMAT", "
+                            "\"max_queue_usec\": %"G_GUINT64_FORMAT", "
+                            "\"avg_io_usec\": %"G_GUINT64_FORMAT", "
+                            "\"max_io_usec\": %"G_GUINT64_FORMAT"}",
+                            name, st->n_threads, st->queued,
+                            st->n_ops, st->n_failed,
+                            st->n_ops > 0 ? st->total_queue_usec / st->n_ops : 0,
+                            st->max_queue_usec,
+                            st->n_ops > 0 ? st->total_io_usec / st->n_ops : 0,
+                            st->max_io_usec);
+}
+
+static void
+format_obj_store_stats (GString *buf, const char *name,
+                        struct SeafObjStore *obj_store)
+{
+    ObjStoreAsyncStats stats;
+
+    g_string_append_printf (buf, "\"%s\": ", name);
+    if (seaf_obj_store_get_async_stats (obj_store, &stats) < 0) {
+        g_string_append (buf, "null");
+        return;
+    }
+
+    g_string_append_c (buf, '{');
+    format_obj_pool_stats (buf, "read", &stats.read);
+    g_string_append (buf, ", ");
+    format_obj_pool_stats (buf, "write", &stats.write);
+    g_string_append (buf, ", ");
+    format_obj_pool_stats (buf, "stat", &stats.stat);
+    g_string_append_c (buf, '}');
+}
+
+char *
+seafile_get_obj_store_stats (GError **error)
+{
+    GString *buf = g_string_new ("{");
+
+    format_obj_store_stats (buf, "fs", seaf->fs_mgr->obj_store);
+    g_string_append (buf, ", ");
+    format_obj_store_stats (buf, "commits", seaf->commit_mgr->obj_store);
+    g_string_append_c (buf, '}');
+
+    return g_string_free (buf, FALSE);
+}
+
 static int
 update_valid_since_time (SeafRepo *repo, gint64 new_time)
 {
@@ -125,6 +125,7 @@ migrate_blocks (SeafFSManager *mgr,
                 GCData *data, const char *file_id)
 {
     Seafile *seafile;
+    char block_id[41];
     int i;
 
     seafile = seaf_fs_manager_get_seafile (mgr,
@@ -137,7 +138,8 @@ migrate_blocks (SeafFSManager *mgr,
     }
 
     for (i = 0; i < seafile->n_blocks; ++i) {
-        if (migrate_block (repo_id, seafile->blk_sha1s[i]) < 0)
+        seafile_get_block_id (seafile, i, block_id);
+        if (migrate_block (repo_id, block_id) < 0)
             data->migrate_block_failed = TRUE;
         ++data->traversed_blocks;
     }
@@ -388,6 +388,8 @@ clone_task_new (const char *repo_id,
     CloneTask *task = g_new0 (CloneTask, 1);
 
     memcpy (task->repo_id, repo_id, 37);
+    task->index_progress = g_new0 (IndexProgress, 1);
+    index_progress_init (task->index_progress);
     memcpy (task->peer_id, peer_id, 41);
     task->token = g_strdup (token);
     task->worktree = g_strdup(worktree);
@@ -416,6 +418,8 @@ clone_task_free (CloneTask *task)
     g_free (task->random_key);
     g_free (task->server_url);
     g_free (task->effective_url);
+    index_progress_destroy (task->index_progress);
+    g_free (task->index_progress);
 
     g_free (task);
 }
@@ -892,7 +896,8 @@ index_files_job (void *data)
                                         task->worktree,
                                         task->passwd, task->enc_version,
                                         task->random_key,
-                                        task->root_id) == 0)
+                                        task->root_id,
+                                        task->index_progress) == 0)
         aux->success = TRUE;
 
     return data;
@@ -7,6 +7,7 @@
 #include "db.h"
 
 struct _SeafileSession;
+struct IndexProgress;
 
 typedef struct _CloneTask CloneTask;
 typedef struct _SeafCloneManager SeafCloneManager;
@@ -59,6 +60,9 @@ struct _CloneTask {
     char                 root_id[41];
     gboolean             is_readonly;
 
+    /* Progress of indexing existing files in the worktree. */
+    struct IndexProgress *index_progress;
+
     /* Http sync fields */
     char                *server_url;
     char                *effective_url;
@@ -67,6 +67,7 @@ add_blocks_to_index (SeafFSManager *mgr,
 {
     Bloom *index = data->index;
     Seafile *seafile;
+    char block_id[41];
     int i;
 
     seafile = seaf_fs_manager_get_seafile (mgr,
@@ -79,7 +80,7 @@ add_blocks_to_index (SeafFSManager *mgr,
     }
 
     for (i = 0; i < seafile->n_blocks; ++i) {
-        bloom_add (index, seafile->blk_sha1s[i]);
+        bloom_add (index, seafile_get_block_id (seafile, i, block_id));
         ++data->traversed_blocks;
     }
 
@@ -2007,6 +2007,7 @@ block_list_diff_files (int n, const char *basedir, SeafDirent *files[], void *vd
     CalcBlockListData *data = vdata;
     HttpTxTask *task = data->task;
     Seafile *f1 = NULL, *f2 = NULL;
+    char block_id[41];
     int i;
 
     if (file1 && strcmp (file1->id, EMPTY_SHA1) != 0) {
@@ -2020,7 +2021,7 @@ block_list_diff_files (int n, const char *basedir, SeafDirent *files[], void *vd
             }
             for (i = 0; i < f1->n_blocks; ++i)
                 add_to_block_list (&data->block_list, data->added_blocks,
-                                   f1->blk_sha1s[i]);
+                                   seafile_get_block_id (f1, i, block_id));
             seafile_unref (f1);
         } else if (strcmp (file1->id, file2->id) != 0) {
             f1 = seaf_fs_manager_get_seafile (seaf->fs_mgr,
@@ -2039,15 +2040,15 @@ block_list_diff_files (int n, const char *basedir, SeafDirent *files[], void *vd
                 return -1;
             }
 
-            GHashTable *h = g_hash_table_new (g_str_hash, g_str_equal);
+            GHashTable *h = g_hash_table_new (ccnet_sha1_hash, ccnet_sha1_equal);
             int dummy;
             for (i = 0; i < f2->n_blocks; ++i)
-                g_hash_table_insert (h, f2->blk_sha1s[i], &dummy);
+                g_hash_table_insert (h, f2->blk_ids + i * 20, &dummy);
 
             for (i = 0; i < f1->n_blocks; ++i)
-                if (!g_hash_table_lookup (h, f1->blk_sha1s[i]))
+                if (!g_hash_table_lookup (h, f1->blk_ids + i * 20))
                     add_to_block_list (&data->block_list, data->added_blocks,
-                                       f1->blk_sha1s[i]);
+                                       seafile_get_block_id (f1, i, block_id));
 
             seafile_unref (f1);
             seafile_unref (f2);
@@ -3088,9 +3089,9 @@ http_tx_task_download_file_blocks (HttpTxTask *task, const char *file_id)
     }
 
     int i;
-    char *block_id;
+    char block_id[41];
     for (i = 0; i < file->n_blocks; ++i) {
-        block_id = file->blk_sha1s[i];
+        seafile_get_block_id (file, i, block_id);
         if (!seaf_block_manager_block_exists (seaf->block_mgr,
                                               task->repo_id,
                                               task->repo_version,
@@ -45,6 +45,11 @@ struct _SeafRepoManagerPriv {
     pthread_mutex_t db_lock;
     GHashTable *checkout_tasks_hash;
     pthread_rwlock_t lock;
+
+    /* Workers which index files for add_recursive(), shared by all repos.
+     * NULL if files are indexed serially.
+     */
+    GThreadPool *index_pool;
 };
 
 static const char *ignore_table[] = {
@@ -909,27 +914,416 @@ typedef struct _AddOptions {
     GList *group_perms;
     gboolean is_repo_ro;
     gboolean startup_scan;
+    IndexProgress *progress;
 } AddOptions;
 
-#ifndef WIN32
+void
+index_progress_init (IndexProgress *progress)
+{
+    memset (progress, 0, sizeof(IndexProgress));
+    pthread_mutex_init (&progress->lock, NULL);
+}
+
+void
+index_progress_destroy (IndexProgress *progress)
+{
+    pthread_mutex_destroy (&progress->lock);
+}
+
+void
+index_progress_get (IndexProgress *progress,
+                    int *done_files, int *total_files,
+                    gint64 *done_bytes, gint64 *total_bytes)
+{
+    pthread_mutex_lock (&progress->lock);
+    *done_files = progress->done_files;
+    *total_files = progress->total_files;
+    *done_bytes = progress->done_bytes;
+    *total_bytes = progress->total_bytes;
+    pthread_mutex_unlock (&progress->lock);
+}
+
+static void
+index_progress_add (IndexProgress *progress, gint64 size, gboolean done)
+{
+    if (!progress)
+        return;
+
+    pthread_mutex_lock (&progress->lock);
+    if (done) {
+        ++progress->done_files;
+        progress->done_bytes += size;
+    } else {
+        ++progress->total_files;
+        progress->total_bytes += size;
+    }
+    pthread_mutex_unlock (&progress->lock);
+}
 
 /*
- * @remain_files: returns the files haven't been added under this path.
- *                If it's set to NULL, no partial commit will be created.
+ * Parallel indexing.
+ *
+ * While add_recursive() walks the worktree, files that need to be indexed
+ * are handed to the index workers, which chunk, hash and write blocks.
+ * Every change to the index is queued as a job in traversal order, and
+ * applied by the walking thread in that order once the job is done. So the
+ * resulting index, and where a partial commit is cut, are the same as with
+ * serial indexing.
+ */
+
+/* How many jobs may be queued per worker before the walk waits. */
+#define INDEX_JOBS_PER_WORKER 4
+
+enum {
+    INDEX_JOB_FILE,
+    INDEX_JOB_EMPTY_DIR,
+};
+
+enum {
+    INDEX_RESULT_OK = 0,
+    INDEX_RESULT_ERROR,
+    /* The file is unchanged or can't be read, leave its entry as is. */
+    INDEX_RESULT_SKIP,
+};
+
+typedef struct IndexQueue IndexQueue;
+
+typedef struct IndexJob {
+    IndexQueue *queue;
+    int type;
+    char *path;
+    char *full_path;
+    SeafStat st;
+    /* FALSE if the file is unchanged or will go into the next commit.
+     * Such jobs are only queued to keep the order.
+     */
+    gboolean need_index;
+    /* Set from index_check_entry(). */
+    gboolean uptodate;
+    gboolean verify_id;
+    unsigned char old_sha1[20];
+    /* Report sync status of the file after it's applied. */
+    gboolean update_status;
+
+    /* Set by the worker. */
+    unsigned char sha1[20];
+    int result;
+    gboolean done;
+} IndexJob;
+
+struct IndexQueue {
+    const char *repo_id;
+    int version;
+    const char *modifier;
+    struct index_state *istate;
+    SeafileCrypt *crypt;
+    gint64 *total_size;
+    GQueue **remain_files;
+    IndexProgress *progress;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Jobs in traversal order. */
+    GQueue *jobs;
+    int max_jobs;
+};
+
+static void
+index_job_free (IndexJob *job)
+{
+    g_free (job->path);
+    g_free (job->full_path);
+    g_free (job);
+}
+
+static void
+index_worker (gpointer data, gpointer user_data)
+{
+    IndexJob *job = data;
+    IndexQueue *queue = job->queue;
+    int result = INDEX_RESULT_OK;
+
+    if (job->verify_id) {
+        /* Only the timestamps may have changed, don't write blocks if the
+         * content is the same.
+         */
+        if (index_cb (queue->repo_id, queue->version, job->full_path,
+                      job->sha1, queue->crypt, FALSE) < 0)
+            result = INDEX_RESULT_SKIP;
+        else if (memcmp (job->old_sha1, job->sha1, 20) == 0)
+            goto done;
+    }
+
+    if (result == INDEX_RESULT_OK &&
+        index_cb (queue->repo_id, queue->version, job->full_path,
+                  job->sha1, queue->crypt, TRUE) < 0)
+        result = INDEX_RESULT_ERROR;
+
+done:
+    index_progress_add (queue->progress, (gint64)job->st.st_size, TRUE);
+
+    pthread_mutex_lock (&queue->lock);
+    job->result = result;
+    job->done = TRUE;
+    pthread_cond_broadcast (&queue->cond);
+    pthread_mutex_unlock (&queue->lock);
+}
+
+static IndexQueue *
+index_queue_new (const char *repo_id,
+                 int version,
+                 const char *modifier,
+                 struct index_state *istate,
+                 SeafileCrypt *crypt,
+                 gint64 *total_size,
+                 GQueue **remain_files,
+                 IndexProgress *progress)
+{
+    GThreadPool *pool = seaf->repo_mgr->priv->index_pool;
+    IndexQueue *queue;
+
+    if (!pool)
+        return NULL;
+
+    queue = g_new0 (IndexQueue, 1);
+    queue->repo_id = repo_id;
+    queue->version = version;
+    queue->modifier = modifier;
+    queue->istate = istate;
+    queue->crypt = crypt;
+    queue->total_size = total_size;
+    queue->remain_files = remain_files;
+    queue->progress = progress;
+
+    pthread_mutex_init (&queue->lock, NULL);
+    pthread_cond_init (&queue->cond, NULL);
+    queue->jobs = g_queue_new ();
+    queue->max_jobs = g_thread_pool_get_max_threads (pool) * INDEX_JOBS_PER_WORKER;
+
+    return queue;
+}
+
+/* Apply a finished job to the index, on the walking thread. */
+static void
+apply_index_job (IndexQueue *queue, IndexJob *job)
+{
+    GQueue **remain_files = queue->remain_files;
+    gboolean added = FALSE;
+    int ret = 0;
+
+    if (remain_files && *remain_files != NULL) {
+        /* The blocks written for the file are simply not referenced yet.
+         * They'll be found when the file is indexed for the next commit.
+         */
+        g_queue_push_tail (*remain_files, g_strdup(job->path));
+        return;
+    }
+
+    if (job->type == INDEX_JOB_EMPTY_DIR) {
+        add_empty_dir_to_index (queue->istate, job->path, &job->st);
+        return;
+    }
+
+    /* Only known to be in this commit now that earlier jobs are applied. */
+    if (job->uptodate)
+        index_mark_entry_added (queue->istate, job->path);
+
+    if (job->need_index) {
+        if (job->result == INDEX_RESULT_ERROR) {
+            g_warning ("Failed to index file %s.\n", job->full_path);
+            ret = -1;
+        } else if (job->result == INDEX_RESULT_OK) {
+            ret = add_to_index_with_sha1 (queue->istate, job->path, &job->st,
+                                          job->sha1, queue->modifier, &added);
+        }
+    }
+
+    if (added && remain_files) {
+        *queue->total_size += (gint64)(job->st.st_size);
+        if (*queue->total_size >= MAX_COMMIT_SIZE)
+            *remain_files = g_queue_new ();
+    }
+
+    if (job->update_status) {
+        if (ret < 0)
+            seaf_sync_manager_update_active_path (seaf->sync_mgr,
+                                                  queue->repo_id,
+                                                  job->path,
+                                                  S_IFREG,
+                                                  SYNC_STATUS_ERROR);
+        else if (!added)
+            /* If the contents of the file doesn't change, move it to
+               synced status.
+            */
+            seaf_sync_manager_update_active_path (seaf->sync_mgr,
+                                                  queue->repo_id,
+                                                  job->path,
+                                                  S_IFREG,
+                                                  SYNC_STATUS_SYNCED);
+    }
+}
+
+/*
+ * Apply finished jobs from the head of the queue, and wait until at most
+ * @max_jobs jobs are left.
  */
+static void
+index_queue_apply (IndexQueue *queue, int max_jobs)
+{
+    IndexJob *job;
+
+    while (1) {
+        pthread_mutex_lock (&queue->lock);
+        job = g_queue_peek_head (queue->jobs);
+        if (!job) {
+            pthread_mutex_unlock (&queue->lock);
+            break;
+        }
+        if (!job->done) {
+            if (g_queue_get_length (queue->jobs) <= max_jobs) {
+                pthread_mutex_unlock (&queue->lock);
+                break;
+            }
+            while (!job->done)
+                pthread_cond_wait (&queue->cond, &queue->lock);
+        }
+        g_queue_pop_head (queue->jobs);
+        pthread_mutex_unlock (&queue->lock);
+
+        apply_index_job (queue, job);
+        index_job_free (job);
+    }
+}
+
+static gboolean
+index_queue_is_empty (IndexQueue *queue)
+{
+    gboolean ret;
+
+    pthread_mutex_lock (&queue->lock);
+    ret = g_queue_is_empty (queue->jobs);
+    pthread_mutex_unlock (&queue->lock);
+
+    return ret;
+}
+
+static void
+index_queue_push (IndexQueue *queue, IndexJob *job)
+{
+    GError *error = NULL;
+
+    job->queue = queue;
+    job->done = !job->need_index;
+
+    pthread_mutex_lock (&queue->lock);
+    g_queue_push_tail (queue->jobs, job);
+    pthread_mutex_unlock (&queue->lock);
+
+    if (job->need_index) {
+        index_progress_add (queue->progress, (gint64)job->st.st_size, FALSE);
+
+        g_thread_pool_push (seaf->repo_mgr->priv->index_pool, job, &error);
+        if (error) {
+            g_warning ("Failed to start indexing %s: %s.\n",
+                       job->path, error->message);
+            g_clear_error (&error);
+            pthread_mutex_lock (&queue->lock);
+            job->result = INDEX_RESULT_ERROR;
+            job->done = TRUE;
+            pthread_mutex_unlock (&queue->lock);
+        }
+    }
+
+    index_queue_apply (queue, queue->max_jobs);
+}
+
+/*
+ * Queue a regular file found by the walk. If it needs to be indexed, it's
+ * handed to a worker.
+ */
+static void
+index_queue_add_file (IndexQueue *queue,
+                      const char *path,
+                      const char *full_path,
+                      SeafStat *st,
+                      gboolean update_status)
+{
+    GQueue **remain_files = queue->remain_files;
+    IndexJob *job;
+    gboolean uptodate = FALSE;
+    gboolean pending = !index_queue_is_empty (queue);
+
+    /* No queued file can end the commit any more. */
+    if (remain_files && *remain_files != NULL && !pending) {
+        g_queue_push_tail (*remain_files, g_strdup(path));
+        return;
+    }
+
+    job = g_new0 (IndexJob, 1);
+    job->type = INDEX_JOB_FILE;
+    job->st = *st;
+    job->update_status = update_status;
+
+    if (!remain_files || *remain_files == NULL) {
+        uptodate = index_check_entry (queue->istate, path, st,
+                                      job->old_sha1, &job->verify_id);
+        job->need_index = !uptodate;
+        job->uptodate = uptodate;
+    }
+
+    /* An unchanged file is only queued if a queued file may still end the
+     * commit before it, or to report its status in order.
+     */
+    if (uptodate && !update_status && (!remain_files || !pending)) {
+        index_mark_entry_added (queue->istate, path);
+        g_free (job);
+        return;
+    }
+
+    job->path = g_strdup (path);
+    job->full_path = g_strdup (full_path);
+    index_queue_push (queue, job);
+}
+
+static void
+index_queue_add_empty_dir (IndexQueue *queue, const char *path, SeafStat *st)
+{
+    IndexJob *job = g_new0 (IndexJob, 1);
+
+    job->type = INDEX_JOB_EMPTY_DIR;
+    job->path = g_strdup (path);
+    job->st = *st;
+    index_queue_push (queue, job);
+}
+
+/* Wait for all queued jobs and apply them. */
+static void
+index_queue_finish (IndexQueue *queue)
+{
+    index_queue_apply (queue, 0);
+
+    g_queue_free (queue->jobs);
+    pthread_mutex_destroy (&queue->lock);
+    pthread_cond_destroy (&queue->cond);
+    g_free (queue);
+}
+
+#ifndef WIN32
+
 static int
-add_recursive (const char *repo_id,
-               int version,
-               const char *modifier,
-               struct index_state *istate, 
-               const char *worktree,
-               const char *path,
-               SeafileCrypt *crypt,
-               gboolean ignore_empty_dir,
-               GList *ignore_list,
-               gint64 *total_size,
-               GQueue **remain_files,
-               AddOptions *options)
+add_path_recursive (const char *repo_id,
+                    int version,
+                    const char *modifier,
+                    struct index_state *istate, 
+                    const char *worktree,
+                    const char *path,
+                    SeafileCrypt *crypt,
+                    gboolean ignore_empty_dir,
+                    GList *ignore_list,
+                    gint64 *total_size,
+                    GQueue **remain_files,
+                    AddOptions *options,
+                    IndexQueue *queue)
 {
     char *full_path;
     GDir *dir;
@@ -962,7 +1356,9 @@ add_recursive (const char *repo_id,
             return ret;
         }
 
-        if (!remain_files) {
+        if (queue) {
+            index_queue_add_file (queue, path, full_path, &st, FALSE);
+        } else if (!remain_files) {
             ret = add_to_index (repo_id, version, istate, path, full_path,
                                 &st, 0, crypt, index_cb, modifier, &added);
         } else if (*remain_files == NULL) {
@@ -1003,10 +1399,11 @@ add_recursive (const char *repo_id,
             subpath = g_build_path (PATH_SEPERATOR, path, dname, NULL);
 #endif
 
-            ret = add_recursive (repo_id, version, modifier,
-                                 istate, worktree, subpath,
-                                 crypt, ignore_empty_dir, ignore_list,
-                                 total_size, remain_files, options);
+            ret = add_path_recursive (repo_id, version, modifier,
+                                      istate, worktree, subpath,
+                                      crypt, ignore_empty_dir, ignore_list,
+                                      total_size, remain_files, options,
+                                      queue);
             g_free (subpath);
         }
         g_dir_close (dir);
@@ -1016,7 +1413,9 @@ add_recursive (const char *repo_id,
              is_path_writable(options->user_perms, options->group_perms,
                               options->is_repo_ro, path)))
         {
-            if (!remain_files || *remain_files == NULL)
+            if (queue)
+                index_queue_add_empty_dir (queue, path, &st);
+            else if (!remain_files || *remain_files == NULL)
                 add_empty_dir_to_index (istate, path, &st);
             else
                 g_queue_push_tail (*remain_files, g_strdup(path));
@@ -1027,6 +1426,41 @@ add_recursive (const char *repo_id,
     return 0;
 }
 
+/*
+ * @remain_files: returns the files haven't been added under this path.
+ *                If it's set to NULL, no partial commit will be created.
+ */
+static int
+add_recursive (const char *repo_id,
+               int version,
+               const char *modifier,
+               struct index_state *istate, 
+               const char *worktree,
+               const char *path,
+               SeafileCrypt *crypt,
+               gboolean ignore_empty_dir,
+               GList *ignore_list,
+               gint64 *total_size,
+               GQueue **remain_files,
+               AddOptions *options)
+{
+    IndexQueue *queue;
+    int ret;
+
+    queue = index_queue_new (repo_id, version, modifier, istate, crypt,
+                             total_size, remain_files,
+                             options ? options->progress : NULL);
+
+    ret = add_path_recursive (repo_id, version, modifier, istate, worktree,
+                              path, crypt, ignore_empty_dir, ignore_list,
+                              total_size, remain_files, options, queue);
+
+    if (queue)
+        index_queue_finish (queue);
+
+    return ret;
+}
+
 static gboolean
 is_empty_dir (const char *path, GList *ignore_list)
 {
@@ -1063,7 +1497,8 @@ add_file (const char *repo_id,
           SeafileCrypt *crypt,
           gint64 *total_size,
           GQueue **remain_files,
-          AddOptions *options)
+          AddOptions *options,
+          IndexQueue *queue)
 {
     gboolean added = FALSE;
     int ret = 0;
@@ -1111,6 +1546,11 @@ add_file (const char *repo_id,
         }
     }
 
+    if (queue) {
+        index_queue_add_file (queue, path, full_path, st, TRUE);
+        return ret;
+    }
+
     if (!remain_files) {
         ret = add_to_index (repo_id, version, istate, path, full_path,
                             st, 0, crypt, index_cb, modifier, &added);
@@ -1163,6 +1603,7 @@ typedef struct AddParams {
     gint64 *total_size;
     GQueue **remain_files;
     AddOptions *options;
+    IndexQueue *queue;
 } AddParams;
 
 typedef struct IterCBData {
@@ -1227,7 +1668,8 @@ iter_dir_cb (wchar_t *full_parent_w,
                         params->crypt,
                         params->total_size,
                         params->remain_files,
-                        params->options);
+                        params->options,
+                        params->queue);
 
     ++(data->n);
 
@@ -1301,7 +1743,9 @@ add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
     }
 
     if (data.n == 0 && path[0] != 0 && !params->ignore_empty_dir && is_writable) {
-        if (!params->remain_files || *(params->remain_files) == NULL)
+        if (params->queue)
+            index_queue_add_empty_dir (params->queue, path, st);
+        else if (!params->remain_files || *(params->remain_files) == NULL)
             add_empty_dir_to_index (params->istate, path, st);
         else
             g_queue_push_tail (*(params->remain_files), g_strdup(path));
@@ -1352,7 +1796,8 @@ add_recursive (const char *repo_id,
                         crypt,
                         total_size,
                         remain_files,
-                        options);
+                        options,
+                        NULL);
     } else if (S_ISDIR(st.st_mode)) {
         AddParams params = {
             .repo_id = repo_id,
@@ -1368,7 +1813,14 @@ add_recursive (const char *repo_id,
             .options = options,
         };
 
+        params.queue = index_queue_new (repo_id, version, modifier, istate,
+                                        crypt, total_size, remain_files,
+                                        options ? options->progress : NULL);
+
         ret = add_dir_recursive (path, full_path, &st, &params, FALSE);
+
+        if (params.queue)
+            index_queue_finish (params.queue);
     }
 
     g_free (full_path);
@@ -2636,7 +3088,8 @@ seaf_repo_index_worktree_files (const char *repo_id,
                                 const char *passwd,
                                 int enc_version,
                                 const char *random_key,
-                                char *root_id)
+                                char *root_id,
+                                IndexProgress *progress)
 {
     char index_path[SEAF_PATH_MAX];
     struct index_state istate;
@@ -2644,10 +3097,14 @@ seaf_repo_index_worktree_files (const char *repo_id,
     SeafileCrypt *crypt = NULL;
     struct cache_tree *it = NULL;
     GList *ignore_list = NULL;
+    AddOptions options;
 
     memset (&istate, 0, sizeof(istate));
     snprintf (index_path, SEAF_PATH_MAX, "%s/%s", seaf->repo_mgr->index_dir, repo_id);
 
+    memset (&options, 0, sizeof(options));
+    options.progress = progress;
+
     /* Remove existing index. An existing index signifies an interrupted
      * clone-merge. Removing it assures that new blocks from the worktree
      * get added into the repo again (they're deleted by GC).
@@ -2675,7 +3132,7 @@ seaf_repo_index_worktree_files (const char *repo_id,
      */
     if (add_recursive (repo_id, repo_version, modifier,
                        &istate, worktree, "", crypt, FALSE, ignore_list,
-                       NULL, NULL, NULL) < 0)
+                       NULL, NULL, &options) < 0)
         goto error;
 
     remove_deleted (&istate, worktree, "", ignore_list, NULL, NULL, NULL, FALSE);
@@ -3551,15 +4008,18 @@ static void
 cleanup_file_blocks (const char *repo_id, int version, const char *file_id)
 {
     Seafile *file;
+    char block_id[41];
     int i;
 
     file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
                                         repo_id, version,
                                         file_id);
-    for (i = 0; i < file->n_blocks; ++i)
+    for (i = 0; i < file->n_blocks; ++i) {
+        seafile_get_block_id (file, i, block_id);
         seaf_block_manager_remove_block (seaf->block_mgr,
                                          repo_id, version,
-                                         file->blk_sha1s[i]);
+                                         block_id);
+    }
 
     seafile_unref (file);
 }
@@ -4359,6 +4819,19 @@ seaf_repo_manager_init (SeafRepoManager *mgr)
         return -1;
     }
 
+    if (mgr->seaf->index_workers > 1) {
+        GError *error = NULL;
+
+        mgr->priv->index_pool = g_thread_pool_new (index_worker, NULL,
+                                                   mgr->seaf->index_workers,
+                                                   FALSE, &error);
+        if (!mgr->priv->index_pool) {
+            g_warning ("Failed to start index workers: %s.\n",
+                       error ? error->message : "");
+            g_clear_error (&error);
+        }
+    }
+
     /* Load all the repos into memory on the client side. */
     load_repos (mgr, mgr->seaf->seaf_dir);
 
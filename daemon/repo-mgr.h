@@ -138,6 +138,29 @@ seaf_repo_get_commits (SeafRepo *repo);
 int
 seaf_repo_index_add (SeafRepo *repo, const char *path);
 
+/* Progress of indexing files, updated by the index workers. */
+typedef struct IndexProgress {
+    pthread_mutex_t lock;
+    int total_files;
+    int done_files;
+    gint64 total_bytes;
+    gint64 done_bytes;
+} IndexProgress;
+
+void
+index_progress_init (IndexProgress *progress);
+
+void
+index_progress_destroy (IndexProgress *progress);
+
+void
+index_progress_get (IndexProgress *progress,
+                    int *done_files, int *total_files,
+                    gint64 *done_bytes, gint64 *total_bytes);
+
+/*
+ * @progress: if not NULL, updated as files are indexed.
+ */
 int
 seaf_repo_index_worktree_files (const char *repo_id,
                                 int version,
@@ -146,7 +169,8 @@ seaf_repo_index_worktree_files (const char *repo_id,
                                 const char *passwd,
                                 int enc_version,
                                 const char *random_key,
-                                char *root_id);
+                                char *root_id,
+                                IndexProgress *progress);
 
 int
 seaf_repo_index_rm (SeafRepo *repo, const char *path);
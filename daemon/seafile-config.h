@@ -17,6 +17,8 @@
 #define KEY_ALLOW_INVALID_WORKTREE "allow_invalid_worktree"
 #define KEY_ALLOW_REPO_NOT_FOUND_ON_SERVER "allow_repo_not_found_on_server"
 #define KEY_SYNC_EXTRA_TEMP_FILE "sync_extra_temp_file"
+/* Number of threads to index files in worktree. 1 means serial indexing. */
+#define KEY_INDEX_WORKERS "index_workers"
 
 /* Http sync settings. */
 #define KEY_ENABLE_HTTP_SYNC "enable_http_sync"
@@ -30,6 +30,7 @@
 #include "client-migrate.h"
 
 #define MAX_THREADS 50
+#define DEFAULT_INDEX_WORKERS 8
 
 enum {
 	REPO_COMMITTED,
@@ -220,6 +221,11 @@ seafile_session_prepare (SeafileSession *session)
     session->disable_verify_certificate = seafile_session_config_get_bool
         (session, KEY_DISABLE_VERIFY_CERTIFICATE);
 
+    session->index_workers = seafile_session_config_get_int
+        (session, KEY_INDEX_WORKERS, NULL);
+    if (session->index_workers <= 0)
+        session->index_workers = MIN (get_cpu_count (), DEFAULT_INDEX_WORKERS);
+
     session->use_http_proxy = seafile_session_config_get_bool
         (session, KEY_USE_PROXY);
     session->http_proxy_type = seafile_session_config_get_string
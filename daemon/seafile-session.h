@@ -76,6 +76,8 @@ struct _SeafileSession {
     gboolean             enable_http_sync;
     gboolean             disable_verify_certificate;
 
+    int                  index_workers;
+
     gboolean             use_http_proxy;
     char                *http_proxy_type;
     char                *http_proxy_addr;
@@ -1202,7 +1202,8 @@ load_locked_files_blocks (const char *repo_id)
             }
 
             for (i = 0; i < file->n_blocks; ++i) {
-                blk_id = g_strdup (file->blk_sha1s[i]);
+                blk_id = g_malloc (41);
+                seafile_get_block_id (file, i, blk_id);
                 g_hash_table_replace (block_id_hash, blk_id, blk_id);
             }
 
@@ -2222,15 +2223,18 @@ static void
 cleanup_file_blocks (const char *repo_id, int version, const char *file_id)
 {
     Seafile *file;
+    char block_id[41];
     int i;
 
     file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
                                         repo_id, version,
                                         file_id);
-    for (i = 0; i < file->n_blocks; ++i)
+    for (i = 0; i < file->n_blocks; ++i) {
+        seafile_get_block_id (file, i, block_id);
         seaf_block_manager_remove_block (seaf->block_mgr,
                                          repo_id, version,
-                                         file->blk_sha1s[i]);
+                                         block_id);
+    }
 
     seafile_unref (file);
 }
@@ -806,9 +806,9 @@ seaf_transfer_manager_download_file_blocks (SeafTransferManager *manager,
     }
 
     int i;
-    char *block_id;
+    char block_id[41];
     for (i = 0; i < file->n_blocks; ++i) {
-        block_id = file->blk_sha1s[i];
+        seafile_get_block_id (file, i, block_id);
         if (!seaf_block_manager_block_exists (seaf->block_mgr,
                                               task->repo_id,
                                               task->repo_version,
@@ -1011,6 +1011,7 @@ diff_files (int n, const char *basedir, SeafDirent *files[], void *vdata)
     BlockList *bl = data->bl;
     TransferTask *task = data->task;
     Seafile *f1 = NULL, *f2 = NULL;
+    char block_id[41];
     int i;
 
     if (file1 && strcmp (file1->id, EMPTY_SHA1) != 0) {
@@ -1023,7 +1024,7 @@ diff_files (int n, const char *basedir, SeafDirent *files[], void *vdata)
                 return -1;
             }
             for (i = 0; i < f1->n_blocks; ++i)
-                block_list_insert (bl, f1->blk_sha1s[i]);
+                block_list_insert (bl, seafile_get_block_id (f1, i, block_id));
             seafile_unref (f1);
         } else if (strcmp (file1->id, file2->id) != 0) {
             f1 = seaf_fs_manager_get_seafile (seaf->fs_mgr,
@@ -1042,14 +1043,14 @@ diff_files (int n, const char *basedir, SeafDirent *files[], void *vdata)
                 return -1;
             }
 
-            GHashTable *h = g_hash_table_new (g_str_hash, g_str_equal);
+            GHashTable *h = g_hash_table_new (ccnet_sha1_hash, ccnet_sha1_equal);
             int dummy;
             for (i = 0; i < f2->n_blocks; ++i)
-                g_hash_table_insert (h, f2->blk_sha1s[i], &dummy);
+                g_hash_table_insert (h, f2->blk_ids + i * 20, &dummy);
 
             for (i = 0; i < f1->n_blocks; ++i)
-                if (!g_hash_table_lookup (h, f1->blk_sha1s[i]))
-                    block_list_insert (bl, f1->blk_sha1s[i]);
+                if (!g_hash_table_lookup (h, f1->blk_ids + i * 20))
+                    block_list_insert (bl, seafile_get_block_id (f1, i, block_id));
 
             seafile_unref (f1);
             seafile_unref (f2);
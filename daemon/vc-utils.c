@@ -352,6 +352,7 @@ compare_file_content (const char *path, SeafStat *st, const unsigned char *ce_sh
         cdc.block_min_sz = cdc.block_sz >> 2;
         cdc.block_max_sz = cdc.block_sz << 2;
         cdc.write_block = seafile_write_chunk;
+        cdc.engine = cdc_engine_for_repo_version (repo_version);
         if (filename_chunk_cdc (path, &cdc, crypt, FALSE) < 0) {
             g_warning ("Failed to chunk file.\n");
             return -1;
@@ -1122,6 +1123,7 @@ fill_seafile_blocks (const char *repo_id, int version,
                      const unsigned char *sha1, BlockList *bl)
 {
     char file_id[41];
+    char block_id[41];
     Seafile *seafile;
     int i;
 
@@ -1133,7 +1135,7 @@ fill_seafile_blocks (const char *repo_id, int version,
     }
 
     for (i = 0; i < seafile->n_blocks; ++i)
-        block_list_insert (bl, seafile->blk_sha1s[i]);
+        block_list_insert (bl, seafile_get_block_id (seafile, i, block_id));
 
     seafile_unref (seafile);
 }
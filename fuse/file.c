@@ -21,36 +21,29 @@ int read_file(SeafileSession *seaf,
               off_t offset, struct fuse_file_info *info)
 {
     BlockHandle *handle = NULL;;
-    BlockMetadata *bmd;
-    char *blkid;
+    const guint64 *offsets;
+    char blkid[41];
     char *ptr;
     off_t off = 0, nleft;
     int i, n, ret = -EIO;
 
-    for (i = 0; i < file->n_blocks; i++) {
-        blkid = file->blk_sha1s[i];
-
-        bmd = seaf_block_manager_stat_block(seaf->block_mgr, store_id, version, blkid);
-        if (!bmd)
-            return -EIO;
-
-        if (offset < off + bmd->size) {
-            g_free (bmd);
-            break;
-        }
-
-        off += bmd->size;
-        g_free (bmd);
-    }
+    /* Offsets are kept with the file, which can stay in the fs cache
+     * between reads.
+     */
+    offsets = seafile_get_block_offsets (file, store_id, version);
+    if (!offsets)
+        return -EIO;
 
     /* beyond the file size */
-    if (i == file->n_blocks)
+    i = seafile_find_block (file, offsets, offset);
+    if (i < 0)
         return 0;
+    off = offsets[i];
 
     nleft = size;
     ptr = buf;
     while (nleft > 0 && i < file->n_blocks) {
-        blkid = file->blk_sha1s[i];
+        seafile_get_block_id (file, i, blkid);
 
         handle = seaf_block_manager_open_block(seaf->block_mgr,
                                                store_id, version,
@@ -903,6 +903,30 @@ seafile_get_virtual_repo (const char *origin_repo,
 char *
 seafile_get_system_default_repo_id (GError **error);
 
+/* Block cache counters in JSON. */
+char *
+seafile_get_block_cache_stats (GError **error);
+
+/* Commit cache counters in JSON. */
+char *
+seafile_get_commit_cache_stats (GError **error);
+
+/* Path cache counters in JSON. */
+char *
+seafile_get_path_cache_stats (GError **error);
+
+/* Block compression counters in JSON. */
+char *
+seafile_get_block_compress_stats (GError **error);
+
+/* Block scrubber progress and error counts in JSON. */
+char *
+seafile_get_block_scrubber_status (GError **error);
+
+/* Queue depth and latency of the object store thread pools in JSON. */
+char *
+seafile_get_obj_store_stats (GError **error);
+
 /* Clean trash */
 
 int
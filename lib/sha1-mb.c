@@ -0,0 +1,293 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <openssl/sha.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "sha1-mb.h"
+
+/*
+ * Multi-buffer SHA-1: the state of SHA1_MB_LANES messages is kept in
+ * vectors with one 32-bit lane per message, so every SIMD instruction
+ * advances all messages by one step. When a message is finished, the next
+ * pending message is loaded into its lane.
+ *
+ * GCC vector extensions are used instead of intrinsics so the same code is
+ * compiled to SSE2/AVX2 on x86 and NEON on ARM.
+ */
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 6 && \
+    defined(__x86_64__) && defined(__linux__)
+#define SHA1_MB_TARGETS __attribute__ ((target_clones ("avx2", "default")))
+#else
+#define SHA1_MB_TARGETS
+#endif
+
+#ifdef __GNUC__
+#define HAVE_SHA1_MB_SIMD 1
+typedef uint32_t v32 __attribute__ ((vector_size (SHA1_MB_LANES * 4)));
+#endif
+
+static int sha1_mb_mode = SHA1_MB_AUTO;
+
+void
+sha1_mb_set_mode (int mode)
+{
+    sha1_mb_mode = mode;
+}
+
+static void
+sha1_scalar (int n,
+             const unsigned char * const *data,
+             const size_t *len,
+             unsigned char *digests)
+{
+    SHA_CTX ctx;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        SHA1_Init (&ctx);
+        SHA1_Update (&ctx, data[i], len[i]);
+        SHA1_Final (digests + i * 20, &ctx);
+    }
+}
+
+#ifdef HAVE_SHA1_MB_SIMD
+
+static const uint32_t sha1_iv[5] = {
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static inline uint32_t
+load_be32 (const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void
+store_be32 (unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* One message being hashed in a lane. */
+typedef struct Sha1Lane {
+    int job;                    /* index of the message, -1 if idle */
+    const unsigned char *data;
+    size_t len;
+    size_t n_blocks;            /* including padding blocks */
+    size_t next_block;
+    unsigned char pad[128];     /* last partial block and padding */
+} Sha1Lane;
+
+static void
+lane_start (Sha1Lane *lane, int job, const unsigned char *data, size_t len)
+{
+    size_t full = len / 64;
+    size_t rest = len - full * 64;
+    uint64_t bits = (uint64_t)len * 8;
+    int pad_blocks = (rest + 9 > 64) ? 2 : 1;
+    int i;
+
+    lane->job = job;
+    lane->data = data;
+    lane->len = len;
+    lane->n_blocks = full + pad_blocks;
+    lane->next_block = 0;
+
+    memset (lane->pad, 0, sizeof(lane->pad));
+    memcpy (lane->pad, data + full * 64, rest);
+    lane->pad[rest] = 0x80;
+    for (i = 0; i < 8; ++i)
+        lane->pad[pad_blocks * 64 - 1 - i] = (unsigned char)(bits >> (i * 8));
+}
+
+static inline const unsigned char *
+lane_block (Sha1Lane *lane)
+{
+    size_t full = lane->len / 64;
+    size_t i = lane->next_block;
+
+    if (i < full)
+        return lane->data + i * 64;
+    return lane->pad + (i - full) * 64;
+}
+
+#define R(f, k, a, b, c, d, e, i)                           \
+do {                                                        \
+    e += ROL (a, 5) + (f) + k + w[(i) & 15];                \
+    b = ROL (b, 30);                                        \
+} while (0)
+
+#define SCHED(i)                                            \
+do {                                                        \
+    v32 _t = w[((i) + 13) & 15] ^ w[((i) + 8) & 15] ^       \
+        w[((i) + 2) & 15] ^ w[(i) & 15];                    \
+    w[(i) & 15] = ROL (_t, 1);                              \
+} while (0)
+
+#define F1(b, c, d) (d ^ (b & (c ^ d)))
+#define F2(b, c, d) (b ^ c ^ d)
+#define F3(b, c, d) ((b & c) | (d & (b | c)))
+
+/* Compress one 64-byte block per lane into @state. Always inlined so
+ * that it is compiled for the instruction set of each clone of
+ * sha1_simd().
+ */
+static inline __attribute__ ((always_inline)) void
+sha1_mb_compress (v32 state[5], const unsigned char *blocks[SHA1_MB_LANES])
+{
+    v32 w[16];
+    v32 a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    const v32 k1 = (v32){0} + 0x5A827999;
+    const v32 k2 = (v32){0} + 0x6ED9EBA1;
+    const v32 k3 = (v32){0} + 0x8F1BBCDC;
+    const v32 k4 = (v32){0} + 0xCA62C1D6;
+    int i, l;
+
+    for (i = 0; i < 16; ++i)
+        for (l = 0; l < SHA1_MB_LANES; ++l)
+            w[i][l] = load_be32 (blocks[l] + i * 4);
+
+    for (i = 0; i < 80; i += 5) {
+        for (l = i; l < i + 5; ++l)
+            if (l >= 16)
+                SCHED (l);
+        if (i < 20) {
+            R (F1 (b, c, d), k1, a, b, c, d, e, i);
+            R (F1 (a, b, c), k1, e, a, b, c, d, i + 1);
+            R (F1 (e, a, b), k1, d, e, a, b, c, i + 2);
+            R (F1 (d, e, a), k1, c, d, e, a, b, i + 3);
+            R (F1 (c, d, e), k1, b, c, d, e, a, i + 4);
+        } else if (i < 40) {
+            R (F2 (b, c, d), k2, a, b, c, d, e, i);
+            R (F2 (a, b, c), k2, e, a, b, c, d, i + 1);
+            R (F2 (e, a, b), k2, d, e, a, b, c, i + 2);
+            R (F2 (d, e, a), k2, c, d, e, a, b, i + 3);
+            R (F2 (c, d, e), k2, b, c, d, e, a, i + 4);
+        } else if (i < 60) {
+            R (F3 (b, c, d), k3, a, b, c, d, e, i);
+            R (F3 (a, b, c), k3, e, a, b, c, d, i + 1);
+            R (F3 (e, a, b), k3, d, e, a, b, c, i + 2);
+            R (F3 (d, e, a), k3, c, d, e, a, b, i + 3);
+            R (F3 (c, d, e), k3, b, c, d, e, a, i + 4);
+        } else {
+            R (F2 (b, c, d), k4, a, b, c, d, e, i);
+            R (F2 (a, b, c), k4, e, a, b, c, d, i + 1);
+            R (F2 (e, a, b), k4, d, e, a, b, c, i + 2);
+            R (F2 (d, e, a), k4, c, d, e, a, b, i + 3);
+            R (F2 (c, d, e), k4, b, c, d, e, a, i + 4);
+        }
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+SHA1_MB_TARGETS
+static void
+sha1_simd (int n,
+           const unsigned char * const *data,
+           const size_t *len,
+           unsigned char *digests)
+{
+    static const unsigned char idle_block[64];
+    Sha1Lane lanes[SHA1_MB_LANES];
+    const unsigned char *blocks[SHA1_MB_LANES];
+    v32 state[5];
+    int next_job = 0, active = 0;
+    int l, k;
+
+    for (l = 0; l < SHA1_MB_LANES; ++l) {
+        lanes[l].job = -1;
+        for (k = 0; k < 5; ++k)
+            state[k][l] = sha1_iv[k];
+        if (next_job < n) {
+            lane_start (&lanes[l], next_job, data[next_job], len[next_job]);
+            ++next_job;
+            ++active;
+        }
+    }
+
+    while (active > 0) {
+        for (l = 0; l < SHA1_MB_LANES; ++l)
+            blocks[l] = lanes[l].job >= 0 ? lane_block (&lanes[l]) : idle_block;
+
+        sha1_mb_compress (state, blocks);
+
+        for (l = 0; l < SHA1_MB_LANES; ++l) {
+            Sha1Lane *lane = &lanes[l];
+
+            if (lane->job < 0 || ++lane->next_block < lane->n_blocks)
+                continue;
+
+            for (k = 0; k < 5; ++k) {
+                store_be32 (digests + lane->job * 20 + k * 4, state[k][l]);
+                state[k][l] = sha1_iv[k];
+            }
+
+            if (next_job < n) {
+                lane_start (lane, next_job, data[next_job], len[next_job]);
+                ++next_job;
+            } else {
+                lane->job = -1;
+                --active;
+            }
+        }
+    }
+}
+
+static int
+cpu_has_sha_ni ()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (ebx >> 29) & 1;
+#else
+    /* Assume other architectures (e.g. ARMv8) have SHA-1 instructions
+     * that OpenSSL uses.
+     */
+    return 1;
+#endif
+}
+
+#endif  /* HAVE_SHA1_MB_SIMD */
+
+void
+sha1_mb_digest (int n,
+                const unsigned char * const *data,
+                const size_t *len,
+                unsigned char *digests)
+{
+#ifdef HAVE_SHA1_MB_SIMD
+    static int use_simd = -1;
+
+    if (use_simd < 0)
+        use_simd = !cpu_has_sha_ni ();
+
+    if (sha1_mb_mode == SHA1_MB_SIMD ||
+        (sha1_mb_mode == SHA1_MB_AUTO && use_simd && n > 1)) {
+        sha1_simd (n, data, len, digests);
+        return;
+    }
+#endif
+
+    sha1_scalar (n, data, len, digests);
+}
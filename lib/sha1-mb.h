@@ -0,0 +1,37 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SHA1_MB_H
+#define SHA1_MB_H
+
+#include <stddef.h>
+
+/* Number of buffers hashed in parallel lanes. Callers get the best
+ * throughput by passing at least this many buffers of similar size.
+ */
+#define SHA1_MB_LANES 8
+
+/*
+ * Compute SHA-1 of @n independent buffers. The digest of @data[i] is
+ * written to @digests + i * 20.
+ *
+ * On CPUs without SHA instructions the buffers are hashed in parallel
+ * SIMD lanes. Otherwise, or for a single buffer, each buffer is hashed
+ * with OpenSSL which uses the hardware instructions.
+ */
+void
+sha1_mb_digest (int n,
+                const unsigned char * const *data,
+                const size_t *len,
+                unsigned char *digests);
+
+/* Force the scalar (OpenSSL) or SIMD path, for testing and benchmarks. */
+enum {
+    SHA1_MB_AUTO = 0,
+    SHA1_MB_SCALAR,
+    SHA1_MB_SIMD,
+};
+
+void
+sha1_mb_set_mode (int mode);
+
+#endif
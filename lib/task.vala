@@ -50,6 +50,10 @@ public class CloneTask : Object {
        public string repo_name { get; set; }
        public string worktree { get; set; }
        public string tx_id { get; set; }
+       public int index_done_files { get; set; }
+       public int index_total_files { get; set; }
+       public int64 index_done_bytes { get; set; }
+       public int64 index_total_bytes { get; set; }
 }
 
 } // namespace
@@ -202,6 +202,86 @@ objstore_get_path (char *path, const char *base, const char *obj_id)
     strcpy(path+len+4, obj_id+2);
 }
 
+typedef struct {
+    const char *id;
+    int idx;
+} ObjIdRef;
+
+static int
+compare_obj_id_ref (const void *a, const void *b)
+{
+    return strcmp (((const ObjIdRef *)a)->id, ((const ObjIdRef *)b)->id);
+}
+
+int
+objstore_objs_exist (const char *base, int n,
+                     const char **obj_ids, gboolean *results)
+{
+    ObjIdRef *refs;
+    int i;
+
+    memset (results, 0, sizeof(gboolean) * n);
+    if (n <= 0)
+        return 0;
+
+    /* Sort the ids so that the ones in the same sub-directory are
+     * checked together.
+     */
+    refs = g_new (ObjIdRef, n);
+    for (i = 0; i < n; i++) {
+        refs[i].id = obj_ids[i];
+        refs[i].idx = i;
+    }
+    qsort (refs, n, sizeof(ObjIdRef), compare_obj_id_ref);
+
+#ifndef WIN32
+    int base_fd, sub_fd = -1;
+    char subdir[3] = { 0 };
+
+    base_fd = open (base, O_RDONLY | O_DIRECTORY);
+    if (base_fd < 0) {
+        g_free (refs);
+        return (errno == ENOENT) ? 0 : -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        const char *id = refs[i].id;
+
+        if (strlen(id) < 3)
+            continue;
+
+        if (sub_fd < 0 || id[0] != subdir[0] || id[1] != subdir[1]) {
+            if (sub_fd >= 0)
+                close (sub_fd);
+            subdir[0] = id[0];
+            subdir[1] = id[1];
+            sub_fd = openat (base_fd, subdir, O_RDONLY | O_DIRECTORY);
+        }
+        if (sub_fd < 0)
+            continue;
+
+        results[refs[i].idx] = (faccessat (sub_fd, id + 2, F_OK, 0) == 0);
+    }
+
+    if (sub_fd >= 0)
+        close (sub_fd);
+    close (base_fd);
+#else
+    char path[SEAF_PATH_MAX];
+
+    for (i = 0; i < n; i++) {
+        if (strlen(refs[i].id) < 3 ||
+            strlen(base) + strlen(refs[i].id) + 2 >= SEAF_PATH_MAX)
+            continue;
+        objstore_get_path (path, base, refs[i].id);
+        results[refs[i].idx] = (g_access (path, F_OK) == 0);
+    }
+#endif
+
+    g_free (refs);
+    return 0;
+}
+
 #ifdef WIN32
 
 /* UNIX epoch expressed in Windows time, the unit is 100 nanoseconds.
@@ -1477,6 +1557,21 @@ get_current_time()
     return t;
 }
 
+int
+get_cpu_count ()
+{
+#ifdef WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo (&info);
+    return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
 #ifdef WIN32
 int
 pgpipe (ccnet_pipe_t handles[2])
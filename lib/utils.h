@@ -167,6 +167,12 @@ char* ccnet_expand_path (const char *src);
  */
 int objstore_mkdir (const char *base);
 void objstore_get_path (char *path, const char *base, const char *obj_id);
+/**
+ * Check whether @n objects exist under `base`, with one open of each
+ * sub-directory. Results are stored in @results.
+ */
+int objstore_objs_exist (const char *base, int n,
+                         const char **obj_ids, gboolean *results);
 
 
 char** strsplit_by_space (char *string, int *length);
@@ -219,6 +225,9 @@ void nfree_string_array (char **array, int n);
 /* 64bit time */
 gint64 get_current_time();
 
+/* Number of online processors, at least 1. */
+int get_cpu_count ();
+
 int
 ccnet_encrypt (char **data_out,
                int *out_len,
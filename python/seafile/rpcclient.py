@@ -851,6 +851,36 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
     def get_system_default_repo_id():
         pass
 
+    # block cache
+    @searpc_func("string", [])
+    def get_block_cache_stats():
+        pass
+
+    # commit cache
+    @searpc_func("string", [])
+    def get_commit_cache_stats():
+        pass
+
+    # path cache
+    @searpc_func("string", [])
+    def get_path_cache_stats():
+        pass
+
+    # block compression
+    @searpc_func("string", [])
+    def get_block_compress_stats():
+        pass
+
+    # block scrubber
+    @searpc_func("string", [])
+    def get_block_scrubber_status():
+        pass
+
+    # object store
+    @searpc_func("string", [])
+    def get_obj_store_stats():
+        pass
+
     # Change password
     @searpc_func("int", ["string", "string", "string", "string"])
     def seafile_change_repo_passwd(repo_id, old_passwd, new_passwd, user):
@@ -42,6 +42,7 @@ typedef struct SendBlockData {
     BlockHandle *handle;
     uint32_t bsize;
     uint32_t remain;
+    gboolean sent_from_file;
 
     char store_id[37];
     int repo_version;
@@ -61,6 +62,7 @@ typedef struct SendfileData {
     BlockHandle *handle;
     size_t remain;
     int idx;
+    gboolean sent_from_file;
 
     char store_id[37];
     int repo_version;
@@ -178,6 +180,38 @@ free_senddir_data (SendDirData *data)
     g_free (data);
 }
 
+/*
+ * Queue the whole content of the block on @bev straight from the file it's
+ * stored in, so that it can be sent with sendfile().
+ * Returns -1 if the block is not stored in a file.
+ */
+static int
+send_block_from_file (struct bufferevent *bev, BlockHandle *handle)
+{
+    gint64 offset;
+    guint32 size;
+    int fd;
+
+    fd = seaf_block_manager_get_block_fd (seaf->block_mgr, handle,
+                                          &offset, &size);
+    if (fd < 0)
+        return -1;
+
+    /* Nothing would be written, and the write callback wouldn't be called. */
+    if (size == 0) {
+        close (fd);
+        return -1;
+    }
+
+    /* The fd belongs to the output buffer once it's added. */
+    if (evbuffer_add_file (bufferevent_get_output (bev), fd, offset, size) < 0) {
+        close (fd);
+        return -1;
+    }
+
+    return 0;
+}
+
 static void
 write_block_data_cb (struct bufferevent *bev, void *ctx)
 {
@@ -200,10 +234,19 @@ write_block_data_cb (struct bufferevent *bev, void *ctx)
         }
 
         data->remain = data->bsize;
+
+        if (send_block_from_file (bev, data->handle) == 0) {
+            data->sent_from_file = TRUE;
+            return;
+        }
     }
     handle = data->handle;
 
-    n = seaf_block_manager_read_block(seaf->block_mgr, handle, buf, sizeof(buf));
+    if (data->sent_from_file)
+        n = 0;
+    else
+        n = seaf_block_manager_read_block(seaf->block_mgr, handle,
+                                          buf, sizeof(buf));
     data->remain -= n;
     if (n < 0) {
         seaf_warning ("Error when reading from block %s.\n", blk_id);
@@ -244,13 +287,13 @@ static void
 write_data_cb (struct bufferevent *bev, void *ctx)
 {
     SendfileData *data = ctx;
-    char *blk_id;
+    char blk_id[41];
     BlockHandle *handle;
     char buf[1024 * 64];
     int n;
 
 next:
-    blk_id = data->file->blk_sha1s[data->idx];
+    seafile_get_block_id (data->file, data->idx, blk_id);
 
     if (!data->handle) {
         data->handle = seaf_block_manager_open_block(seaf->block_mgr,
@@ -279,11 +322,19 @@ next:
                 goto err;
             }
             data->enc_init = TRUE;
+        } else if (send_block_from_file (bev, data->handle) == 0) {
+            data->sent_from_file = TRUE;
+            return;
         }
     }
     handle = data->handle;
 
-    n = seaf_block_manager_read_block(seaf->block_mgr, handle, buf, sizeof(buf));
+    /* The block was queued from its file in the last call. */
+    if (data->sent_from_file)
+        n = 0;
+    else
+        n = seaf_block_manager_read_block(seaf->block_mgr, handle,
+                                          buf, sizeof(buf));
     data->remain -= n;
     if (n < 0) {
         seaf_warning ("Error when reading from block %s.\n", blk_id);
@@ -293,6 +344,7 @@ next:
         seaf_block_manager_close_block (seaf->block_mgr, handle);
         seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
         data->handle = NULL;
+        data->sent_from_file = FALSE;
         if (data->crypt != NULL) {
             EVP_CIPHER_CTX_cleanup (&data->ctx);
             data->enc_init = FALSE;
@@ -638,31 +690,23 @@ get_start_block_handle (const char *store_id, int version, Seafile *file,
                         guint64 start, int *blk_idx)
 {
     BlockHandle *handle = NULL;
-    BlockMetadata *bmd;
-    char *blkid;
-    guint64 tolsize = 0;
-    int i = 0;
-
-    for (; i < file->n_blocks; i++) {
-        blkid = file->blk_sha1s[i];
-
-        bmd = seaf_block_manager_stat_block(seaf->block_mgr, store_id,
-                                            version, blkid);
-        if (!bmd)
-            return NULL;
+    const guint64 *offsets;
+    char blkid[41];
+    guint64 tolsize;
+    int i;
 
-        if (start < tolsize + bmd->size) {
-            g_free (bmd);
-            break;
-        }
-        tolsize += bmd->size;
-        g_free (bmd);
-    }
+    offsets = seafile_get_block_offsets (file, store_id, version);
+    if (!offsets)
+        return NULL;
 
     /* beyond the file size */
-    if (i == file->n_blocks)
+    i = seafile_find_block (file, offsets, start);
+    if (i < 0)
         return NULL;
 
+    seafile_get_block_id (file, i, blkid);
+    tolsize = offsets[i];
+
     handle = seaf_block_manager_open_block(seaf->block_mgr,
                                            store_id, version,
                                            blkid, BLOCK_READ);
@@ -717,7 +761,7 @@ static void
 write_file_range_cb (struct bufferevent *bev, void *ctx)
 {
     SendFileRangeData *data = ctx;
-    char *blk_id;
+    char blk_id[41];
     char buf[BUFFER_SIZE];
     int bsize;
     int n;
@@ -732,7 +776,7 @@ write_file_range_cb (struct bufferevent *bev, void *ctx)
     }
 
 next:
-    blk_id = data->file->blk_sha1s[data->blk_idx];
+    seafile_get_block_id (data->file, data->blk_idx, blk_id);
 
     if (!data->handle) {
         data->handle = seaf_block_manager_open_block(seaf->block_mgr,
@@ -1254,17 +1298,23 @@ do_block(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     uint32_t bsize;
     gboolean found = FALSE;
     int i;
+    unsigned char raw_id[20];
     char blk_size[255];
     char cont_filename[SEAF_PATH_MAX];
     SendBlockData *data;
 
+    if (strlen (blk_id) != 40 || hex_to_rawdata (blk_id, raw_id, 20) < 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return 0;
+    }
+
     file = seaf_fs_manager_get_seafile(seaf->fs_mgr,
                                        repo->store_id, repo->version, file_id);
     if (file == NULL)
         return -1;
 
     for (i = 0; i < file->n_blocks; i++) {
-        if (memcmp(file->blk_sha1s[i], blk_id, 40) == 0) {
+        if (memcmp(file->blk_ids + i * 20, raw_id, 20) == 0) {
             BlockMetadata *bm = seaf_block_manager_stat_block (seaf->block_mgr,
                                                                repo->store_id,
                                                                repo->version,
@@ -0,0 +1,479 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "utils.h"
+
+#include "seafile-session.h"
+#include "block-scrubber.h"
+#include "sha1-mb.h"
+
+#include "log.h"
+
+#define DEFAULT_RATE_MB 10
+#define DEFAULT_INTERVAL_HOURS 24
+
+/* Pause when the read latency is this many times the usual latency. */
+#define LATENCY_FACTOR 4
+#define MIN_BACKOFF 1000000LL       /* 1s */
+#define MAX_BACKOFF 60000000LL      /* 60s */
+
+/* Wait before the first pass, so that it doesn't slow down startup. */
+#define START_DELAY 300             /* 5 minutes */
+
+typedef struct BlockScrubberPriv {
+    gboolean        enabled;
+    /* Max read rate in bytes per second. */
+    double          rate;
+    gint64          interval;
+
+    pthread_t       thread_id;
+
+    pthread_mutex_t lock;
+    BlockScrubberStatus status;
+
+    /* Pacing of reads since window_start. */
+    gint64          window_start;
+    gint64          window_bytes;
+
+    /* Average and usual read latency per block, in microseconds. */
+    double          latency_avg;
+    double          latency_base;
+    gint64          backoff;
+} BlockScrubberPriv;
+
+static const char *bad_block_status[] = {
+    [BLOCK_CHECK_CORRUPT] = "corrupt",
+    [BLOCK_CHECK_UNREADABLE] = "unreadable",
+};
+
+BlockScrubber *
+block_scrubber_new (SeafileSession *session)
+{
+    BlockScrubber *scrubber = g_new0 (BlockScrubber, 1);
+    BlockScrubberPriv *priv = g_new0 (BlockScrubberPriv, 1);
+    GKeyFile *config = session->config;
+    int rate, interval;
+
+    scrubber->seaf = session;
+    scrubber->priv = priv;
+
+    priv->enabled = g_key_file_get_boolean (config, "block_scrubber",
+                                            "enabled", NULL);
+
+    rate = g_key_file_get_integer (config, "block_scrubber", "rate", NULL);
+    if (rate <= 0)
+        rate = DEFAULT_RATE_MB;
+    priv->rate = (double)rate * 1024 * 1024;
+
+    interval = g_key_file_get_integer (config, "block_scrubber",
+                                       "interval", NULL);
+    if (interval <= 0)
+        interval = DEFAULT_INTERVAL_HOURS;
+    priv->interval = (gint64)interval * 3600 * 1000000;
+
+    pthread_mutex_init (&priv->lock, NULL);
+    priv->status.enabled = priv->enabled;
+
+    return scrubber;
+}
+
+static int
+create_bad_block_table (SeafDB *db)
+{
+    const char *sql;
+
+    switch (seaf_db_type(db)) {
+    case SEAF_DB_TYPE_MYSQL:
+        sql = "CREATE TABLE IF NOT EXISTS ScrubBadBlock ("
+            "store_id CHAR(36), block_id CHAR(40), status VARCHAR(16), "
+            "detect_time BIGINT, PRIMARY KEY (store_id, block_id))"
+            "ENGINE=INNODB";
+        break;
+    default:
+        sql = "CREATE TABLE IF NOT EXISTS ScrubBadBlock ("
+            "store_id CHAR(36), block_id CHAR(40), status VARCHAR(16), "
+            "detect_time BIGINT, PRIMARY KEY (store_id, block_id))";
+        break;
+    }
+
+    return seaf_db_query (db, sql);
+}
+
+static int
+record_bad_block (SeafDB *db,
+                  const char *store_id,
+                  const char *block_id,
+                  const char *status)
+{
+    gint64 now = (gint64)time(NULL);
+
+    if (seaf_db_type(db) == SEAF_DB_TYPE_PGSQL) {
+        gboolean exists, err;
+
+        exists = seaf_db_statement_exists (db,
+                                           "SELECT 1 FROM ScrubBadBlock "
+                                           "WHERE store_id=? AND block_id=?",
+                                           &err, 2, "string", store_id,
+                                           "string", block_id);
+        if (err)
+            return -1;
+
+        if (exists)
+            return seaf_db_statement_query (db,
+                                            "UPDATE ScrubBadBlock SET status=?, "
+                                            "detect_time=? WHERE store_id=? "
+                                            "AND block_id=?",
+                                            4, "string", status, "int64", now,
+                                            "string", store_id,
+                                            "string", block_id);
+        return seaf_db_statement_query (db,
+                                        "INSERT INTO ScrubBadBlock VALUES "
+                                        "(?, ?, ?, ?)",
+                                        4, "string", store_id,
+                                        "string", block_id,
+                                        "string", status, "int64", now);
+    }
+
+    return seaf_db_statement_query (db,
+                                    "REPLACE INTO ScrubBadBlock VALUES "
+                                    "(?, ?, ?, ?)",
+                                    4, "string", store_id, "string", block_id,
+                                    "string", status, "int64", now);
+}
+
+static gboolean
+collect_bad_block (SeafDBRow *row, void *data)
+{
+    GHashTable *bad_blocks = data;
+    const char *block_id = seaf_db_row_get_column_text (row, 0);
+
+    g_hash_table_insert (bad_blocks, g_strdup (block_id), GINT_TO_POINTER(1));
+    return TRUE;
+}
+
+/* Blocks of the store recorded by previous passes, so that the ones which
+ * check fine now can be removed from the table.
+ */
+static GHashTable *
+load_bad_blocks (SeafDB *db, const char *store_id)
+{
+    GHashTable *bad_blocks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, NULL);
+
+    seaf_db_statement_foreach_row (db,
+                                   "SELECT block_id FROM ScrubBadBlock "
+                                   "WHERE store_id=?",
+                                   collect_bad_block, bad_blocks,
+                                   1, "string", store_id);
+    return bad_blocks;
+}
+
+static void
+pause_for (BlockScrubberPriv *priv, gint64 usec)
+{
+    g_usleep (usec);
+    priv->window_start = g_get_monotonic_time ();
+    priv->window_bytes = 0;
+}
+
+/* Back off while the disks are busy, then keep reads under the rate. */
+static void
+throttle (BlockScrubberPriv *priv, int n_blocks, gint64 bytes, gint64 elapsed)
+{
+    double sample;
+    gint64 now, due;
+
+    /* Each MB read counts as one more block, so that reading large
+     * blocks doesn't look like a slow disk.
+     */
+    sample = (double)elapsed / (n_blocks + bytes / (1 << 20));
+    if (priv->latency_avg == 0)
+        priv->latency_avg = sample;
+    else
+        priv->latency_avg = 0.8 * priv->latency_avg + 0.2 * sample;
+
+    if (priv->latency_base > 0 &&
+        priv->latency_avg > priv->latency_base * LATENCY_FACTOR) {
+        if (priv->backoff == 0)
+            priv->backoff = MIN_BACKOFF;
+        else
+            priv->backoff = MIN (priv->backoff * 2, MAX_BACKOFF);
+
+        pthread_mutex_lock (&priv->lock);
+        ++priv->status.n_pauses;
+        pthread_mutex_unlock (&priv->lock);
+
+        pause_for (priv, priv->backoff);
+        /* Start over from the next sample. */
+        priv->latency_avg = 0;
+        return;
+    }
+
+    priv->backoff = 0;
+    /* Follow a disk that gets slower over time. */
+    if (priv->latency_base == 0 || priv->latency_avg < priv->latency_base)
+        priv->latency_base = priv->latency_avg;
+    else
+        priv->latency_base += (priv->latency_avg - priv->latency_base) / 256;
+
+    priv->window_bytes += bytes;
+    now = g_get_monotonic_time ();
+    due = priv->window_start + (gint64)(priv->window_bytes / priv->rate * 1000000);
+    if (due > now)
+        g_usleep (due - now);
+}
+
+typedef struct ScrubStore {
+    BlockScrubber   *scrubber;
+    char            store_id[37];
+    int             version;
+    /* Recorded bad blocks not seen yet in this pass. */
+    GHashTable      *bad_blocks;
+    /* Blocks listed but not checked yet. */
+    char            *block_ids[SHA1_MB_LANES];
+    int             n;
+    /* End of the previous check, so that listing counts as reading. */
+    gint64          start;
+} ScrubStore;
+
+static void
+forget_bad_block (SeafDB *db, const char *store_id, const char *block_id)
+{
+    seaf_db_statement_query (db,
+                             "DELETE FROM ScrubBadBlock WHERE "
+                             "store_id=? AND block_id=?",
+                             2, "string", store_id, "string", block_id);
+}
+
+static void
+check_listed_blocks (ScrubStore *data)
+{
+    BlockScrubberPriv *priv = data->scrubber->priv;
+    SeafDB *db = data->scrubber->seaf->db;
+    int status[SHA1_MB_LANES];
+    int n_bad[BLOCK_CHECK_UNREADABLE + 1];
+    gint64 bytes;
+    int i;
+
+    bytes = seaf_block_manager_check_blocks (seaf->block_mgr,
+                                             data->store_id, data->version,
+                                             data->n,
+                                             (const char **)data->block_ids,
+                                             status);
+
+    memset (n_bad, 0, sizeof(n_bad));
+    for (i = 0; i < data->n; ++i) {
+        const char *block_id = data->block_ids[i];
+        gboolean recorded = g_hash_table_remove (data->bad_blocks, block_id);
+
+        if (status[i] == BLOCK_CHECK_OK) {
+            if (recorded)
+                forget_bad_block (db, data->store_id, block_id);
+            continue;
+        }
+
+        /* Removed by GC since it was listed. */
+        if (status[i] == BLOCK_CHECK_UNREADABLE &&
+            !seaf_block_manager_block_exists (seaf->block_mgr,
+                                              data->store_id, data->version,
+                                              block_id)) {
+            if (recorded)
+                forget_bad_block (db, data->store_id, block_id);
+            continue;
+        }
+
+        ++n_bad[status[i]];
+        seaf_warning ("[scrubber] Block %s:%s is %s.\n",
+                      data->store_id, block_id, bad_block_status[status[i]]);
+        if (record_bad_block (db, data->store_id, block_id,
+                              bad_block_status[status[i]]) < 0)
+            seaf_warning ("[scrubber] Failed to record bad block.\n");
+    }
+
+    pthread_mutex_lock (&priv->lock);
+    priv->status.n_blocks_checked += data->n;
+    priv->status.bytes_checked += bytes;
+    priv->status.n_corrupt += n_bad[BLOCK_CHECK_CORRUPT];
+    priv->status.n_unreadable += n_bad[BLOCK_CHECK_UNREADABLE];
+    pthread_mutex_unlock (&priv->lock);
+
+    throttle (priv, data->n, bytes, g_get_monotonic_time () - data->start);
+    data->start = g_get_monotonic_time ();
+
+    for (i = 0; i < data->n; ++i)
+        g_free (data->block_ids[i]);
+    data->n = 0;
+}
+
+static gboolean
+scrub_block_cb (const char *store_id,
+                int version,
+                const char *block_id,
+                void *vdata)
+{
+    ScrubStore *data = vdata;
+
+    data->block_ids[data->n++] = g_strdup (block_id);
+    if (data->n == SHA1_MB_LANES)
+        check_listed_blocks (data);
+
+    return TRUE;
+}
+
+/* Check every block in the store of the repo, including blocks which are
+ * only referenced by history or not referenced at all.
+ */
+static void
+scrub_repo (BlockScrubber *scrubber, const char *repo_id)
+{
+    SeafDB *db = scrubber->seaf->db;
+    SeafRepo *repo;
+    ScrubStore data;
+    GHashTableIter iter;
+    gpointer key;
+    int ret;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo)
+        return;
+
+    memset (&data, 0, sizeof(data));
+    data.scrubber = scrubber;
+    memcpy (data.store_id, repo->store_id, 37);
+    data.version = repo->version;
+    seaf_repo_unref (repo);
+
+    data.bad_blocks = load_bad_blocks (db, data.store_id);
+    data.start = g_get_monotonic_time ();
+
+    ret = seaf_block_manager_foreach_block (seaf->block_mgr,
+                                            data.store_id, data.version,
+                                            scrub_block_cb, &data);
+    if (data.n > 0)
+        check_listed_blocks (&data);
+
+    if (ret < 0) {
+        seaf_warning ("[scrubber] Failed to list blocks of repo %.8s.\n",
+                      repo_id);
+    } else {
+        /* Recorded blocks which are not in the store anymore. */
+        g_hash_table_iter_init (&iter, data.bad_blocks);
+        while (g_hash_table_iter_next (&iter, &key, NULL))
+            forget_bad_block (db, data.store_id, key);
+    }
+
+    g_hash_table_destroy (data.bad_blocks);
+}
+
+static void
+scrub_all_repos (BlockScrubber *scrubber)
+{
+    BlockScrubberPriv *priv = scrubber->priv;
+    BlockScrubberStatus *st = &priv->status;
+    GList *repo_ids, *ptr;
+
+    repo_ids = seaf_repo_manager_get_repo_id_list (seaf->repo_mgr);
+
+    pthread_mutex_lock (&priv->lock);
+    st->running = TRUE;
+    ++st->n_passes;
+    st->n_repos = g_list_length (repo_ids);
+    st->n_repos_done = 0;
+    st->n_blocks_checked = 0;
+    st->bytes_checked = 0;
+    st->n_corrupt = 0;
+    st->n_unreadable = 0;
+    st->pass_start_time = (gint64)time(NULL);
+    pthread_mutex_unlock (&priv->lock);
+
+    seaf_message ("[scrubber] Start checking blocks of %d repos.\n",
+                  st->n_repos);
+
+    priv->window_start = g_get_monotonic_time ();
+    priv->window_bytes = 0;
+
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        const char *repo_id = ptr->data;
+
+        /* Virtual repos share the block store of their origin repo. */
+        if (!seaf_repo_manager_is_virtual_repo (seaf->repo_mgr, repo_id))
+            scrub_repo (scrubber, repo_id);
+
+        pthread_mutex_lock (&priv->lock);
+        ++st->n_repos_done;
+        pthread_mutex_unlock (&priv->lock);
+    }
+
+    pthread_mutex_lock (&priv->lock);
+    st->running = FALSE;
+    st->last_pass_end_time = (gint64)time(NULL);
+    pthread_mutex_unlock (&priv->lock);
+
+    seaf_message ("[scrubber] Checked %"G_GINT64_FORMAT" blocks: "
+                  "%"G_GINT64_FORMAT" corrupt, "
+                  "%"G_GINT64_FORMAT" unreadable.\n",
+                  st->n_blocks_checked, st->n_corrupt, st->n_unreadable);
+
+    string_list_free (repo_ids);
+}
+
+static void *
+scrubber_run (void *vscrubber)
+{
+    BlockScrubber *scrubber = vscrubber;
+    gint64 start, wait;
+
+    g_usleep ((gint64)START_DELAY * 1000000);
+
+    while (1) {
+        start = g_get_monotonic_time ();
+        scrub_all_repos (scrubber);
+
+        wait = start + scrubber->priv->interval - g_get_monotonic_time ();
+        if (wait > 0)
+            g_usleep (wait);
+    }
+
+    return NULL;
+}
+
+int
+block_scrubber_start (BlockScrubber *scrubber)
+{
+    BlockScrubberPriv *priv = scrubber->priv;
+
+    if (create_bad_block_table (scrubber->seaf->db) < 0) {
+        seaf_warning ("Failed to create bad block table.\n");
+        return -1;
+    }
+
+    if (!priv->enabled)
+        return 0;
+
+    int ret = pthread_create (&priv->thread_id, NULL, scrubber_run, scrubber);
+    if (ret != 0)
+        return -1;
+
+    pthread_detach (priv->thread_id);
+    return 0;
+}
+
+void
+block_scrubber_get_status (BlockScrubber *scrubber,
+                           BlockScrubberStatus *status)
+{
+    pthread_mutex_lock (&scrubber->priv->lock);
+    memcpy (status, &scrubber->priv->status, sizeof(BlockScrubberStatus));
+    pthread_mutex_unlock (&scrubber->priv->lock);
+}
+
+gint64
+block_scrubber_count_bad_blocks (BlockScrubber *scrubber)
+{
+    return seaf_db_statement_get_int64 (scrubber->seaf->db,
+                                        "SELECT COUNT(*) FROM ScrubBadBlock",
+                                        0);
+}
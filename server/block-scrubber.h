@@ -0,0 +1,69 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef BLOCK_SCRUBBER_H
+#define BLOCK_SCRUBBER_H
+
+#include <glib.h>
+
+struct _SeafileSession;
+
+/*
+ * Background verification of block contents.
+ *
+ * The scrubber walks every block in the store of each repo, checking that
+ * its content still matches its id. Corrupt and unreadable blocks are
+ * recorded in the ScrubBadBlock table. Reads are limited to a configured
+ * rate, and the scrubber pauses when its read latency, including the time
+ * spent listing the store, rises well above normal, which means the disks
+ * are busy with foreground requests.
+ *
+ * Configured in seafile.conf:
+ *
+ * [block_scrubber]
+ * enabled = true
+ * # Max read rate in MB/s.
+ * rate = 10
+ * # Hours between the start of two passes.
+ * interval = 24
+ */
+
+struct BlockScrubberPriv;
+
+typedef struct BlockScrubber {
+    struct _SeafileSession *seaf;
+
+    struct BlockScrubberPriv *priv;
+} BlockScrubber;
+
+typedef struct BlockScrubberStatus {
+    gboolean    enabled;
+    gboolean    running;
+    int         n_passes;
+    /* Progress of the current pass, or of the last one when not running. */
+    int         n_repos;
+    int         n_repos_done;
+    gint64      n_blocks_checked;
+    gint64      bytes_checked;
+    gint64      n_corrupt;
+    gint64      n_unreadable;
+    /* Number of times the scrubber backed off for foreground I/O. */
+    gint64      n_pauses;
+    gint64      pass_start_time;
+    gint64      last_pass_end_time;
+} BlockScrubberStatus;
+
+BlockScrubber *
+block_scrubber_new (struct _SeafileSession *session);
+
+int
+block_scrubber_start (BlockScrubber *scrubber);
+
+void
+block_scrubber_get_status (BlockScrubber *scrubber,
+                           BlockScrubberStatus *status);
+
+/* Number of bad blocks currently recorded, or -1 on DB error. */
+gint64
+block_scrubber_count_bad_blocks (BlockScrubber *scrubber);
+
+#endif
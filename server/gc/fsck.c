@@ -1,13 +1,18 @@
 #include "common.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "seafile-session.h"
 #include "log.h"
 #include "utils.h"
+#include "sha1-mb.h"
 
 #include "fsck.h"
 
+/* Threads to read the commit objects of a repo with. */
+#define SCAN_THREADS 16
+
 typedef struct FsckData {
     gboolean repair;
     SeafRepo *repo;
@@ -59,6 +64,49 @@ fsck_verify_seafobj (const char *store_id,
     return valid;
 }
 
+/* Verify a batch of blocks of a file. Blocks are handled in order, as if
+ * checked one by one: stops at the first block which is corrupted or
+ * can't be read, and returns -1.
+ */
+static int
+verify_block_batch (FsckData *fsck_data, const char **block_ids, int n,
+                    gboolean *io_error)
+{
+    SeafRepo *repo = fsck_data->repo;
+    int status[SHA1_MB_LANES];
+    int i;
+    int dummy;
+
+    seaf_block_manager_check_blocks (seaf->block_mgr,
+                                     repo->store_id, repo->version,
+                                     n, block_ids, status);
+
+    for (i = 0; i < n; ++i) {
+        if (status[i] == BLOCK_CHECK_UNREADABLE) {
+            *io_error = TRUE;
+            return -1;
+        }
+
+        // check block integrity, if not remove it
+        if (status[i] == BLOCK_CHECK_CORRUPT) {
+            if (fsck_data->repair) {
+                seaf_message ("Block %s is corrupted, remove it.\n", block_ids[i]);
+                seaf_block_manager_remove_block (seaf->block_mgr,
+                                                 repo->store_id, repo->version,
+                                                 block_ids[i]);
+            } else {
+                seaf_message ("Block %s is corrupted.\n", block_ids[i]);
+            }
+            return -1;
+        }
+
+        g_hash_table_insert (fsck_data->existing_blocks,
+                             g_strdup(block_ids[i]), &dummy);
+    }
+
+    return 0;
+}
+
 static int
 check_blocks (const char *file_id, FsckData *fsck_data, gboolean *io_error)
 {
@@ -66,9 +114,10 @@ check_blocks (const char *file_id, FsckData *fsck_data, gboolean *io_error)
     int i;
     char *block_id;
     int ret = 0;
-    int dummy;
+    char batch_ids[SHA1_MB_LANES][41];
+    const char *batch[SHA1_MB_LANES];
+    int n_batch = 0;
 
-    gboolean ok = TRUE;
     SeafRepo *repo = fsck_data->repo;
     const char *store_id = repo->store_id;
     int version = repo->version;
@@ -76,8 +125,12 @@ check_blocks (const char *file_id, FsckData *fsck_data, gboolean *io_error)
     seafile = seaf_fs_manager_get_seafile (seaf->fs_mgr, store_id,
                                            version, file_id);
 
+    /* Blocks are verified in batches so that they can be hashed in
+     * parallel.
+     */
     for (i = 0; i < seafile->n_blocks; ++i) {
-        block_id = seafile->blk_sha1s[i];
+        /* Skipped blocks leave their slot to the next one. */
+        block_id = seafile_get_block_id (seafile, i, batch_ids[n_batch]);
 
         if (g_hash_table_lookup (fsck_data->existing_blocks, block_id))
             continue;
@@ -90,31 +143,18 @@ check_blocks (const char *file_id, FsckData *fsck_data, gboolean *io_error)
             break;
         }
 
-        // check block integrity, if not remove it
-        ok = seaf_block_manager_verify_block (seaf->block_mgr,
-                                              store_id, version,
-                                              block_id, io_error);
-        if (!ok) {
-            if (*io_error) {
-                ret = -1;
+        batch[n_batch++] = block_id;
+        if (n_batch == SHA1_MB_LANES) {
+            ret = verify_block_batch (fsck_data, batch, n_batch, io_error);
+            n_batch = 0;
+            if (ret < 0)
                 break;
-            } else {
-                if (fsck_data->repair) {
-                    seaf_message ("Block %s is corrupted, remove it.\n", block_id);
-                    seaf_block_manager_remove_block (seaf->block_mgr,
-                                                     store_id, version,
-                                                     block_id);
-                } else {
-                    seaf_message ("Block %s is corrupted.\n", block_id);
-                }
-                ret = -1;
-                break;
-            }
         }
-
-        g_hash_table_insert (fsck_data->existing_blocks, g_strdup(block_id), &dummy);
     }
 
+    if (ret == 0 && n_batch > 0)
+        ret = verify_block_batch (fsck_data, batch, n_batch, io_error);
+
     seafile_unref (seafile);
 
     return ret;
@@ -123,7 +163,7 @@ check_blocks (const char *file_id, FsckData *fsck_data, gboolean *io_error)
 static char*
 fsck_check_dir_recursive (const char *id, const char *parent_dir, FsckData *fsck_data)
 {
-    SeafDir *dir;
+    SeafDir *dir, *shared;
     SeafDir *new_dir;
     GList *p;
     SeafDirent *seaf_dent;
@@ -136,7 +176,12 @@ fsck_check_dir_recursive (const char *id, const char *parent_dir, FsckData *fsck
     int version = fsck_data->repo->version;
     gboolean is_corrupted = FALSE;
 
-    dir = seaf_fs_manager_get_seafdir (mgr, store_id, version, id);
+    shared = seaf_fs_manager_get_seafdir (mgr, store_id, version, id);
+    if (!shared)
+        return NULL;
+    /* Corrupted entries are repaired in place, so work on a private copy. */
+    dir = seaf_dir_dup (shared);
+    seaf_dir_free (shared);
 
     for (p = dir->entries; p; p = p->next) {
         seaf_dent = p->data;
@@ -261,13 +306,18 @@ compare_commit_by_ctime (gconstpointer a, gconstpointer b)
     return (commit_b->ctime - commit_a->ctime);
 }
 
+typedef struct CommitListData {
+    GList *commits;
+    pthread_mutex_t lock;
+} CommitListData;
+
 static gboolean
 fsck_get_repo_commit (const char *repo_id, int version,
-                      const char *obj_id, void *commit_list)
+                      const char *obj_id, void *vdata)
 {
     void *data = NULL;
     int data_len;
-    GList **cur_list = (GList **)commit_list;
+    CommitListData *list_data = vdata;
 
     int ret = seaf_obj_store_read_obj (seaf->commit_mgr->obj_store, repo_id,
                                        version, obj_id, &data, &data_len);
@@ -276,13 +326,32 @@ fsck_get_repo_commit (const char *repo_id, int version,
 
     SeafCommit *cur_commit = seaf_commit_from_data (obj_id, data, data_len);
     if (cur_commit != NULL) {
-       *cur_list = g_list_prepend (*cur_list, cur_commit);
+        pthread_mutex_lock (&list_data->lock);
+        list_data->commits = g_list_prepend (list_data->commits, cur_commit);
+        pthread_mutex_unlock (&list_data->lock);
     }
 
     g_free(data);
     return TRUE;
 }
 
+/* Read all commit objects of the repo, in no particular order. */
+static GList *
+get_repo_commits (const char *repo_id)
+{
+    CommitListData data;
+
+    data.commits = NULL;
+    pthread_mutex_init (&data.lock, NULL);
+
+    seaf_obj_store_foreach_obj_parallel (seaf->commit_mgr->obj_store, repo_id,
+                                         1, SCAN_THREADS,
+                                         fsck_get_repo_commit, &data);
+
+    pthread_mutex_destroy (&data.lock);
+    return data.commits;
+}
+
 static void
 reset_commit_to_repair (SeafRepo *repo, SeafCommit *parent, char *new_root_id)
 {
@@ -325,8 +394,7 @@ get_available_repo (char *repo_id, gboolean repair)
 
     seaf_message ("Scanning available commits...\n");
 
-    seaf_obj_store_foreach_obj (seaf->commit_mgr->obj_store, repo_id,
-                                1, fsck_get_repo_commit, &commit_list);
+    commit_list = get_repo_commits (repo_id);
 
     if (commit_list == NULL) {
         seaf_warning ("No available commits for repo %.8s, can't be repaired.\n",
@@ -779,7 +847,7 @@ create_file (const char *repo_id,
              const char *path)
 {
     int i;
-    char *block_id;
+    char block_id[41];
     int fd;
     Seafile *seafile;
     gboolean ret = TRUE;
@@ -799,7 +867,7 @@ create_file (const char *repo_id,
     }
 
     for (i = 0; i < seafile->n_blocks; ++i) {
-        block_id = seafile->blk_sha1s[i];
+        seafile_get_block_id (seafile, i, block_id);
 
         ret = write_nonenc_block_to_file (repo_id, version, block_id,
                                           fd, path);
@@ -875,8 +943,7 @@ get_available_commit (const char *repo_id)
 
     seaf_message ("Scanning available commits for repo %s...\n", repo_id);
 
-    seaf_obj_store_foreach_obj (seaf->commit_mgr->obj_store, repo_id,
-                                1, fsck_get_repo_commit, &commit_list);
+    commit_list = get_repo_commits (repo_id);
 
     if (commit_list == NULL) {
         seaf_warning ("No available commits for repo %.8s, export failed.\n\n",
@@ -2,6 +2,8 @@
 
 #include "common.h"
 
+#include <pthread.h>
+
 #include "seafile-session.h"
 #include "bloom-filter.h"
 #include "gc-core.h"
@@ -12,6 +14,9 @@
 
 #define MAX_BF_SIZE (((size_t)1) << 29)   /* 64 MB */
 
+/* Threads to scan the block store with. */
+#define SCAN_THREADS 16
+
 /* Total number of blocks to be scanned. */
 static guint64 total_blocks;
 static guint64 removed_blocks;
@@ -73,6 +78,7 @@ add_blocks_to_index (SeafFSManager *mgr, GCData *data, const char *file_id)
     SeafRepo *repo = data->repo;
     Bloom *index = data->index;
     Seafile *seafile;
+    char block_id[41];
     int i;
 
     seafile = seaf_fs_manager_get_seafile (mgr, repo->store_id, repo->version, file_id);
@@ -82,7 +88,7 @@ add_blocks_to_index (SeafFSManager *mgr, GCData *data, const char *file_id)
     }
 
     for (i = 0; i < seafile->n_blocks; ++i) {
-        bloom_add (index, seafile->blk_sha1s[i]);
+        bloom_add (index, seafile_get_block_id (seafile, i, block_id));
         ++data->traversed_blocks;
     }
 
@@ -244,6 +250,8 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *index, int verbose)
 typedef struct {
     Bloom *index;
     int dry_run;
+    /* Protects removed_blocks, this is called from several threads. */
+    pthread_mutex_t lock;
 } CheckBlocksData;
 
 static gboolean
@@ -254,7 +262,9 @@ check_block_liveness (const char *store_id, int version,
     Bloom *index = data->index;
 
     if (!bloom_test (index, block_id)) {
+        pthread_mutex_lock (&data->lock);
         ++removed_blocks;
+        pthread_mutex_unlock (&data->lock);
         if (!data->dry_run)
             seaf_block_manager_remove_block (seaf->block_mgr,
                                              store_id, version,
@@ -345,16 +355,36 @@ gc_v1_repo (SeafRepo *repo, int dry_run, int verbose)
     CheckBlocksData data;
     data.index = index;
     data.dry_run = dry_run;
-
-    ret = seaf_block_manager_foreach_block (seaf->block_mgr,
-                                            repo->store_id, repo->version,
-                                            check_block_liveness,
-                                            &data);
+    pthread_mutex_init (&data.lock, NULL);
+
+    ret = seaf_block_manager_foreach_block_parallel (seaf->block_mgr,
+                                                     repo->store_id,
+                                                     repo->version,
+                                                     SCAN_THREADS,
+                                                     check_block_liveness,
+                                                     &data);
+    pthread_mutex_destroy (&data.lock);
     if (ret < 0) {
         seaf_warning ("GC: Failed to clean dead blocks.\n");
         goto out;
     }
 
+    /* Backends which only mark blocks as removed free the space here. */
+    if (!dry_run && removed_blocks > 0 &&
+        seaf_block_manager_compact_store (seaf->block_mgr,
+                                          repo->store_id, repo->version) < 0)
+        seaf_warning ("GC: Failed to compact block store.\n");
+
+    /* Objects removed by fsck leave tombstones in pack object stores. */
+    if (!dry_run) {
+        if (seaf_obj_store_compact (seaf->fs_mgr->obj_store,
+                                    repo->store_id, repo->version) < 0)
+            seaf_warning ("GC: Failed to compact fs object store.\n");
+        if (seaf_obj_store_compact (seaf->commit_mgr->obj_store,
+                                    repo->id, repo->version) < 0)
+            seaf_warning ("GC: Failed to compact commit object store.\n");
+    }
+
     ret = removed_blocks;
 
     if (!dry_run)
@@ -17,21 +17,33 @@ static char *seafile_dir = NULL;
 CcnetClient *ccnet_client;
 SeafileSession *seaf;
 
-static const char *short_opts = "hvc:d:VDi";
+static const char *short_opts = "hvc:d:VDipb";
 static const struct option long_opts[] = {
     { "help", no_argument, NULL, 'h', },
     { "version", no_argument, NULL, 'v', },
     { "config-file", required_argument, NULL, 'c', },
     { "seafdir", required_argument, NULL, 'd', },
+    { "to-packs", no_argument, NULL, 'p', },
+    { "rebalance-blocks", no_argument, NULL, 'b', },
+    { 0, 0, 0, 0 },
 };
 
 static int
 migrate_v0_repos_to_v1_layout ();
 
+static int
+migrate_objects_to_packs ();
+
+static int
+rebalance_blocks ();
+
 static void usage ()
 {
     fprintf (stderr,
-             "usage: seaf-migrate [-c config_dir] [-d seafile_dir]\n");
+             "usage: seaf-migrate [-c config_dir] [-d seafile_dir] [-p] [-b]\n"
+             "  -p, --to-packs  copy fs objects and commits into pack files\n"
+             "  -b, --rebalance-blocks  move blocks to their shards after "
+             "the shards are changed\n");
 }
 
 static void
@@ -79,6 +91,8 @@ int
 main(int argc, char *argv[])
 {
     int c;
+    gboolean to_packs = FALSE;
+    gboolean rebalance = FALSE;
 
 #ifdef WIN32
     argv = get_argv_utf8 (&argc);
@@ -101,6 +115,12 @@ main(int argc, char *argv[])
         case 'd':
             seafile_dir = strdup(optarg);
             break;
+        case 'p':
+            to_packs = TRUE;
+            break;
+        case 'b':
+            rebalance = TRUE;
+            break;
         default:
             usage();
             exit(-1);
@@ -133,6 +153,12 @@ main(int argc, char *argv[])
 
     load_history_config ();
 
+    if (to_packs)
+        return (migrate_objects_to_packs () < 0) ? 1 : 0;
+
+    if (rebalance)
+        return (rebalance_blocks () < 0) ? 1 : 0;
+
     migrate_v0_repos_to_v1_layout ();
 
     return 0;
@@ -157,7 +183,7 @@ migrate_file_blocks (SeafFSManager *mgr, MigrationData *data, const char *file_i
     SeafRepo *repo = data->repo;
     Seafile *seafile;
     int i;
-    char *block_id;
+    char block_id[41];
 
     seafile = seaf_fs_manager_get_seafile (mgr, repo->store_id, repo->version, file_id);
     if (!seafile) {
@@ -166,7 +192,7 @@ migrate_file_blocks (SeafFSManager *mgr, MigrationData *data, const char *file_i
     }
 
     for (i = 0; i < seafile->n_blocks; ++i) {
-        block_id = seafile->blk_sha1s[i];
+        seafile_get_block_id (seafile, i, block_id);
         if (seaf_block_manager_copy_block (seaf->block_mgr,
                                            repo->store_id, repo->version,
                                            repo->store_id, 1,
@@ -314,3 +340,282 @@ migrate_v0_repos_to_v1_layout ()
 
     return 0;
 }
+
+/* Migration from one file per object to pack files. */
+
+typedef struct {
+    struct SeafObjStore *src;
+    struct SeafObjStore *dst;
+    /* Objects copied by copy_tree(), skipped when the rest is copied. */
+    GHashTable *copied;
+    guint64 n_copied;
+    gboolean error;
+} PackMigration;
+
+static void
+pack_migration_init (PackMigration *m,
+                     struct SeafObjStore *src,
+                     struct SeafObjStore *dst)
+{
+    memset (m, 0, sizeof(*m));
+    m->src = src;
+    m->dst = dst;
+    m->copied = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+/* The data is returned in @data if it's not NULL. */
+static int
+copy_object (PackMigration *m, const char *store_id, int version,
+             const char *obj_id, void **data, int *len)
+{
+    void *buf;
+    int n;
+
+    if (seaf_obj_store_read_obj (m->src, store_id, version,
+                                 obj_id, &buf, &n) < 0) {
+        seaf_warning ("Failed to read object %s:%s.\n", store_id, obj_id);
+        return -1;
+    }
+
+    /* Synced once per repo, when the batch is committed. */
+    if (seaf_obj_store_write_obj (m->dst, store_id, version,
+                                  obj_id, buf, n, TRUE) < 0) {
+        seaf_warning ("Failed to write object %s:%s.\n", store_id, obj_id);
+        g_free (buf);
+        return -1;
+    }
+
+    ++m->n_copied;
+
+    if (data) {
+        *data = buf;
+        *len = n;
+    } else {
+        g_free (buf);
+    }
+    return 0;
+}
+
+static gboolean
+mark_copied (PackMigration *m, const char *obj_id)
+{
+    if (g_hash_table_lookup (m->copied, obj_id))
+        return FALSE;
+    g_hash_table_insert (m->copied, g_strdup (obj_id), m);
+    return TRUE;
+}
+
+/*
+ * Copy a tree depth first, each dir followed by its files, so that the
+ * objects read together when walking the tree are next to each other in
+ * the packs.
+ */
+static int
+copy_tree (PackMigration *m, const char *store_id, int version,
+           const char *dir_id)
+{
+    SeafDir *dir;
+    SeafDirent *dent;
+    GList *ptr;
+    void *data;
+    int len;
+    int ret = 0;
+
+    if (strcmp (dir_id, EMPTY_SHA1) == 0 || !mark_copied (m, dir_id))
+        return 0;
+
+    if (copy_object (m, store_id, version, dir_id, &data, &len) < 0)
+        return -1;
+
+    dir = seaf_dir_from_data (dir_id, data, len, (version > 0));
+    g_free (data);
+    if (!dir) {
+        seaf_warning ("Failed to parse dir %s:%s.\n", store_id, dir_id);
+        return -1;
+    }
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        if (S_ISREG(dent->mode) && strcmp (dent->id, EMPTY_SHA1) != 0 &&
+            mark_copied (m, dent->id) &&
+            copy_object (m, store_id, version, dent->id, NULL, NULL) < 0)
+            ret = -1;
+    }
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        if (S_ISDIR(dent->mode) &&
+            copy_tree (m, store_id, version, dent->id) < 0)
+            ret = -1;
+    }
+
+    seaf_dir_free (dir);
+    return ret;
+}
+
+static gboolean
+copy_object_cb (const char *store_id, int version,
+                const char *obj_id, void *user_data)
+{
+    PackMigration *m = user_data;
+
+    if (g_hash_table_lookup (m->copied, obj_id))
+        return TRUE;
+
+    if (copy_object (m, store_id, version, obj_id, NULL, NULL) < 0)
+        m->error = TRUE;
+
+    return TRUE;
+}
+
+static int
+copy_store (PackMigration *m, const char *store_id, int version,
+            const char *root_id)
+{
+    int ret = 0;
+
+    seaf_obj_store_begin_batch (m->dst);
+
+    if (root_id && copy_tree (m, store_id, version, root_id) < 0)
+        ret = -1;
+
+    /* Then everything else: history, and objects not referenced anymore. */
+    if (seaf_obj_store_foreach_obj (m->src, store_id, version,
+                                    copy_object_cb, m) < 0 || m->error)
+        ret = -1;
+
+    if (seaf_obj_store_commit_batch (m->dst) < 0)
+        ret = -1;
+
+    return ret;
+}
+
+static int
+migrate_repo_to_packs (const char *repo_id,
+                       struct SeafObjStore *src_commits,
+                       struct SeafObjStore *src_fs)
+{
+    PackMigration commits, fs;
+    SeafRepo *repo;
+    SeafCommit *head = NULL;
+    int version = 1;
+    int ret = 0;
+
+    /* Commits go first, the repo can't be loaded from the packs before. */
+    pack_migration_init (&commits, src_commits, seaf->commit_mgr->obj_store);
+    if (copy_store (&commits, repo_id, version, NULL) < 0)
+        ret = -1;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo) {
+        seaf_warning ("Failed to load repo %.8s, its fs objects are copied "
+                      "without ordering. Version 0 repos must be migrated "
+                      "to the version 1 layout first.\n", repo_id);
+    } else {
+        version = repo->version;
+        /* Virtual repos share the fs objects of the origin repo. */
+        if (!repo->is_virtual)
+            head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                   repo->id, repo->version,
+                                                   repo->head->commit_id);
+    }
+
+    pack_migration_init (&fs, src_fs, seaf->fs_mgr->obj_store);
+    if (copy_store (&fs, repo_id, version, head ? head->root_id : NULL) < 0)
+        ret = -1;
+
+    seaf_message ("Repo %.8s: copied %"G_GUINT64_FORMAT" commits and "
+                  "%"G_GUINT64_FORMAT" fs objects%s.\n",
+                  repo_id, commits.n_copied, fs.n_copied,
+                  (ret < 0) ? ", with errors" : "");
+
+    g_hash_table_destroy (commits.copied);
+    g_hash_table_destroy (fs.copied);
+    seaf_commit_unref (head);
+    if (repo)
+        seaf_repo_unref (repo);
+    return ret;
+}
+
+static int
+migrate_objects_to_packs ()
+{
+    struct SeafObjStore *src_commits, *src_fs;
+    GList *repo_ids, *ptr;
+    char *backend;
+    int n_failed = 0;
+
+    backend = g_key_file_get_string (seaf->config, "object_backend",
+                                     "name", NULL);
+    if (g_strcmp0 (backend, "pack") != 0) {
+        seaf_warning ("Set \"name = pack\" in the [object_backend] section "
+                      "of seafile.conf first.\n");
+        g_free (backend);
+        return -1;
+    }
+    g_free (backend);
+
+    src_commits = seaf_obj_store_new_fs (seaf, "commits");
+    src_fs = seaf_obj_store_new_fs (seaf, "fs");
+    if (!src_commits || !src_fs)
+        return -1;
+
+    repo_ids = seaf_repo_manager_get_repo_id_list (seaf->repo_mgr);
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        if (migrate_repo_to_packs (ptr->data, src_commits, src_fs) < 0)
+            ++n_failed;
+        g_free (ptr->data);
+    }
+    g_list_free (repo_ids);
+
+    if (n_failed > 0) {
+        seaf_warning ("%d repos were not completely migrated, "
+                      "run the migration again after fixing them.\n",
+                      n_failed);
+        return -1;
+    }
+
+    seaf_message ("All objects are copied. The old object files in "
+                  "storage/fs and storage/commits can be removed after "
+                  "checking the libraries.\n");
+    return 0;
+}
+
+static int
+rebalance_blocks ()
+{
+    GList *repo_ids, *ptr;
+    SeafRepo *repo;
+    int n_failed = 0;
+
+    repo_ids = seaf_repo_manager_get_repo_id_list (seaf->repo_mgr);
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, ptr->data);
+        if (!repo) {
+            seaf_warning ("Failed to load repo %.8s.\n", (char *)ptr->data);
+            ++n_failed;
+            continue;
+        }
+
+        /* Virtual repos share the block store of their origin repo. */
+        if (!repo->is_virtual &&
+            seaf_block_manager_rebalance_store (seaf->block_mgr,
+                                                repo->store_id,
+                                                repo->version) < 0)
+            ++n_failed;
+        seaf_repo_unref (repo);
+    }
+    string_list_free (repo_ids);
+
+    if (n_failed > 0) {
+        seaf_warning ("Blocks of %d repos were not completely moved, "
+                      "run the rebalance again after fixing them.\n",
+                      n_failed);
+        return -1;
+    }
+
+    seaf_message ("All blocks are on their shards. previous_shard_names, "
+                  "previous_shard_weights and old_block_dir can be removed "
+                  "from seafile.conf.\n");
+    return 0;
+}
@@ -12,6 +12,7 @@ check_blocks (VerifyData *data, const char *file_id)
 {
     SeafRepo *repo = data->repo;
     Seafile *seafile;
+    char block_id[41];
     int i;
 
     seafile = seaf_fs_manager_get_seafile (seaf->fs_mgr,
@@ -24,11 +25,12 @@ check_blocks (VerifyData *data, const char *file_id)
     }
 
     for (i = 0; i < seafile->n_blocks; ++i) {
+        seafile_get_block_id (seafile, i, block_id);
         if (!seaf_block_manager_block_exists (seaf->block_mgr,
                                               repo->store_id,
                                               repo->version,
-                                              seafile->blk_sha1s[i]))
-            g_message ("Block %s is missing.\n", seafile->blk_sha1s[i]);
+                                              block_id))
+            g_message ("Block %s is missing.\n", block_id);
     }
 
     seafile_unref (seafile);
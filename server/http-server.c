@@ -14,6 +14,8 @@
 
 #include <evhtp.h>
 
+#include <openssl/sha.h>
+
 #include "utils.h"
 #include "log.h"
 #include "http-server.h"
@@ -1247,6 +1249,24 @@ get_block_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
+    /* Let libevent send the block straight from the file if possible. */
+    gint64 blk_offset;
+    guint32 blk_size;
+    int blk_fd = seaf_block_manager_get_block_fd (seaf->block_mgr, blk_handle,
+                                                  &blk_offset, &blk_size);
+    if (blk_fd >= 0) {
+        /* The fd belongs to the buffer once it's added. */
+        if (evbuffer_add_file (req->buffer_out, blk_fd,
+                               blk_offset, blk_size) < 0) {
+            seaf_warning ("Failed to send block %.8s:%s.\n", store_id, block_id);
+            close (blk_fd);
+            evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        } else {
+            evhtp_send_reply (req, EVHTP_RES_OK);
+        }
+        goto free_handle;
+    }
+
     void *block_con = g_new0 (char, blk_meta->size);
     if (!block_con) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
@@ -1275,6 +1295,71 @@ out:
     g_strfreev (parts);
 }
 
+enum {
+    PUT_BLOCK_SUBMITTING = 0,
+    PUT_BLOCK_SUBMITTED,
+    /* Written before seaf_block_manager_write_block_async() returned. */
+    PUT_BLOCK_DONE_INLINE,
+};
+
+typedef struct PutBlockData {
+    evhtp_request_t *req;
+    /* The evhtp thread of the connection. */
+    evthr_t *thread;
+    char *blk_con;
+    int status;
+    int state;
+} PutBlockData;
+
+/* How long to retry handing the reply to a busy connection thread. */
+#define PUT_BLOCK_DEFER_RETRIES 100
+#define PUT_BLOCK_DEFER_WAIT_USEC 10000
+
+static void
+put_block_reply (evthr_t *thread, void *arg, void *shared)
+{
+    PutBlockData *data = arg;
+
+    evhtp_request_resume (data->req);
+    evhtp_send_reply (data->req, data->status == 0 ? EVHTP_RES_OK :
+                      EVHTP_RES_SERVERR);
+
+    g_free (data->blk_con);
+    g_free (data);
+}
+
+static void
+put_block_written (int status, void *user_data)
+{
+    PutBlockData *data = user_data;
+    int i;
+
+    data->status = status;
+
+    /* Written synchronously, put_send_block_cb() replies on return. */
+    if (g_atomic_int_compare_and_exchange (&data->state,
+                                           PUT_BLOCK_SUBMITTING,
+                                           PUT_BLOCK_DONE_INLINE))
+        return;
+
+    /* This is an I/O thread, the request must be answered from the
+     * thread which owns the connection. The defer only fails while the
+     * thread's command pipe is full, so retry for a while.
+     */
+    for (i = 0; i < PUT_BLOCK_DEFER_RETRIES; i++) {
+        if (evthr_defer (data->thread, put_block_reply, data) == EVTHR_RES_OK)
+            return;
+        g_usleep (PUT_BLOCK_DEFER_WAIT_USEC);
+    }
+
+    /* The connection thread is gone, so the request can't be answered
+     * anymore; don't leak it.
+     */
+    seaf_warning ("Failed to schedule the reply to a block upload.\n");
+    g_free (data->blk_con);
+    g_free (data);
+}
+
 static void
 put_send_block_cb (evhtp_request_t *req, void *arg)
 {
@@ -1323,42 +1408,41 @@ put_send_block_cb (evhtp_request_t *req, void *arg)
 
     evbuffer_remove (req->buffer_in, blk_con, blk_len);
 
-    BlockHandle *blk_handle = NULL;
-    blk_handle = seaf_block_manager_open_block (seaf->block_mgr,
-                                                store_id, 1, block_id, BLOCK_WRITE);
-    if (blk_handle == NULL) {
-        seaf_warning ("Failed to open block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
-    }
+    /* Don't store a block whose content doesn't match its id. */
+    unsigned char sha1[20];
+    char check_id[41];
 
-    if (seaf_block_manager_write_block (seaf->block_mgr, blk_handle,
-                                        blk_con, blk_len) != blk_len) {
-        seaf_warning ("Failed to write block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        seaf_block_manager_close_block (seaf->block_mgr, blk_handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
+    SHA1 ((const unsigned char *)blk_con, blk_len, sha1);
+    rawdata_to_hex (sha1, check_id, 20);
+    if (strcmp (check_id, block_id) != 0) {
+        seaf_warning ("Block %.8s:%s doesn't match its content.\n",
+                      store_id, block_id);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
         goto out;
     }
 
-    if (seaf_block_manager_close_block (seaf->block_mgr, blk_handle) < 0) {
-        seaf_warning ("Failed to close block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
-        goto out;
-    }
+    PutBlockData *data = g_new0 (PutBlockData, 1);
+    data->req = req;
+    data->thread = req->conn->thread;
+    data->blk_con = blk_con;
+    blk_con = NULL;
 
-    if (seaf_block_manager_commit_block (seaf->block_mgr,
-                                         blk_handle) < 0) {
-        seaf_warning ("Failed to commit block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
-        goto out;
-    }
+    /* Don't read further requests from the connection until the block is
+     * on disk; the reply is sent from put_block_reply().
+     *
+     * Submitting can block this thread while the async I/O queue is full,
+     * which bounds the number of uploads in flight.
+     */
+    evhtp_request_pause (req);
 
-    seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
+    seaf_block_manager_write_block_async (seaf->block_mgr, store_id, 1, block_id,
+                                          data->blk_con, blk_len,
+                                          put_block_written, data);
 
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    if (!g_atomic_int_compare_and_exchange (&data->state,
+                                            PUT_BLOCK_SUBMITTING,
+                                            PUT_BLOCK_SUBMITTED))
+        put_block_reply (data->thread, data, NULL);
 
 out:
     g_free (username);
@@ -1423,32 +1507,52 @@ post_check_exist_cb (evhtp_request_t *req, void *arg, CheckExistType type)
     }
 
     json_t *obj = NULL;
-    gboolean ret = TRUE;
     const char *obj_id = NULL;
     int index = 0;
+    int n_ids = 0;
+    int ret = 0;
 
     int array_size = json_array_size (obj_array);
     json_t *needed_objs = json_array();
+    const char **obj_ids = g_new0 (const char *, array_size + 1);
+    json_t **objs = g_new0 (json_t *, array_size + 1);
+    gboolean *exists = g_new0 (gboolean, array_size + 1);
 
+    /* Check all the ids with one call, so that backends can batch
+     * the lookups.
+     */
     for (; index < array_size; ++index) {
         obj = json_array_get (obj_array, index);
         obj_id = json_string_value (obj);
-        if (strlen (obj_id) != 40)
+        if (!obj_id || strlen (obj_id) != 40)
             continue;
 
-        if (type == CHECK_FS_EXIST) {
-            ret = seaf_fs_manager_object_exists (seaf->fs_mgr, store_id, 1,
-                                                 obj_id);
-        } else if (type == CHECK_BLOCK_EXIST) {
-            ret = seaf_block_manager_block_exists (seaf->block_mgr, store_id, 1,
-                                                   obj_id);
-        }
+        obj_ids[n_ids] = obj_id;
+        objs[n_ids] = obj;
+        ++n_ids;
+    }
+
+    if (type == CHECK_FS_EXIST) {
+        ret = seaf_fs_manager_objects_exist (seaf->fs_mgr, store_id, 1,
+                                             n_ids, obj_ids, exists);
+    } else if (type == CHECK_BLOCK_EXIST) {
+        ret = seaf_block_manager_blocks_exist (seaf->block_mgr, store_id, 1,
+                                               n_ids, obj_ids, exists);
+    }
+    if (ret < 0)
+        seaf_warning ("Failed to check existence of objects in repo %.8s.\n",
+                      repo_id);
 
-        if (!ret) {
-            json_array_append (needed_objs, obj);
+    for (index = 0; index < n_ids; ++index) {
+        if (!exists[index]) {
+            json_array_append (needed_objs, objs[index]);
         }
     }
 
+    g_free (obj_ids);
+    g_free (objs);
+    g_free (exists);
+
     char *ret_array = json_dumps (needed_objs, JSON_COMPACT);
     evbuffer_add (req->buffer_out, ret_array, strlen (ret_array));
     evhtp_send_reply (req, EVHTP_RES_OK);
@@ -1519,6 +1623,9 @@ post_recv_fs_cb (evhtp_request_t *req, void *arg)
     void *obj_con = NULL;
     int con_len;
 
+    /* Sync all the objects together before replying. */
+    seaf_obj_store_begin_batch (seaf->fs_mgr->obj_store);
+
     while (fs_con_len > 0) {
         if (fs_con_len < sizeof(FsHdr)) {
             seaf_warning ("Bad fs object content format from %.8s:%s.\n",
@@ -1541,7 +1648,7 @@ post_recv_fs_cb (evhtp_request_t *req, void *arg)
 
         if (seaf_obj_store_write_obj (seaf->fs_mgr->obj_store,
                                       store_id, 1, obj_id, obj_con,
-                                      con_len, FALSE) < 0) {
+                                      con_len, TRUE) < 0) {
             seaf_warning ("Failed to write fs object %.8s to disk.\n",
                           obj_id);
             g_free (obj_con);
@@ -1553,7 +1660,10 @@ post_recv_fs_cb (evhtp_request_t *req, void *arg)
         g_free (obj_con);
     }
 
-    if (fs_con_len == 0) {
+    if (seaf_obj_store_commit_batch (seaf->fs_mgr->obj_store) < 0) {
+        if (fs_con_len == 0)
+            evhtp_send_reply (req, EVHTP_RES_SERVERR);
+    } else if (fs_con_len == 0) {
         evhtp_send_reply (req, EVHTP_RES_OK);
     }
 
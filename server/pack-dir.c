@@ -62,6 +62,86 @@ do_iconv (char *fromcode, char *tocode, char *in)
     return g_strndup(out, outlen);
 }
 
+/* Number of blocks read together when adding a file. */
+#define READ_BLOCKS_WINDOW 4
+
+static int
+write_block_to_archive (struct archive *a,
+                        SeafileCrypt *crypt,
+                        const char *blk_id,
+                        const char *content,
+                        int content_len)
+{
+    EVP_CIPHER_CTX ctx;
+    char *dec_out = NULL;
+    int dec_out_len = -1;
+    int len, ret = 0;
+
+    if (crypt == NULL) {
+        /* not encrypted */
+        if (content_len == 0)
+            return 0;
+        len = archive_write_data (a, content, content_len);
+        if (len <= 0) {
+            seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
+            return -1;
+        }
+        return 0;
+    }
+
+    /* an encrypted block */
+    if (seafile_decrypt_init (&ctx, crypt->version,
+                              crypt->key, crypt->iv) < 0) {
+        seaf_warning ("Failed to init decrypt.\n");
+        return -1;
+    }
+
+    dec_out = g_new (char, content_len + 16);
+
+    /* EVP_DecryptUpdate returns 1 on success, 0 on failure */
+    if (EVP_DecryptUpdate (&ctx,
+                           (unsigned char *)dec_out,
+                           &dec_out_len,
+                           (unsigned char *)content,
+                           content_len) != 1) {
+        seaf_warning ("Decrypt block %s failed.\n", blk_id);
+        ret = -1;
+        goto out;
+    }
+
+    if (dec_out_len > 0) {
+        len = archive_write_data (a, dec_out, dec_out_len);
+        if (len <= 0) {
+            seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
+            ret = -1;
+            goto out;
+        }
+    }
+
+    /* Decrypt the possible partial block at the end. */
+    if (EVP_DecryptFinal_ex (&ctx,
+                             (unsigned char *)dec_out,
+                             &dec_out_len) != 1) {
+        seaf_warning ("Decrypt block %s failed.\n", blk_id);
+        ret = -1;
+        goto out;
+    }
+
+    if (dec_out_len != 0) {
+        len = archive_write_data (a, dec_out, dec_out_len);
+        if (len <= 0) {
+            seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
+            ret = -1;
+            goto out;
+        }
+    }
+
+out:
+    EVP_CIPHER_CTX_cleanup (&ctx);
+    g_free (dec_out);
+    return ret;
+}
+
 static int
 add_file_to_archive (PackDirData *data,
                      const char *parent_dir,
@@ -75,18 +155,13 @@ add_file_to_archive (PackDirData *data,
     struct archive_entry *entry = NULL;
     Seafile *file = NULL;
     char *pathname = NULL;
-    char buf[64 * 1024];
-    int len = 0;
+    char *contents[READ_BLOCKS_WINDOW] = { NULL };
+    int lens[READ_BLOCKS_WINDOW];
+    char block_ids[READ_BLOCKS_WINDOW][41];
+    const char *id_ptrs[READ_BLOCKS_WINDOW];
     int n = 0;
     int idx = 0;
-    BlockHandle *handle = NULL;
-    BlockMetadata *bmd = NULL;
-    char *blk_id = NULL;
-    uint32_t remain = 0;
-    EVP_CIPHER_CTX ctx;
-    gboolean enc_init = FALSE;
-    char *dec_out = NULL;
-    int dec_out_len = -1;
+    int i;
     int ret = 0;
 
     pathname = g_build_filename (top_dir_name, parent_dir, dent->name, NULL);
@@ -131,138 +206,48 @@ add_file_to_archive (PackDirData *data,
         goto out;
     }
 
-    /* Read data of this entry block by block */
+    /* Read the blocks of this entry a few at a time, in parallel. */
     while (idx < file->n_blocks) {
-        blk_id = file->blk_sha1s[idx];
-        handle = seaf_block_manager_open_block (seaf->block_mgr,
-                                                data->store_id,
-                                                data->repo_version,
-                                                blk_id, BLOCK_READ);
-        if (!handle) {
-            seaf_warning ("Failed to open block %s\n", blk_id);
-            ret = -1;
-            goto out;
-        }
+        n = MIN (file->n_blocks - idx, READ_BLOCKS_WINDOW);
+
+        for (i = 0; i < n; i++)
+            id_ptrs[i] = seafile_get_block_id (file, idx + i, block_ids[i]);
 
-        bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr,
-                                                       handle);
-        if (!bmd) {
-            seaf_warning ("Failed to stat block %s\n", blk_id);
+        if (seaf_block_manager_read_blocks (seaf->block_mgr,
+                                            data->store_id,
+                                            data->repo_version,
+                                            n, id_ptrs,
+                                            contents, lens) < 0) {
+            seaf_warning ("Failed to read blocks of %s\n", pathname);
             ret = -1;
             goto out;
         }
-        remain = bmd->size;
-        g_free (bmd);
 
-        if (crypt) {
-            if (seafile_decrypt_init (&ctx, crypt->version,
-                                      crypt->key, crypt->iv) < 0) {
-                seaf_warning ("Failed to init decrypt.\n");
+        for (i = 0; i < n; i++) {
+            if (write_block_to_archive (a, crypt, block_ids[i],
+                                        contents[i], lens[i]) < 0) {
                 ret = -1;
                 goto out;
             }
-            enc_init = TRUE;
         }
 
-        while (remain != 0) {
-            n = seaf_block_manager_read_block (seaf->block_mgr, handle,
-                                               buf, sizeof(buf));
-            if (n <= 0) {
-                seaf_warning ("failed to read block %s\n", blk_id);
-                ret = -1;
-                goto out;
-            }
-            remain -= n;
-
-            /* OK, We're read some data of this block  */
-            if (crypt == NULL) {
-                /* not encrypted */
-                len = archive_write_data (a, buf, n);
-                if (len <= 0) {
-                    seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
-                    ret = -1;
-                    goto out;
-                }
-
-            } else {
-                /* an encrypted block */
-                dec_out = g_new (char, n + 16);
-                if (!dec_out) {
-                    seaf_warning ("Failed to alloc memory.\n");
-                    ret = -1;
-                    goto out;
-                }
-
-                int r = EVP_DecryptUpdate (&ctx,
-                                           (unsigned char *)dec_out,
-                                           &dec_out_len,
-                                           (unsigned char *)buf,
-                                           n);
-
-                /* EVP_DecryptUpdate returns 1 on success, 0 on failure */
-                if (r != 1) {
-                    seaf_warning ("Decrypt block %s failed.\n", blk_id);
-                    ret = -1;
-                    goto out;
-                }
-
-                if (dec_out_len > 0) {
-                    len = archive_write_data (a, dec_out, dec_out_len);
-                    if (len <= 0) {
-                        seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
-                        ret = -1;
-                        goto out;
-                    }
-                }
-
-                /* If it's the last piece of a block, call decrypt_final()
-                 * to decrypt the possible partial block. */
-                if (remain == 0) {
-                    r = EVP_DecryptFinal_ex (&ctx,
-                                             (unsigned char *)dec_out,
-                                             &dec_out_len);
-                    if (r != 1) {
-                        seaf_warning ("Decrypt block %s failed.\n", blk_id);
-                        ret = -1;
-                        goto out;
-                    }
-
-                    if (dec_out_len != 0) {
-                        len = archive_write_data (a, dec_out, dec_out_len);
-                        if (len <= 0) {
-                            seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
-                            ret = -1;
-                            goto out;
-                        }
-                    }
-                }
-
-                g_free (dec_out);
-                dec_out = NULL;
-            }
+        for (i = 0; i < n; i++) {
+            g_free (contents[i]);
+            contents[i] = NULL;
         }
 
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
-        handle = NULL;
-
-        /* turn to next block */
-        idx++;
+        /* turn to next blocks */
+        idx += n;
     }
 
 out:
+    for (i = 0; i < READ_BLOCKS_WINDOW; i++)
+        g_free (contents[i]);
     g_free (pathname);
     if (entry)
         archive_entry_free (entry);
     if (file)
         seafile_unref (file);
-    if (handle) {
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free(seaf->block_mgr, handle);
-    }
-    if (crypt != NULL && enc_init)
-        EVP_CIPHER_CTX_cleanup (&ctx);
-    g_free (dec_out);
 
     return ret;
 }
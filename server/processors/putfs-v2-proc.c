@@ -94,7 +94,7 @@ seafile_putfs_v2_proc_init (SeafilePutfsV2Proc *processor)
 }
 
 static void
-fs_object_read_cb (OSAsyncResult *res, void *data);
+fs_objects_read_cb (OSAsyncResult *results, int n_results, void *data);
 
 static void
 register_async_io (CcnetProcessor *processor)
@@ -102,11 +102,12 @@ register_async_io (CcnetProcessor *processor)
     USE_PRIV;
 
     priv->registered = TRUE;
-    priv->reader_id = seaf_obj_store_register_async_read (seaf->fs_mgr->obj_store,
-                                                          priv->store_id,
-                                                          priv->repo_version,
-                                                          fs_object_read_cb,
-                                                          processor);
+    priv->reader_id =
+        seaf_obj_store_register_async_batch_read (seaf->fs_mgr->obj_store,
+                                                  priv->store_id,
+                                                  priv->repo_version,
+                                                  fs_objects_read_cb,
+                                                  processor);
 }
 
 static void *
@@ -418,34 +419,33 @@ send_fs_object (CcnetProcessor *processor,
 }
 
 static void
-fs_object_read_cb (OSAsyncResult *res, void *data)
+fs_objects_read_cb (OSAsyncResult *results, int n_results, void *data)
 {
     CcnetProcessor *processor = data;
+    OSAsyncResult *res;
+    int i;
 
-    if (!res->success) {
-        seaf_warning ("Failed to read fs object %.8s.\n", res->obj_id);
-        ccnet_processor_send_response (processor, SC_NOT_FOUND, SS_NOT_FOUND,
-                                       res->obj_id, 41);
-        ccnet_processor_done (processor, FALSE);
-        return;
-    }
+    for (i = 0; i < n_results; ++i) {
+        res = &results[i];
 
-    send_fs_object (processor, res->obj_id, res->data, res->len);
-}
-
-static void
-read_fs_object (CcnetProcessor *processor, const char *obj_id)
-{
-    USE_PRIV;
+        if (!res->success) {
+            seaf_warning ("Failed to read fs object %.8s.\n", res->obj_id);
+            ccnet_processor_send_response (processor,
+                                           SC_NOT_FOUND, SS_NOT_FOUND,
+                                           res->obj_id, 41);
+            /* The processor is released here, so stop at once. */
+            ccnet_processor_done (processor, FALSE);
+            return;
+        }
 
-    seaf_obj_store_async_read (seaf->fs_mgr->obj_store,
-                               priv->reader_id,
-                               obj_id);
+        send_fs_object (processor, res->obj_id, res->data, res->len);
+    }
 }
 
 static void
 process_object_list_segment (CcnetProcessor *processor, char *content, int clen)
 {
+    USE_PRIV;
     int n, i;
     char *p;
 
@@ -461,13 +461,31 @@ process_object_list_segment (CcnetProcessor *processor, char *content, int clen)
 
     seaf_debug ("%d objects are needed by the client.\n", n);
 
-    char *obj_id;
+    if (n == 0)
+        return;
+
+    /* Read the whole segment as one batch, so that the reader threads
+     * work on it in parallel and the objects are sent in one go.
+     */
+    char (*ids)[41] = g_new (char[41], n);
+    const char **obj_ids = g_new (const char *, n);
     for (i = 0; i < n; ++i) {
-        obj_id = g_strndup(p, 40);
-        read_fs_object (processor, obj_id);
-        g_free (obj_id);
+        memcpy (ids[i], p, 40);
+        ids[i][40] = 0;
+        obj_ids[i] = ids[i];
         p += 40;
     }
+
+    if (seaf_obj_store_async_read_batch (seaf->fs_mgr->obj_store,
+                                         priv->reader_id,
+                                         n, obj_ids) < 0) {
+        ccnet_processor_send_response (processor, SC_SHUTDOWN, SS_SHUTDOWN,
+                                       NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+    }
+
+    g_free (obj_ids);
+    g_free (ids);
 }
 
 static void
@@ -24,6 +24,9 @@ enum {
     RECV_OBJECTS,
 };
 
+/* Number of received objects handed to the writer threads at once. */
+#define WRITE_BATCH_SIZE 64
+
 typedef struct  {
     char *obj_seg;
     int obj_seg_len;
@@ -44,7 +47,14 @@ typedef struct  {
     int n_needed;
 
     int total_needed;
+    int n_received;
     int n_saved;
+
+    /* Received objects not yet submitted for writing. */
+    char pending_ids[WRITE_BATCH_SIZE][41];
+    void *pending_datas[WRITE_BATCH_SIZE];
+    int pending_lens[WRITE_BATCH_SIZE];
+    int n_pending;
 } SeafileRecvfsProcPriv;
 
 #define GET_PRIV(o)  \
@@ -65,6 +75,7 @@ static void
 release_resource(CcnetProcessor *processor)
 {
     USE_PRIV;
+    int i;
 
     g_free (priv->obj_seg);
     
@@ -76,6 +87,10 @@ release_resource(CcnetProcessor *processor)
     g_free (priv->recv_objs);
     string_list_free (priv->needed_objs);
 
+    for (i = 0; i < priv->n_pending; ++i)
+        g_free (priv->pending_datas[i]);
+    priv->n_pending = 0;
+
     CCNET_PROCESSOR_CLASS (seafile_recvfs_v2_proc_parent_class)->release_resource (processor);
 }
 
@@ -98,7 +113,7 @@ seafile_recvfs_v2_proc_init (SeafileRecvfsV2Proc *processor)
 }
 
 static void
-on_fs_write (OSAsyncResult *res, void *cb_data);
+on_fs_write (OSAsyncResult *results, int n_results, void *cb_data);
 
 static void
 register_async_io (CcnetProcessor *processor)
@@ -106,11 +121,12 @@ register_async_io (CcnetProcessor *processor)
     USE_PRIV;
 
     priv->registered = TRUE;
-    priv->writer_id = seaf_obj_store_register_async_write (seaf->fs_mgr->obj_store,
-                                                           priv->store_id,
-                                                           priv->repo_version,
-                                                           on_fs_write,
-                                                           processor);
+    priv->writer_id =
+        seaf_obj_store_register_async_batch_write (seaf->fs_mgr->obj_store,
+                                                   priv->store_id,
+                                                   priv->repo_version,
+                                                   on_fs_write,
+                                                   processor);
 }
 
 static void *
@@ -184,39 +200,80 @@ start (CcnetProcessor *processor, int argc, char **argv)
 }
 
 static void
-on_fs_write (OSAsyncResult *res, void *cb_data)
+on_fs_write (OSAsyncResult *results, int n_results, void *cb_data)
 {
     CcnetProcessor *processor = cb_data;
     USE_PRIV;
+    int i;
 
-    if (!res->success) {
-        g_warning ("[recvfs] Failed to write %s.\n", res->obj_id);
-        ccnet_processor_send_response (processor, SC_BAD_OBJECT, SS_BAD_OBJECT,
-                                       NULL, 0);
-        ccnet_processor_done (processor, FALSE);
-        return;
+    for (i = 0; i < n_results; ++i) {
+        if (!results[i].success) {
+            g_warning ("[recvfs] Failed to write %s.\n", results[i].obj_id);
+            ccnet_processor_send_response (processor,
+                                           SC_BAD_OBJECT, SS_BAD_OBJECT,
+                                           NULL, 0);
+            /* The processor is released here, so stop at once. */
+            ccnet_processor_done (processor, FALSE);
+            return;
+        }
     }
 
-    seaf_debug ("[recvfs] Wrote fs object %s.\n", res->obj_id);
+    seaf_debug ("[recvfs] Wrote %d fs objects.\n", n_results);
 
-    if (++(priv->n_saved) == priv->total_needed) {
+    priv->n_saved += n_results;
+    if (priv->n_saved == priv->total_needed) {
         seaf_debug ("All objects saved. Done.\n");
         ccnet_processor_send_response (processor, SC_END, SS_END, NULL, 0);
         ccnet_processor_done (processor, TRUE);
     }
 }
 
+static int
+flush_pending_objects (CcnetProcessor *processor)
+{
+    USE_PRIV;
+    const char *obj_ids[WRITE_BATCH_SIZE];
+    int i, n = priv->n_pending;
+
+    for (i = 0; i < n; ++i)
+        obj_ids[i] = priv->pending_ids[i];
+
+    /* The object store takes over the pending data. */
+    priv->n_pending = 0;
+
+    return seaf_obj_store_async_write_batch (seaf->fs_mgr->obj_store,
+                                             priv->writer_id,
+                                             n,
+                                             obj_ids,
+                                             priv->pending_datas,
+                                             priv->pending_lens,
+                                             FALSE);
+}
+
+/*
+ * Objects are collected and written in batches, so that the writer
+ * threads work on a batch in parallel and we're called back once per
+ * batch instead of once per object. The last batch is flushed as soon
+ * as all needed objects are received.
+ */
 static int
 save_fs_object (CcnetProcessor *processor, ObjectPack *pack, int len)
 {
     USE_PRIV;
+    int i = priv->n_pending;
+    int obj_len = len - sizeof(ObjectPack);
+
+    memcpy (priv->pending_ids[i], pack->id, 41);
+    priv->pending_datas[i] = g_memdup (pack->object, obj_len);
+    priv->pending_lens[i] = obj_len;
+    ++(priv->n_pending);
+    ++(priv->n_received);
 
-    return seaf_obj_store_async_write (seaf->fs_mgr->obj_store,
-                                       priv->writer_id,
-                                       pack->id,
-                                       pack->object,
-                                       len - 41,
-                                       FALSE);
+    if (priv->n_pending == WRITE_BATCH_SIZE ||
+        priv->n_received >= priv->total_needed)
+        return flush_pending_objects (processor);
+
+    return 0;
 }
 
 static int
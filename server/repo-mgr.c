@@ -43,6 +43,9 @@ struct _SeafRepoManagerPriv {
 
     CcnetTimer *scan_trash_timer;
     gint64 trash_expire_interval;
+
+    /* Version of newly created repos. */
+    int new_repo_version;
 };
 
 static const char *ignore_table[] = {
@@ -339,6 +342,19 @@ seaf_repo_manager_new (SeafileSession *seaf)
 
     init_scan_trash_timer (mgr->priv, seaf->config);
 
+    /* Binary fs objects can only be synced by clients that support them.
+     * Gear chunking doesn't change the format of any object, so it can be
+     * enabled on its own.
+     */
+    if (g_key_file_get_boolean (seaf->config,
+                                "library", "binary_fs_objects", NULL))
+        mgr->priv->new_repo_version = BINARY_FS_REPO_VERSION;
+    else if (g_key_file_get_boolean (seaf->config,
+                                     "library", "gear_chunking", NULL))
+        mgr->priv->new_repo_version = CDC_GEAR_MIN_REPO_VERSION;
+    else
+        mgr->priv->new_repo_version = CURRENT_REPO_VERSION;
+
     /* ignore_patterns = g_new0 (GPatternSpec*, G_N_ELEMENTS(ignore_table)); */
     /* int i; */
     /* for (i = 0; ignore_table[i] != NULL; i++) { */
@@ -2951,7 +2967,7 @@ create_repo_common (SeafRepoManager *mgr,
         memcpy (repo->random_key, random_key, 96);
     }
 
-    repo->version = CURRENT_REPO_VERSION;
+    repo->version = mgr->priv->new_repo_version;
     memcpy (repo->store_id, repo_id, 36);
 
     commit = seaf_commit_new (NULL, repo->id,
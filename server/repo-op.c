@@ -64,15 +64,40 @@ dup_seafdir_entries (const GList *entries)
     return g_list_reverse(newentries);
 }
 
-static gboolean
-filename_exists (GList *entries, const char *filename)
+/* Point the entry @name to the new object @id. Entries of dirs from the
+ * fs manager may be shared, so only call this on duplicated entries.
+ */
+static void
+update_dirent_id (GList *entries, const char *name, const char *id,
+                  gboolean update_mtime)
 {
     GList *ptr;
     SeafDirent *dent;
 
-    for (ptr = entries; ptr != NULL; ptr = ptr->next) {
+    for (ptr = entries; ptr; ptr = ptr->next) {
         dent = ptr->data;
-        if (strcmp (dent->name, filename) == 0)
+        if (strcmp (dent->name, name) != 0)
+            continue;
+
+        memcpy (dent->id, id, 40);
+        dent->id[40] = '\0';
+        if (update_mtime)
+            dent->mtime = (guint64)time(NULL);
+        break;
+    }
+}
+
+/* @added_names are names added to @dir since it was loaded. */
+static gboolean
+filename_exists (SeafDir *dir, GList *added_names, const char *filename)
+{
+    GList *ptr;
+
+    if (seaf_dir_lookup (dir, filename) != NULL)
+        return TRUE;
+
+    for (ptr = added_names; ptr != NULL; ptr = ptr->next) {
+        if (strcmp ((char *)ptr->data, filename) == 0)
             return TRUE;
     }
 
@@ -95,14 +120,14 @@ split_filename (const char *filename, char **name, char **ext)
 }
 
 static char *
-generate_unique_filename (const char *file, GList *entries)
+generate_unique_filename (const char *file, SeafDir *dir, GList *added_names)
 {
     int i = 1;
     char *name, *ext, *unique_name;
 
     unique_name = g_strdup(file);
     split_filename (unique_name, &name, &ext);
-    while (filename_exists (entries, unique_name) && i <= 16) {
+    while (filename_exists (dir, added_names, unique_name) && i <= 16) {
         g_free (unique_name);
         if (ext)
             unique_name = g_strdup_printf ("%s (%d).%s", name, i, ext);
@@ -134,7 +159,6 @@ post_file_recursive (SeafRepo *repo,
 {
     SeafDir *olddir, *newdir;
     SeafDirent *dent;
-    GList *ptr;
     char *slash;
     char *to_path_dup = NULL;
     char *remain = NULL;
@@ -151,7 +175,7 @@ post_file_recursive (SeafRepo *repo,
         GList *newentries = NULL;
         char *unique_name;
         SeafDirent *dent_dup;
-        if (replace_existed && filename_exists(olddir->entries, newdent->name)) {
+        if (replace_existed && filename_exists(olddir, NULL, newdent->name)) {
             GList *p;
             SeafDirent *dent;
 
@@ -173,7 +197,7 @@ post_file_recursive (SeafRepo *repo,
             goto out;
         }
 
-        unique_name = generate_unique_filename (newdent->name, olddir->entries);
+        unique_name = generate_unique_filename (newdent->name, olddir, NULL);
         if (!unique_name)
             goto out;
         dent_dup = seaf_dirent_new (newdent->version,
@@ -206,27 +230,16 @@ post_file_recursive (SeafRepo *repo,
         remain = slash + 1;
     }
 
-    for (ptr = olddir->entries; ptr; ptr = ptr->next) {
-        dent = (SeafDirent *)ptr->data;
-
-        if (strcmp(dent->name, to_path_dup) != 0)
-            continue;
-
+    dent = seaf_dir_lookup (olddir, to_path_dup);
+    if (dent)
         id = post_file_recursive (repo, dent->id, remain, replace_existed, newdent);
-        if (id != NULL) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-            if (repo->version > 0)
-                dent->mtime = (guint64)time(NULL);
-        }
-        break;
-    }
     
     if (id != NULL) {
         /* Create a new SeafDir. */
         GList *new_entries;
         
         new_entries = dup_seafdir_entries (olddir->entries);
+        update_dirent_id (new_entries, to_path_dup, id, (repo->version > 0));
         newdir = seaf_dir_new (NULL, new_entries,
                                dir_version_from_repo_version(repo->version));
         seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir);
@@ -711,8 +724,11 @@ out:
     return ret;
 }
 
+/* @entries is a copy of the entries of @olddir. Names added to it are
+ * appended to @name_list.
+ */
 static int
-add_new_entries (SeafRepo *repo, const char *user,
+add_new_entries (SeafRepo *repo, const char *user, SeafDir *olddir,
                  GList **entries, GList *filenames, GList *id_list,
                  GList *size_list, int replace_existed, GList **name_list)
 {
@@ -732,7 +748,7 @@ add_new_entries (SeafRepo *repo, const char *user,
         SeafDirent *newdent;
         gboolean replace = FALSE;
 
-        if (replace_existed) {
+        if (replace_existed && filename_exists (olddir, *name_list, file)) {
             GList *p;
             SeafDirent *dent;
 
@@ -750,7 +766,7 @@ add_new_entries (SeafRepo *repo, const char *user,
         if (replace)
             unique_name = g_strdup (file);
         else
-            unique_name = generate_unique_filename (file, *entries);
+            unique_name = generate_unique_filename (file, olddir, *name_list);
 
         if (unique_name != NULL) {
             newdent = seaf_dirent_new (dir_version_from_repo_version(repo->version),
@@ -780,7 +796,6 @@ post_multi_files_recursive (SeafRepo *repo,
 {
     SeafDir *olddir, *newdir;
     SeafDirent *dent;
-    GList *ptr;
     char *slash;
     char *to_path_dup = NULL;
     char *remain = NULL;
@@ -799,7 +814,7 @@ post_multi_files_recursive (SeafRepo *repo,
 
         newentries = dup_seafdir_entries (olddir->entries);
 
-        if (add_new_entries (repo, user,
+        if (add_new_entries (repo, user, olddir,
                              &newentries, filenames, id_list, size_list,
                              replace_existed, name_list) < 0)
             goto out;
@@ -823,29 +838,18 @@ post_multi_files_recursive (SeafRepo *repo,
         remain = slash + 1;
     }
 
-    for (ptr = olddir->entries; ptr; ptr = ptr->next) {
-        dent = (SeafDirent *)ptr->data;
-
-        if (strcmp(dent->name, to_path_dup) != 0)
-            continue;
-
+    dent = seaf_dir_lookup (olddir, to_path_dup);
+    if (dent)
         id = post_multi_files_recursive (repo, dent->id, remain, filenames,
                                          id_list, size_list, user,
                                          replace_existed, name_list);
-        if (id != NULL) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-            if (repo->version > 0)
-                dent->mtime = (guint64)time(NULL);
-        }
-        break;
-    }
     
     if (id != NULL) {
         /* Create a new SeafDir. */
         GList *new_entries;
         
         new_entries = dup_seafdir_entries (olddir->entries);
+        update_dirent_id (new_entries, to_path_dup, id, (repo->version > 0));
         newdir = seaf_dir_new (NULL, new_entries,
                                dir_version_from_repo_version(repo->version));
         seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir);
@@ -1220,7 +1224,6 @@ del_file_recursive(SeafRepo *repo,
 {
     SeafDir *olddir, *newdir;
     SeafDirent *dent;
-    GList *ptr;
     char *to_path_dup = NULL;
     char *remain = NULL;
     char *slash;
@@ -1266,26 +1269,15 @@ del_file_recursive(SeafRepo *repo,
         remain = slash + 1;
     }
 
-    for (ptr = olddir->entries; ptr; ptr = ptr->next) {
-        dent = (SeafDirent *)ptr->data;
-
-        if (strcmp(dent->name, to_path_dup) != 0)
-            continue;
-
+    dent = seaf_dir_lookup (olddir, to_path_dup);
+    if (dent)
         id = del_file_recursive(repo, dent->id, remain, filename);
-        if (id != NULL) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-            if (repo->version > 0)
-                dent->mtime = (guint64)time(NULL);
-        }
-        break;
-    }
     if (id != NULL) {
         /* Create a new SeafDir. */
         GList *new_entries;
         
         new_entries = dup_seafdir_entries (olddir->entries);
+        update_dirent_id (new_entries, to_path_dup, id, (repo->version > 0));
         newdir = seaf_dir_new (NULL, new_entries,
                                dir_version_from_repo_version(repo->version));
         seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir);
@@ -1515,7 +1507,7 @@ copy_seafile (SeafRepo *src_repo, SeafRepo *dst_repo, const char *file_id,
     }
 
     int i;
-    char *block_id;
+    char block_id[41];
     for (i = 0; i < file->n_blocks; ++i) {
         /* Check cancel before copying a block. */
         if (task && g_atomic_int_get (&task->canceled)) {
@@ -1523,7 +1515,7 @@ copy_seafile (SeafRepo *src_repo, SeafRepo *dst_repo, const char *file_id,
             return NULL;
         }
 
-        block_id = file->blk_sha1s[i];
+        seafile_get_block_id (file, i, block_id);
         if (seaf_block_manager_copy_block (seaf->block_mgr,
                                            src_repo->store_id, src_repo->version,
                                            dst_repo->store_id, dst_repo->version,
@@ -2399,7 +2391,6 @@ rename_file_recursive(SeafRepo *repo,
 {
     SeafDir *olddir, *newdir;
     SeafDirent *dent;
-    GList *ptr;
     char *to_path_dup = NULL;
     char *remain = NULL;
     char *slash;
@@ -2457,25 +2448,16 @@ rename_file_recursive(SeafRepo *repo,
         remain = slash + 1;
     }
 
-    for (ptr = olddir->entries; ptr; ptr = ptr->next) {
-        dent = (SeafDirent *)ptr->data;
-
-        if (strcmp(dent->name, to_path_dup) != 0)
-            continue;
-
+    dent = seaf_dir_lookup (olddir, to_path_dup);
+    if (dent)
         id = rename_file_recursive (repo, dent->id, remain, oldname, newname);
-        if (id != NULL) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-        }
-        break;
-    }
     
     if (id != NULL) {
         /* Create a new SeafDir. */
         GList *new_entries;
         
         new_entries = dup_seafdir_entries (olddir->entries);
+        update_dirent_id (new_entries, to_path_dup, id, FALSE);
         newdir = seaf_dir_new (NULL, new_entries,
                                dir_version_from_repo_version(repo->version));
         seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir);
@@ -2589,7 +2571,6 @@ put_file_recursive(SeafRepo *repo,
 {
     SeafDir *olddir, *newdir;
     SeafDirent *dent;
-    GList *ptr;
     char *to_path_dup = NULL;
     char *remain = NULL;
     char *slash;
@@ -2635,27 +2616,16 @@ put_file_recursive(SeafRepo *repo,
         remain = slash + 1;
     }
 
-    for (ptr = olddir->entries; ptr; ptr = ptr->next) {
-        dent = (SeafDirent *)ptr->data;
-
-        if (strcmp(dent->name, to_path_dup) != 0)
-            continue;
-
+    dent = seaf_dir_lookup (olddir, to_path_dup);
+    if (dent)
         id = put_file_recursive (repo, dent->id, remain, newdent);
-        if (id != NULL) {
-            memcpy(dent->id, id, 40);
-            dent->id[40] = '\0';
-            if (repo->version > 0)
-                dent->mtime = (guint64)time(NULL);
-        }
-        break;
-    }
     
     if (id != NULL) {
         /* Create a new SeafDir. */
         GList *new_entries;
         
         new_entries = dup_seafdir_entries (olddir->entries);
+        update_dirent_id (new_entries, to_path_dup, id, (repo->version > 0));
         newdir = seaf_dir_new (NULL, new_entries,
                                dir_version_from_repo_version(repo->version));
         seaf_dir_save (seaf->fs_mgr, repo->store_id, repo->version, newdir);
@@ -196,7 +196,7 @@ seaf_repo_manager_list_dir_with_perm (SeafRepoManager *mgr,
     SeafDirent *dent;
     SeafileDirent *d;
     GList *res = NULL;
-    GList *p;
+    GList *sorted, *p;
 
     if (!repo_id || !is_uuid_valid(repo_id) || dir_id == NULL || !user) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_DIR_ID, "Bad dir id");
@@ -226,14 +226,15 @@ seaf_repo_manager_list_dir_with_perm (SeafRepoManager *mgr,
         return NULL;
     }
 
-    dir->entries = g_list_sort (dir->entries, comp_dirent_func);
+    /* The dir may be shared, sort a copy of the list. */
+    sorted = g_list_sort (g_list_copy (dir->entries), comp_dirent_func);
 
     if (offset < 0) {
         offset = 0;
     }
 
     int index = 0;
-    for (p = dir->entries; p != NULL; p = p->next, index++) {
+    for (p = sorted; p != NULL; p = p->next, index++) {
         if (index < offset) {
             continue;
         }
@@ -256,6 +257,7 @@ seaf_repo_manager_list_dir_with_perm (SeafRepoManager *mgr,
         res = g_list_prepend (res, d);
     }
 
+    g_list_free (sorted);
     seaf_dir_free (dir);
     seaf_repo_unref (repo);
     g_free (perm);
@@ -616,6 +616,42 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      "get_system_default_repo_id",
                                      searpc_signature_string__void());
 
+    /* Block cache */
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_block_cache_stats,
+                                     "get_block_cache_stats",
+                                     searpc_signature_string__void());
+
+    /* Commit cache */
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_commit_cache_stats,
+                                     "get_commit_cache_stats",
+                                     searpc_signature_string__void());
+
+    /* Path cache */
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_path_cache_stats,
+                                     "get_path_cache_stats",
+                                     searpc_signature_string__void());
+
+    /* Block compression */
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_block_compress_stats,
+                                     "get_block_compress_stats",
+                                     searpc_signature_string__void());
+
+    /* Block scrubber */
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_block_scrubber_status,
+                                     "get_block_scrubber_status",
+                                     searpc_signature_string__void());
+
+    /* Object store */
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_obj_store_stats,
+                                     "get_obj_store_stats",
+                                     searpc_signature_string__void());
+
     /* Trashed repos. */
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_get_trash_repo_list,
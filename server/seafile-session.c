@@ -143,6 +143,8 @@ seafile_session_new(const char *seafile_dir,
 
     session->size_sched = size_scheduler_new (session);
 
+    session->block_scrubber = block_scrubber_new (session);
+
     session->ev_mgr = cevent_manager_new ();
     if (!session->ev_mgr)
         goto onerror;
@@ -233,6 +235,11 @@ seafile_session_start (SeafileSession *session)
         return -1;
     }
 
+    if (block_scrubber_start (session->block_scrubber) < 0) {
+        seaf_warning ("Failed to start block scrubber.\n");
+        return -1;
+    }
+
     if (seaf_copy_manager_start (session->copy_mgr) < 0) {
         seaf_warning ("Failed to start copy manager.\n");
         return -1;
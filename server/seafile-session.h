@@ -23,6 +23,7 @@
 #include "quota-mgr.h"
 #include "listen-mgr.h"
 #include "size-sched.h"
+#include "block-scrubber.h"
 #include "copy-mgr.h"
 
 #include "mq-mgr.h"
@@ -76,6 +77,8 @@ struct _SeafileSession {
 
     SizeScheduler       *size_sched;
 
+    BlockScrubber       *block_scrubber;
+
     int                  is_master;
 
     int                  cloud_mode;
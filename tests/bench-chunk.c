@@ -0,0 +1,885 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Benchmarks for the file indexing hot path: chunk boundary detection,
+ * SHA-1, block encryption, zlib compression, and chunking + hashing +
+ * writing blocks of whole datasets.
+ *
+ * The datasets are generated from a fixed seed under a scratch directory,
+ * so numbers are comparable between runs and hosts:
+ *
+ *   random  incompressible data
+ *   text    words separated by spaces and newlines
+ *   vm      VM image like: zero runs, repeated pages and random extents
+ *   small   many small text files
+ *
+ * A second version of each dataset with scattered insertions and overwrites
+ * is used to measure the dedup ratio between file versions.
+ *
+ * The end to end benchmark calls seaf_fs_manager_index_blocks() on a
+ * minimal session whose stores are in the scratch directory, so it covers
+ * the block manager and its backends too. Chunking is only spread over
+ * worker threads for files of at least 16MB.
+ */
+
+#include "common.h"
+
+#include <getopt.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include <glib/gstdio.h>
+
+#include <ccnet.h>
+
+#include "seafile-session.h"
+#include "fs-mgr.h"
+
+#include "utils.h"
+#include "sha1-mb.h"
+#include "seafile-crypt.h"
+#include "cdc/cdc.h"
+
+CcnetClient *ccnet_client;
+SeafileSession *seaf;
+
+#define MB (1024 * 1024)
+
+#define DEFAULT_SIZE_MB 64
+
+/* Edits applied to a dataset to create its second version. */
+#define N_EDITS         8
+#define EDIT_SZ         100
+#define OVERWRITE_SZ    4096
+
+/* Sizes of files in the small files dataset. */
+#define SMALL_MIN_SZ    1024
+#define SMALL_MAX_SZ    (64 * 1024)
+
+/* Chunk size histogram buckets: <= 8KB, <= 16KB, ..., <= 8MB. */
+#define HIST_MIN_BITS   13
+#define HIST_MAX_BITS   23
+#define HIST_BUCKETS    (HIST_MAX_BITS - HIST_MIN_BITS + 1)
+
+typedef struct Dataset {
+    const char *name;
+    /* File paths of the first and second version. */
+    GPtrArray *v1;
+    GPtrArray *v2;
+    guint64 size;
+} Dataset;
+
+typedef struct ChunkStats {
+    pthread_mutex_t lock;
+    guint64 n_chunks;
+    guint64 total_sz;
+    guint64 hist[HIST_BUCKETS];
+    /* checksum -> TRUE, only filled when chunks are hashed. */
+    GHashTable *seen;
+    guint64 dup_sz;
+} ChunkStats;
+
+/* Where write_block callbacks record chunks. */
+static ChunkStats *cur_stats;
+
+static const char *engine_names[] = { "rabin", "gear" };
+
+static guint64 rand_state = 0x5eaf11e0c0ffee11ULL;
+
+static guint64
+next_rand ()
+{
+    /* xorshift64 */
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+static gint64
+now_usec ()
+{
+    GTimeVal tv;
+
+    g_get_current_time (&tv);
+    return tv.tv_sec * (gint64)1000000 + tv.tv_usec;
+}
+
+static double
+mb_per_sec (guint64 bytes, gint64 usec)
+{
+    if (usec <= 0)
+        usec = 1;
+    return (double)bytes / MB / ((double)usec / 1000000);
+}
+
+/* Datasets */
+
+static void
+fill_random (char *buf, guint64 len)
+{
+    guint64 i, r;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        r = next_rand ();
+        memcpy (buf + i, &r, 8);
+    }
+    for (; i < len; ++i)
+        buf[i] = (char)next_rand ();
+}
+
+static void
+fill_text (char *buf, guint64 len)
+{
+    static const char *words[] = {
+        "the", "seafile", "block", "commit", "repo", "of", "and", "to",
+        "library", "sync", "server", "a", "file", "is", "in", "directory",
+        "chunk", "upload", "download", "version", "history", "share",
+    };
+    guint64 i = 0;
+    const char *w;
+    int n, n_words = G_N_ELEMENTS (words);
+
+    while (i < len) {
+        w = words[next_rand () % n_words];
+        n = MIN (strlen (w), len - i);
+        memcpy (buf + i, w, n);
+        i += n;
+        if (i < len)
+            buf[i++] = (next_rand () % 12 == 0) ? '\n' : ' ';
+    }
+}
+
+/* Virtual disk image: 4KB pages that are zero, copies of a small set of
+ * common pages (e.g. libraries installed in many VMs), or random.
+ */
+static void
+fill_vm (char *buf, guint64 len)
+{
+    char common[16][4096];
+    guint64 i, r;
+    int n;
+
+    for (n = 0; n < 16; ++n)
+        fill_random (common[n], 4096);
+
+    for (i = 0; i < len; i += 4096) {
+        n = MIN (4096, len - i);
+        r = next_rand () % 10;
+        if (r < 4)
+            memset (buf + i, 0, n);
+        else if (r < 7)
+            memcpy (buf + i, common[next_rand () % 16], n);
+        else
+            fill_random (buf + i, n);
+    }
+}
+
+/* Insert N_EDITS short runs and overwrite N_EDITS pages. */
+static char *
+make_edited (const char *buf, guint64 len, guint64 *new_len)
+{
+    GByteArray *out = g_byte_array_new ();
+    char edit[EDIT_SZ];
+    guint64 off, prev = 0;
+    int i;
+
+    memset (edit, 'e', sizeof(edit));
+    for (i = 1; i <= N_EDITS; ++i) {
+        off = len / (N_EDITS + 1) * i;
+        g_byte_array_append (out, (guint8 *)buf + prev, off - prev);
+        g_byte_array_append (out, (guint8 *)edit, sizeof(edit));
+        prev = off;
+    }
+    g_byte_array_append (out, (guint8 *)buf + prev, len - prev);
+
+    for (i = 0; i < N_EDITS && out->len > OVERWRITE_SZ; ++i) {
+        off = next_rand () % (out->len - OVERWRITE_SZ);
+        fill_random ((char *)out->data + off, OVERWRITE_SZ);
+    }
+
+    *new_len = out->len;
+    return (char *)g_byte_array_free (out, FALSE);
+}
+
+static int
+write_file (const char *path, const char *buf, guint64 len)
+{
+    GError *error = NULL;
+
+    if (!g_file_set_contents (path, buf, len, &error)) {
+        fprintf (stderr, "Failed to write %s: %s.\n", path, error->message);
+        g_clear_error (&error);
+        return -1;
+    }
+    return 0;
+}
+
+static Dataset *
+dataset_new (const char *name)
+{
+    Dataset *ds = g_new0 (Dataset, 1);
+
+    ds->name = name;
+    ds->v1 = g_ptr_array_new ();
+    ds->v2 = g_ptr_array_new ();
+    return ds;
+}
+
+static void
+dataset_free (Dataset *ds)
+{
+    guint i;
+
+    for (i = 0; i < ds->v1->len; ++i)
+        g_free (g_ptr_array_index (ds->v1, i));
+    for (i = 0; i < ds->v2->len; ++i)
+        g_free (g_ptr_array_index (ds->v2, i));
+    g_ptr_array_free (ds->v1, TRUE);
+    g_ptr_array_free (ds->v2, TRUE);
+    g_free (ds);
+}
+
+/* A dataset of a single large file. */
+static Dataset *
+gen_large_dataset (const char *dir, const char *name,
+                   void (*fill) (char *, guint64), guint64 size)
+{
+    Dataset *ds = dataset_new (name);
+    char *buf, *edited;
+    guint64 edited_len;
+    char *path;
+
+    buf = g_malloc (size);
+    fill (buf, size);
+    edited = make_edited (buf, size, &edited_len);
+
+    path = g_strdup_printf ("%s/%s.v1", dir, name);
+    g_ptr_array_add (ds->v1, path);
+    if (write_file (path, buf, size) < 0)
+        goto error;
+
+    path = g_strdup_printf ("%s/%s.v2", dir, name);
+    g_ptr_array_add (ds->v2, path);
+    if (write_file (path, edited, edited_len) < 0)
+        goto error;
+
+    ds->size = size;
+    g_free (buf);
+    g_free (edited);
+    return ds;
+
+error:
+    g_free (buf);
+    g_free (edited);
+    dataset_free (ds);
+    return NULL;
+}
+
+/* Many small files. In the second version, every tenth file has text
+ * appended to it.
+ */
+static Dataset *
+gen_small_dataset (const char *dir, guint64 size)
+{
+    Dataset *ds = dataset_new ("small");
+    char *buf = g_malloc (SMALL_MAX_SZ + EDIT_SZ);
+    char *subdir = g_build_filename (dir, "small", NULL);
+    char *path;
+    guint64 len;
+    int i;
+
+    g_mkdir_with_parents (subdir, 0777);
+
+    for (i = 0; ds->size < size; ++i) {
+        len = SMALL_MIN_SZ + next_rand () % (SMALL_MAX_SZ - SMALL_MIN_SZ);
+        fill_text (buf, len);
+
+        path = g_strdup_printf ("%s/%d.v1", subdir, i);
+        g_ptr_array_add (ds->v1, path);
+        if (write_file (path, buf, len) < 0)
+            goto error;
+        ds->size += len;
+
+        if (i % 10 == 0) {
+            memset (buf + len, 'e', EDIT_SZ);
+            len += EDIT_SZ;
+        }
+        path = g_strdup_printf ("%s/%d.v2", subdir, i);
+        g_ptr_array_add (ds->v2, path);
+        if (write_file (path, buf, len) < 0)
+            goto error;
+    }
+
+    g_free (subdir);
+    g_free (buf);
+    return ds;
+
+error:
+    g_free (subdir);
+    g_free (buf);
+    dataset_free (ds);
+    return NULL;
+}
+
+static void
+remove_recursive (const char *path)
+{
+    GDir *dir;
+    const char *dname;
+    char *sub;
+
+    if (!g_file_test (path, G_FILE_TEST_IS_DIR)) {
+        g_unlink (path);
+        return;
+    }
+
+    dir = g_dir_open (path, 0, NULL);
+    if (dir) {
+        while ((dname = g_dir_read_name (dir)) != NULL) {
+            sub = g_build_filename (path, dname, NULL);
+            remove_recursive (sub);
+            g_free (sub);
+        }
+        g_dir_close (dir);
+    }
+    g_rmdir (path);
+}
+
+/* Chunk stats */
+
+static guint
+checksum_hash (gconstpointer key)
+{
+    return *(const guint32 *)key;
+}
+
+static gboolean
+checksum_equal (gconstpointer a, gconstpointer b)
+{
+    return memcmp (a, b, CHECKSUM_LENGTH) == 0;
+}
+
+static void
+stats_init (ChunkStats *st, gboolean dedup)
+{
+    memset (st, 0, sizeof(ChunkStats));
+    pthread_mutex_init (&st->lock, NULL);
+    if (dedup)
+        st->seen = g_hash_table_new_full (checksum_hash, checksum_equal,
+                                          g_free, NULL);
+}
+
+static void
+stats_reset (ChunkStats *st)
+{
+    st->n_chunks = 0;
+    st->total_sz = 0;
+    st->dup_sz = 0;
+    memset (st->hist, 0, sizeof(st->hist));
+}
+
+static void
+stats_destroy (ChunkStats *st)
+{
+    if (st->seen)
+        g_hash_table_destroy (st->seen);
+    pthread_mutex_destroy (&st->lock);
+}
+
+static void
+record_chunk (guint32 len, const uint8_t *checksum)
+{
+    ChunkStats *st = cur_stats;
+    int bucket = 0;
+
+    while (bucket < HIST_BUCKETS - 1 &&
+           len > (1U << (HIST_MIN_BITS + bucket)))
+        ++bucket;
+
+    pthread_mutex_lock (&st->lock);
+
+    st->n_chunks++;
+    st->total_sz += len;
+    st->hist[bucket]++;
+
+    if (st->seen && checksum) {
+        if (g_hash_table_lookup (st->seen, checksum))
+            st->dup_sz += len;
+        else
+            g_hash_table_insert (st->seen,
+                                 g_memdup (checksum, CHECKSUM_LENGTH),
+                                 GINT_TO_POINTER(1));
+    }
+
+    pthread_mutex_unlock (&st->lock);
+}
+
+static void
+print_histogram (ChunkStats *st)
+{
+    int i;
+
+    printf ("    chunk sizes:");
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        guint32 limit = 1U << (HIST_MIN_BITS + i);
+        if (limit >= MB)
+            printf (" <=%uM:%" G_GUINT64_FORMAT, limit / MB, st->hist[i]);
+        else
+            printf (" <=%uK:%" G_GUINT64_FORMAT, limit / 1024, st->hist[i]);
+    }
+    printf ("\n");
+}
+
+/* write_block callbacks */
+
+static void
+chunk_sha1 (const char *buf, int len, uint8_t *checksum)
+{
+    SHA_CTX ctx;
+
+    SHA1_Init (&ctx);
+    SHA1_Update (&ctx, buf, len);
+    SHA1_Final (checksum, &ctx);
+}
+
+/* Only find chunk boundaries. */
+static int
+scan_chunk (const char *repo_id,
+            int version,
+            CDCDescriptor *chunk_descr,
+            struct SeafileCrypt *crypt,
+            uint8_t *checksum,
+            gboolean write_data)
+{
+    memset (checksum, 0, CHECKSUM_LENGTH);
+    record_chunk (chunk_descr->len, NULL);
+    return 0;
+}
+
+static int
+hash_chunk (const char *repo_id,
+            int version,
+            CDCDescriptor *chunk_descr,
+            struct SeafileCrypt *crypt,
+            uint8_t *checksum,
+            gboolean write_data)
+{
+    if (!chunk_descr->has_checksum)
+        chunk_sha1 (chunk_descr->block_buf, chunk_descr->len, checksum);
+    record_chunk (chunk_descr->len, checksum);
+    return 0;
+}
+
+/* Chunk every file of a dataset version. */
+static int
+chunk_files (GPtrArray *files, int engine,
+             WriteblockFunc write_block, SeafileCrypt *crypt,
+             ChunkStats *st, gint64 *usec)
+{
+    CDCFileDescriptor cdc;
+    gint64 start;
+    guint i;
+    int ret;
+
+    cur_stats = st;
+    start = now_usec ();
+
+    for (i = 0; i < files->len; ++i) {
+        memset (&cdc, 0, sizeof(cdc));
+        cdc.write_block = write_block;
+        cdc.engine = engine;
+
+        ret = filename_chunk_cdc (g_ptr_array_index (files, i), &cdc,
+                                  crypt, TRUE);
+        free (cdc.blk_sha1s);
+        if (ret < 0) {
+            fprintf (stderr, "Failed to chunk %s.\n",
+                     (char *)g_ptr_array_index (files, i));
+            return -1;
+        }
+    }
+
+    *usec = now_usec () - start;
+    return 0;
+}
+
+/* Index every file of a dataset version into a new, empty store. */
+static int
+index_files (GPtrArray *files, int engine, SeafileCrypt *crypt,
+             guint64 *bytes, gint64 *usec)
+{
+    /* Gear chunking is selected by the repo version. */
+    int version = (engine == CDC_ENGINE_GEAR) ? CDC_GEAR_MIN_REPO_VERSION : 1;
+    char *repo_id = gen_uuid ();
+    char *storage_dir;
+    unsigned char sha1[20];
+    gint64 size, start;
+    guint i;
+    int ret = 0;
+
+    *bytes = 0;
+    start = now_usec ();
+
+    for (i = 0; i < files->len; ++i) {
+        if (seaf_fs_manager_index_blocks (seaf->fs_mgr, repo_id, version,
+                                          g_ptr_array_index (files, i),
+                                          sha1, &size, crypt, TRUE) < 0) {
+            fprintf (stderr, "Failed to index %s.\n",
+                     (char *)g_ptr_array_index (files, i));
+            ret = -1;
+            break;
+        }
+        *bytes += size;
+    }
+
+    *usec = now_usec () - start;
+
+    seaf_block_manager_remove_store (seaf->block_mgr, repo_id);
+    storage_dir = g_build_filename (seaf->seaf_dir, "storage", NULL);
+    remove_recursive (storage_dir);
+    g_free (storage_dir);
+    g_free (repo_id);
+    return ret;
+}
+
+static int
+bench_dataset (Dataset *ds, SeafileCrypt *crypt)
+{
+    ChunkStats st;
+    guint64 bytes;
+    gint64 usec;
+    int engine;
+    int ret = 0;
+
+    printf ("%s: %u files, %.1f MB\n", ds->name, ds->v1->len,
+            (double)ds->size / MB);
+
+    for (engine = CDC_ENGINE_RABIN; engine <= CDC_ENGINE_GEAR; ++engine) {
+        const char *name = engine_names[engine];
+
+        stats_init (&st, FALSE);
+        if (chunk_files (ds->v1, engine, scan_chunk, NULL, &st, &usec) < 0)
+            goto error;
+        printf ("  %-6s boundary scan:      %8.1f MB/s, %" G_GUINT64_FORMAT
+                " chunks, avg %" G_GUINT64_FORMAT " bytes\n",
+                name, mb_per_sec (st.total_sz, usec), st.n_chunks,
+                st.n_chunks ? st.total_sz / st.n_chunks : 0);
+        print_histogram (&st);
+        stats_destroy (&st);
+
+        /* Dedup ratio: part of the second version that is already
+         * stored by the first version.
+         */
+        stats_init (&st, TRUE);
+        if (chunk_files (ds->v1, engine, hash_chunk, NULL, &st, &usec) < 0)
+            goto error;
+        printf ("  %-6s chunk + sha1:       %8.1f MB/s\n",
+                name, mb_per_sec (st.total_sz, usec));
+        stats_reset (&st);
+        if (chunk_files (ds->v2, engine, hash_chunk, NULL, &st, &usec) < 0)
+            goto error;
+        printf ("  %-6s dedup v1 -> v2:     %8.2f%%\n", name,
+                st.total_sz ? 100.0 * st.dup_sz / st.total_sz : 0.0);
+        stats_destroy (&st);
+
+        /* End to end, into an empty store. */
+        if (index_files (ds->v1, engine, NULL, &bytes, &usec) < 0)
+            return -1;
+        printf ("  %-6s index:              %8.1f MB/s\n",
+                name, mb_per_sec (bytes, usec));
+
+        if (index_files (ds->v1, engine, crypt, &bytes, &usec) < 0)
+            return -1;
+        printf ("  %-6s index encrypted:    %8.1f MB/s\n",
+                name, mb_per_sec (bytes, usec));
+    }
+
+    return ret;
+
+error:
+    stats_destroy (&st);
+    return -1;
+}
+
+/* Primitive benchmarks, on 1MB blocks of @buf. */
+
+static void
+bench_sha1 (const char *buf, guint64 len)
+{
+    const unsigned char *bufs[SHA1_MB_LANES];
+    size_t lens[SHA1_MB_LANES];
+    unsigned char sha1s[SHA1_MB_LANES * 20];
+    guint64 n_blocks = len / MB, i;
+    gint64 start;
+    int j, n;
+
+    start = now_usec ();
+    for (i = 0; i < n_blocks; ++i) {
+        SHA_CTX ctx;
+        SHA1_Init (&ctx);
+        SHA1_Update (&ctx, buf + i * MB, MB);
+        SHA1_Final (sha1s, &ctx);
+    }
+    printf ("sha1 (openssl):            %8.1f MB/s\n",
+            mb_per_sec (n_blocks * MB, now_usec () - start));
+
+    start = now_usec ();
+    for (i = 0; i < n_blocks; i += n) {
+        n = MIN (n_blocks - i, SHA1_MB_LANES);
+        for (j = 0; j < n; ++j) {
+            bufs[j] = (const unsigned char *)buf + (i + j) * MB;
+            lens[j] = MB;
+        }
+        sha1_mb_digest (n, bufs, lens, sha1s);
+    }
+    printf ("sha1 (multi-buffer):       %8.1f MB/s\n",
+            mb_per_sec (n_blocks * MB, now_usec () - start));
+}
+
+static int
+bench_crypt (const char *buf, guint64 len, SeafileCrypt *crypt)
+{
+    guint64 n_blocks = len / MB, i;
+    char **enc = g_new0 (char *, n_blocks);
+    int *enc_len = g_new0 (int, n_blocks);
+    char *dec;
+    int dec_len;
+    gint64 start;
+    int ret = 0;
+
+    start = now_usec ();
+    for (i = 0; i < n_blocks; ++i) {
+        if (seafile_encrypt (&enc[i], &enc_len[i], buf + i * MB, MB, crypt) < 0) {
+            fprintf (stderr, "Failed to encrypt.\n");
+            ret = -1;
+            goto out;
+        }
+    }
+    printf ("seafile_encrypt:           %8.1f MB/s\n",
+            mb_per_sec (n_blocks * MB, now_usec () - start));
+
+    start = now_usec ();
+    for (i = 0; i < n_blocks; ++i) {
+        if (seafile_decrypt (&dec, &dec_len, enc[i], enc_len[i], crypt) < 0) {
+            fprintf (stderr, "Failed to decrypt.\n");
+            ret = -1;
+            goto out;
+        }
+        g_free (dec);
+    }
+    printf ("seafile_decrypt:           %8.1f MB/s\n",
+            mb_per_sec (n_blocks * MB, now_usec () - start));
+
+out:
+    for (i = 0; i < n_blocks; ++i)
+        g_free (enc[i]);
+    g_free (enc);
+    g_free (enc_len);
+    return ret;
+}
+
+static int
+bench_compress (const char *name, const char *buf, guint64 len)
+{
+    guint64 n_blocks = len / MB, i, out_total = 0;
+    guint8 **out = g_new0 (guint8 *, n_blocks);
+    int *out_len = g_new0 (int, n_blocks);
+    guint8 *dec;
+    int dec_len;
+    gint64 start;
+    int ret = 0;
+
+    start = now_usec ();
+    for (i = 0; i < n_blocks; ++i) {
+        if (seaf_compress ((guint8 *)buf + i * MB, MB, &out[i], &out_len[i]) < 0) {
+            fprintf (stderr, "Failed to compress.\n");
+            ret = -1;
+            goto out;
+        }
+        out_total += out_len[i];
+    }
+    printf ("seaf_compress %-6s:      %8.1f MB/s, ratio %.2f\n", name,
+            mb_per_sec (n_blocks * MB, now_usec () - start),
+            out_total ? (double)(n_blocks * MB) / out_total : 0.0);
+
+    start = now_usec ();
+    for (i = 0; i < n_blocks; ++i) {
+        if (seaf_decompress (out[i], out_len[i], &dec, &dec_len) < 0) {
+            fprintf (stderr, "Failed to decompress.\n");
+            ret = -1;
+            goto out;
+        }
+        g_free (dec);
+    }
+    printf ("seaf_decompress %-6s:    %8.1f MB/s\n", name,
+            mb_per_sec (n_blocks * MB, now_usec () - start));
+
+out:
+    for (i = 0; i < n_blocks; ++i)
+        g_free (out[i]);
+    g_free (out);
+    g_free (out_len);
+    return ret;
+}
+
+static int
+bench_primitives (guint64 size, SeafileCrypt *crypt)
+{
+    char *random_buf = g_malloc (size);
+    char *text_buf = g_malloc (size);
+    int ret = 0;
+
+    fill_random (random_buf, size);
+    fill_text (text_buf, size);
+
+    bench_sha1 (random_buf, size);
+    if (bench_crypt (random_buf, size, crypt) < 0 ||
+        bench_compress ("random", random_buf, size) < 0 ||
+        bench_compress ("text", text_buf, size) < 0)
+        ret = -1;
+
+    g_free (random_buf);
+    g_free (text_buf);
+    return ret;
+}
+
+/* A session with only the block and fs managers, storing under
+ * @work_dir.
+ */
+static int
+session_init (const char *work_dir, int n_workers)
+{
+    seaf = g_new0 (SeafileSession, 1);
+    seaf->seaf_dir = g_build_filename (work_dir, "seafile-data", NULL);
+    seaf->tmp_file_dir = g_build_filename (seaf->seaf_dir, "tmpfiles", NULL);
+    if (g_mkdir_with_parents (seaf->tmp_file_dir, 0777) < 0) {
+        fprintf (stderr, "Failed to create %s.\n", seaf->tmp_file_dir);
+        return -1;
+    }
+
+    seaf->config = g_key_file_new ();
+    if (n_workers > 0)
+        g_key_file_set_integer (seaf->config,
+                                "fileserver", "index_workers", n_workers);
+
+    seaf->block_mgr = seaf_block_manager_new (seaf, seaf->seaf_dir);
+    if (!seaf->block_mgr) {
+        fprintf (stderr, "Failed to create block manager.\n");
+        return -1;
+    }
+    seaf->fs_mgr = seaf_fs_manager_new (seaf, seaf->seaf_dir);
+    if (!seaf->fs_mgr) {
+        fprintf (stderr, "Failed to create fs manager.\n");
+        return -1;
+    }
+
+    if (seaf_block_manager_init (seaf->block_mgr) < 0 ||
+        seaf_fs_manager_init (seaf->fs_mgr) < 0) {
+        fprintf (stderr, "Failed to init session.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr,
+             "usage: %s [-s SIZE_MB] [-d DIR] [-w WORKERS] [-k]\n"
+             "  -s  size of each dataset in MB (default %d)\n"
+             "  -d  scratch directory (default: system temp dir)\n"
+             "  -w  chunking threads for large files in the index benchmarks\n"
+             "  -k  keep the generated datasets\n",
+             prog, DEFAULT_SIZE_MB);
+}
+
+int main (int argc, char *argv[])
+{
+    guint64 size = (guint64)DEFAULT_SIZE_MB * MB;
+    const char *base_dir = g_get_tmp_dir ();
+    char *work_dir;
+    int n_workers = 0;
+    gboolean keep = FALSE;
+    unsigned char key[32], iv[16];
+    SeafileCrypt *crypt;
+    Dataset *datasets[4];
+    int i, c, ret = 0;
+
+    while ((c = getopt (argc, argv, "s:d:w:kh")) != -1) {
+        switch (c) {
+        case 's':
+            size = (guint64)atoi (optarg) * MB;
+            break;
+        case 'd':
+            base_dir = optarg;
+            break;
+        case 'w':
+            n_workers = atoi (optarg);
+            break;
+        case 'k':
+            keep = TRUE;
+            break;
+        default:
+            usage (argv[0]);
+            exit (1);
+        }
+    }
+
+    if (size < MB) {
+        usage (argv[0]);
+        exit (1);
+    }
+
+    cdc_init ();
+
+    for (i = 0; i < 32; ++i)
+        key[i] = (unsigned char)i;
+    for (i = 0; i < 16; ++i)
+        iv[i] = (unsigned char)(16 - i);
+    crypt = seafile_crypt_new (2, key, iv);
+
+    work_dir = g_strdup_printf ("%s/seaf-bench-%d", base_dir, (int)getpid());
+    if (g_mkdir_with_parents (work_dir, 0777) < 0) {
+        fprintf (stderr, "Failed to create %s.\n", work_dir);
+        exit (1);
+    }
+
+    if (session_init (work_dir, n_workers) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (bench_primitives (size, crypt) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    memset (datasets, 0, sizeof(datasets));
+    datasets[0] = gen_large_dataset (work_dir, "random", fill_random, size);
+    datasets[1] = gen_large_dataset (work_dir, "text", fill_text, size);
+    datasets[2] = gen_large_dataset (work_dir, "vm", fill_vm, size);
+    datasets[3] = gen_small_dataset (work_dir, size);
+
+    for (i = 0; i < 4; ++i) {
+        if (!datasets[i] || bench_dataset (datasets[i], crypt) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    for (i = 0; i < 4; ++i)
+        if (datasets[i])
+            dataset_free (datasets[i]);
+
+out:
+    if (keep)
+        printf ("datasets kept in %s\n", work_dir);
+    else
+        remove_recursive (work_dir);
+    g_free (work_dir);
+    g_free (crypt);
+
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,236 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Benchmarks for fs object formats: compares the zlib compressed json
+ * format (version 1) with the binary format (version 2) for dir and file
+ * objects of several sizes.
+ *
+ * For each object it reports the stored size, the time to serialize it
+ * and the time to parse it back, as done when an object is read from the
+ * object store.
+ */
+
+#include "common.h"
+
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include <ccnet.h>
+
+#include "seafile-session.h"
+#include "fs-mgr.h"
+
+#include "utils.h"
+
+CcnetClient *ccnet_client;
+SeafileSession *seaf;
+
+#define DEFAULT_ITERS   100
+
+static const int dir_sizes[] = { 10, 100, 1000, 10000 };
+static const int file_blocks[] = { 1, 16, 256, 4096 };
+
+static guint64 rand_state = 0x5eaf11e0c0ffee11ULL;
+
+static guint64
+next_rand ()
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+static gint64
+now_usec ()
+{
+    GTimeVal tv;
+
+    g_get_current_time (&tv);
+    return tv.tv_sec * (gint64)1000000 + tv.tv_usec;
+}
+
+static void
+random_sha1 (unsigned char *sha1)
+{
+    guint64 r;
+    int i;
+
+    for (i = 0; i < 20; i += 8) {
+        r = next_rand ();
+        memcpy (sha1 + i, &r, MIN (8, 20 - i));
+    }
+}
+
+static void
+random_id (char *id)
+{
+    unsigned char sha1[20];
+
+    random_sha1 (sha1);
+    rawdata_to_hex (sha1, id, 20);
+}
+
+/* Dirents are kept sorted by name in descending order. */
+static gint
+compare_dirents (gconstpointer a, gconstpointer b)
+{
+    const SeafDirent *denta = a, *dentb = b;
+
+    return strcmp (dentb->name, denta->name);
+}
+
+static GList *
+gen_dirents (int version, int n_entries)
+{
+    GList *entries = NULL;
+    char id[41], name[64];
+    int i;
+
+    for (i = 0; i < n_entries; ++i) {
+        random_id (id);
+        if (i % 8 == 0) {
+            snprintf (name, sizeof(name), "folder-%d", i);
+            entries = g_list_prepend (entries,
+                                      seaf_dirent_new (version, id, S_IFDIR,
+                                                       name, 0, NULL, 0));
+        } else {
+            snprintf (name, sizeof(name), "document %d - draft.docx", i);
+            entries = g_list_prepend (entries,
+                                      seaf_dirent_new (version, id,
+                                                       S_IFREG | 0644, name,
+                                                       1500000000 + i,
+                                                       "someone@example.com",
+                                                       next_rand () % (1 << 24)));
+        }
+    }
+
+    return g_list_sort (entries, compare_dirents);
+}
+
+static void
+bench_dir (int version, int n_entries, int iters)
+{
+    SeafDir *dir, *parsed;
+    gint64 start, encode_usec, decode_usec;
+    int i;
+
+    dir = seaf_dir_new (NULL, gen_dirents (version, n_entries), version);
+
+    start = now_usec ();
+    for (i = 0; i < iters; ++i) {
+        void *data;
+        int len;
+
+        data = seaf_dir_to_data (dir, &len);
+        g_free (data);
+    }
+    encode_usec = now_usec () - start;
+
+    start = now_usec ();
+    for (i = 0; i < iters; ++i) {
+        parsed = seaf_dir_from_data (dir->dir_id, dir->ondisk,
+                                     dir->ondisk_size, TRUE);
+        if (!parsed) {
+            fprintf (stderr, "Failed to parse dir object.\n");
+            exit (1);
+        }
+        seaf_dir_free (parsed);
+    }
+    decode_usec = now_usec () - start;
+
+    printf ("dir   v%d %6d entries  %9d bytes  encode %9.1f us  parse %9.1f us\n",
+            version, n_entries, dir->ondisk_size,
+            (double)encode_usec / iters, (double)decode_usec / iters);
+
+    seaf_dir_free (dir);
+}
+
+static void
+bench_file (int version, int n_blocks, int iters)
+{
+    Seafile file, *parsed;
+    void *data;
+    int len, i;
+    gint64 start, encode_usec, decode_usec;
+
+    memset (&file, 0, sizeof(file));
+    file.version = version;
+    file.n_blocks = n_blocks;
+    file.file_size = (guint64)n_blocks * (1 << 20);
+    file.blk_ids = g_new (guint8, n_blocks * 20);
+    for (i = 0; i < n_blocks; ++i)
+        random_sha1 (file.blk_ids + i * 20);
+
+    start = now_usec ();
+    for (i = 0; i < iters; ++i) {
+        data = seafile_to_data (&file, &len);
+        g_free (data);
+    }
+    encode_usec = now_usec () - start;
+
+    /* seafile_to_data() sets the file id as a side effect. */
+    data = seafile_to_data (&file, &len);
+
+    start = now_usec ();
+    for (i = 0; i < iters; ++i) {
+        parsed = (Seafile *)seaf_fs_object_from_data (file.file_id,
+                                                      data, len, TRUE);
+        if (!parsed) {
+            fprintf (stderr, "Failed to parse file object.\n");
+            exit (1);
+        }
+        seaf_fs_object_free ((SeafFSObject *)parsed);
+    }
+    decode_usec = now_usec () - start;
+
+    printf ("file  v%d %6d blocks   %9d bytes  encode %9.1f us  parse %9.1f us\n",
+            version, n_blocks, len,
+            (double)encode_usec / iters, (double)decode_usec / iters);
+
+    g_free (data);
+    g_free (file.blk_ids);
+}
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr,
+             "usage: %s [-n ITERATIONS]\n"
+             "  -n  iterations per measurement (default %d)\n",
+             prog, DEFAULT_ITERS);
+}
+
+int main (int argc, char *argv[])
+{
+    int iters = DEFAULT_ITERS;
+    int i, c;
+
+    while ((c = getopt (argc, argv, "n:h")) != -1) {
+        switch (c) {
+        case 'n':
+            iters = atoi (optarg);
+            break;
+        default:
+            usage (argv[0]);
+            exit (1);
+        }
+    }
+
+    if (iters <= 0) {
+        usage (argv[0]);
+        exit (1);
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(dir_sizes); ++i) {
+        bench_dir (1, dir_sizes[i], iters);
+        bench_dir (BINARY_FS_OBJ_VERSION, dir_sizes[i], iters);
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(file_blocks); ++i) {
+        bench_file (1, file_blocks[i], iters);
+        bench_file (BINARY_FS_OBJ_VERSION, file_blocks[i], iters);
+    }
+
+    return 0;
+}
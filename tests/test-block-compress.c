@@ -0,0 +1,199 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/sha.h>
+
+#include "utils.h"
+#include "block-backend.h"
+
+/*
+ * Writes blocks through the compress backend on top of the fs backend,
+ * the way the block manager does (write, close, commit), and reads them
+ * back.
+ */
+
+BlockBackend *
+block_backend_fs_new (const char *block_dir, const char *tmp_dir);
+
+#define STORE_ID "0ddf0a3c-a59c-4d67-a0b6-f0ac4d12c0a5"
+#define BLOCK_SIZE (256 * 1024)
+
+static int
+write_block (BlockBackend *bend, const char *block_id,
+             const char *data, int len)
+{
+    BHandle *handle;
+    int ret = -1;
+
+    handle = bend->open_block (bend, STORE_ID, 1, block_id, BLOCK_WRITE);
+    if (!handle) {
+        fprintf (stderr, "Failed to open block %s for write.\n", block_id);
+        return -1;
+    }
+
+    if (bend->write_block (bend, handle, data, len) != len) {
+        fprintf (stderr, "Failed to write block %s.\n", block_id);
+        goto out;
+    }
+    if (bend->close_block (bend, handle) < 0) {
+        fprintf (stderr, "Failed to close block %s.\n", block_id);
+        goto out;
+    }
+    if (bend->commit_block (bend, handle) < 0) {
+        fprintf (stderr, "Failed to commit block %s.\n", block_id);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    bend->block_handle_free (bend, handle);
+    return ret;
+}
+
+static int
+check_block (BlockBackend *bend, const char *block_id,
+             const char *data, int len)
+{
+    BHandle *handle;
+    char *buf;
+    int n = 0, ret;
+
+    if (!bend->exists (bend, STORE_ID, 1, block_id)) {
+        fprintf (stderr, "Block %s doesn't exist.\n", block_id);
+        return -1;
+    }
+
+    handle = bend->open_block (bend, STORE_ID, 1, block_id, BLOCK_READ);
+    if (!handle) {
+        fprintf (stderr, "Failed to open block %s for read.\n", block_id);
+        return -1;
+    }
+
+    buf = g_malloc (len + 1);
+    while (n <= len) {
+        ret = bend->read_block (bend, handle, buf + n, len + 1 - n);
+        if (ret <= 0)
+            break;
+        n += ret;
+    }
+    bend->close_block (bend, handle);
+    bend->block_handle_free (bend, handle);
+
+    if (n != len || memcmp (buf, data, len) != 0) {
+        fprintf (stderr, "Block %s read back wrong content.\n", block_id);
+        g_free (buf);
+        return -1;
+    }
+
+    g_free (buf);
+    return 0;
+}
+
+static int
+test_codec (const char *dir, const char *codec)
+{
+    BlockBackend *fs_bend, *bend;
+    BlockCompressStats stats;
+    BMetadata *md;
+    unsigned char sha1[20];
+    char text_id[41], random_id[41];
+    char *text = NULL, *random = NULL;
+    char *seaf_dir, *tmp_dir;
+    int i, ret = -1;
+
+    seaf_dir = g_build_filename (dir, codec, NULL);
+    tmp_dir = g_build_filename (seaf_dir, "tmpfiles", NULL);
+
+    fs_bend = block_backend_fs_new (seaf_dir, tmp_dir);
+    if (!fs_bend) {
+        fprintf (stderr, "Failed to create fs backend.\n");
+        goto out_free;
+    }
+    bend = block_backend_compress_new (fs_bend, codec, 0);
+    if (!bend) {
+        fprintf (stderr, "Failed to create %s backend.\n", codec);
+        goto out_free;
+    }
+
+    text = g_malloc (BLOCK_SIZE);
+    for (i = 0; i < BLOCK_SIZE; ++i)
+        text[i] = "seafile block compression test\n"[i % 31];
+    random = g_malloc (BLOCK_SIZE);
+    for (i = 0; i < BLOCK_SIZE; ++i)
+        random[i] = rand () & 0xff;
+
+    SHA1 ((unsigned char *)text, BLOCK_SIZE, sha1);
+    sha1_to_hex (sha1, text_id);
+    SHA1 ((unsigned char *)random, BLOCK_SIZE, sha1);
+    sha1_to_hex (sha1, random_id);
+
+    if (write_block (bend, text_id, text, BLOCK_SIZE) < 0 ||
+        write_block (bend, random_id, random, BLOCK_SIZE) < 0)
+        goto out;
+
+    if (check_block (bend, text_id, text, BLOCK_SIZE) < 0 ||
+        check_block (bend, random_id, random, BLOCK_SIZE) < 0)
+        goto out;
+
+    /* The text block is stored compressed in the fs backend. */
+    md = fs_bend->stat_block (fs_bend, STORE_ID, 1, text_id);
+    if (!md || md->size >= BLOCK_SIZE) {
+        fprintf (stderr, "Block %s is not stored compressed.\n", text_id);
+        g_free (md);
+        goto out;
+    }
+    g_free (md);
+
+    block_backend_compress_get_stats (bend, &stats);
+    if (stats.n_compressed != 1 || stats.n_raw != 1 ||
+        stats.raw_bytes != BLOCK_SIZE) {
+        fprintf (stderr, "Wrong stats: %d compressed, %d raw.\n",
+                 (int)stats.n_compressed, (int)stats.n_raw);
+        goto out;
+    }
+
+    printf ("%s: %d bytes stored as %d.\n", codec,
+            (int)stats.raw_bytes, (int)stats.stored_bytes);
+    ret = 0;
+
+out:
+    g_free (text);
+    g_free (random);
+out_free:
+    g_free (seaf_dir);
+    g_free (tmp_dir);
+    return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+    char dir[] = "/tmp/test-block-compress-XXXXXX";
+    char *cmd;
+    int ret = 0;
+
+    if (!mkdtemp (dir)) {
+        fprintf (stderr, "Failed to create temp dir.\n");
+        return 1;
+    }
+
+    if (test_codec (dir, "zlib") < 0)
+        ret = 1;
+#ifdef HAVE_ZSTD
+    if (test_codec (dir, "zstd") < 0)
+        ret = 1;
+#endif
+
+    cmd = g_strdup_printf ("rm -rf '%s'", dir);
+    if (system (cmd) != 0)
+        fprintf (stderr, "Failed to remove %s.\n", dir);
+    g_free (cmd);
+
+    if (ret == 0)
+        printf ("Block compression test passed.\n");
+    return ret;
+}
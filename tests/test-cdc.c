@@ -12,6 +12,12 @@
 
 char *dest_dir = NULL;
 
+/* Edits applied to the source file when measuring dedup ratio. */
+#define N_EDITS         8
+#define EDIT_SZ         100
+
+#define PIPELINE_WORKERS 4
+
 static void rawdata_to_hex (const unsigned char *rawdata, 
                             char *hex_str, int n_bytes)
 {
@@ -101,14 +107,311 @@ int test_write_chunk (const char *repo_id,
     return ret;
 }
 
+typedef struct ChunkStat {
+    guint64 n_chunks;
+    guint64 total_sz;
+    guint32 min_sz;
+    guint32 max_sz;
+    guint32 last_sz;
+    /* Chunks other than the last one that are smaller than block_min_sz. */
+    guint64 n_small;
+    /* checksum -> chunk size, only filled when hashing. */
+    GHashTable *chunks;
+    guint64 dup_sz;
+} ChunkStat;
+
+static ChunkStat *cur_stat = NULL;
+
+static void
+record_chunk (CDCDescriptor *chunk_descr, uint8_t *checksum)
+{
+    ChunkStat *st = cur_stat;
+    guint32 len = chunk_descr->len;
+
+    if (st->n_chunks > 0 && st->last_sz < BLOCK_MIN_SZ)
+        ++st->n_small;
+
+    st->n_chunks++;
+    st->last_sz = len;
+    st->total_sz += len;
+    if (len < st->min_sz)
+        st->min_sz = len;
+    if (len > st->max_sz)
+        st->max_sz = len;
+
+    if (st->chunks) {
+        if (g_hash_table_lookup (st->chunks, checksum))
+            st->dup_sz += len;
+        else
+            g_hash_table_insert (st->chunks,
+                                 g_memdup (checksum, CHECKSUM_LENGTH),
+                                 GUINT_TO_POINTER(len));
+    }
+}
+
+/* Only find chunk boundaries, don't hash or write anything. */
+static int
+scan_only_chunk (const char *repo_id,
+                 int version,
+                 CDCDescriptor *chunk_descr,
+                 struct SeafileCrypt *crypt,
+                 uint8_t *checksum,
+                 gboolean write_data)
+{
+    memset (checksum, 0, CHECKSUM_LENGTH);
+    record_chunk (chunk_descr, checksum);
+    return 0;
+}
+
+static int
+hash_only_chunk (const char *repo_id,
+                 int version,
+                 CDCDescriptor *chunk_descr,
+                 struct SeafileCrypt *crypt,
+                 uint8_t *checksum,
+                 gboolean write_data)
+{
+    SHA_CTX ctx;
+
+    /* Like seafile_write_chunk(), reuse the checksum of a batch. */
+    if (!chunk_descr->has_checksum) {
+        SHA1_Init (&ctx);
+        SHA1_Update (&ctx, chunk_descr->block_buf, chunk_descr->len);
+        SHA1_Final (checksum, &ctx);
+    }
+
+    record_chunk (chunk_descr, checksum);
+    return 0;
+}
+
+static guint
+checksum_hash (gconstpointer key)
+{
+    return *(const guint32 *)key;
+}
+
+static gboolean
+checksum_equal (gconstpointer a, gconstpointer b)
+{
+    return memcmp (a, b, CHECKSUM_LENGTH) == 0;
+}
+
+static gint64
+now_usec ()
+{
+    GTimeVal tv;
+
+    g_get_current_time (&tv);
+    return tv.tv_sec * (gint64)1000000 + tv.tv_usec;
+}
+
+/* Thread-safe variant used with worker threads, doesn't record stats. */
+static int
+hash_chunk_mt (const char *repo_id,
+               int version,
+               CDCDescriptor *chunk_descr,
+               struct SeafileCrypt *crypt,
+               uint8_t *checksum,
+               gboolean write_data)
+{
+    SHA_CTX ctx;
+
+    SHA1_Init (&ctx);
+    SHA1_Update (&ctx, chunk_descr->block_buf, chunk_descr->len);
+    SHA1_Final (checksum, &ctx);
+    return 0;
+}
+
+static int
+chunk_with_engine (const char *filename, int engine, int n_workers,
+                   gboolean use_mmap,
+                   WriteblockFunc write_block, ChunkStat *st,
+                   gint64 *usec, uint8_t *file_sum)
+{
+    CDCFileDescriptor file_descr;
+    gint64 start;
+    int ret;
+
+    memset (&file_descr, 0, sizeof (file_descr));
+    file_descr.write_block = write_block;
+    file_descr.engine = engine;
+    file_descr.n_workers = n_workers;
+    file_descr.use_mmap = use_mmap;
+
+    cur_stat = st;
+    start = now_usec ();
+    ret = filename_chunk_cdc (filename, &file_descr, NULL, FALSE);
+    if (usec)
+        *usec = now_usec () - start;
+    cur_stat = NULL;
+
+    if (file_sum)
+        memcpy (file_sum, file_descr.file_sum, CHECKSUM_LENGTH);
+    free (file_descr.blk_sha1s);
+    return ret;
+}
+
+/*
+ * Write a copy of @src_filename with N_EDITS insertions spread over the
+ * file, which shifts the content after each edit point.
+ */
+static char *
+make_edited_copy (const char *src_filename)
+{
+    char *contents = NULL;
+    gsize len, off, prev = 0;
+    char *path;
+    char edit[EDIT_SZ];
+    FILE *fp;
+    int i;
+
+    if (!g_file_get_contents (src_filename, &contents, &len, NULL))
+        return NULL;
+
+    path = g_build_filename (dest_dir, "cdc-edited", NULL);
+    fp = fopen (path, "wb");
+    if (!fp) {
+        g_free (contents);
+        g_free (path);
+        return NULL;
+    }
+
+    memset (edit, 'e', sizeof(edit));
+    for (i = 1; i <= N_EDITS; ++i) {
+        off = len / (N_EDITS + 1) * i;
+        fwrite (contents + prev, 1, off - prev, fp);
+        fwrite (edit, 1, sizeof(edit), fp);
+        prev = off;
+    }
+    fwrite (contents + prev, 1, len - prev, fp);
+
+    fclose (fp);
+    g_free (contents);
+    return path;
+}
+
+static int
+compare_engine (const char *src_filename, const char *edited, int engine,
+                const char *name)
+{
+    ChunkStat st;
+    gint64 usec;
+    guint64 orig_sz;
+    double mbps;
+    uint8_t serial_sum[CHECKSUM_LENGTH], pipelined_sum[CHECKSUM_LENGTH];
+
+    memset (&st, 0, sizeof(st));
+    st.min_sz = G_MAXUINT32;
+    if (chunk_with_engine (src_filename, engine, 0, FALSE, scan_only_chunk,
+                           &st, &usec, NULL) < 0) {
+        fprintf (stderr, "%s: failed to chunk %s.\n", name, src_filename);
+        return -1;
+    }
+
+    if (st.max_sz > BLOCK_MAX_SZ || st.n_small > 0) {
+        fprintf (stderr, "%s: chunk size out of range.\n", name);
+        return -1;
+    }
+
+    mbps = usec > 0 ? (double)st.total_sz / usec : 0;
+    printf ("%-6s boundary scan: %.1f MB/s, %" G_GUINT64_FORMAT " chunks, "
+            "avg %" G_GUINT64_FORMAT ", min %u, max %u\n",
+            name, mbps, st.n_chunks, st.total_sz / st.n_chunks,
+            st.min_sz, st.max_sz);
+
+    memset (&st, 0, sizeof(st));
+    st.min_sz = G_MAXUINT32;
+    st.chunks = g_hash_table_new_full (checksum_hash, checksum_equal,
+                                       g_free, NULL);
+    if (chunk_with_engine (src_filename, engine, 0, FALSE, hash_only_chunk,
+                           &st, &usec, serial_sum) < 0) {
+        g_hash_table_destroy (st.chunks);
+        return -1;
+    }
+    mbps = usec > 0 ? (double)st.total_sz / usec : 0;
+    orig_sz = st.total_sz;
+
+    /* Chunks of the edited copy found in the original are deduplicated. */
+    st.total_sz = 0;
+    st.dup_sz = 0;
+    if (chunk_with_engine (edited, engine, 0, FALSE, hash_only_chunk,
+                           &st, NULL, NULL) < 0) {
+        g_hash_table_destroy (st.chunks);
+        return -1;
+    }
+
+    printf ("%-6s chunk + sha1: %.1f MB/s, dedup ratio after %d edits: %.2f%%\n",
+            name, mbps, N_EDITS,
+            st.total_sz > 0 ? 100.0 * st.dup_sz / st.total_sz : 0);
+
+    g_hash_table_destroy (st.chunks);
+
+    /* Pipelined and mmap chunking must produce the same file checksum. */
+    if (chunk_with_engine (src_filename, engine, PIPELINE_WORKERS, FALSE,
+                           hash_chunk_mt, NULL, &usec, pipelined_sum) < 0) {
+        fprintf (stderr, "%s: pipelined chunking failed.\n", name);
+        return -1;
+    }
+    if (memcmp (serial_sum, pipelined_sum, CHECKSUM_LENGTH) != 0) {
+        fprintf (stderr, "%s: pipelined chunking gives a different file id.\n",
+                 name);
+        return -1;
+    }
+    printf ("%-6s chunk + sha1 with %d workers: %.1f MB/s\n",
+            name, PIPELINE_WORKERS, usec > 0 ? (double)orig_sz / usec : 0);
+
+    if (chunk_with_engine (src_filename, engine, 0, TRUE,
+                           hash_chunk_mt, NULL, &usec, pipelined_sum) < 0) {
+        fprintf (stderr, "%s: mmap chunking failed.\n", name);
+        return -1;
+    }
+    if (memcmp (serial_sum, pipelined_sum, CHECKSUM_LENGTH) != 0) {
+        fprintf (stderr, "%s: mmap chunking gives a different file id.\n",
+                 name);
+        return -1;
+    }
+    printf ("%-6s chunk + sha1 with mmap: %.1f MB/s\n",
+            name, usec > 0 ? (double)orig_sz / usec : 0);
+
+    return orig_sz > 0 ? 0 : -1;
+}
+
+static int
+compare_engines (const char *src_filename)
+{
+    char *edited;
+    int ret = 0;
+
+    edited = make_edited_copy (src_filename);
+    if (!edited) {
+        fprintf (stderr, "failed to create edited copy of %s.\n", src_filename);
+        return -1;
+    }
+
+    if (compare_engine (src_filename, edited, CDC_ENGINE_RABIN, "rabin") < 0 ||
+        compare_engine (src_filename, edited, CDC_ENGINE_GEAR, "gear") < 0)
+        ret = -1;
+
+    g_unlink (edited);
+    g_free (edited);
+    return ret;
+}
+
 int main (int argc, char *argv[])
 {
     char *src_filename = NULL;
     int ret = 0, fd_src;
     CDCFileDescriptor file_descr;
+    gboolean compare = FALSE;
+
+    if (argc > 1 && strcmp (argv[1], "-c") == 0) {
+        compare = TRUE;
+        --argc;
+        ++argv;
+    }
 
     if (argc < 3) {
-        fprintf(stderr, "%s SOURCE DEST \n", argv[0]);
+        fprintf(stderr, "%s [-c] SOURCE DEST \n", argv[0]);
         exit(0);
     } else {
         src_filename = argv[1];
@@ -116,6 +419,15 @@ int main (int argc, char *argv[])
     }
 
     cdc_init ();
+
+    if (compare) {
+        if (compare_engines (src_filename) < 0) {
+            fprintf (stderr, "engine comparison failed.\n");
+            exit(1);
+        }
+        printf ("test passed.\n");
+        return 0;
+    }
     
     memset (&file_descr, 0, sizeof (file_descr));
     file_descr.write_block = test_write_chunk;